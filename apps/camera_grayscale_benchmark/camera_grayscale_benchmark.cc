@@ -0,0 +1,134 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "libs/base/random.h"
+#include "libs/base/timer.h"
+#include "libs/camera/camera.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_clock.h"
+
+// Checks and benchmarks the conversion of `CameraFormat::kY8` frames,
+// `CameraRgbToGrayscale()`, which uses fixed-point lookup tables.
+//
+// First, every one of the 2^24 RGB colors is converted and compared with the
+// float formula that the lookup tables replaced. No result may differ by more
+// than one. Then a frame of random pixels is converted with both, and the app
+// prints the time of each and the CPU cycles per pixel.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e camera_grayscale_benchmark
+
+namespace coralmicro {
+namespace {
+constexpr int kFramePixels = CameraTask::kWidth * CameraTask::kHeight;
+constexpr int kIterations = 20;
+constexpr int kNameWidth = 8;
+
+// The conversion used before the lookup tables.
+uint8_t FloatGrayscale(uint8_t r, uint8_t g, uint8_t b) {
+  constexpr float kUint8Max = 255.0;
+  float r_f = static_cast<float>(r) / kUint8Max;
+  float g_f = static_cast<float>(g) / kUint8Max;
+  float b_f = static_cast<float>(b) / kUint8Max;
+  return static_cast<uint8_t>(
+      ((.2126f * r_f * r_f) + (.7152f * g_f * g_f) + (.0722f * b_f * b_f)) *
+      kUint8Max);
+}
+
+void FloatRgbToGrayscale(const uint8_t* rgb, uint8_t* grayscale, int count) {
+  for (int i = 0; i < count; ++i, rgb += 3) {
+    grayscale[i] = FloatGrayscale(rgb[0], rgb[1], rgb[2]);
+  }
+}
+
+bool CheckAllColors() {
+  uint8_t rgb[256 * 3];
+  uint8_t grayscale[256];
+  uint32_t off_by_one = 0;
+  for (int r = 0; r < 256; ++r) {
+    for (int g = 0; g < 256; ++g) {
+      for (int b = 0; b < 256; ++b) {
+        rgb[b * 3 + 0] = r;
+        rgb[b * 3 + 1] = g;
+        rgb[b * 3 + 2] = b;
+      }
+      // Two calls, so the pixels left over after groups of four are covered
+      // as well.
+      CameraRgbToGrayscale(rgb, grayscale, 255);
+      CameraRgbToGrayscale(rgb + 255 * 3, grayscale + 255, 1);
+      for (int b = 0; b < 256; ++b) {
+        const int expected = FloatGrayscale(r, g, b);
+        const int diff = std::abs(grayscale[b] - expected);
+        if (diff > 1) {
+          printf("ERROR: RGB (%d, %d, %d) gives %d instead of %d\r\n", r, g, b,
+                 grayscale[b], expected);
+          return false;
+        }
+        if (diff) ++off_by_one;
+      }
+    }
+  }
+  printf("All colors within 1 of the float formula, %lu (%.2f%%) off by 1\r\n",
+         static_cast<unsigned long>(off_by_one),
+         100.0 * off_by_one / (1 << 24));
+  return true;
+}
+
+void PrintCyclesPerPixel(const char* name, const TimingSummary& summary) {
+  const double cycles_per_us = CLOCK_GetFreq(kCLOCK_CpuClk) / 1e6;
+  summary.Print(name, kNameWidth);
+  printf("%-*s %.2f cycles per pixel\r\n", kNameWidth, "",
+         summary.Average() * cycles_per_us / kFramePixels);
+}
+
+void Main() {
+  printf("Camera grayscale conversion benchmark\r\n");
+  if (!CheckAllColors()) return;
+
+  std::vector<uint8_t> rgb(kFramePixels * 3);
+  std::vector<uint8_t> grayscale(kFramePixels);
+  if (!RandomGenerate(rgb.data(), rgb.size())) {
+    printf("ERROR: Failed to generate random pixels\r\n");
+    return;
+  }
+  TimingSummary lut, float_formula;
+  for (int i = 0; i < kIterations; ++i) {
+    uint64_t start_us = TimerMicros();
+    CameraRgbToGrayscale(rgb.data(), grayscale.data(), kFramePixels);
+    lut.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+
+    start_us = TimerMicros();
+    FloatRgbToGrayscale(rgb.data(), grayscale.data(), kFramePixels);
+    float_formula.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+  }
+
+  printf("%d pixels, %d iterations\r\n", kFramePixels, kIterations);
+  PrintCyclesPerPixel("LUT", lut);
+  PrintCyclesPerPixel("float", float_formula);
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
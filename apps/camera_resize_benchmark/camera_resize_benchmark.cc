@@ -0,0 +1,175 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "libs/base/timer.h"
+#include "libs/camera/camera.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+// Compares the resize filters of `CameraFrameFormat` on speed and quality,
+// at common model input sizes.
+//
+// The input is a zone plate: concentric rings whose frequency grows from
+// zero at the center of the frame to the Nyquist frequency of the sensor at
+// its edges, so every frequency is present. It is written as a raw frame in
+// gray, and each filter resizes it to RGB with `CameraTask::ConvertFrame()`.
+// For each size and filter, the app prints the conversion time and the PSNR
+// against the zone plate averaged over each output pixel, the ideal result of
+// the downscale. Aliasing shows up as a lower PSNR.
+//
+// The camera isn't used, so it doesn't need to be connected.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e camera_resize_benchmark
+
+namespace coralmicro {
+namespace {
+constexpr int kSizes[] = {96, 128, 192, 224, 300};
+constexpr int kIterations = 10;
+constexpr int kNameWidth = 16;
+// Samples per axis averaged for each pixel of the reference images.
+constexpr int kSupersampling = 8;
+// Sensor pixels along the edges that demosaicing can't fully reconstruct.
+constexpr int kBorder = 3;
+constexpr int kFrameSize = CameraTask::kWidth;
+static_assert(CameraTask::kWidth == CameraTask::kHeight,
+              "The zone plate assumes a square frame");
+
+struct Filter {
+  const char* name;
+  CameraResizeFilter filter;
+};
+
+constexpr Filter kFilters[] = {
+    {"nearest-neighbor", CameraResizeFilter::kNearestNeighbor},
+    {"bilinear", CameraResizeFilter::kBilinear},
+    {"area", CameraResizeFilter::kArea},
+};
+
+// Value of the zone plate at a point of the frame, in sensor pixels. Pixel
+// `i` covers [i, i + 1).
+float ZonePlate(float x, float y) {
+  constexpr float kPi = 3.14159265f;
+  constexpr float kRadius = kFrameSize / 2.0f;
+  const float dx = x - kRadius;
+  const float dy = y - kRadius;
+  return 127.5f + 127.5f * std::cos(kPi / (2 * kRadius) * (dx * dx + dy * dy));
+}
+
+// Makes a raw frame of the zone plate. Every Bayer site has the same value,
+// so the image is gray.
+std::vector<uint8_t> MakeRawFrame() {
+  std::vector<uint8_t> raw(kFrameSize * kFrameSize);
+  for (int y = 0; y < kFrameSize; ++y) {
+    for (int x = 0; x < kFrameSize; ++x) {
+      raw[y * kFrameSize + x] =
+          static_cast<uint8_t>(ZonePlate(x + 0.5f, y + 0.5f) + 0.5f);
+    }
+  }
+  return raw;
+}
+
+// Makes the ideal `size` x `size` image of the zone plate: each pixel is the
+// average of the zone plate over the area it covers.
+std::vector<float> MakeReference(int size) {
+  const float scale = static_cast<float>(kFrameSize) / size;
+  std::vector<float> reference(size * size);
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      float sum = 0;
+      for (int sy = 0; sy < kSupersampling; ++sy) {
+        for (int sx = 0; sx < kSupersampling; ++sx) {
+          sum += ZonePlate((x + (sx + 0.5f) / kSupersampling) * scale,
+                           (y + (sy + 0.5f) / kSupersampling) * scale);
+        }
+      }
+      reference[y * size + x] = sum / (kSupersampling * kSupersampling);
+    }
+  }
+  return reference;
+}
+
+// Gets the PSNR of an RGB image against the reference, in dB, leaving out
+// the pixels that cover the border of the frame.
+double Psnr(const std::vector<uint8_t>& rgb,
+            const std::vector<float>& reference, int size) {
+  const int margin = static_cast<int>(
+      std::ceil(static_cast<float>(kBorder) * size / kFrameSize));
+  double squared_error = 0;
+  int count = 0;
+  for (int y = margin; y < size - margin; ++y) {
+    for (int x = margin; x < size - margin; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        const double error =
+            rgb[(y * size + x) * 3 + c] - reference[y * size + x];
+        squared_error += error * error;
+        ++count;
+      }
+    }
+  }
+  return 10 * std::log10(255.0 * 255.0 / (squared_error / count));
+}
+
+bool RunSize(const std::vector<uint8_t>& raw, int size) {
+  const std::vector<float> reference = MakeReference(size);
+  std::vector<uint8_t> rgb(size * size * 3);
+  printf("%dx%d\r\n", size, size);
+  for (const Filter& filter : kFilters) {
+    CameraFrameFormat fmt{CameraFormat::kRgb,
+                          CameraFilterMethod::kBilinear,
+                          CameraRotation::k0,
+                          size,
+                          size,
+                          /*preserve_ratio=*/false,
+                          /*buffer=*/rgb.data(),
+                          /*white_balance=*/false};
+    fmt.resize_filter = filter.filter;
+
+    TimingSummary convert;
+    for (int i = 0; i < kIterations; ++i) {
+      const uint64_t start_us = TimerMicros();
+      if (!CameraTask::GetSingleton()->ConvertFrame(raw.data(), {fmt})) {
+        printf("ERROR: ConvertFrame() failed\r\n");
+        return false;
+      }
+      convert.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+    }
+    convert.Print(filter.name, kNameWidth);
+    printf("%-*s PSNR %.2f dB, %.1f frames/s\r\n", kNameWidth, "",
+           Psnr(rgb, reference, size), 1e6 / convert.Average());
+  }
+  return true;
+}
+
+void Main() {
+  printf("Camera resize filter benchmark\r\n");
+  const std::vector<uint8_t> raw = MakeRawFrame();
+  for (int size : kSizes) {
+    if (!RunSize(raw, size)) return;
+  }
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
@@ -0,0 +1,291 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <queue>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "libs/base/random.h"
+#include "libs/base/timer.h"
+#include "libs/tensorflow/classification.h"
+#include "libs/tensorflow/utils.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/test_helpers.h"
+
+// Checks `tensorflow::GetClassificationResults()`, which selects the top
+// classes of quantized outputs on the quantized scores, against the version it
+// replaced, which dequantized every score and ranked them with a
+// `std::priority_queue`. That version is copied below.
+//
+// Each case makes a random output tensor of type uint8, int8 or float32, with
+// random scale and zero point, and gets the results with both. Some cases only
+// use a few distinct scores, so that many classes tie. The thresholds include
+// +/-inf, NaN, scores that equal a dequantized value exactly and the floats
+// next to them, and `top_k` values of 0, 1, the number of classes and
+// `SIZE_MAX`. Ids and scores must match exactly. For float tensors, the
+// overload that takes a score array is checked as well. The app prints the
+// total time of both.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e classification_check
+
+namespace coralmicro {
+namespace {
+constexpr int kCases = 3000;
+constexpr int kMaxClasses = 1001;
+
+// `GetClassificationResults()` before selecting on quantized scores.
+namespace previous {
+struct ClassComparator {
+  bool operator()(const tensorflow::Class& lhs,
+                  const tensorflow::Class& rhs) const {
+    return std::tie(lhs.score, lhs.id) > std::tie(rhs.score, rhs.id);
+  }
+};
+
+std::vector<tensorflow::Class> GetClassificationResults(const float* scores,
+                                                        ssize_t scores_count,
+                                                        float threshold,
+                                                        size_t top_k) {
+  std::priority_queue<tensorflow::Class, std::vector<tensorflow::Class>,
+                      ClassComparator>
+      q;
+  for (int i = 0; i < scores_count; ++i) {
+    if (scores[i] < threshold) continue;
+    q.push(tensorflow::Class{i, scores[i]});
+    if (q.size() > top_k) q.pop();
+  }
+
+  std::vector<tensorflow::Class> ret;
+  while (!q.empty()) {
+    ret.push_back(q.top());
+    q.pop();
+  }
+  std::reverse(ret.begin(), ret.end());
+  return ret;
+}
+
+std::vector<tensorflow::Class> GetClassificationResults(TfLiteTensor* tensor,
+                                                        float threshold,
+                                                        size_t top_k) {
+  if (tensor->type == kTfLiteUInt8 || tensor->type == kTfLiteInt8) {
+    auto scores = tensorflow::DequantizeTensor<float>(tensor);
+    return GetClassificationResults(scores.data(), scores.size(), threshold,
+                                    top_k);
+  }
+  return GetClassificationResults(tflite::GetTensorData<float>(tensor),
+                                  tensorflow::TensorSize(tensor), threshold,
+                                  top_k);
+}
+}  // namespace previous
+
+// Random numbers for one case, drawn with a single `RandomGenerate()`.
+class CaseRandom {
+ public:
+  bool Generate() { return RandomGenerate(values_, sizeof(values_)); }
+
+  // Gets the next number in [min, max].
+  int Uniform(int min, int max) {
+    const uint32_t value = values_[next_++ % kCount];
+    return min + static_cast<int>(value % static_cast<uint32_t>(max - min + 1));
+  }
+
+ private:
+  static constexpr int kCount = 16;
+  uint32_t values_[kCount];
+  int next_ = 0;
+};
+
+struct Case {
+  TfLiteType type;
+  int count;
+  float scale;
+  int zero_point;
+  // Raw tensor data: `count` bytes for quantized types, or `count` floats.
+  std::vector<uint8_t> data;
+};
+
+bool MakeCase(CaseRandom& random, Case* c) {
+  constexpr TfLiteType kTypes[] = {kTfLiteUInt8, kTfLiteInt8, kTfLiteFloat32};
+  constexpr float kScales[] = {1.0f / 256, 1.0f / 255, 0.1f, 0.0123f, 3.0f};
+  c->type = kTypes[random.Uniform(0, 2)];
+  c->count = random.Uniform(1, kMaxClasses);
+  c->scale = kScales[random.Uniform(0, 4)];
+  const bool is_signed = c->type == kTfLiteInt8;
+  c->zero_point = random.Uniform(is_signed ? -128 : 0, is_signed ? 127 : 255);
+
+  const bool is_float = c->type == kTfLiteFloat32;
+  std::vector<uint8_t> bytes(c->count);
+  if (!RandomGenerate(bytes.data(), bytes.size())) return false;
+  // One case in four only uses a few distinct scores, so many classes tie.
+  const int distinct = random.Uniform(0, 3) == 0 ? random.Uniform(1, 4) : 256;
+  for (auto& byte : bytes) byte = byte % distinct;
+  if (is_float) {
+    c->data.resize(c->count * sizeof(float));
+    auto* scores = reinterpret_cast<float*>(c->data.data());
+    for (int i = 0; i < c->count; ++i) {
+      scores[i] = c->scale * (bytes[i] - c->zero_point);
+    }
+  } else {
+    c->data = std::move(bytes);
+  }
+  return true;
+}
+
+// Gets the score of a random class, as the previous version saw it.
+float ScoreOf(CaseRandom& random, const Case& c, TfLiteTensor* tensor) {
+  const int i = random.Uniform(0, c.count - 1);
+  if (c.type == kTfLiteFloat32) return tflite::GetTensorData<float>(tensor)[i];
+  return tensorflow::DequantizeTensor<float>(tensor)[i];
+}
+
+float MakeThreshold(CaseRandom& random, const Case& c, TfLiteTensor* tensor) {
+  constexpr float kInfinity = std::numeric_limits<float>::infinity();
+  switch (random.Uniform(0, 7)) {
+    case 0:
+      return -kInfinity;
+    case 1:
+      return kInfinity;
+    case 2:
+      return std::numeric_limits<float>::quiet_NaN();
+    case 3:
+      return std::nextafter(ScoreOf(random, c, tensor), -kInfinity);
+    case 4:
+      return std::nextafter(ScoreOf(random, c, tensor), kInfinity);
+    case 5:
+      return c.scale * random.Uniform(-300, 300) / 2;
+    default:
+      return ScoreOf(random, c, tensor);
+  }
+}
+
+size_t MakeTopK(CaseRandom& random, int count) {
+  switch (random.Uniform(0, 5)) {
+    case 0:
+      return 0;
+    case 1:
+      return 1;
+    case 2:
+      return count;
+    case 3:
+      return std::numeric_limits<size_t>::max();
+    default:
+      return random.Uniform(1, 10);
+  }
+}
+
+bool Compare(const char* name, const Case& c, float threshold, size_t top_k,
+             const std::vector<tensorflow::Class>& expected,
+             const tensorflow::Class* actual, size_t actual_size) {
+  bool match = expected.size() == actual_size;
+  for (size_t i = 0; match && i < actual_size; ++i) {
+    match = expected[i].id == actual[i].id &&
+            expected[i].score == actual[i].score;
+  }
+  if (!match) {
+    printf(
+        "ERROR: %s, type %d, %d classes, scale %f, zero point %d, threshold "
+        "%f, top_k %lu: %u results instead of %u\r\n",
+        name, static_cast<int>(c.type), c.count, c.scale, c.zero_point,
+        threshold, static_cast<unsigned long>(top_k),
+        static_cast<unsigned>(actual_size),
+        static_cast<unsigned>(expected.size()));
+  }
+  return match;
+}
+
+// Runs one case.
+// @return False if the results differ.
+bool RunCase(uint64_t* new_us, uint64_t* previous_us) {
+  CaseRandom random;
+  Case c;
+  if (!random.Generate() || !MakeCase(random, &c)) {
+    printf("ERROR: Failed to generate a case\r\n");
+    return false;
+  }
+  int dims_data[] = {2, 1, c.count};
+  TfLiteIntArray* dims = tflite::testing::IntArrayFromInts(dims_data);
+  TfLiteTensor tensor;
+  if (c.type == kTfLiteUInt8) {
+    tensor = tflite::testing::CreateQuantizedTensor(c.data.data(), dims,
+                                                    c.scale, c.zero_point);
+  } else if (c.type == kTfLiteInt8) {
+    tensor = tflite::testing::CreateQuantizedTensor(
+        reinterpret_cast<const int8_t*>(c.data.data()), dims, c.scale,
+        c.zero_point);
+  } else {
+    tensor = tflite::testing::CreateTensor(
+        reinterpret_cast<const float*>(c.data.data()), dims);
+  }
+  const float threshold = MakeThreshold(random, c, &tensor);
+  const size_t top_k = MakeTopK(random, c.count);
+
+  uint64_t start_us = TimerMicros();
+  const auto expected =
+      previous::GetClassificationResults(&tensor, threshold, top_k);
+  *previous_us += TimerMicros() - start_us;
+
+  std::vector<tensorflow::Class> actual(
+      std::min(top_k, static_cast<size_t>(c.count)));
+  start_us = TimerMicros();
+  const size_t size = tensorflow::GetClassificationResults(
+      &tensor, threshold, actual.data(), actual.size());
+  *new_us += TimerMicros() - start_us;
+  if (!Compare("tensor", c, threshold, top_k, expected, actual.data(), size)) {
+    return false;
+  }
+
+  if (c.type == kTfLiteFloat32) {
+    const auto from_scores = tensorflow::GetClassificationResults(
+        tflite::GetTensorData<float>(&tensor), c.count, threshold, top_k);
+    if (!Compare("scores", c, threshold, top_k, expected, from_scores.data(),
+                 from_scores.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Main() {
+  printf("Classification top-k check\r\n");
+  uint64_t new_us = 0, previous_us = 0;
+  int failures = 0;
+  for (int i = 0; i < kCases; ++i) {
+    if (!RunCase(&new_us, &previous_us)) ++failures;
+  }
+  printf("GetClassificationResults() %lu us, before %lu us\r\n",
+         static_cast<unsigned long>(new_us),
+         static_cast<unsigned long>(previous_us));
+  if (failures) {
+    printf("FAILED: %d of %d cases\r\n", failures, kCases);
+  } else {
+    printf("All %d cases match\r\n", kCases);
+  }
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
@@ -0,0 +1,155 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "libs/base/filesystem.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_fake_transport.h"
+#include "libs/tpu/edgetpu_manager.h"
+#include "libs/tpu/edgetpu_op.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_error_reporter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_mutable_op_resolver.h"
+
+// Runs Edge TPU models through the whole invocation path (the custom op,
+// `EdgeTpuManager`, `EdgeTpuExecutable` and `TpuDriver`) against a simulated
+// Edge TPU, `FakeTpuTransport`, so changes to that path can be measured
+// without the chip and without its timing noise.
+//
+// Each model is invoked with two timings of the fake: one close to the
+// Edge TPU on USB 2.0, and one where the fake takes no time at all, which
+// leaves only the CPU time of the host side. For each, the app prints the
+// invoke latency and the traffic of an invocation.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e edgetpu_fake_benchmark
+
+namespace coralmicro {
+namespace {
+constexpr const char* kModelPaths[] = {
+    "/models/testconv1-edgetpu.tflite",
+    "/models/mobilenet_v1_1.0_224_quant_edgetpu.tflite",
+};
+constexpr int kTensorArenaSize = 1024 * 1024;
+STATIC_TENSOR_ARENA_IN_SDRAM(tensor_arena, kTensorArenaSize);
+constexpr int kIterations = 50;
+constexpr int kNameWidth = 8;
+
+struct Timing {
+  const char* name;
+  FakeTpuTiming timing;
+};
+
+constexpr Timing kTimings[] = {
+    // One register access per microframe, and about the bulk throughput the
+    // Edge TPU reaches on USB 2.0.
+    {"usb2", {125, 20, 320, 2000}},
+    {"instant", {0, 0, 0, 0}},
+};
+
+bool RunModel(const char* path, FakeTpuTransport* transport) {
+  std::vector<uint8_t> model;
+  if (!LfsReadFile(path, &model)) {
+    printf("ERROR: Failed to load %s\r\n", path);
+    return false;
+  }
+
+  tflite::MicroErrorReporter error_reporter;
+  tflite::MicroMutableOpResolver<1> resolver;
+  resolver.AddCustom(kCustomOp, RegisterCustomOp());
+  tflite::MicroInterpreter interpreter(tflite::GetModel(model.data()), resolver,
+                                       tensor_arena, kTensorArenaSize,
+                                       &error_reporter);
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    printf("ERROR: AllocateTensors() failed\r\n");
+    return false;
+  }
+  auto* input_tensor = interpreter.input_tensor(0);
+  std::memset(tflite::GetTensorData<uint8_t>(input_tensor), 0,
+              input_tensor->bytes);
+
+  printf("%s\r\n", path);
+  auto* manager = EdgeTpuManager::GetSingleton();
+  for (const auto& timing : kTimings) {
+    transport->SetTiming(timing.timing);
+    // Warm up. The first invocation of the model also caches its
+    // parameters.
+    if (interpreter.Invoke() != kTfLiteOk) {
+      printf("ERROR: Invoke() failed\r\n");
+      return false;
+    }
+    transport->ResetStats();
+    manager->ResetTransferStats();
+
+    TimingSummary invoke;
+    for (int i = 0; i < kIterations; ++i) {
+      const uint64_t start_us = TimerMicros();
+      if (interpreter.Invoke() != kTfLiteOk) {
+        printf("ERROR: Invoke() failed\r\n");
+        return false;
+      }
+      invoke.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+    }
+
+    invoke.Print(timing.name, kNameWidth);
+    const FakeTpuStats stats = transport->GetStats();
+    const TpuTransferStats transfers = manager->GetTransferStats();
+    printf(
+        "  per invoke: %lu instruction, %lu parameter, %lu input, %lu output "
+        "bytes (%lu copied), %lu executables\r\n",
+        static_cast<unsigned long>(stats.instruction_bytes / kIterations),
+        static_cast<unsigned long>(stats.parameter_bytes / kIterations),
+        static_cast<unsigned long>(stats.input_bytes / kIterations),
+        static_cast<unsigned long>(stats.output_bytes / kIterations),
+        static_cast<unsigned long>(transfers.bytes_copied / kIterations),
+        static_cast<unsigned long>(stats.executables / kIterations));
+  }
+  return true;
+}
+
+void Main() {
+  printf("Edge TPU benchmark on a simulated Edge TPU\r\n");
+
+  FakeTpuTransport transport(kTimings[0].timing);
+  auto* manager = EdgeTpuManager::GetSingleton();
+  manager->SetTransport(&transport);
+  auto tpu_context = manager->OpenDevice();
+  if (!tpu_context) {
+    printf("ERROR: Failed to get EdgeTpu context\r\n");
+    return;
+  }
+  const EdgeTpuStartupStats startup = manager->GetStartupStats();
+  printf("Initialize: %lu us, %lu register accesses\r\n",
+         static_cast<unsigned long>(startup.initialize_us),
+         static_cast<unsigned long>(startup.csr_transfers));
+
+  for (const char* path : kModelPaths) {
+    if (!RunModel(path, &transport)) return;
+  }
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
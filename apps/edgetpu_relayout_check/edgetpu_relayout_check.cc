@@ -0,0 +1,343 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "libs/base/random.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_executable.h"
+#include "third_party/flatbuffers/include/flatbuffers/flatbuffers.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+// Checks `OutputLayer::Relayout()`, which copies the output activations of
+// the Edge TPU into tensor layout with a plan of spans built once per layer,
+// against the algorithm it replaced, which walked the layout on every call.
+// That algorithm is copied below.
+//
+// Each case builds a random output layer: its dimensions, data type, z
+// padding, and a tiling of x and y into tiles stored in random order with
+// gaps between them. The output buffer is filled with random bytes and
+// relayed out with both, and the results must match byte for byte. The cases
+// cover 8, 16 and 32-bit types, signed and unsigned, padded and unpadded z,
+// and 1-D outputs. The app prints the total time of both.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e edgetpu_relayout_check
+
+namespace coralmicro {
+namespace {
+constexpr int kCases = 3000;
+constexpr int kMaxDim = 40;
+constexpr int kMaxZDim = 16;
+constexpr int kMaxTiles = 4;
+
+constexpr platforms::darwinn::DataType kDataTypes[] = {
+    platforms::darwinn::DataType_FIXED_POINT8,
+    platforms::darwinn::DataType_SIGNED_FIXED_POINT8,
+    platforms::darwinn::DataType_FIXED_POINT16,
+    platforms::darwinn::DataType_SIGNED_FIXED_POINT16,
+    platforms::darwinn::DataType_SIGNED_FIXED_POINT32,
+};
+constexpr int kDataTypeCount = sizeof(kDataTypes) / sizeof(kDataTypes[0]);
+
+int DataTypeSize(platforms::darwinn::DataType type) {
+  switch (type) {
+    case platforms::darwinn::DataType_FIXED_POINT16:
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT16:
+      return 2;
+    case platforms::darwinn::DataType_SIGNED_FIXED_POINT32:
+      return 4;
+    default:
+      return 1;
+  }
+}
+
+// Random numbers from `RandomGenerate()`, fetched in batches.
+class RandomSource {
+ public:
+  // Gets a number in [min, max].
+  int Uniform(int min, int max) {
+    if (next_ == kBatchSize) {
+      if (!RandomGenerate(batch_, sizeof(batch_))) {
+        printf("ERROR: Failed to generate random numbers\r\n");
+      }
+      next_ = 0;
+    }
+    return min + static_cast<int>(batch_[next_++] %
+                                  static_cast<uint32_t>(max - min + 1));
+  }
+
+ private:
+  static constexpr int kBatchSize = 256;
+  uint32_t batch_[kBatchSize];
+  int next_ = kBatchSize;
+};
+
+// Splits [0, size) into up to `max_tiles` tiles, the first of which is at
+// least `min_first` long, and returns the start of each tile followed by
+// `size`.
+std::vector<int> MakeTiles(RandomSource& random, int size, int max_tiles,
+                           int min_first) {
+  std::vector<int> starts{0};
+  const int tiles = random.Uniform(1, max_tiles);
+  for (int i = 1; i < tiles && size > min_first; ++i) {
+    starts.push_back(random.Uniform(min_first, size - 1));
+  }
+  starts.push_back(size);
+  std::sort(starts.begin(), starts.end());
+  starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+  return starts;
+}
+
+// Builds a random output layer into `builder`, and writes a description of it
+// to `description`, for error messages.
+void BuildLayer(RandomSource& random, flatbuffers::FlatBufferBuilder* builder,
+                char* description, size_t description_size) {
+  const auto data_type = kDataTypes[random.Uniform(0, kDataTypeCount - 1)];
+  const int data_type_size = DataTypeSize(data_type);
+  int y_dim = 1, x_dim = 1;
+  // One case in ten is a 1-D output.
+  if (random.Uniform(0, 9) != 0) {
+    y_dim = random.Uniform(1, kMaxDim);
+    x_dim = random.Uniform(y_dim == 1 ? 2 : 1, kMaxDim);
+  }
+  const int z_dim = random.Uniform(1, kMaxZDim);
+  // Grayscale and RGB outputs are always padded to 4 bytes, other outputs
+  // may or may not be padded.
+  int z_padded = z_dim;
+  const int z_bytes = z_dim * data_type_size;
+  if (z_bytes == 1 || z_bytes == 3) {
+    z_padded = 4;
+  } else if (random.Uniform(0, 1)) {
+    z_padded += random.Uniform(1, 4);
+  }
+
+  // All offsets are in elements. `Relayout()` reads the z padding from the
+  // distance between the first two elements of the first tile, so the first
+  // tile holds at least two of them.
+  const std::vector<int> x_tiles =
+      MakeTiles(random, x_dim, kMaxTiles, x_dim > 1 ? 2 : 1);
+  const std::vector<int> y_tiles =
+      MakeTiles(random, y_dim, kMaxTiles, x_dim == 1 && y_dim > 1 ? 2 : 1);
+  const int x_tile_count = x_tiles.size() - 1;
+  const int y_tile_count = y_tiles.size() - 1;
+  std::vector<int32_t> x_tile_ids(x_dim), x_offsets(x_dim), row_sizes(x_dim);
+  std::vector<int32_t> y_tile_ids(y_dim), y_offsets(y_dim);
+  std::vector<int> tile_row_sizes(x_tile_count);
+  for (int tx = 0; tx < x_tile_count; ++tx) {
+    const int width = x_tiles[tx + 1] - x_tiles[tx];
+    tile_row_sizes[tx] = width * z_padded + random.Uniform(0, 1) * 4;
+    for (int x = x_tiles[tx]; x < x_tiles[tx + 1]; ++x) {
+      x_tile_ids[x] = tx;
+      x_offsets[x] = (x - x_tiles[tx]) * z_padded;
+      row_sizes[x] = tile_row_sizes[tx];
+    }
+  }
+  for (int ty = 0; ty < y_tile_count; ++ty) {
+    for (int y = y_tiles[ty]; y < y_tiles[ty + 1]; ++y) {
+      y_tile_ids[y] = ty * x_tile_count;
+      y_offsets[y] = y - y_tiles[ty];
+    }
+  }
+
+  // Tiles are stored in random order, with gaps between them.
+  const int tile_count = x_tile_count * y_tile_count;
+  std::vector<int> order(tile_count);
+  for (int i = 0; i < tile_count; ++i) order[i] = i;
+  for (int i = tile_count - 1; i > 0; --i) {
+    std::swap(order[i], order[random.Uniform(0, i)]);
+  }
+  std::vector<int32_t> tile_offsets(tile_count);
+  int size = 0;
+  for (int tile : order) {
+    const int ty = tile / x_tile_count;
+    const int tx = tile % x_tile_count;
+    tile_offsets[tile] = size;
+    size += (y_tiles[ty + 1] - y_tiles[ty]) * tile_row_sizes[tx] +
+            random.Uniform(0, 8);
+  }
+  // A 1-D output has no tiles of its own, only padding at its end. Layers run
+  // once per inference, since the output buffer holds a single execution.
+  if (x_dim == 1 && y_dim == 1) size = z_padded;
+
+  auto layout = platforms::darwinn::CreateOutputLayoutDirect(
+      *builder, &y_tile_ids, &x_tile_ids, &tile_offsets, &x_offsets, &y_offsets,
+      &row_sizes);
+  auto output_layer =
+      platforms::darwinn::CreateOutputLayer(*builder, layout, data_type);
+  builder->Finish(platforms::darwinn::CreateLayerDirect(
+      *builder, "output", size * data_type_size, y_dim, x_dim, z_dim,
+      /*numerics=*/0, data_type, platforms::darwinn::AnyLayer_OutputLayer,
+      output_layer.Union()));
+  snprintf(description, description_size,
+           "%dx%dx%d, %d bytes, z padded to %d, %dx%d tiles", y_dim, x_dim,
+           z_dim, data_type_size, z_padded, y_tile_count, x_tile_count);
+}
+
+// `OutputLayer::Relayout()` and `OutputLayer::TransformSignedDataType()`
+// before the relayout plan, as functions of the layer.
+namespace previous {
+int GetBufferIndex(const platforms::darwinn::Layer* layer, int y, int x,
+                   int z) {
+  const auto* layout = layer->any_layer_as_OutputLayer()->layout();
+  const int linear_tile_id =
+      layout->y_coordinate_to_linear_tile_id_map()->Get(y) +
+      layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+  const int global_tile_byte_offset =
+      layout->linearized_tile_byte_offset()->Get(linear_tile_id);
+
+  const int local_x_byte_offset =
+      layout->x_coordinate_to_local_byte_offset()->Get(x);
+  const int local_y_byte_offset =
+      layout->y_coordinate_to_local_y_offset()->Get(y) *
+      layout->x_coordinate_to_local_y_row_size()->Get(x);
+
+  return global_tile_byte_offset + local_y_byte_offset + local_x_byte_offset +
+         z;
+}
+
+void Relayout(const platforms::darwinn::Layer* layer, const uint8_t* src,
+              uint8_t* dest) {
+  const int x_dim = layer->x_dim();
+  const int y_dim = layer->y_dim();
+  const int data_type_size = DataTypeSize(layer->data_type());
+  const int z_bytes = layer->z_dim() * data_type_size;
+
+  if (y_dim == 1 && x_dim == 1) {
+    // One dimensional output (only z-dimension).
+    memcpy(dest, src, z_bytes);
+    return;
+  }
+
+  int z_bytes_padded;
+  if (x_dim > 1) {
+    z_bytes_padded =
+        GetBufferIndex(layer, 0, 1, 0) - GetBufferIndex(layer, 0, 0, 0);
+  } else {
+    z_bytes_padded =
+        GetBufferIndex(layer, 1, 0, 0) - GetBufferIndex(layer, 0, 0, 0);
+  }
+  z_bytes_padded *= data_type_size;
+  if (z_bytes == 1 || z_bytes == 3) z_bytes_padded = 4;
+
+  const auto* layout = layer->any_layer_as_OutputLayer()->layout();
+  std::vector<int> tile_x_sizes;
+  int last_x = 0;
+  int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+  for (int x = 1; x < x_dim; ++x) {
+    int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+    if (cur_x_tile != last_x_tile) {
+      tile_x_sizes.push_back(x - last_x);
+      last_x_tile = cur_x_tile;
+      last_x = x;
+    }
+  }
+  tile_x_sizes.push_back(x_dim - last_x);
+
+  for (int y = 0; y < y_dim; ++y) {
+    int tile_starting_x = 0;
+    for (int tile_x_size : tile_x_sizes) {
+      const uint8_t* source =
+          src + GetBufferIndex(layer, y, tile_starting_x, 0) * data_type_size;
+      for (int i = 0; i < tile_x_size; ++i) {
+        memcpy(dest, source, z_bytes);
+        dest += z_bytes;
+        source += z_bytes_padded;
+      }
+      tile_starting_x += tile_x_size;
+    }
+  }
+}
+
+void TransformSignedDataType(const platforms::darwinn::Layer* layer,
+                             uint8_t* buffer) {
+  if (!OutputLayer::SignedDataType(layer->data_type())) return;
+  const int data_type_size = DataTypeSize(layer->data_type());
+  const int count = layer->x_dim() * layer->y_dim() * layer->z_dim();
+  for (int i = 0; i < count; ++i) {
+    // Flips the MSB of each little endian element.
+    buffer[i * data_type_size + data_type_size - 1] ^= 128;
+  }
+}
+}  // namespace previous
+
+// Runs one case.
+// @return False if the results differ.
+bool RunCase(RandomSource& random, uint64_t* plan_us, uint64_t* previous_us) {
+  flatbuffers::FlatBufferBuilder builder;
+  char description[96];
+  BuildLayer(random, &builder, description, sizeof(description));
+  const auto* layer = flatbuffers::GetRoot<platforms::darwinn::Layer>(
+      builder.GetBufferPointer());
+
+  OutputLayer output_layer(layer, /*arena=*/nullptr);
+  if (!RandomGenerate(output_layer.output_buffer(), layer->size_bytes())) {
+    printf("ERROR: Failed to generate output activations\r\n");
+    return false;
+  }
+  const int tensor_size = layer->x_dim() * layer->y_dim() * layer->z_dim() *
+                          DataTypeSize(layer->data_type());
+  std::vector<uint8_t> expected(tensor_size);
+  std::vector<uint8_t> actual(tensor_size);
+
+  uint64_t start_us = TimerMicros();
+  output_layer.Relayout(actual.data());
+  *plan_us += TimerMicros() - start_us;
+
+  start_us = TimerMicros();
+  previous::Relayout(layer, output_layer.output_buffer(), expected.data());
+  previous::TransformSignedDataType(layer, expected.data());
+  *previous_us += TimerMicros() - start_us;
+
+  for (int i = 0; i < tensor_size; ++i) {
+    if (actual[i] != expected[i]) {
+      printf("ERROR: %s: byte %d is %d instead of %d\r\n", description, i,
+             actual[i], expected[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+void Main() {
+  printf("Edge TPU output relayout check\r\n");
+  RandomSource random;
+  uint64_t plan_us = 0, previous_us = 0;
+  int failures = 0;
+  for (int i = 0; i < kCases; ++i) {
+    if (!RunCase(random, &plan_us, &previous_us)) ++failures;
+  }
+  printf("Relayout() %lu us, before %lu us\r\n",
+         static_cast<unsigned long>(plan_us),
+         static_cast<unsigned long>(previous_us));
+  if (failures) {
+    printf("FAILED: %d of %d cases\r\n", failures, kCases);
+  } else {
+    printf("All %d cases match\r\n", kCases);
+  }
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
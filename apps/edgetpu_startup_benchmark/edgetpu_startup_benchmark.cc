@@ -0,0 +1,139 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "libs/base/filesystem.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/edgetpu_manager.h"
+#include "libs/tpu/edgetpu_op.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_error_reporter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_mutable_op_resolver.h"
+
+// Measures the latency of bringing up the Edge TPU: powering it on, waiting
+// for it to enumerate, configuring its registers, and running the first
+// inference with MobileNet (which also caches its parameters). Each
+// iteration releases the Edge TPU so it powers off again, like an
+// application that only powers it for bursts of inferences.
+//
+// The time of each phase is printed for every iteration, followed by the
+// minimum, average and maximum.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e edgetpu_startup_benchmark
+
+namespace coralmicro {
+namespace {
+constexpr char kModelPath[] =
+    "/models/mobilenet_v1_1.0_224_quant_edgetpu.tflite";
+constexpr int kTensorArenaSize = 1024 * 1024;
+STATIC_TENSOR_ARENA_IN_SDRAM(tensor_arena, kTensorArenaSize);
+constexpr int kIterations = 20;
+constexpr int kNameWidth = 16;
+// Time the Edge TPU stays off between iterations.
+constexpr TickType_t kPowerOffDelay = pdMS_TO_TICKS(200);
+
+struct Sample {
+  EdgeTpuStartupStats startup;
+  uint32_t first_invoke_us;
+};
+
+bool RunIteration(const std::vector<uint8_t>& model, Sample* sample) {
+  auto* manager = EdgeTpuManager::GetSingleton();
+  auto tpu_context = manager->OpenDevice();
+  if (!tpu_context) {
+    printf("ERROR: Failed to get EdgeTpu context\r\n");
+    return false;
+  }
+  sample->startup = manager->GetStartupStats();
+
+  tflite::MicroErrorReporter error_reporter;
+  tflite::MicroMutableOpResolver<1> resolver;
+  resolver.AddCustom(kCustomOp, RegisterCustomOp());
+  tflite::MicroInterpreter interpreter(tflite::GetModel(model.data()), resolver,
+                                       tensor_arena, kTensorArenaSize,
+                                       &error_reporter);
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    printf("ERROR: AllocateTensors() failed\r\n");
+    return false;
+  }
+  auto* input_tensor = interpreter.input_tensor(0);
+  std::memset(tflite::GetTensorData<uint8_t>(input_tensor), 0,
+              input_tensor->bytes);
+
+  const uint64_t start_us = TimerMicros();
+  if (interpreter.Invoke() != kTfLiteOk) {
+    printf("ERROR: Invoke() failed\r\n");
+    return false;
+  }
+  sample->first_invoke_us = static_cast<uint32_t>(TimerMicros() - start_us);
+  return true;
+}
+
+void Main() {
+  printf("Edge TPU startup benchmark\r\n");
+
+  std::vector<uint8_t> model;
+  if (!LfsReadFile(kModelPath, &model)) {
+    printf("ERROR: Failed to load %s\r\n", kModelPath);
+    return;
+  }
+
+  TimingSummary enumeration, initialize, open_device, first_invoke;
+  uint32_t csr_transfers = 0;
+  for (int i = 0; i < kIterations; ++i) {
+    Sample sample;
+    if (!RunIteration(model, &sample)) return;
+    printf(
+        "%2d: enumeration %lu us, initialize %lu us (%lu transfers), "
+        "open %lu us, first invoke %lu us\r\n",
+        i, static_cast<unsigned long>(sample.startup.enumeration_us),
+        static_cast<unsigned long>(sample.startup.initialize_us),
+        static_cast<unsigned long>(sample.startup.csr_transfers),
+        static_cast<unsigned long>(sample.startup.total_us),
+        static_cast<unsigned long>(sample.first_invoke_us));
+    enumeration.Add(sample.startup.enumeration_us);
+    initialize.Add(sample.startup.initialize_us);
+    open_device.Add(sample.startup.total_us);
+    first_invoke.Add(sample.first_invoke_us);
+    csr_transfers = sample.startup.csr_transfers;
+    vTaskDelay(kPowerOffDelay);
+  }
+
+  printf("Over %d power cycles:\r\n", kIterations);
+  enumeration.Print("enumeration", kNameWidth);
+  initialize.Print("initialize", kNameWidth);
+  open_device.Print("OpenDevice()", kNameWidth);
+  first_invoke.Print("first invoke", kNameWidth);
+  printf("%lu register accesses, %lu us each on average\r\n",
+         static_cast<unsigned long>(csr_transfers),
+         static_cast<unsigned long>(
+             csr_transfers ? initialize.total / kIterations / csr_transfers
+                           : 0));
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
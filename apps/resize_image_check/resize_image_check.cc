@@ -0,0 +1,199 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "libs/base/random.h"
+#include "libs/base/timer.h"
+#include "libs/tensorflow/utils.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/kernels/kernel_runner.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/kernels/micro_ops.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/test_helpers.h"
+
+// Checks that the nearest-neighbor `tensorflow::ResizeImage()` gives the same
+// bytes as TFLM's RESIZE_NEAREST_NEIGHBOR op, which it replaced, over a set of
+// shapes and channel counts.
+//
+// Each case resizes random pixels with both, and compares the results. The
+// op runs on int8 tensors, which hold the pixel bytes unchanged, since
+// nearest-neighbor only copies them. `ResizeImage()` is also checked with a
+// random lookup table, against the op output mapped through the table. The
+// app prints the time of both for each case.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e resize_image_check
+
+namespace coralmicro {
+namespace {
+struct Shape {
+  int in_height;
+  int in_width;
+  int out_height;
+  int out_width;
+};
+
+constexpr Shape kShapes[] = {
+    // Camera frames to model inputs.
+    {324, 324, 224, 224},
+    {324, 324, 96, 96},
+    {240, 320, 300, 300},
+    // Upscaling, a single row or column, and sizes that don't divide.
+    {96, 96, 320, 320},
+    {1, 64, 5, 32},
+    {64, 1, 32, 5},
+    {17, 33, 8, 32},
+    {5, 7, 13, 11},
+    {1, 1, 3, 2},
+    {64, 64, 64, 64},
+};
+constexpr int kDepths[] = {1, 2, 3, 4, 5};
+
+// Resizes `in` with the TFLM op.
+bool OpResize(const Shape& shape, int depth, const uint8_t* in, uint8_t* out,
+              uint32_t* invoke_us) {
+  int input_dims[] = {4, 1, shape.in_height, shape.in_width, depth};
+  int size_dims[] = {1, 2};
+  int output_dims[] = {4, 1, shape.out_height, shape.out_width, depth};
+  int32_t size[] = {shape.out_height, shape.out_width};
+  constexpr int kTensorsSize = 3;
+  TfLiteTensor tensors[kTensorsSize] = {
+      tflite::testing::CreateQuantizedTensor(
+          reinterpret_cast<int8_t*>(const_cast<uint8_t*>(in)),
+          tflite::testing::IntArrayFromInts(input_dims), 0, 255),
+      tflite::testing::CreateTensor(
+          size, tflite::testing::IntArrayFromInts(size_dims)),
+      tflite::testing::CreateQuantizedTensor(
+          reinterpret_cast<int8_t*>(out),
+          tflite::testing::IntArrayFromInts(output_dims), 0, 255),
+  };
+  tensors[1].allocation_type = kTfLiteMmapRo;
+  int inputs[] = {2, 0, 1};
+  int outputs[] = {1, 2};
+  TfLiteResizeNearestNeighborParams params = {false, /* align_corners */
+                                              false /* half_pixel_centers */};
+
+  tflite::micro::KernelRunner runner(
+      tflite::ops::micro::Register_RESIZE_NEAREST_NEIGHBOR(), tensors,
+      kTensorsSize, tflite::testing::IntArrayFromInts(inputs),
+      tflite::testing::IntArrayFromInts(outputs), &params);
+  if (runner.InitAndPrepare() != kTfLiteOk) {
+    printf("ERROR: Failed to prepare the op\r\n");
+    return false;
+  }
+  const uint64_t start_us = TimerMicros();
+  if (runner.Invoke() != kTfLiteOk) {
+    printf("ERROR: Failed to invoke the op\r\n");
+    return false;
+  }
+  *invoke_us = static_cast<uint32_t>(TimerMicros() - start_us);
+  return true;
+}
+
+// Gets the index of the first byte that differs, or -1 if there is none.
+int FirstDifference(const std::vector<uint8_t>& a,
+                    const std::vector<uint8_t>& b) {
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i] != b[i]) return static_cast<int>(i);
+  }
+  return -1;
+}
+
+// Runs one case.
+// @return False if the results differ or the op fails.
+bool RunCase(const Shape& shape, int depth, const uint8_t* lut) {
+  const tensorflow::ImageDims in_dims{shape.in_height, shape.in_width, depth};
+  const tensorflow::ImageDims out_dims{shape.out_height, shape.out_width,
+                                       depth};
+  std::vector<uint8_t> in(tensorflow::ImageSize(in_dims));
+  std::vector<uint8_t> expected(tensorflow::ImageSize(out_dims));
+  std::vector<uint8_t> actual(expected.size());
+  printf("%3dx%-3d -> %3dx%-3d x%d: ", shape.in_height, shape.in_width,
+         shape.out_height, shape.out_width, depth);
+  if (!RandomGenerate(in.data(), in.size())) {
+    printf("ERROR: Failed to generate random pixels\r\n");
+    return false;
+  }
+
+  uint32_t op_us;
+  if (!OpResize(shape, depth, in.data(), expected.data(), &op_us)) {
+    return false;
+  }
+  const uint64_t start_us = TimerMicros();
+  if (!tensorflow::ResizeImage(in_dims, in.data(), out_dims, actual.data())) {
+    printf("ERROR: ResizeImage() failed\r\n");
+    return false;
+  }
+  const auto resize_us = static_cast<uint32_t>(TimerMicros() - start_us);
+  int diff = FirstDifference(expected, actual);
+  if (diff >= 0) {
+    printf("ERROR: byte %d is %d instead of %d\r\n", diff, actual[diff],
+           expected[diff]);
+    return false;
+  }
+
+  if (!tensorflow::ResizeImage(in_dims, in.data(), out_dims, actual.data(),
+                               tensorflow::ResizeMethod::kNearestNeighbor,
+                               lut)) {
+    printf("ERROR: ResizeImage() with a lookup table failed\r\n");
+    return false;
+  }
+  for (auto& value : expected) value = lut[value];
+  diff = FirstDifference(expected, actual);
+  if (diff >= 0) {
+    printf("ERROR: with a lookup table, byte %d is %d instead of %d\r\n", diff,
+           actual[diff], expected[diff]);
+    return false;
+  }
+
+  printf("ResizeImage %6lu us, op %6lu us\r\n",
+         static_cast<unsigned long>(resize_us),
+         static_cast<unsigned long>(op_us));
+  return true;
+}
+
+void Main() {
+  printf("ResizeImage() check against RESIZE_NEAREST_NEIGHBOR\r\n");
+  uint8_t lut[256];
+  if (!RandomGenerate(lut, sizeof(lut))) {
+    printf("ERROR: Failed to generate a lookup table\r\n");
+    return;
+  }
+
+  int cases = 0, failures = 0;
+  for (const Shape& shape : kShapes) {
+    for (int depth : kDepths) {
+      ++cases;
+      if (!RunCase(shape, depth, lut)) ++failures;
+    }
+  }
+  if (failures) {
+    printf("FAILED: %d of %d cases\r\n", failures, cases);
+  } else {
+    printf("All %d cases match\r\n", cases);
+  }
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
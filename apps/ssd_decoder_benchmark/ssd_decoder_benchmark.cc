@@ -0,0 +1,328 @@
+// Copyright 2022 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include "flatbuffers/flexbuffers.h"
+#include "libs/base/filesystem.h"
+#include "libs/base/timer.h"
+#include "libs/tensorflow/detection.h"
+#include "libs/tensorflow/utils.h"
+#include "libs/tpu/edgetpu_manager.h"
+#include "libs/tpu/edgetpu_op.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/task.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/kernels/kernel_util.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/kernels/micro_ops.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_error_reporter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/micro_mutable_op_resolver.h"
+#include "third_party/tflite-micro/tensorflow/lite/micro/test_helpers.h"
+
+// Compares the SSD post-processing of `TFLite_Detection_PostProcess` (and the
+// Dequantize ops in front of it) with `tensorflow::GetSsdDetectionResults()`.
+//
+// The app runs SSD MobileNet V2 with both ops wrapped: the Dequantize ops
+// keep a copy of the raw quantized Edge TPU outputs, and the post-processing
+// op exposes its anchors and options. After each inference, the raw outputs
+// are decoded again with `GetSsdDetectionResults()`, using the same options,
+// and the objects are compared with those of the model. The decoder is also
+// timed with an application score threshold, as in the detection examples.
+//
+// To build and flash from coralmicro root:
+//    bash build.sh
+//    python3 scripts/flashtool.py -e ssd_decoder_benchmark
+
+namespace coralmicro {
+namespace {
+constexpr char kModelPath[] =
+    "/models/tf2_ssd_mobilenet_v2_coco17_ptq_edgetpu.tflite";
+constexpr char kImagePath[] = "/examples/detect_objects_file/cat_300x300.rgb";
+constexpr int kTensorArenaSize = 8 * 1024 * 1024;
+STATIC_TENSOR_ARENA_IN_SDRAM(tensor_arena, kTensorArenaSize);
+constexpr int kIterations = 50;
+constexpr int kNameWidth = 22;
+// Score threshold of the application-level decoder run.
+constexpr float kAppThreshold = 0.5f;
+
+// A quantized tensor copied from the input of a Dequantize op.
+struct CapturedTensor {
+  const TfLiteNode* node;
+  TfLiteType type;
+  TfLiteQuantizationParams params;
+  // Dimensions in the `IntArrayFromInts()` format.
+  int dims[2];
+  std::vector<uint8_t> data;
+};
+
+constexpr int kMaxCaptures = 2;
+CapturedTensor captures[kMaxCaptures];
+int capture_count = 0;
+
+const TfLiteRegistration* dequantize_op;
+TfLiteRegistration dequantize_wrapper;
+const TfLiteRegistration* postprocess_op;
+TfLiteRegistration postprocess_wrapper;
+
+tensorflow::SsdDecoderOptions model_options;
+const float* anchors = nullptr;
+int num_anchors = 0;
+
+// Time spent in the wrapped ops during the last inference.
+uint32_t dequantize_us = 0;
+uint32_t postprocess_us = 0;
+
+TfLiteStatus DequantizePrepare(TfLiteContext* context, TfLiteNode* node) {
+  TF_LITE_ENSURE_STATUS(dequantize_op->prepare(context, node));
+  TF_LITE_ENSURE(context, capture_count < kMaxCaptures);
+  tflite::MicroContext* micro_context = tflite::GetMicroContext(context);
+  TfLiteTensor* input = micro_context->AllocateTempInputTensor(node, 0);
+  TF_LITE_ENSURE(context, input != nullptr);
+  auto& capture = captures[capture_count++];
+  capture.node = node;
+  capture.type = input->type;
+  capture.params = input->params;
+  capture.dims[0] = 1;
+  capture.dims[1] = tflite::ElementCount(*input->dims);
+  capture.data.resize(input->bytes);
+  micro_context->DeallocateTempTfLiteTensor(input);
+  return kTfLiteOk;
+}
+
+TfLiteStatus DequantizeInvoke(TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteEvalTensor* input = tflite::micro::GetEvalInput(context, node, 0);
+  for (int i = 0; i < capture_count; ++i) {
+    if (captures[i].node == node) {
+      std::memcpy(captures[i].data.data(), input->data.raw,
+                  captures[i].data.size());
+    }
+  }
+  const uint64_t start_us = TimerMicros();
+  const TfLiteStatus status = dequantize_op->invoke(context, node);
+  dequantize_us += static_cast<uint32_t>(TimerMicros() - start_us);
+  return status;
+}
+
+void* PostprocessInit(TfLiteContext* context, const char* buffer,
+                      size_t length) {
+  const flexbuffers::Map& m =
+      flexbuffers::GetRoot(reinterpret_cast<const uint8_t*>(buffer), length)
+          .AsMap();
+  model_options.y_scale = m["y_scale"].AsFloat();
+  model_options.x_scale = m["x_scale"].AsFloat();
+  model_options.h_scale = m["h_scale"].AsFloat();
+  model_options.w_scale = m["w_scale"].AsFloat();
+  model_options.score_threshold = m["nms_score_threshold"].AsFloat();
+  model_options.iou_threshold = m["nms_iou_threshold"].AsFloat();
+  model_options.max_detections = m["max_detections"].AsInt32();
+  model_options.class_aware = m["use_regular_nms"].AsBool();
+  return postprocess_op->init(context, buffer, length);
+}
+
+TfLiteStatus PostprocessPrepare(TfLiteContext* context, TfLiteNode* node) {
+  TF_LITE_ENSURE_STATUS(postprocess_op->prepare(context, node));
+  tflite::MicroContext* micro_context = tflite::GetMicroContext(context);
+  TfLiteTensor* input = micro_context->AllocateTempInputTensor(node, 2);
+  TF_LITE_ENSURE(context, input != nullptr);
+  // The anchors are a constant tensor, so the data outlives this call.
+  anchors = tflite::GetTensorData<float>(input);
+  num_anchors = tflite::ElementCount(*input->dims) / 4;
+  micro_context->DeallocateTempTfLiteTensor(input);
+  return kTfLiteOk;
+}
+
+TfLiteStatus PostprocessInvoke(TfLiteContext* context, TfLiteNode* node) {
+  const uint64_t start_us = TimerMicros();
+  const TfLiteStatus status = postprocess_op->invoke(context, node);
+  postprocess_us = static_cast<uint32_t>(TimerMicros() - start_us);
+  return status;
+}
+
+// Resolves the Dequantize builtin to `dequantize_wrapper`.
+class BenchmarkOpResolver : public tflite::MicroMutableOpResolver<3> {
+ public:
+  using MicroMutableOpResolver::FindOp;
+  const TfLiteRegistration* FindOp(tflite::BuiltinOperator op) const override {
+    if (op == tflite::BuiltinOperator_DEQUANTIZE) return &dequantize_wrapper;
+    return MicroMutableOpResolver::FindOp(op);
+  }
+};
+
+TfLiteTensor CapturedTfLiteTensor(CapturedTensor* capture) {
+  TfLiteTensor tensor = {};
+  tensor.type = capture->type;
+  tensor.params = capture->params;
+  tensor.dims = tflite::testing::IntArrayFromInts(capture->dims);
+  tensor.data.raw = reinterpret_cast<char*>(capture->data.data());
+  tensor.bytes = capture->data.size();
+  return tensor;
+}
+
+float IntersectionOverUnion(const tensorflow::BBox<float>& a,
+                            const tensorflow::BBox<float>& b) {
+  const float area_a = (a.ymax - a.ymin) * (a.xmax - a.xmin);
+  const float area_b = (b.ymax - b.ymin) * (b.xmax - b.xmin);
+  if (area_a <= 0 || area_b <= 0) return 0.0f;
+  const float h = std::min(a.ymax, b.ymax) - std::max(a.ymin, b.ymin);
+  const float w = std::min(a.xmax, b.xmax) - std::max(a.xmin, b.xmin);
+  const float intersection = std::max(h, 0.0f) * std::max(w, 0.0f);
+  return intersection / (area_a + area_b - intersection);
+}
+
+// Counts the `expected` objects that have a match in `objects`. Boxes are
+// clamped like `GetDetectionResults()` does.
+int CountMatches(const std::vector<tensorflow::Object>& expected,
+                 const std::vector<tensorflow::Object>& objects) {
+  int matches = 0;
+  for (const auto& e : expected) {
+    for (auto o : objects) {
+      o.bbox.ymin = std::max(0.0f, o.bbox.ymin);
+      o.bbox.xmin = std::max(0.0f, o.bbox.xmin);
+      o.bbox.ymax = std::max(0.0f, o.bbox.ymax);
+      o.bbox.xmax = std::max(0.0f, o.bbox.xmax);
+      if (o.id == e.id && std::abs(o.score - e.score) < 1e-5f &&
+          IntersectionOverUnion(o.bbox, e.bbox) > 0.99f) {
+        ++matches;
+        break;
+      }
+    }
+  }
+  return matches;
+}
+
+void Main() {
+  printf("SSD decoder benchmark\r\n");
+
+  std::vector<uint8_t> model;
+  if (!LfsReadFile(kModelPath, &model)) {
+    printf("ERROR: Failed to load %s\r\n", kModelPath);
+    return;
+  }
+
+  auto tpu_context = EdgeTpuManager::GetSingleton()->OpenDevice();
+  if (!tpu_context) {
+    printf("ERROR: Failed to get EdgeTpu context\r\n");
+    return;
+  }
+
+  BenchmarkOpResolver resolver;
+  resolver.AddDequantize();
+  dequantize_op = resolver.MicroMutableOpResolver::FindOp(
+      tflite::BuiltinOperator_DEQUANTIZE);
+  dequantize_wrapper = *dequantize_op;
+  dequantize_wrapper.prepare = DequantizePrepare;
+  dequantize_wrapper.invoke = DequantizeInvoke;
+  postprocess_op = tflite::Register_DETECTION_POSTPROCESS();
+  postprocess_wrapper = *postprocess_op;
+  postprocess_wrapper.init = PostprocessInit;
+  postprocess_wrapper.prepare = PostprocessPrepare;
+  postprocess_wrapper.invoke = PostprocessInvoke;
+  resolver.AddCustom("TFLite_Detection_PostProcess", &postprocess_wrapper);
+  resolver.AddCustom(kCustomOp, RegisterCustomOp());
+
+  tflite::MicroErrorReporter error_reporter;
+  tflite::MicroInterpreter interpreter(tflite::GetModel(model.data()), resolver,
+                                       tensor_arena, kTensorArenaSize,
+                                       &error_reporter);
+  if (interpreter.AllocateTensors() != kTfLiteOk) {
+    printf("ERROR: AllocateTensors() failed\r\n");
+    return;
+  }
+  if (capture_count != 2 || !anchors) {
+    printf("ERROR: Model must have 2 Dequantize ops and a postprocess op\r\n");
+    return;
+  }
+
+  auto* input_tensor = interpreter.input_tensor(0);
+  if (!LfsReadFile(kImagePath, tflite::GetTensorData<uint8_t>(input_tensor),
+                   input_tensor->bytes)) {
+    printf("ERROR: Failed to load %s\r\n", kImagePath);
+    return;
+  }
+
+  // The box encodings have 4 values per anchor.
+  const bool boxes_first = captures[0].dims[1] == num_anchors * 4;
+  CapturedTensor* boxes = &captures[boxes_first ? 0 : 1];
+  CapturedTensor* classes = &captures[boxes_first ? 1 : 0];
+  const TfLiteTensor box_encodings = CapturedTfLiteTensor(boxes);
+  const TfLiteTensor class_predictions = CapturedTfLiteTensor(classes);
+  // Same results as the op, so keep every candidate.
+  model_options.max_candidates = std::numeric_limits<size_t>::max();
+  tensorflow::SsdDecoderOptions app_options = model_options;
+  app_options.score_threshold = kAppThreshold;
+  app_options.max_candidates = tensorflow::SsdDecoderOptions().max_candidates;
+
+  printf("%d anchors, %d classes, score threshold %f, %s NMS\r\n", num_anchors,
+         classes->dims[1] / num_anchors - model_options.label_offset,
+         static_cast<double>(model_options.score_threshold),
+         model_options.class_aware ? "regular" : "fast");
+
+  TimingSummary tflm, dequantize, postprocess, decoder, decoder_app;
+  int expected_objects = 0, matched_objects = 0, extra_objects = 0;
+  for (int i = 0; i < kIterations; ++i) {
+    dequantize_us = 0;
+    if (interpreter.Invoke() != kTfLiteOk) {
+      printf("ERROR: Invoke() failed\r\n");
+      return;
+    }
+    tflm.Add(dequantize_us + postprocess_us);
+    dequantize.Add(dequantize_us);
+    postprocess.Add(postprocess_us);
+
+    uint64_t start_us = TimerMicros();
+    auto objects = tensorflow::GetSsdDetectionResults(
+        box_encodings, class_predictions, anchors, model_options);
+    decoder.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+
+    start_us = TimerMicros();
+    auto app_objects = tensorflow::GetSsdDetectionResults(
+        box_encodings, class_predictions, anchors, app_options);
+    decoder_app.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+
+    auto expected = tensorflow::GetDetectionResults(&interpreter);
+    const int matches = CountMatches(expected, objects);
+    expected_objects += expected.size();
+    matched_objects += matches;
+    extra_objects += objects.size() - matches;
+    if (i == 0) {
+      printf("Op:      %s\r\n",
+             tensorflow::FormatDetectionOutput(expected).c_str());
+      printf("Decoder: %s\r\n",
+             tensorflow::FormatDetectionOutput(app_objects).c_str());
+    }
+  }
+
+  printf("Over %d inferences:\r\n", kIterations);
+  dequantize.Print("Dequantize ops", kNameWidth);
+  postprocess.Print("PostProcess op", kNameWidth);
+  tflm.Print("TFLM total", kNameWidth);
+  decoder.Print("decoder (op options)", kNameWidth);
+  decoder_app.Print("decoder (threshold)", kNameWidth);
+  printf("%d of %d objects matched, %d extra\r\n", matched_objects,
+         expected_objects, extra_objects);
+}
+}  // namespace
+}  // namespace coralmicro
+
+extern "C" void app_main(void* param) {
+  (void)param;
+  coralmicro::Main();
+  vTaskSuspend(nullptr);
+}
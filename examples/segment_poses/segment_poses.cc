@@ -131,7 +131,10 @@ void Main() {
   // Creates a micro interpreter.
   tflite::MicroMutableOpResolver<2> resolver;
   resolver.AddCustom(kCustomOp, RegisterCustomOp());
-  resolver.AddCustom(kPosenetDecoderOp, RegisterPosenetDecoderOp());
+  // The instance masks aren't sent to the client, so decode them in the
+  // faster label format.
+  resolver.AddCustom(kPosenetDecoderOp,
+                     RegisterPosenetDecoderOp(PosenetMaskFormat::kLabels));
   tflite::MicroInterpreter interpreter = tflite::MicroInterpreter{
       model, resolver, tensor_arena, kTensorArenaSize, &error_reporter};
   if (interpreter.AllocateTensors() != kTfLiteOk) {
@@ -41,6 +41,8 @@ enum {
   kUsbHostTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kEdgeTpuDfuTaskPriority = TaskPriority<configMAX_PRIORITIES - 2>,
   kEdgeTpuTaskPriority = TaskPriority<configMAX_PRIORITIES - 2>,
+  kEdgeTpuInvokeTaskPriority = TaskPriority<configMAX_PRIORITIES - 2>,
+  kEdgeTpuFakeTransportTaskPriority = TaskPriority<configMAX_PRIORITIES - 3>,
   kRandomTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kPmicTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
   kCameraTaskPriority = TaskPriority<configMAX_PRIORITIES - 1>,
@@ -19,6 +19,7 @@
 #include <sys/time.h>
 
 #include <climits>
+#include <cstdio>
 #include <ctime>
 
 #include "libs/base/check.h"
@@ -112,6 +113,13 @@ void TimerSetRtcTime(uint32_t sec) {
   coralmicro::g_rtc_set = true;
 }
 
+void TimingSummary::Print(const char* name, int name_width) const {
+  printf("%-*s min %7lu us  avg %7lu us  max %7lu us\r\n", name_width, name,
+         static_cast<unsigned long>(count ? min : 0),
+         static_cast<unsigned long>(Average()),
+         static_cast<unsigned long>(max));
+}
+
 }  // namespace coralmicro
 
 extern "C" void GPT1_IRQHandler() {
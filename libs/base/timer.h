@@ -17,6 +17,7 @@
 #ifndef LIBS_BASE_TIMER_H_
 #define LIBS_BASE_TIMER_H_
 
+#include <algorithm>
 #include <cstdint>
 #include <ctime>
 
@@ -47,6 +48,42 @@ inline uint64_t TimerMillis() { return TimerMicros() / 1000; }
 void TimerSetRtcTime(uint32_t sec);
 void TimerGetRtcTime(struct tm* time);
 
+// Collects the minimum, average and maximum of durations, such as the
+// iterations of a benchmark. For example:
+//
+// ```
+// TimingSummary invoke;
+// for (int i = 0; i < kIterations; ++i) {
+//   const uint64_t start_us = TimerMicros();
+//   interpreter.Invoke();
+//   invoke.Add(static_cast<uint32_t>(TimerMicros() - start_us));
+// }
+// invoke.Print("invoke", 8);
+// ```
+struct TimingSummary {
+  uint32_t min = UINT32_MAX;
+  uint32_t max = 0;
+  uint64_t total = 0;
+  uint32_t count = 0;
+
+  // Adds a duration in microseconds.
+  void Add(uint32_t us) {
+    min = std::min(min, us);
+    max = std::max(max, us);
+    total += us;
+    ++count;
+  }
+
+  // Average of the durations, or 0 if there are none.
+  uint32_t Average() const {
+    return count ? static_cast<uint32_t>(total / count) : 0;
+  }
+
+  // Prints a line with `name`, left-aligned in `name_width` characters, and
+  // the minimum, average and maximum duration.
+  void Print(const char* name, int name_width) const;
+};
+
 }  // namespace coralmicro
 
 #endif  // LIBS_BASE_TIMER_H_
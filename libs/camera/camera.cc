@@ -18,6 +18,8 @@
 
 #include "libs/base/check.h"
 #include "libs/base/gpio.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
 #include "libs/pmic/pmic.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_csi.h"
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/fsl_lpi2c.h"
@@ -29,13 +31,16 @@
 #include "third_party/nxp/rt1176-sdk/devices/MIMXRT1176/drivers/cm4/fsl_cache.h"
 #endif
 
+#include <algorithm>
+#include <cmath>
 #include <cstring>
-#include <memory>
+#include <optional>
+#include <vector>
 
 namespace coralmicro {
 namespace {
 constexpr uint8_t kCameraAddress = 0x24;
-constexpr int kFramebufferCount = 4;
+constexpr int kFramebufferCount = CameraTask::kFramebufferCount;
 constexpr float kRedCoefficient = .2126;
 constexpr float kGreenCoefficient = .7152;
 constexpr float kBlueCoefficient = .0722;
@@ -112,6 +117,16 @@ __attribute__((section(".sdram_bss,\"aw\",%nobits @")))
 __attribute__((aligned(64))) uint8_t
     framebuffers[kFramebufferCount][CameraTask::kHeight][CameraTask::kWidth];
 
+// Demosaiced full-resolution frame shared by all formats of one `GetFrame()`
+// call, guarded by `CameraTask::frame_mutex_`.
+__attribute__((section(".sdram_bss,\"aw\",%nobits @")))
+__attribute__((aligned(64))) uint8_t
+    frame_rgb[CameraTask::kHeight][CameraTask::kWidth][3];
+
+// One vertically filtered line of `frame_rgb`, in 8.8 fixed point, for the
+// bilinear and area resize filters. Also guarded by `CameraTask::frame_mutex_`.
+uint16_t filter_line[std::max(CameraTask::kWidth, CameraTask::kHeight)][3];
+
 uint8_t* IndexToFramebufferPtr(int index) {
   if (index < 0 || index >= kFramebufferCount) {
     return nullptr;
@@ -128,42 +143,6 @@ int FramebufferPtrToIndex(const uint8_t* framebuffer_ptr) {
   return -1;
 }
 
-void ResizeNearestNeighbor(const uint8_t* src, int src_w, int src_h,
-                           uint8_t* dst, int dst_w, int dst_h, int comps,
-                           bool preserve_aspect) {
-  int src_p = src_w * comps;
-  int dst_p = dst_w * comps;
-  float ratio_src = (float)src_w / src_h;
-  float ratio_dst = (float)dst_w / dst_h;
-  int scaled_w =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? src_w * (float)dst_h / src_h : dst_w)
-          : dst_w;
-  int scaled_h =
-      preserve_aspect
-          ? (ratio_dst > ratio_src ? dst_h : src_h * (float)dst_w / src_w)
-          : dst_h;
-  float ratio_x = (float)src_w / scaled_w;
-  float ratio_y = (float)src_h / scaled_h;
-
-  for (int y = 0; y < dst_h; y++) {
-    if (y >= scaled_h) {
-      std::memset(dst, 0, dst_p);
-      dst += dst_p;
-      continue;
-    }
-
-    int offset_y = static_cast<int>(y * ratio_y) * src_p;
-    for (int x = 0; x < dst_w; x++) {
-      int offset_x = static_cast<int>(x * ratio_x) * comps;
-      const uint8_t* src_y = src + offset_y;
-      for (int i = 0; i < comps; i++) {
-        *dst++ = x < scaled_w ? src_y[offset_x + i] : 0;
-      }
-    }
-  }
-}
-
 template <typename Callback>
 void BayerInternal(const uint8_t* camera_raw, int width, int height,
                    CameraFilterMethod filter, Callback callback) {
@@ -313,145 +292,747 @@ void BayerInternal(const uint8_t* camera_raw, int width, int height,
   }
 }
 
-void RotateXY(CameraRotation rotation, int in_x, int in_y, int* out_x,
-              int* out_y) {
-  CHECK(out_x);
-  CHECK(out_y);
+// Demosaics the single pixel at (x, y), producing exactly the value that
+// `BayerInternal()` passes to its callback for that position. Returns false
+// for the border pixels that `BayerInternal()` never visits.
+template <CameraFilterMethod kFilter>
+inline bool DemosaicPixel(const uint8_t* camera_raw, int width, int height,
+                          int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+  if (y < 2 || y > height - 3) {
+    return false;
+  }
+  if (kFilter == CameraFilterMethod::kBilinear) {
+    if (x < 1 || x > width - 2) {
+      return false;
+    }
+    // The bilinear filter is centered one row above the output row.
+    const uint8_t* c = camera_raw + (y - 1) * width + x;
+    bool odd_row = y & 1;
+    if ((x + y) & 1) {
+      // Red or blue sample.
+      uint8_t diag = (static_cast<uint32_t>(c[-width - 1]) +
+                      static_cast<uint32_t>(c[-width + 1]) +
+                      static_cast<uint32_t>(c[width - 1]) +
+                      static_cast<uint32_t>(c[width + 1]) + 2) >>
+                     2;
+      *g = (static_cast<uint32_t>(c[-width]) + static_cast<uint32_t>(c[-1]) +
+            static_cast<uint32_t>(c[1]) + static_cast<uint32_t>(c[width]) +
+            2) >>
+           2;
+      *r = odd_row ? diag : *c;
+      *b = odd_row ? *c : diag;
+    } else {
+      // Green sample.
+      uint8_t vert = (static_cast<uint32_t>(c[-width]) +
+                      static_cast<uint32_t>(c[width]) + 1) >>
+                     1;
+      uint8_t horiz =
+          (static_cast<uint32_t>(c[-1]) + static_cast<uint32_t>(c[1]) + 1) >>
+          1;
+      *g = *c;
+      *r = odd_row ? vert : horiz;
+      *b = odd_row ? horiz : vert;
+    }
+    return true;
+  }
 
-  // Short-circuit for no rotation
-  if (rotation == CameraRotation::k0) {
-    *out_x = in_x;
-    *out_y = in_y;
-    return;
+  const uint8_t* row = camera_raw + y * width;
+  const uint8_t* next_row = row + width;
+  if (!(y & 1)) {
+    if (x < 2 || x > width - 3) {
+      return false;
+    }
+    if (!(x & 1)) {
+      *r = next_row[x + 1];
+      *g = row[x + 1];
+      *b = row[x];
+    } else {
+      *r = next_row[x];
+      *g = next_row[x + 1];
+      *b = row[x + 1];
+    }
+  } else {
+    if (x < 3 || x > width - 2) {
+      return false;
+    }
+    if (x & 1) {
+      *r = row[x];
+      *g = row[x + 1];
+      *b = next_row[x + 1];
+    } else {
+      *r = row[x + 1];
+      *g = next_row[x + 1];
+      *b = next_row[x];
+    }
   }
+  return true;
+}
+
+// Squared-luminance lookup tables in 8.8 fixed point, one per channel:
+// `coefficient * (v / 255)^2 * 255 * 256`. The three entries for a pixel sum
+// to at most 255 << 8, so two pixels fit side by side in a 32-bit word.
+struct GrayscaleLut {
+  uint16_t r[256];
+  uint16_t g[256];
+  uint16_t b[256];
+};
+
+constexpr GrayscaleLut MakeGrayscaleLut() {
+  GrayscaleLut lut{};
+  for (int v = 0; v < 256; ++v) {
+    float v_f = static_cast<float>(v) / kUint8Max;
+    float scale = v_f * v_f * kUint8Max * (1 << 8);
+    lut.r[v] = static_cast<uint16_t>(kRedCoefficient * scale + 0.5f);
+    lut.g[v] = static_cast<uint16_t>(kGreenCoefficient * scale + 0.5f);
+    lut.b[v] = static_cast<uint16_t>(kBlueCoefficient * scale + 0.5f);
+  }
+  return lut;
+}
+
+constexpr GrayscaleLut kGrayscaleLut = MakeGrayscaleLut();
+
+inline uint32_t GrayscaleFixed(const uint8_t* rgb) {
+  return kGrayscaleLut.r[rgb[0]] + kGrayscaleLut.g[rgb[1]] +
+         kGrayscaleLut.b[rgb[2]];
+}
+
+// Converts `count` packed RGB pixels to grayscale, four pixels per iteration.
+// Matches the float formula `0.2126 r^2 + 0.7152 g^2 + 0.0722 b^2` (on
+// normalized channels) to within one LSB.
+void RgbToGrayscale(const uint8_t* rgb, uint8_t* grayscale, int count) {
+  int i = 0;
+  for (; i + 4 <= count; i += 4, rgb += 12) {
+#if defined(__ARM_FEATURE_DSP)
+    // Two pixels per halfword-SIMD add.
+    auto pair = [](const uint8_t* p, const uint8_t* q) {
+      uint32_t r = kGrayscaleLut.r[p[0]] | (kGrayscaleLut.r[q[0]] << 16);
+      uint32_t g = kGrayscaleLut.g[p[1]] | (kGrayscaleLut.g[q[1]] << 16);
+      uint32_t b = kGrayscaleLut.b[p[2]] | (kGrayscaleLut.b[q[2]] << 16);
+      return __UADD16(__UADD16(r, g), b);
+    };
+    uint32_t p01 = pair(rgb, rgb + 3);
+    uint32_t p23 = pair(rgb + 6, rgb + 9);
+    // Keep the high byte of each halfword.
+    uint32_t out = ((p01 >> 8) & 0x000000FF) | ((p01 >> 16) & 0x0000FF00) |
+                   ((p23 << 8) & 0x00FF0000) | (p23 & 0xFF000000);
+    std::memcpy(grayscale + i, &out, sizeof(out));
+#else
+    grayscale[i + 0] = GrayscaleFixed(rgb + 0) >> 8;
+    grayscale[i + 1] = GrayscaleFixed(rgb + 3) >> 8;
+    grayscale[i + 2] = GrayscaleFixed(rgb + 6) >> 8;
+    grayscale[i + 3] = GrayscaleFixed(rgb + 9) >> 8;
+#endif
+  }
+  for (; i < count; ++i, rgb += 3) {
+    grayscale[i] = GrayscaleFixed(rgb) >> 8;
+  }
+}
+
+// Accumulates the channel sums used for auto white balance. Pixels with a
+// saturated color are left out of the sums.
+class WhiteBalanceAccumulator {
+ public:
+  inline void Add(uint8_t r, uint8_t g, uint8_t b) {
+    uint16_t min_rgb = static_cast<uint16_t>(std::min(r, std::min(g, b)));
+    uint16_t max_rgb = static_cast<uint16_t>(std::max(r, std::max(g, b)));
+    // Branchless: saturated pixels are weighted by zero.
+    unsigned int keep =
+        ((max_rgb - min_rgb) * 255) <= (kThreshold16 * max_rgb);
+    r_sum_ += r * keep;
+    g_sum_ += g * keep;
+    b_sum_ += b * keep;
+  }
+
+  CameraWhiteBalanceGains Gains() const {
+    float r_sum_f = static_cast<float>(r_sum_);
+    float g_sum_f = static_cast<float>(g_sum_);
+    float b_sum_f = static_cast<float>(b_sum_);
+    float max_channel = std::max(r_sum_f, std::max(g_sum_f, b_sum_f));
+    float epsilon = 0.1;
+    float r_gain_f = r_sum_f < epsilon ? 0.0f : max_channel / r_sum_f;
+    float g_gain_f = g_sum_f < epsilon ? 0.0f : max_channel / g_sum_f;
+    float b_gain_f = b_sum_f < epsilon ? 0.0f : max_channel / b_sum_f;
+    CameraWhiteBalanceGains gains;
+    gains.r = static_cast<uint16_t>(r_gain_f * (1 << 8));
+    gains.g = static_cast<uint16_t>(g_gain_f * (1 << 8));
+    gains.b = static_cast<uint16_t>(b_gain_f * (1 << 8));
+    return gains;
+  }
+
+ private:
+  static constexpr uint16_t kThreshold16 = static_cast<uint16_t>(0.9f * 255);
+  unsigned int r_sum_ = 0;
+  unsigned int g_sum_ = 0;
+  unsigned int b_sum_ = 0;
+};
+
+CameraWhiteBalanceGains ComputeWhiteBalanceGains(const uint8_t* camera_raw,
+                                                 int width, int height,
+                                                 CameraFilterMethod filter) {
+  WhiteBalanceAccumulator stats;
+  BayerInternal(camera_raw, width, height, filter,
+                [&stats](int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+                  stats.Add(r, g, b);
+                });
+  return stats.Gains();
+}
+
+// Estimates white balance gains from a sparse grid of raw Bayer quads,
+// without demosaicing. Each quad contributes its red, blue and averaged green
+// samples. `grid_step` is the spacing of the quads in pixels.
+CameraWhiteBalanceGains EstimateWhiteBalanceGains(const uint8_t* camera_raw,
+                                                  int width, int height,
+                                                  int grid_step) {
+  // Raw rows alternate B G B G ... and G R G R ..., starting at (0, 0).
+  grid_step = std::max(2, grid_step & ~1);
+  WhiteBalanceAccumulator stats;
+  for (int y = 0; y + 1 < height; y += grid_step) {
+    const uint8_t* row = camera_raw + y * width;
+    const uint8_t* next_row = row + width;
+    for (int x = 0; x + 1 < width; x += grid_step) {
+      uint8_t g = (static_cast<uint32_t>(row[x + 1]) +
+                   static_cast<uint32_t>(next_row[x]) + 1) >>
+                  1;
+      stats.Add(next_row[x + 1], g, row[x]);
+    }
+  }
+  return stats.Gains();
+}
+
+// Moves `gains` toward `estimate` by `smoothing` (0 keeps `gains`, 1 replaces
+// them).
+CameraWhiteBalanceGains SmoothWhiteBalanceGains(
+    const CameraWhiteBalanceGains& gains,
+    const CameraWhiteBalanceGains& estimate, float smoothing) {
+  smoothing = std::min(1.0f, std::max(0.0f, smoothing));
+  auto blend = [smoothing](uint16_t from, uint16_t to) {
+    return static_cast<uint16_t>(from + (to - from) * smoothing + 0.5f);
+  };
+  CameraWhiteBalanceGains smoothed;
+  smoothed.r = blend(gains.r, estimate.r);
+  smoothed.g = blend(gains.g, estimate.g);
+  smoothed.b = blend(gains.b, estimate.b);
+  return smoothed;
+}
+
+inline uint8_t ApplyGain(uint8_t value, uint16_t gain) {
+  return static_cast<uint8_t>(
+      std::min<uint32_t>(255, (static_cast<uint32_t>(value) * gain) >> 8));
+}
+
+bool HasRegion(const CameraFrameFormat& fmt) {
+  return fmt.roi.width != 0 || fmt.roi.height != 0;
+}
+
+bool IsValidRegion(const CameraFrameFormat& fmt) {
+  if (!HasRegion(fmt)) return true;
+  const CameraRegion& roi = fmt.roi;
+  return roi.x >= 0 && roi.y >= 0 && roi.width > 0 && roi.height > 0 &&
+         roi.x + roi.width <= static_cast<int>(CameraTask::kWidth) &&
+         roi.y + roi.height <= static_cast<int>(CameraTask::kHeight);
+}
 
-  // Shift our coordinates so that the center of the image is 0,0
-  in_x = in_x - (CameraTask::kWidth / 2);
-  in_y = in_y - (CameraTask::kHeight / 2);
+// How one destination axis of a `CameraFrameFormat` maps onto the sensor.
+// Destination pixel `i` (for `i < scaled`) covers the rotated frame
+// coordinates `[start + i * ratio, start + (i + 1) * ratio)`, and rotated frame
+// coordinate `r` is sensor coordinate `r * scale + offset`, valid if within
+// `[0, limit)`.
+struct FrameAxis {
+  int size;
+  int scaled;
+  int start;
+  float ratio;
+  int scale;
+  int offset;
+  int limit;
+};
 
-  // Simple rotation around origin
-  switch (rotation) {
+// Computes the destination axes of `fmt`, with region of interest, scaling
+// and rotation folded in. Returns true for 90 and 270 degree rotations, where
+// destination rows walk the sensor's x axis and destination columns walk its y
+// axis.
+bool GetFrameAxes(const CameraFrameFormat& fmt, FrameAxis* rows,
+                  FrameAxis* cols) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  constexpr int kSrcH = CameraTask::kHeight;
+  constexpr int kCenterX = kSrcW / 2;
+  constexpr int kCenterY = kSrcH / 2;
+
+  // The region of the rotated frame that is resized.
+  CameraRegion roi = {0, 0, kSrcW, kSrcH};
+  if (HasRegion(fmt)) roi = fmt.roi;
+
+  // Same scaling math as the nearest-neighbor resize of the full frame.
+  float ratio_src = (float)roi.width / roi.height;
+  float ratio_dst = (float)fmt.width / fmt.height;
+  int scaled_w =
+      fmt.preserve_ratio
+          ? (ratio_dst > ratio_src ? roi.width * (float)fmt.height / roi.height
+                                   : fmt.width)
+          : fmt.width;
+  int scaled_h =
+      fmt.preserve_ratio
+          ? (ratio_dst > ratio_src ? fmt.height
+                                   : roi.height * (float)fmt.width / roi.width)
+          : fmt.height;
+  // A thin region can round down to nothing when the ratio is preserved.
+  scaled_w = std::max(1, scaled_w);
+  scaled_h = std::max(1, scaled_h);
+  rows->size = fmt.height;
+  rows->scaled = scaled_h;
+  rows->start = roi.y;
+  rows->ratio = (float)roi.height / scaled_h;
+  cols->size = fmt.width;
+  cols->scaled = scaled_w;
+  cols->start = roi.x;
+  cols->ratio = (float)roi.width / scaled_w;
+
+  // Inverse of the rotation about the frame center: maps a rotated frame
+  // coordinate back to the sensor coordinate it came from.
+  switch (fmt.rotation) {
     case CameraRotation::k90:
-      *out_x = -in_y;
-      *out_y = in_x;
-      break;
+      rows->scale = 1, rows->offset = kCenterX - kCenterY, rows->limit = kSrcW;
+      cols->scale = -1, cols->offset = kCenterX + kCenterY, cols->limit = kSrcH;
+      return true;
     case CameraRotation::k180:
-      *out_x = -in_x;
-      *out_y = -in_y;
-      break;
+      rows->scale = -1, rows->offset = 2 * kCenterY, rows->limit = kSrcH;
+      cols->scale = -1, cols->offset = 2 * kCenterX, cols->limit = kSrcW;
+      return false;
     case CameraRotation::k270:
-      *out_x = in_y;
-      *out_y = -in_x;
-      break;
+      rows->scale = -1, rows->offset = kCenterX + kCenterY, rows->limit = kSrcW;
+      cols->scale = 1, cols->offset = kCenterY - kCenterX, cols->limit = kSrcH;
+      return true;
     case CameraRotation::k0:
     default:
-      CHECK(false);
+      rows->scale = 1, rows->offset = 0, rows->limit = kSrcH;
+      cols->scale = 1, cols->offset = 0, cols->limit = kSrcW;
+      return false;
   }
+}
 
-  // Undo coordinate space shift
-  *out_x = *out_x + (CameraTask::kWidth / 2);
-  *out_y = *out_y + (CameraTask::kHeight / 2);
-  CHECK(*out_x >= 0);
-  CHECK(*out_x < static_cast<int>(CameraTask::kWidth));
-  CHECK(*out_y >= 0);
-  CHECK(*out_y < static_cast<int>(CameraTask::kHeight));
+// Sensor coordinates for every destination row and column of a
+// `CameraFrameFormat`, used for nearest-neighbor resizing. Entries of -1 fall
+// outside of the scaled image (or the sensor) and are filled with zeros.
+struct FrameSampleMap {
+  // True for 90 and 270 degree rotations (see `GetFrameAxes()`).
+  bool transpose;
+  std::vector<int16_t> rows;
+  std::vector<int16_t> cols;
+};
+
+void BuildFrameSampleMap(const CameraFrameFormat& fmt, FrameSampleMap* map) {
+  FrameAxis rows, cols;
+  map->transpose = GetFrameAxes(fmt, &rows, &cols);
+
+  auto build = [](std::vector<int16_t>* table, const FrameAxis& axis) {
+    table->resize(axis.size);
+    for (int i = 0; i < axis.size; ++i) {
+      int src = -1;
+      if (i < axis.scaled) {
+        src = (axis.start + static_cast<int>(i * axis.ratio)) * axis.scale +
+              axis.offset;
+        if (src < 0 || src >= axis.limit) src = -1;
+      }
+      (*table)[i] = static_cast<int16_t>(src);
+    }
+  };
+  build(&map->rows, rows);
+  build(&map->cols, cols);
 }
 
-void BayerToRgb(const uint8_t* camera_raw, uint8_t* camera_rgb, int width,
-                int height, CameraFilterMethod filter,
-                CameraRotation rotation) {
-  std::memset(camera_rgb, 0, width * height * 3);
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_rgb, width, height, rotation](int x, int y, uint8_t r,
-                                                      uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 0] = r;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 1] = g;
-                  camera_rgb[(rot_x * 3) + (rot_y * width * 3) + 2] = b;
+// Separable resampling filter for one destination axis. Destination pixel `i`
+// blends the sensor lines `index[i * taps + k]` with the 8.8 fixed-point
+// weights `weight[i * taps + k]`, which sum to 256. Destination pixels outside
+// of the scaled image have an index of -1 in their first tap.
+struct AxisFilter {
+  int taps;
+  // Smallest and largest sensor line referenced by any tap.
+  int min_index;
+  int max_index;
+  std::vector<int16_t> index;
+  std::vector<uint16_t> weight;
+};
+
+// Bilinear or area-averaging resize tables for a `CameraFrameFormat`.
+struct FrameFilterMap {
+  // True for 90 and 270 degree rotations (see `GetFrameAxes()`).
+  bool transpose;
+  AxisFilter rows;
+  AxisFilter cols;
+  // Geometry the tables were built for.
+  int width = 0;
+  int height = 0;
+  CameraRotation rotation;
+  bool preserve_ratio;
+  CameraResizeFilter resize_filter;
+  CameraRegion roi;
+};
+
+void BuildAxisFilter(const FrameAxis& axis, CameraResizeFilter filter,
+                     AxisFilter* out) {
+  constexpr int kMaxTaps = 8;
+  // Rotated frame coordinates that land on the sensor. Taps beyond them are
+  // clamped, which replicates the edge pixels.
+  int first = axis.scale > 0 ? -axis.offset : axis.offset - (axis.limit - 1);
+  int last = axis.scale > 0 ? axis.limit - 1 - axis.offset : axis.offset;
+
+  int taps = 2;
+  if (filter == CameraResizeFilter::kArea) {
+    taps = static_cast<int>(std::ceil(axis.ratio)) + 1;
+  }
+  taps = std::min(taps, kMaxTaps);
+  out->taps = taps;
+  out->min_index = axis.limit - 1;
+  out->max_index = 0;
+  out->index.assign(axis.size * taps, 0);
+  out->weight.assign(axis.size * taps, 0);
+  for (int i = 0; i < axis.size; ++i) {
+    int16_t* index = &out->index[i * taps];
+    uint16_t* weight = &out->weight[i * taps];
+    if (i >= axis.scaled || first > last) {
+      index[0] = -1;
+      continue;
+    }
+
+    float w[kMaxTaps] = {};
+    int tap0;
+    if (filter == CameraResizeFilter::kArea) {
+      // Fraction of the destination pixel covered by each source pixel.
+      float begin = axis.start + i * axis.ratio;
+      float end = begin + axis.ratio;
+      tap0 = static_cast<int>(begin);
+      for (int k = 0; k < taps; ++k) {
+        float overlap = std::min<float>(end, tap0 + k + 1) -
+                        std::max<float>(begin, tap0 + k);
+        w[k] = std::max(0.0f, overlap) / axis.ratio;
+      }
+    } else {
+      float center = axis.start + (i + 0.5f) * axis.ratio - 0.5f;
+      tap0 = static_cast<int>(std::floor(center));
+      w[1] = center - tap0;
+      w[0] = 1.0f - w[1];
+    }
+
+    // Quantize, giving the rounding error to the heaviest tap so the weights
+    // sum to exactly 1.0. (For extreme downscaling the area filter is capped
+    // at `kMaxTaps` and only covers part of each destination pixel.)
+    float total = 0.0f;
+    for (int k = 0; k < taps; ++k) total += w[k];
+    int sum = 0, heaviest = 0;
+    for (int k = 0; k < taps; ++k) {
+      weight[k] = static_cast<uint16_t>(w[k] / total * 256 + 0.5f);
+      sum += weight[k];
+      if (weight[k] > weight[heaviest]) heaviest = k;
+    }
+    weight[heaviest] += 256 - sum;
+
+    for (int k = 0; k < taps; ++k) {
+      int src = std::min(last, std::max(first, tap0 + k));
+      index[k] = static_cast<int16_t>(src * axis.scale + axis.offset);
+      out->min_index = std::min<int>(out->min_index, index[k]);
+      out->max_index = std::max<int>(out->max_index, index[k]);
+    }
+  }
+}
+
+// Builds the resize tables for `fmt`, unless `map` already holds them.
+void BuildFrameFilterMap(const CameraFrameFormat& fmt, FrameFilterMap* map) {
+  if (map->width == fmt.width && map->height == fmt.height &&
+      map->rotation == fmt.rotation &&
+      map->preserve_ratio == fmt.preserve_ratio &&
+      map->resize_filter == fmt.resize_filter && map->roi.x == fmt.roi.x &&
+      map->roi.y == fmt.roi.y && map->roi.width == fmt.roi.width &&
+      map->roi.height == fmt.roi.height) {
+    return;
+  }
+  map->width = fmt.width;
+  map->height = fmt.height;
+  map->rotation = fmt.rotation;
+  map->preserve_ratio = fmt.preserve_ratio;
+  map->resize_filter = fmt.resize_filter;
+  map->roi = fmt.roi;
+
+  FrameAxis rows, cols;
+  map->transpose = GetFrameAxes(fmt, &rows, &cols);
+  BuildAxisFilter(rows, fmt.resize_filter, &map->rows);
+  BuildAxisFilter(cols, fmt.resize_filter, &map->cols);
+}
+
+// Writes destination pixels in order, applying white balance `gains` and the
+// output table `lut` if non-null. Grayscale pixels are staged as RGB and
+// converted in batches.
+template <CameraFormat kFormat>
+class FrameWriter {
+ public:
+  FrameWriter(uint8_t* dst, const CameraWhiteBalanceGains* gains,
+              const uint8_t* lut)
+      : dst_(dst),
+        gains_(gains),
+        lut_(lut),
+        rgb_(kFormat == CameraFormat::kRgb ? dst : line_) {}
+
+  inline void Put(uint8_t r, uint8_t g, uint8_t b) {
+    if (gains_) {
+      r = ApplyGain(r, gains_->r);
+      g = ApplyGain(g, gains_->g);
+      b = ApplyGain(b, gains_->b);
+    }
+    if (kFormat == CameraFormat::kRgb && lut_) {
+      r = lut_[r];
+      g = lut_[g];
+      b = lut_[b];
+    }
+    *rgb_++ = r;
+    *rgb_++ = g;
+    *rgb_++ = b;
+    if (kFormat == CameraFormat::kY8 && ++pending_ == kLinePixels) Flush();
+  }
+
+  // Converts the staged grayscale pixels. Must be called once all pixels are
+  // written.
+  void Flush() {
+    if (kFormat == CameraFormat::kY8) {
+      RgbToGrayscale(line_, dst_, pending_);
+      if (lut_) {
+        for (int i = 0; i < pending_; ++i) dst_[i] = lut_[dst_[i]];
+      }
+      dst_ += pending_;
+      rgb_ = line_;
+      pending_ = 0;
+    }
+  }
+
+ private:
+  static constexpr int kLinePixels = 64;
+  uint8_t* dst_;
+  const CameraWhiteBalanceGains* gains_;
+  const uint8_t* lut_;
+  uint8_t line_[kLinePixels * 3];
+  uint8_t* rgb_;
+  int pending_ = 0;
+};
+
+// Writes every destination pixel of `fmt`, fetching sensor pixels through
+// `sampler(x, y, &r, &g, &b)` and applying white balance `gains` if non-null.
+// Pixels that the sampler rejects, or that fall outside of the scaled image,
+// are written as zero.
+template <bool kTranspose, CameraFormat kFormat, typename Sampler>
+void SampleFrame(const CameraFrameFormat& fmt, const FrameSampleMap& map,
+                 const CameraWhiteBalanceGains* gains, Sampler sampler) {
+  FrameWriter<kFormat> writer(fmt.buffer, gains, fmt.lut);
+  for (int y = 0; y < fmt.height; ++y) {
+    int row = map.rows[y];
+    for (int x = 0; x < fmt.width; ++x) {
+      int col = map.cols[x];
+      uint8_t r = 0, g = 0, b = 0;
+      if (row >= 0 && col >= 0) {
+        sampler(kTranspose ? row : col, kTranspose ? col : row, &r, &g, &b);
+      }
+      writer.Put(r, g, b);
+    }
+  }
+  writer.Flush();
+}
+
+template <typename Sampler>
+void SampleFrame(const CameraFrameFormat& fmt, const FrameSampleMap& map,
+                 const CameraWhiteBalanceGains* gains, Sampler sampler) {
+  if (fmt.fmt == CameraFormat::kRgb) {
+    if (map.transpose) {
+      SampleFrame<true, CameraFormat::kRgb>(fmt, map, gains, sampler);
+    } else {
+      SampleFrame<false, CameraFormat::kRgb>(fmt, map, gains, sampler);
+    }
+  } else {
+    if (map.transpose) {
+      SampleFrame<true, CameraFormat::kY8>(fmt, map, gains, sampler);
+    } else {
+      SampleFrame<false, CameraFormat::kY8>(fmt, map, gains, sampler);
+    }
+  }
+}
+
+// Fused demosaic, rotate, resize and white balance. Only the pixels that land
+// in `fmt.buffer` are demosaiced, straight from the raw frame, so there is no
+// full-resolution intermediate. The output is bit-exact with demosaicing the
+// whole frame, rotating it and resizing it with nearest-neighbor sampling.
+void ProcessFrame(const uint8_t* camera_raw, const CameraFrameFormat& fmt,
+                  const FrameSampleMap& map,
+                  const CameraWhiteBalanceGains* gains) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  constexpr int kSrcH = CameraTask::kHeight;
+  if (fmt.filter == CameraFilterMethod::kBilinear) {
+    SampleFrame(fmt, map, gains,
+                [camera_raw](int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+                  return DemosaicPixel<CameraFilterMethod::kBilinear>(
+                      camera_raw, kSrcW, kSrcH, x, y, r, g, b);
+                });
+  } else {
+    SampleFrame(fmt, map, gains,
+                [camera_raw](int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+                  return DemosaicPixel<CameraFilterMethod::kNearestNeighbor>(
+                      camera_raw, kSrcW, kSrcH, x, y, r, g, b);
                 });
+  }
 }
 
-void BayerToGrayscale(const uint8_t* camera_raw, uint8_t* camera_grayscale,
-                      int width, int height, CameraFilterMethod filter,
-                      CameraRotation rotation) {
-  BayerInternal(camera_raw, width, height, filter,
-                [camera_grayscale, width, height, rotation](
-                    int x, int y, uint8_t r, uint8_t g, uint8_t b) {
-                  int rot_x, rot_y;
-                  RotateXY(rotation, x, y, &rot_x, &rot_y);
-                  float r_f = static_cast<float>(r) / kUint8Max;
-                  float g_f = static_cast<float>(g) / kUint8Max;
-                  float b_f = static_cast<float>(b) / kUint8Max;
-                  camera_grayscale[rot_x + (rot_y * width)] =
-                      static_cast<uint8_t>(((kRedCoefficient * r_f * r_f) +
-                                            (kGreenCoefficient * g_f * g_f) +
-                                            (kBlueCoefficient * b_f * b_f)) *
-                                           kUint8Max);
+// Demosaics the whole frame, unrotated, into `camera_rgb`. Pixels the demosaic
+// does not cover are zeroed. If `gains` is non-null, the white balance gains
+// are accumulated in the same pass.
+void DemosaicFrame(const uint8_t* camera_raw, uint8_t* camera_rgb,
+                   CameraFilterMethod filter, CameraWhiteBalanceGains* gains) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  constexpr int kSrcH = CameraTask::kHeight;
+  constexpr int kStride = kSrcW * 3;
+  constexpr int kBorder = 3;
+  std::memset(camera_rgb, 0, 2 * kStride);
+  std::memset(camera_rgb + (kSrcH - 2) * kStride, 0, 2 * kStride);
+  for (int y = 2; y < kSrcH - 2; ++y) {
+    std::memset(camera_rgb + y * kStride, 0, kBorder * 3);
+    std::memset(camera_rgb + y * kStride + (kSrcW - kBorder) * 3, 0,
+                kBorder * 3);
+  }
+
+  WhiteBalanceAccumulator stats;
+  BayerInternal(camera_raw, kSrcW, kSrcH, filter,
+                [camera_rgb, gains, &stats](int x, int y, uint8_t r, uint8_t g,
+                                            uint8_t b) {
+                  uint8_t* dst = camera_rgb + y * kStride + x * 3;
+                  dst[0] = r;
+                  dst[1] = g;
+                  dst[2] = b;
+                  if (gains) stats.Add(r, g, b);
                 });
+  if (gains) *gains = stats.Gains();
+}
+
+// Demosaics only the sensor pixels that the resize tables of `map` read, into
+// the same positions of `camera_rgb` that `DemosaicFrame()` would write. The
+// rest of `camera_rgb` is left untouched.
+template <CameraFilterMethod kFilter>
+void DemosaicRegion(const uint8_t* camera_raw, uint8_t* camera_rgb,
+                    const FrameFilterMap& map) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  constexpr int kSrcH = CameraTask::kHeight;
+  const AxisFilter& x_axis = map.transpose ? map.rows : map.cols;
+  const AxisFilter& y_axis = map.transpose ? map.cols : map.rows;
+  for (int y = y_axis.min_index; y <= y_axis.max_index; ++y) {
+    uint8_t* dst = camera_rgb + (y * kSrcW + x_axis.min_index) * 3;
+    for (int x = x_axis.min_index; x <= x_axis.max_index; ++x, dst += 3) {
+      uint8_t r = 0, g = 0, b = 0;
+      DemosaicPixel<kFilter>(camera_raw, kSrcW, kSrcH, x, y, &r, &g, &b);
+      dst[0] = r;
+      dst[1] = g;
+      dst[2] = b;
+    }
+  }
 }
 
-void RgbToGrayscale(const uint8_t* camera_rgb, uint8_t* camera_grayscale,
-                    int width, int height) {
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      float r_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 0]) /
-          kUint8Max;
-      float g_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 1]) /
-          kUint8Max;
-      float b_f =
-          static_cast<float>(camera_rgb[(x * 3) + (y * width * 3) + 2]) /
-          kUint8Max;
-      camera_grayscale[x + (y * width)] = static_cast<uint8_t>(
-          ((kRedCoefficient * r_f * r_f) + (kGreenCoefficient * g_f * g_f) +
-           (kBlueCoefficient * b_f * b_f)) *
-          kUint8Max);
-    }
-  }
-}
-
-void AutoWhiteBalance(uint8_t* camera_rgb, int width, int height) {
-  unsigned int r_sum = 0, g_sum = 0, b_sum = 0;
-  float r_sum_f = 0.0, g_sum_f = 0.0, b_sum_f = 0.0;
-  float threshold = 0.9f;
-  uint16_t threshold16 = static_cast<uint16_t>(threshold * 255);
-  uint16_t min_rgb, max_rgb;
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    min_rgb = static_cast<uint16_t>(std::min(r, std::min(g, b)));
-    max_rgb = static_cast<uint16_t>(std::max(r, std::max(g, b)));
-    if (((max_rgb - min_rgb) * 255) > (threshold16 * max_rgb)) {
+void DemosaicRegion(const uint8_t* camera_raw, uint8_t* camera_rgb,
+                    CameraFilterMethod filter, const FrameFilterMap& map) {
+  if (filter == CameraFilterMethod::kBilinear) {
+    DemosaicRegion<CameraFilterMethod::kBilinear>(camera_raw, camera_rgb, map);
+  } else {
+    DemosaicRegion<CameraFilterMethod::kNearestNeighbor>(camera_raw,
+                                                         camera_rgb, map);
+  }
+}
+
+// Samples a frame previously produced by `DemosaicFrame()`.
+void ResampleFrame(const uint8_t* camera_rgb, const CameraFrameFormat& fmt,
+                   const FrameSampleMap& map,
+                   const CameraWhiteBalanceGains* gains) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  SampleFrame(fmt, map, gains,
+              [camera_rgb](int x, int y, uint8_t* r, uint8_t* g, uint8_t* b) {
+                const uint8_t* src = camera_rgb + (y * kSrcW + x) * 3;
+                *r = src[0];
+                *g = src[1];
+                *b = src[2];
+                return true;
+              });
+}
+
+// Resizes a frame previously produced by `DemosaicFrame()` with the separable
+// filters of `map`: each destination row first blends its sensor lines into
+// `filter_line`, which is then filtered along the row.
+template <bool kTranspose, CameraFormat kFormat>
+void FilterFrame(const uint8_t* camera_rgb, const CameraFrameFormat& fmt,
+                 const FrameFilterMap& map,
+                 const CameraWhiteBalanceGains* gains) {
+  constexpr int kSrcW = CameraTask::kWidth;
+  // Strides, in bytes of `camera_rgb`, between consecutive sensor lines and
+  // between consecutive pixels along one line.
+  constexpr int kLineStride = kTranspose ? 3 : kSrcW * 3;
+  constexpr int kPixelStride = kTranspose ? kSrcW * 3 : 3;
+
+  const AxisFilter& rows = map.rows;
+  const AxisFilter& cols = map.cols;
+  FrameWriter<kFormat> writer(fmt.buffer, gains, fmt.lut);
+  for (int y = 0; y < fmt.height; ++y) {
+    const int16_t* row_index = &rows.index[y * rows.taps];
+    const uint16_t* row_weight = &rows.weight[y * rows.taps];
+    if (row_index[0] < 0) {
+      for (int x = 0; x < fmt.width; ++x) writer.Put(0, 0, 0);
       continue;
     }
-    r_sum += r;
-    g_sum += g;
-    b_sum += b;
-  }
-  r_sum_f = static_cast<float>(r_sum);
-  g_sum_f = static_cast<float>(g_sum);
-  b_sum_f = static_cast<float>(b_sum);
-  float max_channel = std::max(r_sum_f, std::max(g_sum_f, b_sum_f));
-  float epsilon = 0.1;
-  float r_gain_f = r_sum_f < epsilon ? 0.0f : max_channel / r_sum_f;
-  float g_gain_f = g_sum_f < epsilon ? 0.0f : max_channel / g_sum_f;
-  float b_gain_f = b_sum_f < epsilon ? 0.0f : max_channel / b_sum_f;
-  uint16_t r_gain_i = static_cast<uint16_t>(r_gain_f * (1 << 8));
-  uint16_t g_gain_i = static_cast<uint16_t>(g_gain_f * (1 << 8));
-  uint16_t b_gain_i = static_cast<uint16_t>(b_gain_f * (1 << 8));
-  for (int i = 0; i < width * height; ++i) {
-    uint8_t r = camera_rgb[i * 3 + 0];
-    uint8_t g = camera_rgb[i * 3 + 1];
-    uint8_t b = camera_rgb[i * 3 + 2];
-    camera_rgb[i * 3 + 0] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(r) * r_gain_i) >> 8));
-    camera_rgb[i * 3 + 1] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(g) * g_gain_i) >> 8));
-    camera_rgb[i * 3 + 2] = static_cast<uint8_t>(
-        std::min(255UL, (static_cast<uint32_t>(b) * b_gain_i) >> 8));
+
+    int count = cols.max_index - cols.min_index + 1;
+    uint16_t* line = filter_line[cols.min_index];
+    for (int k = 0; k < rows.taps; ++k) {
+      const uint8_t* src = camera_rgb + row_index[k] * kLineStride +
+                           cols.min_index * kPixelStride;
+      uint16_t weight = row_weight[k];
+      if (!kTranspose) {
+        // Sensor rows are contiguous, so all channels form a single array.
+        for (int i = 0; i < count * 3; ++i) {
+          line[i] = (k ? line[i] : 0) + weight * src[i];
+        }
+      } else {
+        for (int i = 0; i < count; ++i, src += kPixelStride) {
+          line[i * 3 + 0] = (k ? line[i * 3 + 0] : 0) + weight * src[0];
+          line[i * 3 + 1] = (k ? line[i * 3 + 1] : 0) + weight * src[1];
+          line[i * 3 + 2] = (k ? line[i * 3 + 2] : 0) + weight * src[2];
+        }
+      }
+    }
+
+    for (int x = 0; x < fmt.width; ++x) {
+      const int16_t* col_index = &cols.index[x * cols.taps];
+      const uint16_t* col_weight = &cols.weight[x * cols.taps];
+      if (col_index[0] < 0) {
+        writer.Put(0, 0, 0);
+        continue;
+      }
+      // Both weights are 8.8, so the sums are 16.16.
+      uint32_t r = 1 << 15, g = 1 << 15, b = 1 << 15;
+      for (int k = 0; k < cols.taps; ++k) {
+        const uint16_t* p = filter_line[col_index[k]];
+        r += col_weight[k] * p[0];
+        g += col_weight[k] * p[1];
+        b += col_weight[k] * p[2];
+      }
+      writer.Put(r >> 16, g >> 16, b >> 16);
+    }
+  }
+  writer.Flush();
+}
+
+void FilterFrame(const uint8_t* camera_rgb, const CameraFrameFormat& fmt,
+                 const FrameFilterMap& map,
+                 const CameraWhiteBalanceGains* gains) {
+  if (fmt.fmt == CameraFormat::kRgb) {
+    if (map.transpose) {
+      FilterFrame<true, CameraFormat::kRgb>(camera_rgb, fmt, map, gains);
+    } else {
+      FilterFrame<false, CameraFormat::kRgb>(camera_rgb, fmt, map, gains);
+    }
+  } else {
+    if (map.transpose) {
+      FilterFrame<true, CameraFormat::kY8>(camera_rgb, fmt, map, gains);
+    } else {
+      FilterFrame<false, CameraFormat::kY8>(camera_rgb, fmt, map, gains);
+    }
   }
 }
 }  // namespace
@@ -473,6 +1054,10 @@ int CameraFormatBpp(CameraFormat fmt) {
   return 0;
 }
 
+void CameraRgbToGrayscale(const uint8_t* rgb, uint8_t* grayscale, int count) {
+  RgbToGrayscale(rgb, grayscale, count);
+}
+
 bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
   if (!enabled_) {
     printf("Camera is not enabled, cannot capture frame.\r\n");
@@ -483,8 +1068,8 @@ bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
     return false;
   }
 
-  bool ret = true;
   uint8_t* raw = nullptr;
+  uint64_t start = TimerMicros();
   int index = GetFrame(&raw, true);
   if (!raw) {
     return false;
@@ -493,69 +1078,185 @@ bool CameraTask::GetFrame(const std::vector<CameraFrameFormat>& fmts) {
     GpioSet(Gpio::kCameraTrigger, false);
   }
 
+  bool ret = ConvertFrameInternal(raw, fmts, start);
+  GetSingleton()->ReturnFrame(index);
+  return ret;
+}
+
+bool CameraTask::ConvertFrame(const uint8_t* raw,
+                              const std::vector<CameraFrameFormat>& fmts) {
+  return ConvertFrameInternal(raw, fmts, TimerMicros());
+}
+
+bool CameraTask::ConvertFrameInternal(
+    const uint8_t* raw, const std::vector<CameraFrameFormat>& fmts,
+    uint64_t start) {
+  bool ret = true;
+  MutexLock lock(frame_mutex_);
+  CameraFrameTiming timing{};
+  uint64_t stage_start = TimerMicros();
+  timing.capture_us = stage_start - start;
+
+  // Frame-processing plan: when several formats use the same demosaic filter,
+  // the frame is demosaiced and white balanced once into `frame_rgb` and each
+  // format is sampled from there. A lone format is sampled straight from the
+  // raw frame instead, unless it uses a bilinear or area resize filter, which
+  // reads neighboring pixels from `frame_rgb`. Formats with a region of
+  // interest only demosaic the pixels they need. White balance gains are
+  // computed at most once per filter either way.
+  constexpr int kFilterCount = 2;
+  int formats_per_filter[kFilterCount] = {};
+  bool white_balance_per_filter[kFilterCount] = {};
+  bool white_balance_enabled =
+      GetSingleton()->test_pattern_ == CameraTestPattern::kNone;
+  for (const CameraFrameFormat& fmt : fmts) {
+    if (fmt.fmt != CameraFormat::kRgb && fmt.fmt != CameraFormat::kY8) {
+      continue;
+    }
+    int filter = static_cast<int>(fmt.filter);
+    if (!HasRegion(fmt)) ++formats_per_filter[filter];
+    white_balance_per_filter[filter] |=
+        fmt.fmt == CameraFormat::kRgb && fmt.white_balance &&
+        fmt.white_balance_mode == CameraWhiteBalanceMode::kPerFrame &&
+        white_balance_enabled;
+  }
+  int shared_filter = formats_per_filter[0] >= formats_per_filter[1] ? 0 : 1;
+  if (formats_per_filter[shared_filter] < 2) {
+    shared_filter = -1;
+  }
+  int rgb_filter = -1;
+  std::optional<CameraWhiteBalanceGains> gains[kFilterCount];
+  bool wb_updated = false;
+
+  static FrameSampleMap map;
+  static FrameFilterMap filter_map;
   for (const CameraFrameFormat& fmt : fmts) {
     switch (fmt.fmt) {
-      case CameraFormat::kRgb: {
-        if (fmt.width == kWidth && fmt.height == kHeight) {
-          BayerToRgb(raw, fmt.buffer, fmt.width, fmt.height, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(fmt.buffer, fmt.width, fmt.height);
+      case CameraFormat::kRgb:
+      case CameraFormat::kY8: {
+        if (!IsValidRegion(fmt)) {
+          ret = false;
+          break;
+        }
+        int filter = static_cast<int>(fmt.filter);
+        bool nearest =
+            fmt.resize_filter == CameraResizeFilter::kNearestNeighbor;
+        bool full_frame =
+            filter == shared_filter || (!nearest && !HasRegion(fmt));
+        if (full_frame && rgb_filter != filter) {
+          bool frame_wb = white_balance_per_filter[filter] && !gains[filter];
+          CameraWhiteBalanceGains frame_gains;
+          DemosaicFrame(raw, &frame_rgb[0][0][0], fmt.filter,
+                        frame_wb ? &frame_gains : nullptr);
+          if (frame_wb) gains[filter] = frame_gains;
+          rgb_filter = filter;
+          uint64_t now = TimerMicros();
+          timing.demosaic_us += now - stage_start;
+          stage_start = now;
+        }
+        bool white_balance = fmt.fmt == CameraFormat::kRgb &&
+                             fmt.white_balance && white_balance_enabled;
+        bool cached =
+            fmt.white_balance_mode == CameraWhiteBalanceMode::kCached;
+        if (white_balance && cached && !wb_updated) {
+          UpdateWhiteBalanceGains(raw);
+          wb_updated = true;
+          uint64_t now = TimerMicros();
+          timing.white_balance_us += now - stage_start;
+          stage_start = now;
+        } else if (white_balance && !cached && !gains[filter]) {
+          gains[filter] =
+              ComputeWhiteBalanceGains(raw, kWidth, kHeight, fmt.filter);
+          uint64_t now = TimerMicros();
+          timing.white_balance_us += now - stage_start;
+          stage_start = now;
+        }
+        const CameraWhiteBalanceGains* fmt_gains = nullptr;
+        if (white_balance) {
+          fmt_gains = cached ? &wb_gains_ : &*gains[filter];
+        }
+        if (!nearest) {
+          BuildFrameFilterMap(fmt, &filter_map);
+          if (rgb_filter != filter) {
+            DemosaicRegion(raw, &frame_rgb[0][0][0], fmt.filter, filter_map);
+            // Any full frame of the other filter is now partly overwritten.
+            rgb_filter = -1;
           }
+          FilterFrame(&frame_rgb[0][0][0], fmt, filter_map, fmt_gains);
         } else {
-          auto buffer_rgb = std::make_unique<uint8_t[]>(
-              CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-          BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                     fmt.rotation);
-          if (fmt.white_balance &&
-              GetSingleton()->test_pattern_ == CameraTestPattern::kNone) {
-            AutoWhiteBalance(buffer_rgb.get(), kWidth, kHeight);
-          }
-          ResizeNearestNeighbor(buffer_rgb.get(), kWidth, kHeight, fmt.buffer,
-                                fmt.width, fmt.height,
-                                CameraFormatBpp(CameraFormat::kRgb),
-                                fmt.preserve_ratio);
-        }
-        break;
-        case CameraFormat::kY8: {
-          if (fmt.width == kWidth && fmt.height == kHeight) {
-            BayerToGrayscale(raw, fmt.buffer, kWidth, kHeight, fmt.filter,
-                             fmt.rotation);
+          BuildFrameSampleMap(fmt, &map);
+          if (rgb_filter == filter) {
+            ResampleFrame(&frame_rgb[0][0][0], fmt, map, fmt_gains);
           } else {
-            auto buffer_rgb = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * kWidth * kHeight);
-            auto buffer_rgb_scaled = std::make_unique<uint8_t[]>(
-                CameraFormatBpp(CameraFormat::kRgb) * fmt.width * fmt.height);
-            BayerToRgb(raw, buffer_rgb.get(), kWidth, kHeight, fmt.filter,
-                       fmt.rotation);
-            ResizeNearestNeighbor(
-                buffer_rgb.get(), kWidth, kHeight, buffer_rgb_scaled.get(),
-                fmt.width, fmt.height, CameraFormatBpp(CameraFormat::kRgb),
-                fmt.preserve_ratio);
-            RgbToGrayscale(buffer_rgb_scaled.get(), fmt.buffer, fmt.width,
-                           fmt.height);
+            ProcessFrame(raw, fmt, map, fmt_gains);
           }
-        } break;
-        case CameraFormat::kRaw:
-          if (fmt.width != kWidth || fmt.height != kHeight) {
-            ret = false;
-            break;
-          }
-          std::memcpy(fmt.buffer, raw,
-                      kWidth * kHeight * CameraFormatBpp(CameraFormat::kRaw));
-          ret = true;
-          break;
-        default:
+        }
+      } break;
+      case CameraFormat::kRaw:
+        if (fmt.width != kWidth || fmt.height != kHeight) {
           ret = false;
-      }
+          break;
+        }
+        std::memcpy(fmt.buffer, raw,
+                    kWidth * kHeight * CameraFormatBpp(CameraFormat::kRaw));
+        ret = true;
+        break;
+      default:
+        ret = false;
     }
+    uint64_t now = TimerMicros();
+    timing.convert_us += now - stage_start;
+    stage_start = now;
   }
 
-  GetSingleton()->ReturnFrame(index);
+  timing.total_us = TimerMicros() - start;
+  timing_ = timing;
   return ret;
 }
 
+CameraFrameTiming CameraTask::GetFrameTiming() {
+  MutexLock lock(frame_mutex_);
+  return timing_;
+}
+
+void CameraTask::UpdateWhiteBalanceGains(const uint8_t* raw) {
+  if (wb_config_.locked) return;
+  if (wb_gains_valid_ &&
+      ++wb_frames_since_update_ < wb_config_.update_interval) {
+    return;
+  }
+  CameraWhiteBalanceGains estimate =
+      EstimateWhiteBalanceGains(raw, kWidth, kHeight, wb_config_.grid_step);
+  wb_gains_ = wb_gains_valid_ ? SmoothWhiteBalanceGains(wb_gains_, estimate,
+                                                        wb_config_.smoothing)
+                              : estimate;
+  wb_gains_valid_ = true;
+  wb_frames_since_update_ = 0;
+}
+
+void CameraTask::SetWhiteBalanceConfig(
+    const CameraWhiteBalanceConfig& config) {
+  MutexLock lock(frame_mutex_);
+  wb_config_ = config;
+}
+
+CameraWhiteBalanceConfig CameraTask::GetWhiteBalanceConfig() {
+  MutexLock lock(frame_mutex_);
+  return wb_config_;
+}
+
+CameraWhiteBalanceGains CameraTask::GetWhiteBalanceGains() {
+  MutexLock lock(frame_mutex_);
+  return wb_gains_;
+}
+
+void CameraTask::SetWhiteBalanceGains(const CameraWhiteBalanceGains& gains) {
+  MutexLock lock(frame_mutex_);
+  wb_gains_ = gains;
+  wb_gains_valid_ = true;
+  wb_frames_since_update_ = 0;
+}
+
 bool CameraTask::Read(uint16_t reg, uint8_t* val) {
   lpi2c_master_transfer_t transfer;
   transfer.flags = kLPI2C_TransferDefaultFlag;
@@ -585,6 +1286,8 @@ bool CameraTask::Write(uint16_t reg, uint8_t val) {
 void CameraTask::Init(lpi2c_rtos_handle_t* i2c_handle) {
   QueueTask::Init();
   i2c_handle_ = i2c_handle;
+  frame_mutex_ = xSemaphoreCreateMutex();
+  CHECK(frame_mutex_);
   enabled_ = false;
   GetMotionDetectionConfigDefault(md_config_);
   md_config_.enable = false;
@@ -596,25 +1299,97 @@ void CameraTask::Init(lpi2c_rtos_handle_t* i2c_handle) {
       });
 }
 
-int CameraTask::GetFrame(uint8_t** buffer, bool block) {
+int CameraTask::GetFrame(uint8_t** buffer, bool block, bool lease,
+                         camera::FrameResponse* info) {
   camera::Request req;
   req.type = camera::RequestType::kFrame;
   req.request.frame.index = -1;
+  req.request.frame.lease = lease;
   camera::Response resp;
   do {
     resp = SendRequest(req);
-  } while (block && resp.response.frame.index == -1);
+  } while (block && resp.response.frame.index == -1 &&
+           !(lease && leases_ >= max_frame_leases_));
   *buffer = IndexToFramebufferPtr(resp.response.frame.index);
+  if (info) *info = resp.response.frame;
   return resp.response.frame.index;
 }
 
-void CameraTask::ReturnFrame(int index) {
+void CameraTask::ReturnFrame(int index, bool lease) {
   camera::Request req;
   req.type = camera::RequestType::kFrame;
   req.request.frame.index = index;
+  req.request.frame.lease = lease;
   SendRequest(req);
 }
 
+CameraFrameLease CameraTask::LeaseFrame() {
+  if (!enabled_) {
+    printf("Camera is not enabled, cannot capture frame.\r\n");
+    return CameraFrameLease();
+  }
+  if (mode_ == CameraMode::kTrigger && !GpioGet(Gpio::kCameraTrigger)) {
+    printf("Camera is in trigger mode but was never triggered\r\n");
+    return CameraFrameLease();
+  }
+
+  uint8_t* raw = nullptr;
+  camera::FrameResponse info;
+  int index = GetFrame(&raw, true, /*lease=*/true, &info);
+  if (!raw) {
+    return CameraFrameLease();
+  }
+  if (mode_ == CameraMode::kTrigger) {
+    GpioSet(Gpio::kCameraTrigger, false);
+  }
+  return CameraFrameLease(index, raw, info.sequence, info.timestamp_us);
+}
+
+CameraFrameLease& CameraFrameLease::operator=(
+    CameraFrameLease&& other) noexcept {
+  if (this != &other) {
+    Release();
+    index_ = std::exchange(other.index_, -1);
+    data_ = std::exchange(other.data_, nullptr);
+    sequence_ = other.sequence_;
+    timestamp_us_ = other.timestamp_us_;
+  }
+  return *this;
+}
+
+size_t CameraFrameLease::size() const {
+  return valid() ? CameraTask::kWidth * CameraTask::kHeight : 0;
+}
+
+void CameraFrameLease::Release() {
+  if (!valid()) return;
+  CameraTask::GetSingleton()->ReturnFrame(index_, /*lease=*/true);
+  index_ = -1;
+  data_ = nullptr;
+}
+
+void CameraTask::CsiCallback(CSI_Type* base, csi_handle_t* handle,
+                             status_t status, void* user_data) {
+  if (status != kStatus_CSI_FrameDone) return;
+  auto* camera = static_cast<CameraTask*>(user_data);
+  const FrameInfo info{camera->frames_captured_++, TimerMicros()};
+  // Frames captured into the CSI driver's dummy buffer complete without a
+  // framebuffer, so take the framebuffers here and store the info with the
+  // one it belongs to. Each framebuffer is queued at most once, so
+  // `full_frames_` can't overflow.
+  uint32_t buffer;
+  while (CSI_TransferGetFullBuffer(base, handle, &buffer) == kStatus_Success) {
+    const int index =
+        FramebufferPtrToIndex(reinterpret_cast<uint8_t*>(buffer));
+    if (index < 0) continue;
+    camera->frame_info_[index] = info;
+    const uint32_t write = camera->full_frames_write_;
+    camera->full_frames_[write % kFramebufferCount] = index;
+    __DMB();
+    camera->full_frames_write_ = write + 1;
+  }
+}
+
 bool CameraTask::Enable(CameraMode mode) {
   camera::Request req;
   req.type = camera::RequestType::kEnable;
@@ -754,6 +1529,13 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   camera::EnableResponse resp;
   status_t status;
 
+  // Every framebuffer is submitted again below, so none may be leased.
+  if (leases_ > 0) {
+    printf("Camera frames are still leased, cannot enable camera.\r\n");
+    resp.success = false;
+    return resp;
+  }
+
   // Gated clock mode
   uint8_t osc_clk_div;
   Read(CameraRegisters::kOscClkDiv, &osc_clk_div);
@@ -765,12 +1547,15 @@ camera::EnableResponse CameraTask::HandleEnableRequest(const CameraMode& mode) {
   // Shifting
   Write(CameraRegisters::kVsyncHsyncPixelShiftEn, 0x0);
 
-  status = CSI_TransferCreateHandle(CSI, &csi_handle_, nullptr, 0);
+  frames_captured_ = 0;
+  full_frames_read_ = full_frames_write_;
+  status = CSI_TransferCreateHandle(CSI, &csi_handle_, CsiCallback, this);
 
   int framebuffer_count = kFramebufferCount;
   if (mode == CameraMode::kTrigger) {
     framebuffer_count = 2;
   }
+  max_frame_leases_ = framebuffer_count - 1;
   for (int i = 0; i < framebuffer_count; i++) {
     status = CSI_TransferSubmitEmptyBuffer(
         CSI, &csi_handle_, reinterpret_cast<uint32_t>(framebuffers[i]));
@@ -821,16 +1606,35 @@ camera::FrameResponse CameraTask::HandleFrameRequest(
     const camera::FrameRequest& frame) {
   camera::FrameResponse resp;
   resp.index = -1;
+  resp.sequence = 0;
+  resp.timestamp_us = 0;
   uint32_t buffer;
   if (frame.index == -1) {  // GET
-    status_t status = CSI_TransferGetFullBuffer(CSI, &csi_handle_, &buffer);
-    if (status == kStatus_Success) {
+    if (frame.lease && leases_ >= max_frame_leases_) {
+      return resp;
+    }
+    const uint32_t read = full_frames_read_;
+    if (read != full_frames_write_) {
+      resp.index = full_frames_[read % kFramebufferCount];
+      full_frames_read_ = read + 1;
+      buffer = reinterpret_cast<uint32_t>(IndexToFramebufferPtr(resp.index));
       DCACHE_InvalidateByRange(buffer, kHeight * kWidth);
-      resp.index = FramebufferPtrToIndex(reinterpret_cast<uint8_t*>(buffer));
+      const FrameInfo& info = frame_info_[resp.index];
+      resp.sequence = info.sequence;
+      resp.timestamp_us = info.timestamp_us;
+      if (frame.lease) {
+        leased_[resp.index] = true;
+        ++leases_;
+      }
     }
   } else {  // RETURN
     buffer = reinterpret_cast<uint32_t>(IndexToFramebufferPtr(frame.index));
     if (buffer) {
+      if (frame.lease) {
+        if (!leased_[frame.index]) return resp;
+        leased_[frame.index] = false;
+        --leases_;
+      }
       CSI_TransferSubmitEmptyBuffer(CSI, &csi_handle_, buffer);
     }
   }
@@ -859,6 +1663,7 @@ void CameraTask::HandleDiscardRequest(const camera::DiscardRequest& discard) {
   while (discarded < discard.count) {
     camera::FrameRequest request;
     request.index = -1;
+    request.lease = false;
     camera::FrameResponse resp = HandleFrameRequest(request);
     if (resp.index != -1) {
       // Return the frame, and increment the discard counter.
@@ -19,6 +19,7 @@
 
 #include <cstdint>
 #include <functional>
+#include <utility>
 #include <vector>
 
 #include "libs/base/queue_task.h"
@@ -104,10 +105,14 @@ enum class RequestType : uint8_t {
 
 struct FrameRequest {
   int index;
+  // True if the frame is taken (or returned) by a `CameraFrameLease`.
+  bool lease;
 };
 
 struct FrameResponse {
   int index;
+  uint32_t sequence;
+  uint64_t timestamp_us;
 };
 
 struct PowerRequest {
@@ -171,12 +176,34 @@ enum class CameraFormat {
 // @return The number of bytes per pixel.
 int CameraFormatBpp(CameraFormat fmt);
 
-// Image resampling method (when resizing the image).
+// Converts RGB pixels to grayscale, the way `CameraTask::GetFrame()` makes
+// `CameraFormat::kY8` images. The result is within one of
+// `255 * (0.2126 r^2 + 0.7152 g^2 + 0.0722 b^2)`, with the channels scaled
+// to [0, 1].
+// @param rgb The packed RGB pixels, 3 bytes each.
+// @param grayscale The buffer to write the `count` grayscale pixels to.
+// @param count The number of pixels.
+void CameraRgbToGrayscale(const uint8_t* rgb, uint8_t* grayscale, int count);
+
+// Demosaicing method (when converting the raw Bayer image to RGB).
 enum class CameraFilterMethod {
   kBilinear,
   kNearestNeighbor,
 };
 
+// Image resampling method (when resizing the image).
+enum class CameraResizeFilter {
+  // Picks the closest sensor pixel. This is the fastest method, and can be
+  // computed without demosaicing the whole frame, but it aliases noticeably
+  // when downscaling.
+  kNearestNeighbor,
+  // Interpolates between the four closest sensor pixels.
+  kBilinear,
+  // Averages all sensor pixels covered by each output pixel, weighted by
+  // coverage. Best suited for downscaling.
+  kArea,
+};
+
 // Clockwise image rotations.
 enum class CameraRotation {
   // The natural orientation for the camera module
@@ -191,12 +218,58 @@ enum class CameraRotation {
   k270,
 };
 
+// Auto white balance modes, used with `CameraFrameFormat`.
+enum class CameraWhiteBalanceMode {
+  // Gains are computed from every pixel of each frame (default).
+  kPerFrame,
+  // Gains are estimated from a sparse grid of the raw frame, only every
+  // `CameraWhiteBalanceConfig::update_interval` frames, and smoothed and
+  // cached by `CameraTask` in between. Much cheaper than `kPerFrame` when
+  // streaming, and the gains can be locked with `CameraWhiteBalanceConfig`.
+  kCached,
+};
+
+// White balance gains in 8.8 fixed point (256 is a gain of 1.0).
+struct CameraWhiteBalanceGains {
+  uint16_t r;
+  uint16_t g;
+  uint16_t b;
+};
+
+// Specifies how `CameraWhiteBalanceMode::kCached` gains are maintained.
+// Pass this to `CameraTask::SetWhiteBalanceConfig()`.
+struct CameraWhiteBalanceConfig {
+  // Number of frames between gain updates. Default is 8.
+  int update_interval = 8;
+  // Spacing, in pixels, of the raw Bayer samples used to estimate the gains.
+  // Rounded down to an even number. Default is 8.
+  int grid_step = 8;
+  // Weight of each new estimate when it is blended into the cached gains,
+  // from 0.0 (never change) to 1.0 (no smoothing). Default is 0.25.
+  float smoothing = 0.25f;
+  // Set true to stop updating the cached gains. Default is false.
+  bool locked = false;
+};
+
+// A rectangle of the camera frame, in pixels of the full-resolution frame
+// after rotation (`CameraTask::kWidth` by `CameraTask::kHeight`).
+struct CameraRegion {
+  // Left edge of the region.
+  int x;
+  // Top edge of the region.
+  int y;
+  // Region width. Zero (along with a zero height) selects the whole frame.
+  int width;
+  // Region height. Zero (along with a zero width) selects the whole frame.
+  int height;
+};
+
 // Specifies your image buffer location and any image processing you want to
 // perform when fetching images with `CameraTask::GetFrame()`.
 struct CameraFrameFormat {
   // Image format such as RGB or raw.
   CameraFormat fmt;
-  // Filter method such as bilinear (default) or nearest-neighbor.
+  // Demosaic filter method such as bilinear (default) or nearest-neighbor.
   CameraFilterMethod filter = CameraFilterMethod::kBilinear;
   // Image rotation in 90-degree increments. Default is 270 degree which
   // corresponds to the device held vertically with USB port facing down.
@@ -212,6 +285,102 @@ struct CameraFrameFormat {
   uint8_t* buffer;
   // Set true to perform auto whitebalancing (default), false to disable it.
   bool white_balance = true;
+  // How white balance gains are computed, if `white_balance` is true.
+  CameraWhiteBalanceMode white_balance_mode = CameraWhiteBalanceMode::kPerFrame;
+  // Resampling method used when the image is resized (default is
+  // nearest-neighbor).
+  CameraResizeFilter resize_filter = CameraResizeFilter::kNearestNeighbor;
+  // Region of the frame to resize into `width` and `height`, for cropping or
+  // digital zoom. Only the sensor pixels needed for that region are processed.
+  // The default (all zeros) uses the whole frame. Ignored for raw images.
+  // `CameraTask::GetFrame()` fails if the region is not inside the frame.
+  CameraRegion roi = {0, 0, 0, 0};
+  // Optional 256-entry table through which every output byte is mapped, after
+  // white balance and grayscale conversion. This lets frames be written
+  // directly into a model input tensor that needs normalization, such as with
+  // `tensorflow::ClassificationPreprocessor::lut()`. Ignored for raw images.
+  const uint8_t* lut = nullptr;
+};
+
+// Per-stage timing of one `CameraTask::GetFrame()` call, in microseconds.
+//
+// You can get the timing of the most recent call with
+// `CameraTask::GetFrameTiming()`.
+struct CameraFrameTiming {
+  // Time spent waiting for a frame from the camera.
+  uint64_t capture_us;
+  // Time spent demosaicing the full frame for formats that share a filter
+  // method or use a bilinear or area resize filter, including the white
+  // balance statistics gathered in the same pass.
+  uint64_t demosaic_us;
+  // Time spent computing white balance gains in a separate pass.
+  uint64_t white_balance_us;
+  // Time spent producing the requested formats.
+  uint64_t convert_us;
+  // Total time of the call.
+  uint64_t total_us;
+};
+
+// A read-only view of one raw frame in the camera's framebuffers, obtained
+// with `CameraTask::LeaseFrame()`.
+//
+// The frame is not copied: `data()` points directly at the raw Bayer image
+// (`CameraTask::kWidth` x `CameraTask::kHeight` bytes) that the camera
+// captured. The framebuffer is returned to the camera when the lease is
+// destroyed or `Release()` is called, so keep leases short-lived.
+class CameraFrameLease {
+ public:
+  // Creates an empty lease that holds no frame.
+  CameraFrameLease() = default;
+  ~CameraFrameLease() { Release(); }
+
+  // @cond Do not generate docs
+  CameraFrameLease(CameraFrameLease&& other) noexcept {
+    *this = std::move(other);
+  }
+  CameraFrameLease& operator=(CameraFrameLease&& other) noexcept;
+  CameraFrameLease(const CameraFrameLease&) = delete;
+  CameraFrameLease& operator=(const CameraFrameLease&) = delete;
+  // @endcond
+
+  // Checks whether this lease holds a frame.
+  // @return True if the lease holds a frame, false otherwise.
+  bool valid() const { return index_ >= 0; }
+
+  // Gets the raw Bayer image.
+  // @return A pointer to the frame data, or nullptr if the lease is empty.
+  const uint8_t* data() const { return data_; }
+
+  // Gets the size of the raw Bayer image.
+  // @return The frame size in bytes, or 0 if the lease is empty.
+  size_t size() const;
+
+  // Gets the frame sequence number, which counts every frame the camera
+  // captured since `CameraTask::Enable()`. Gaps mean frames were dropped.
+  // @return The frame sequence number.
+  uint32_t sequence() const { return sequence_; }
+
+  // Gets the time the camera finished capturing this frame.
+  // @return The capture time, in microseconds since boot (see `TimerMicros()`).
+  uint64_t timestamp_us() const { return timestamp_us_; }
+
+  // Returns the frame to the camera before the lease is destroyed.
+  // The lease is empty afterwards.
+  void Release();
+
+ private:
+  friend class CameraTask;
+  CameraFrameLease(int index, const uint8_t* data, uint32_t sequence,
+                   uint64_t timestamp_us)
+      : index_(index),
+        data_(data),
+        sequence_(sequence),
+        timestamp_us_(timestamp_us) {}
+
+  int index_ = -1;
+  const uint8_t* data_ = nullptr;
+  uint32_t sequence_ = 0;
+  uint64_t timestamp_us_ = 0;
 };
 
 // Provides access to the Dev Board Micro camera.
@@ -248,7 +417,7 @@ class CameraTask
   }
 
   // Enables the camera to begin capture. You must call `SetPower()` before
-  // this.
+  // this, and release any `CameraFrameLease` from a previous capture.
   // @param mode The operating mode (either `kStreaming` or `kTrigger`).
   // @return True if camera is enabled, false otherwise.
   bool Enable(CameraMode mode);
@@ -266,10 +435,71 @@ class CameraTask
   // `CameraTask::Trigger`) since the last time `CameraTask::GetFrame` was
   // called.
   //
+  // When several formats use the same `CameraFilterMethod`, the frame is
+  // demosaiced and white balanced only once and every format is derived from
+  // that shared result, so requesting, for example, a model input and a
+  // preview image together costs little more than one of them.
+  //
+  // Likewise, several regions of one frame (each with its own
+  // `CameraFrameFormat::roi`) can be fetched in a single call, such as one
+  // crop per detected object, at the cost of a single capture.
+  //
   // @param fmts A list of image formats you want to receive.
   // @return True if image processing succeeds, false otherwise.
   bool GetFrame(const std::vector<CameraFrameFormat>& fmts);
 
+  // Processes a raw frame into one or more formats, the same way as
+  // `GetFrame()` processes a captured frame. The raw frame can come from
+  // `LeaseFrame()`, from an earlier `GetFrame()` with `CameraFormat::kRaw`,
+  // or be generated, such as a test image. The camera does not need to be
+  // enabled.
+  //
+  // @param raw The raw Bayer image, `kWidth` x `kHeight` bytes.
+  // @param fmts A list of image formats you want to receive.
+  // @return True if image processing succeeds, false otherwise.
+  bool ConvertFrame(const uint8_t* raw,
+                    const std::vector<CameraFrameFormat>& fmts);
+
+  // Leases the next raw frame without copying it.
+  //
+  // This is the zero-copy alternative to `GetFrame()` with
+  // `CameraFormat::kRaw`: the returned lease points straight into the camera's
+  // framebuffer and returns it to the camera when destroyed. The camera
+  // always keeps one framebuffer to capture into, so at most 3 leases can be
+  // held at once in streaming mode, and only 1 in trigger mode.
+  //
+  // @note Like `GetFrame()`, this blocks until a new frame is available, and
+  // in trigger mode it fails if the camera has not been triggered.
+  //
+  // @return A lease on the frame, or an empty lease if the camera is not
+  // enabled or the maximum number of leases are already held.
+  CameraFrameLease LeaseFrame();
+
+  // Gets the per-stage timing of the most recent `GetFrame()` or
+  // `ConvertFrame()` call.
+  //
+  // @return The timing of the last frame.
+  CameraFrameTiming GetFrameTiming();
+
+  // Sets how the white balance gains for `CameraWhiteBalanceMode::kCached`
+  // formats are estimated and updated.
+  // @param config The white balance configuration.
+  void SetWhiteBalanceConfig(const CameraWhiteBalanceConfig& config);
+
+  // Gets the current white balance configuration.
+  // @return The white balance configuration.
+  CameraWhiteBalanceConfig GetWhiteBalanceConfig();
+
+  // Gets the cached white balance gains used by
+  // `CameraWhiteBalanceMode::kCached` formats.
+  // @return The current cached gains.
+  CameraWhiteBalanceGains GetWhiteBalanceGains();
+
+  // Replaces the cached white balance gains. To keep these gains, also set
+  // `CameraWhiteBalanceConfig::locked`.
+  // @param gains The gains to use.
+  void SetWhiteBalanceGains(const CameraWhiteBalanceGains& gains);
+
   // Turns the camera power on and off. You must call this before `Enable()`.
   // @param enable True to turn the camera on, false to turn it off.
   // @return True if the action was successful, false otherwise.
@@ -316,9 +546,27 @@ class CameraTask
   // Native image pixel height.
   static constexpr size_t kHeight = 324;
 
+  // Number of framebuffers the camera captures into.
+  static constexpr int kFramebufferCount = 4;
+
  private:
-  int GetFrame(uint8_t** buffer, bool block);
-  void ReturnFrame(int index);
+  // Sequence number and capture time of a completed frame.
+  struct FrameInfo {
+    uint32_t sequence;
+    uint64_t timestamp_us;
+  };
+
+  friend class CameraFrameLease;
+  static void CsiCallback(CSI_Type* base, csi_handle_t* handle,
+                          status_t status, void* user_data);
+  int GetFrame(uint8_t** buffer, bool block, bool lease = false,
+               camera::FrameResponse* info = nullptr);
+  void ReturnFrame(int index, bool lease = false);
+  // Processes `raw` for `GetFrame()` or `ConvertFrame()`, with timing that
+  // starts at `start`, in microseconds.
+  bool ConvertFrameInternal(const uint8_t* raw,
+                            const std::vector<CameraFrameFormat>& fmts,
+                            uint64_t start);
   void TaskInit() override;
   void RequestHandler(camera::Request* req) override;
   camera::EnableResponse HandleEnableRequest(const CameraMode& mode);
@@ -334,6 +582,7 @@ class CameraTask
   bool Write(uint16_t reg, uint8_t val);
   void SetDefaultRegisters();
   void SetMotionDetectionRegisters();
+  void UpdateWhiteBalanceGains(const uint8_t* raw);
 
   lpi2c_rtos_handle_t* i2c_handle_;
   csi_handle_t csi_handle_;
@@ -342,6 +591,28 @@ class CameraTask
   CameraTestPattern test_pattern_;
   CameraMotionDetectionConfig md_config_;
   bool enabled_{false};
+  // Guards the shared frame processing buffers, `timing_` and the cached
+  // white balance state.
+  SemaphoreHandle_t frame_mutex_;
+  CameraFrameTiming timing_{};
+  CameraWhiteBalanceConfig wb_config_;
+  CameraWhiteBalanceGains wb_gains_{256, 256, 256};
+  bool wb_gains_valid_{false};
+  int wb_frames_since_update_{0};
+  // Written by the CSI interrupt, read by the camera task. The interrupt
+  // takes completed framebuffers from the CSI queue and stores each frame's
+  // info by framebuffer index, then queues the index in `full_frames_`.
+  FrameInfo frame_info_[kFramebufferCount];
+  volatile uint8_t full_frames_[kFramebufferCount];
+  volatile uint32_t full_frames_write_{0};
+  volatile uint32_t full_frames_read_{0};
+  uint32_t frames_captured_{0};
+  // Number of outstanding `CameraFrameLease` objects, and how many can be
+  // held at once: one less than the framebuffers submitted by `Enable()`.
+  int leases_{0};
+  int max_frame_leases_{0};
+  // Framebuffers held by a `CameraFrameLease`.
+  bool leased_[kFramebufferCount]{};
 };
 
 }  // namespace coralmicro
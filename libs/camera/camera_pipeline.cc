@@ -0,0 +1,219 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/camera/camera_pipeline.h"
+
+#include <vector>
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
+
+namespace coralmicro {
+namespace {
+// Back-off after a failed `CameraTask::GetFrame()`, e.g. while the camera is
+// still disabled, so the producer doesn't starve lower priority tasks.
+constexpr TickType_t kErrorDelay = pdMS_TO_TICKS(10);
+}  // namespace
+
+CameraPipeline::CameraPipeline(const CameraFrameFormat& fmt, uint8_t* buffer0,
+                               uint8_t* buffer1,
+                               CameraPipelineDropPolicy policy,
+                               int task_priority)
+    : fmt_(fmt),
+      policy_(policy),
+      buffers_{{buffer0, BufferState::kFree, 0, 0},
+               {buffer1, BufferState::kFree, 0, 0}},
+      mutex_(xSemaphoreCreateMutex()),
+      frame_ready_(xSemaphoreCreateBinary()),
+      buffer_free_(xSemaphoreCreateBinary()),
+      stopped_(xSemaphoreCreateBinary()) {
+  CHECK(buffer0 && buffer1);
+  CHECK(mutex_ && frame_ready_ && buffer_free_ && stopped_);
+  CHECK(xTaskCreate(StaticRun, "camera_pipeline",
+                    configMINIMAL_STACK_SIZE * 10, this, task_priority,
+                    &task_) == pdPASS);
+}
+
+CameraPipeline::~CameraPipeline() {
+  {
+    MutexLock lock(mutex_);
+    running_ = false;
+  }
+  xSemaphoreGive(buffer_free_);
+
+  // The producer usually runs at a lower priority than this task, so block
+  // until it has left `Run()` rather than yielding to it.
+  xSemaphoreTake(stopped_, portMAX_DELAY);
+  vTaskDelete(task_);
+
+  vSemaphoreDelete(stopped_);
+  vSemaphoreDelete(buffer_free_);
+  vSemaphoreDelete(frame_ready_);
+  vSemaphoreDelete(mutex_);
+}
+
+CameraPipelineFrame CameraPipeline::AcquireFrame(TickType_t timeout) {
+  const TickType_t start = xTaskGetTickCount();
+  bool waited = false;
+  while (true) {
+    {
+      MutexLock lock(mutex_);
+      for (const auto& buffer : buffers_)
+        CHECK(buffer.state != BufferState::kHeld);
+
+      int index = NextReadyBuffer();
+      if (index >= 0) {
+        auto& buffer = buffers_[index];
+        buffer.state = BufferState::kHeld;
+        ++stats_.frames_consumed;
+        if (waited) ++stats_.frames_late;
+
+        // Older ready frames would only be stale by the next call.
+        bool freed = false;
+        if (policy_ == CameraPipelineDropPolicy::kLatestWins) {
+          for (auto& other : buffers_) {
+            if (other.state != BufferState::kReady) continue;
+            other.state = BufferState::kFree;
+            ++stats_.frames_dropped;
+            freed = true;
+          }
+        }
+        if (freed) xSemaphoreGive(buffer_free_);
+        return {buffer.data, buffer.sequence, buffer.timestamp_us};
+      }
+    }
+
+    waited = true;
+    TickType_t wait = portMAX_DELAY;
+    if (timeout != portMAX_DELAY) {
+      TickType_t elapsed = xTaskGetTickCount() - start;
+      if (elapsed >= timeout) return {nullptr, 0, 0};
+      wait = timeout - elapsed;
+    }
+    // A notification can be stale if the frame it announced was overwritten,
+    // so always re-check the buffers after waking up.
+    xSemaphoreTake(frame_ready_, wait);
+  }
+}
+
+void CameraPipeline::ReleaseFrame() {
+  {
+    MutexLock lock(mutex_);
+    bool released = false;
+    for (auto& buffer : buffers_) {
+      if (buffer.state == BufferState::kHeld) {
+        buffer.state = BufferState::kFree;
+        released = true;
+      }
+    }
+    CHECK(released);
+  }
+  xSemaphoreGive(buffer_free_);
+}
+
+CameraPipelineStats CameraPipeline::GetStats() const {
+  MutexLock lock(mutex_);
+  return stats_;
+}
+
+void CameraPipeline::ResetStats() {
+  MutexLock lock(mutex_);
+  stats_ = {};
+}
+
+void CameraPipeline::StaticRun(void* param) {
+  auto* pipeline = static_cast<CameraPipeline*>(param);
+  pipeline->Run();
+  xSemaphoreGive(pipeline->stopped_);
+  vTaskSuspend(nullptr);
+}
+
+void CameraPipeline::Run() {
+  std::vector<CameraFrameFormat> fmts{fmt_};
+  while (true) {
+    int index = ClaimBuffer();
+    if (index < 0) return;
+
+    fmts[0].buffer = buffers_[index].data;
+    bool success = CameraTask::GetSingleton()->GetFrame(fmts);
+    {
+      MutexLock lock(mutex_);
+      auto& buffer = buffers_[index];
+      if (success) {
+        buffer.state = BufferState::kReady;
+        buffer.sequence = next_sequence_++;
+        buffer.timestamp_us = TimerMicros();
+        ++stats_.frames_processed;
+      } else {
+        buffer.state = BufferState::kFree;
+        ++stats_.errors;
+      }
+    }
+
+    if (success)
+      xSemaphoreGive(frame_ready_);
+    else
+      vTaskDelay(kErrorDelay);
+  }
+}
+
+int CameraPipeline::ClaimBuffer() {
+  while (true) {
+    {
+      MutexLock lock(mutex_);
+      if (!running_) return -1;
+
+      int oldest_ready = -1;
+      for (int i = 0; i < kBufferCount; ++i) {
+        auto& buffer = buffers_[i];
+        if (buffer.state == BufferState::kFree) {
+          buffer.state = BufferState::kFilling;
+          return i;
+        }
+        if (buffer.state == BufferState::kReady &&
+            (oldest_ready < 0 ||
+             buffer.sequence < buffers_[oldest_ready].sequence))
+          oldest_ready = i;
+      }
+
+      if (policy_ == CameraPipelineDropPolicy::kLatestWins &&
+          oldest_ready >= 0) {
+        buffers_[oldest_ready].state = BufferState::kFilling;
+        ++stats_.frames_dropped;
+        return oldest_ready;
+      }
+    }
+    xSemaphoreTake(buffer_free_, portMAX_DELAY);
+  }
+}
+
+int CameraPipeline::NextReadyBuffer() const {
+  int next = -1;
+  for (int i = 0; i < kBufferCount; ++i) {
+    const auto& buffer = buffers_[i];
+    if (buffer.state != BufferState::kReady) continue;
+    if (next < 0) {
+      next = i;
+      continue;
+    }
+    bool newer = buffer.sequence > buffers_[next].sequence;
+    if (newer == (policy_ == CameraPipelineDropPolicy::kLatestWins)) next = i;
+  }
+  return next;
+}
+
+}  // namespace coralmicro
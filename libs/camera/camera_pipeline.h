@@ -0,0 +1,177 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_CAMERA_CAMERA_PIPELINE_H_
+#define LIBS_CAMERA_CAMERA_PIPELINE_H_
+
+#include <cstdint>
+
+#include "libs/camera/camera.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+namespace coralmicro {
+
+// Specifies what `CameraPipeline` does when the consumer falls behind.
+enum class CameraPipelineDropPolicy : uint8_t {
+  // The producer never waits for the consumer. A processed frame that has not
+  // been acquired yet is overwritten by the next one (and counted as dropped),
+  // so `CameraPipeline::AcquireFrame()` always returns the newest frame.
+  kLatestWins,
+  // Every processed frame is delivered in order. The producer waits for the
+  // consumer to release a buffer; camera frames captured meanwhile are simply
+  // not fetched.
+  kFifo,
+};
+
+// Counters reported by `CameraPipeline::GetStats()`.
+struct CameraPipelineStats {
+  // Frames fetched and converted by the producer task.
+  uint32_t frames_processed;
+  // Frames returned by `CameraPipeline::AcquireFrame()`.
+  uint32_t frames_consumed;
+  // Processed frames overwritten before being acquired (`kLatestWins` only).
+  uint32_t frames_dropped;
+  // Calls to `CameraPipeline::AcquireFrame()` that found no frame ready and
+  // had to wait for the producer.
+  uint32_t frames_late;
+  // `CameraTask::GetFrame()` calls that failed.
+  uint32_t errors;
+};
+
+// A processed frame handed out by `CameraPipeline::AcquireFrame()`.
+struct CameraPipelineFrame {
+  // The frame data in the pipeline's format, or nullptr if no frame was
+  // ready before the timeout.
+  const uint8_t* data;
+  // Monotonic sequence number assigned by the producer, starting at 0. Gaps
+  // correspond to dropped frames.
+  uint32_t sequence;
+  // Time when the frame finished processing, from `TimerMicros()`.
+  uint64_t timestamp_us;
+};
+
+// Overlaps camera capture and preprocessing with frame consumption.
+//
+// `CameraPipeline` owns a FreeRTOS task that repeatedly calls
+// `CameraTask::GetFrame()` into one of two ping-pong buffers while your task
+// (usually the one invoking the interpreter) consumes the other. Thus the
+// conversion of frame N+1 runs while inference runs on frame N, and the
+// overall frame rate is bounded by the slower of the two stages rather than
+// their sum.
+//
+// The camera must be enabled in streaming mode before frames are
+// requested, and no other task should call `CameraTask::GetFrame()` while
+// the pipeline runs. Only one consumer task is supported.
+//
+// For example:
+//
+// ```
+// CameraPipeline pipeline(fmt, buffer_a, buffer_b,
+//                         CameraPipelineDropPolicy::kLatestWins,
+//                         kAppTaskPriority - 1);
+// while (true) {
+//   auto frame = pipeline.AcquireFrame();
+//   std::memcpy(tflite::GetTensorData<uint8_t>(input), frame.data, size);
+//   pipeline.ReleaseFrame();
+//   interpreter.Invoke();
+// }
+// ```
+class CameraPipeline {
+ public:
+  // Constructs the pipeline and starts the producer task.
+  //
+  // @param fmt The format of every processed frame. Its `buffer` member is
+  //   ignored; frames are written to `buffer0` and `buffer1`.
+  // @param buffer0 First frame buffer, at least
+  //   `CameraFormatBpp(fmt.fmt) * fmt.width * fmt.height` bytes.
+  // @param buffer1 Second frame buffer, of the same size.
+  // @param policy What to do when the consumer falls behind.
+  // @param task_priority Priority of the producer task. It should be lower
+  //   than `kCameraTaskPriority`.
+  CameraPipeline(const CameraFrameFormat& fmt, uint8_t* buffer0,
+                 uint8_t* buffer1, CameraPipelineDropPolicy policy,
+                 int task_priority);
+  // Stops the producer task. Any acquired frame must be released first.
+  ~CameraPipeline();
+
+  CameraPipeline(const CameraPipeline&) = delete;
+  CameraPipeline& operator=(const CameraPipeline&) = delete;
+
+  // Gets the next processed frame and keeps it out of the producer's reach
+  // until `ReleaseFrame()` is called. Only one frame can be held at a time.
+  //
+  // With `kLatestWins` this is the newest ready frame; with `kFifo` it is the
+  // oldest one.
+  //
+  // @param timeout Maximum time to wait for a frame.
+  // @return The frame. `data` is nullptr if the timeout expired.
+  CameraPipelineFrame AcquireFrame(TickType_t timeout = portMAX_DELAY);
+
+  // Returns the frame obtained from `AcquireFrame()` to the producer.
+  void ReleaseFrame();
+
+  // Gets the pipeline counters.
+  CameraPipelineStats GetStats() const;
+
+  // Resets all pipeline counters to zero.
+  void ResetStats();
+
+ private:
+  enum class BufferState : uint8_t {
+    kFree,
+    kFilling,
+    kReady,
+    kHeld,
+  };
+
+  struct Buffer {
+    uint8_t* data;
+    BufferState state;
+    uint32_t sequence;
+    uint64_t timestamp_us;
+  };
+
+  static constexpr int kBufferCount = 2;
+
+  static void StaticRun(void* param);
+  void Run();
+  // Finds a buffer for the producer to fill, or -1 once the pipeline stops.
+  int ClaimBuffer();
+  // Finds the ready buffer the consumer should take next, or -1.
+  int NextReadyBuffer() const;
+
+  CameraFrameFormat fmt_;
+  CameraPipelineDropPolicy policy_;
+  Buffer buffers_[kBufferCount];
+  CameraPipelineStats stats_{};
+  uint32_t next_sequence_ = 0;
+  bool running_ = true;
+
+  SemaphoreHandle_t mutex_;
+  // Given by the producer whenever a frame becomes ready.
+  SemaphoreHandle_t frame_ready_;
+  // Given by the consumer (and on stop) whenever a buffer becomes free.
+  SemaphoreHandle_t buffer_free_;
+  // Given by the producer task once it has stopped.
+  SemaphoreHandle_t stopped_;
+  TaskHandle_t task_;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_CAMERA_CAMERA_PIPELINE_H_
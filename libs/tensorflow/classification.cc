@@ -16,13 +16,18 @@
 
 #include "libs/tensorflow/classification.h"
 
-#include <queue>
+#include <algorithm>
+#include <cmath>
 #include <vector>
 
 #include "libs/tensorflow/utils.h"
 
 namespace coralmicro::tensorflow {
 namespace {
+// Normalization expected by classification models.
+constexpr float kInputMean = 128;
+constexpr float kInputStd = 128;
+
 // Defines a comparator which allows us to rank Class based on their score and
 // id.
 struct ClassComparator {
@@ -30,6 +35,47 @@ struct ClassComparator {
     return std::tie(lhs.score, lhs.id) > std::tie(rhs.score, rhs.id);
   }
 };
+
+// Keeps the `max_results` best of the `count` scores that are not less than
+// `min_score` in `results`, ordered by score. The results are kept in a heap
+// whose root is the worst of them, so most scores are rejected by a single
+// comparison. Quantized scores are stored as is in `Class::score`.
+template <typename T, typename S>
+size_t SelectTopClasses(const T* scores, int count, S min_score,
+                        Class* results, size_t max_results) {
+  if (max_results == 0) return 0;
+  const ClassComparator comparator;
+  size_t size = 0;
+  for (int i = 0; i < count; ++i) {
+    if (scores[i] < min_score) continue;
+    const Class c{i, static_cast<float>(scores[i])};
+    if (size < max_results) {
+      results[size++] = c;
+      std::push_heap(results, results + size, comparator);
+    } else if (comparator(c, results[0])) {
+      std::pop_heap(results, results + size, comparator);
+      results[size - 1] = c;
+      std::push_heap(results, results + size, comparator);
+    }
+  }
+  std::sort_heap(results, results + size, comparator);
+  return size;
+}
+
+template <typename T>
+size_t GetQuantizedClassificationResults(const TfLiteTensor* tensor,
+                                         int scores_count, float threshold,
+                                         Class* results, size_t max_results) {
+  const float scale = tensor->params.scale;
+  const float zero_point = tensor->params.zero_point;
+  const int min_score = QuantizedThreshold<T>(*tensor, threshold);
+  const size_t size =
+      SelectTopClasses(tflite::GetTensorData<T>(tensor), scores_count,
+                       min_score, results, max_results);
+  for (size_t i = 0; i < size; ++i)
+    results[i].score = scale * (results[i].score - zero_point);
+  return size;
+}
 }  // namespace
 
 std::string FormatClassificationOutput(
@@ -48,46 +94,54 @@ std::string FormatClassificationOutput(
 std::vector<Class> GetClassificationResults(const float* scores,
                                             ssize_t scores_count,
                                             float threshold, size_t top_k) {
-  std::priority_queue<Class, std::vector<Class>, ClassComparator> q;
-  for (int i = 0; i < scores_count; ++i) {
-    if (scores[i] < threshold) continue;
-    q.push(Class{i, scores[i]});
-    if (q.size() > top_k) q.pop();
-  }
-
-  std::vector<Class> ret;
-  while (!q.empty()) {
-    ret.push_back(q.top());
-    q.pop();
-  }
-  std::reverse(ret.begin(), ret.end());
+  std::vector<Class> ret(
+      std::min(top_k, static_cast<size_t>(std::max<ssize_t>(scores_count, 0))));
+  ret.resize(SelectTopClasses(scores, scores_count, threshold, ret.data(),
+                              ret.size()));
   return ret;
 }
 
 std::vector<Class> GetClassificationResults(
     tflite::MicroInterpreter* interpreter, float threshold, size_t top_k) {
   auto tensor = interpreter->output_tensor(0);
-  if (tensor->type == kTfLiteUInt8 || tensor->type == kTfLiteInt8) {
-    auto scores = DequantizeTensor<float>(tensor);
-    return GetClassificationResults(scores.data(), scores.size(), threshold,
-                                    top_k);
+  std::vector<Class> ret(
+      std::min(top_k, static_cast<size_t>(TensorSize(tensor))));
+  ret.resize(GetClassificationResults(interpreter, threshold, ret.data(),
+                                      ret.size()));
+  return ret;
+}
+
+size_t GetClassificationResults(tflite::MicroInterpreter* interpreter,
+                                float threshold, Class* results,
+                                size_t max_results) {
+  return GetClassificationResults(interpreter->output_tensor(0), threshold,
+                                  results, max_results);
+}
+
+size_t GetClassificationResults(TfLiteTensor* tensor, float threshold,
+                                Class* results, size_t max_results) {
+  const int scores_count = TensorSize(tensor);
+  if (tensor->type == kTfLiteUInt8) {
+    return GetQuantizedClassificationResults<uint8_t>(
+        tensor, scores_count, threshold, results, max_results);
+  } else if (tensor->type == kTfLiteInt8) {
+    return GetQuantizedClassificationResults<int8_t>(
+        tensor, scores_count, threshold, results, max_results);
   } else if (tensor->type == kTfLiteFloat32) {
-    auto scores = tflite::GetTensorData<float>(tensor);
-    return GetClassificationResults(scores, TensorSize(tensor), threshold,
-                                    top_k);
+    return SelectTopClasses(tflite::GetTensorData<float>(tensor),
+                            scores_count, threshold, results, max_results);
   } else {
     assert(false);
+    return 0;
   }
 }
 
 bool ClassificationInputNeedsPreprocessing(const TfLiteTensor& input_tensor) {
   const float scale = input_tensor.params.scale;
   const float zero_point = input_tensor.params.zero_point;
-  const float mean = 128;
-  const float std = 128;
   const float epsilon = 1e-5;
-  if (std::abs(scale * std - 1) < epsilon &&
-      std::abs(mean - zero_point) < epsilon) {
+  if (std::abs(scale * kInputStd - 1) < epsilon &&
+      std::abs(kInputMean - zero_point) < epsilon) {
     return false;
   } else {
     return true;
@@ -98,25 +152,51 @@ bool ClassificationPreprocess(TfLiteTensor* input_tensor) {
   if (input_tensor->type != kTfLiteUInt8) {
     return false;
   }
-  const float scale = input_tensor->params.scale;
-  const float zero_point = input_tensor->params.zero_point;
-  const float mean = 128;
-  const float std = 128;
-  const size_t size = input_tensor->bytes;
-
-  uint8_t* input_tensor_data = tflite::GetTensorData<uint8_t>(input_tensor);
-  for (size_t i = 0; i < size; ++i) {
-    const float tmp =
-        (input_tensor_data[i] - mean) / (std * scale) + zero_point;
-    if (tmp > 255) {
-      input_tensor_data[i] = 255;
-    } else if (tmp < 0) {
-      input_tensor_data[i] = 0;
+  ClassificationPreprocessor preprocessor(*input_tensor);
+  preprocessor.Apply(tflite::GetTensorData<uint8_t>(input_tensor),
+                     input_tensor->bytes);
+  return true;
+}
+
+ClassificationPreprocessor::ClassificationPreprocessor(
+    const TfLiteTensor& input_tensor)
+    : valid_(input_tensor.type == kTfLiteUInt8 ||
+             input_tensor.type == kTfLiteInt8) {
+  const float scale = input_tensor.params.scale;
+  const float zero_point = input_tensor.params.zero_point;
+  const bool is_signed = input_tensor.type == kTfLiteInt8;
+  const float min = is_signed ? -128 : 0;
+  const float max = is_signed ? 127 : 255;
+  for (int i = 0; i < 256; ++i) {
+    const float tmp = (i - kInputMean) / (kInputStd * scale) + zero_point;
+    if (tmp > max) {
+      lut_[i] = static_cast<uint8_t>(static_cast<int>(max));
+    } else if (tmp < min) {
+      lut_[i] = static_cast<uint8_t>(static_cast<int>(min));
     } else {
-      input_tensor_data[i] = static_cast<uint8_t>(tmp);
+      lut_[i] = static_cast<uint8_t>(static_cast<int>(tmp));
     }
   }
-  return true;
+}
+
+void ClassificationPreprocessor::Apply(uint8_t* data, size_t size) const {
+  for (size_t i = 0; i < size; ++i) data[i] = lut_[data[i]];
+}
+
+bool ClassificationPreprocessor::CopyToTensor(const ImageDims& dims,
+                                              const uint8_t* image,
+                                              TfLiteTensor* input_tensor,
+                                              ResizeMethod method) const {
+  if (!valid_ || (input_tensor->type != kTfLiteUInt8 &&
+                  input_tensor->type != kTfLiteInt8)) {
+    return false;
+  }
+  const ImageDims tensor_dims = {input_tensor->dims->data[1],
+                                 input_tensor->dims->data[2],
+                                 input_tensor->dims->data[3]};
+  return ResizeImage(dims, image, tensor_dims,
+                     tflite::GetTensorData<uint8_t>(input_tensor), method,
+                     lut_);
 }
 
 }  // namespace coralmicro::tensorflow
@@ -20,6 +20,7 @@
 #include <limits>
 #include <vector>
 
+#include "libs/tensorflow/utils.h"
 #include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
 
 namespace coralmicro::tensorflow {
@@ -70,6 +71,38 @@ std::vector<Class> GetClassificationResults(
     float threshold = -std::numeric_limits<float>::infinity(),
     size_t top_k = std::numeric_limits<size_t>::max());
 
+// Gets results from a classification model without allocating memory.
+//
+// For quantized output tensors, `threshold` is converted to the quantized
+// domain and the top classes are selected on the quantized scores, so only
+// the returned classes are dequantized. The results are the same as those of
+// the other overloads.
+//
+// @param interpreter The already-invoked interpreter for your classification
+//   model.
+// @param threshold The score threshold for results. All returned results have
+//   a score greater-than-or-equal-to this value.
+// @param results Receives the top `max_results` Class predictions, ordered by
+//   score (first element has the highest score).
+// @param max_results The size of `results`, which is also the maximum number
+//   of predictions to return.
+// @returns The number of predictions written to `results`.
+size_t GetClassificationResults(tflite::MicroInterpreter* interpreter,
+                                float threshold, Class* results,
+                                size_t max_results);
+
+// Gets results from a classification output tensor without allocating memory,
+// like the overload above.
+//
+// @param tensor The output tensor of your classification model, of type
+//   `kTfLiteUInt8`, `kTfLiteInt8` or `kTfLiteFloat32`.
+// @param threshold The score threshold for results.
+// @param results Receives the top `max_results` Class predictions.
+// @param max_results The size of `results`.
+// @returns The number of predictions written to `results`.
+size_t GetClassificationResults(TfLiteTensor* tensor, float threshold,
+                                Class* results, size_t max_results);
+
 // Checks whether an input tensor needs pre-processing for classification.
 // @param intput_tensor The tensor intended as input for a classification model.
 // @returns True if the input tensor requires normalization AND quantization
@@ -82,6 +115,65 @@ bool ClassificationInputNeedsPreprocessing(const TfLiteTensor& input_tensor);
 // @returns True upon success; false if the tensor type is the wrong format.
 bool ClassificationPreprocess(TfLiteTensor* input_tensor);
 
+// Performs the pre-processing of `ClassificationPreprocess()` with a lookup
+// table, while the image is written into the input tensor.
+//
+// The normalization and quantization only depend on the value of each byte,
+// so they are tabulated once from the input tensor parameters. Instead of
+// copying an image into the input tensor and then pre-processing it in place,
+// use `CopyToTensor()` to resize and pre-process it in one pass, or set
+// `CameraFrameFormat::lut` to `lut()` so that `CameraTask::GetFrame()` writes
+// pre-processed frames straight into the input tensor.
+//
+// For example:
+//
+// ```
+// ClassificationPreprocessor preprocessor(*input_tensor);
+// CameraFrameFormat fmt{...};
+// fmt.buffer = tflite::GetTensorData<uint8_t>(input_tensor);
+// fmt.lut = preprocessor.lut();
+// CameraTask::GetSingleton()->GetFrame({fmt});
+// ```
+class ClassificationPreprocessor {
+ public:
+  // Builds the lookup table for `input_tensor`.
+  //
+  // @param input_tensor The input tensor of a classification model, of type
+  //   `kTfLiteUInt8` or `kTfLiteInt8`.
+  explicit ClassificationPreprocessor(const TfLiteTensor& input_tensor);
+
+  // Checks whether the input tensor type is supported.
+  // @returns True if the tensor is of type `kTfLiteUInt8` or `kTfLiteInt8`.
+  bool valid() const { return valid_; }
+
+  // Gets the 256-entry table that maps an image value to an input tensor
+  // value. `kTfLiteInt8` values are stored as their two's complement bytes.
+  const uint8_t* lut() const { return lut_; }
+
+  // Pre-processes image data in place.
+  // @param data The image data.
+  // @param size The number of bytes of `data`.
+  void Apply(uint8_t* data, size_t size) const;
+
+  // Resizes an image into the input tensor and pre-processes it, in a single
+  // pass over the tensor.
+  //
+  // @param dims The dimensions of `image`, whose depth must match the input
+  //   tensor.
+  // @param image The image data.
+  // @param input_tensor The input tensor this table was built for.
+  // @param method The resampling method.
+  // @returns True upon success; false if the tensor type is not supported or
+  //   the dimensions are invalid.
+  bool CopyToTensor(const ImageDims& dims, const uint8_t* image,
+                    TfLiteTensor* input_tensor,
+                    ResizeMethod method = ResizeMethod::kNearestNeighbor) const;
+
+ private:
+  bool valid_;
+  uint8_t lut_[256];
+};
+
 }  // namespace coralmicro::tensorflow
 
 #endif  // LIBS_TENSORFLOW_CLASSIFICATION_H_
@@ -16,9 +16,13 @@
 
 #include "libs/tensorflow/detection.h"
 
+#include <algorithm>
 #include <cmath>
+#include <limits>
 #include <queue>
 
+#include "libs/tensorflow/utils.h"
+
 namespace coralmicro::tensorflow {
 
 namespace {
@@ -27,6 +31,188 @@ struct ObjectComparator {
     return std::tie(lhs.score, lhs.id) > std::tie(rhs.score, rhs.id);
   }
 };
+
+// An anchor and class whose score passed the threshold.
+struct SsdCandidate {
+  int anchor;
+  int id;
+};
+
+template <typename T>
+struct ScoredSsdCandidate {
+  T score;
+  SsdCandidate candidate;
+};
+
+// Ranks candidates by decreasing score, then by anchor and class.
+template <typename T>
+struct SsdCandidateComparator {
+  bool operator()(const ScoredSsdCandidate<T>& lhs,
+                  const ScoredSsdCandidate<T>& rhs) const {
+    if (lhs.score != rhs.score) return lhs.score > rhs.score;
+    return std::tie(lhs.candidate.anchor, lhs.candidate.id) <
+           std::tie(rhs.candidate.anchor, rhs.candidate.id);
+  }
+};
+
+// Cells per side of the grid used to find overlapping boxes during NMS.
+constexpr int kNmsGridSize = 8;
+
+// Tracks which kept boxes touch each cell of a grid over the normalized image.
+// Boxes outside of the image are assigned to the nearest border cells.
+class NmsGrid {
+ public:
+  NmsGrid() { std::fill(std::begin(heads_), std::end(heads_), -1); }
+
+  // Adds the object at `index` over the cells covered by `bbox`.
+  void Add(const BBox<float>& bbox, int index) {
+    Cells cells(bbox);
+    for (int row = cells.row0; row <= cells.row1; ++row) {
+      for (int col = cells.col0; col <= cells.col1; ++col) {
+        int& head = heads_[row * kNmsGridSize + col];
+        entries_.push_back({index, head});
+        head = static_cast<int>(entries_.size()) - 1;
+      }
+    }
+  }
+
+  // Calls `fn(index)` for every object added over a cell covered by `bbox`,
+  // until it returns true. An object may be visited more than once.
+  // @returns True if `fn` returned true.
+  template <typename Fn>
+  bool AnyOverlapping(const BBox<float>& bbox, Fn fn) const {
+    Cells cells(bbox);
+    for (int row = cells.row0; row <= cells.row1; ++row) {
+      for (int col = cells.col0; col <= cells.col1; ++col) {
+        for (int e = heads_[row * kNmsGridSize + col]; e >= 0;
+             e = entries_[e].next) {
+          if (fn(entries_[e].index)) return true;
+        }
+      }
+    }
+    return false;
+  }
+
+ private:
+  struct Entry {
+    int index;
+    int next;
+  };
+
+  struct Cells {
+    explicit Cells(const BBox<float>& bbox)
+        : row0(Cell(std::min(bbox.ymin, bbox.ymax))),
+          row1(Cell(std::max(bbox.ymin, bbox.ymax))),
+          col0(Cell(std::min(bbox.xmin, bbox.xmax))),
+          col1(Cell(std::max(bbox.xmin, bbox.xmax))) {}
+
+    static int Cell(float v) {
+      return static_cast<int>(std::min(std::max(0.0f, v * kNmsGridSize),
+                                       kNmsGridSize - 1.0f));
+    }
+
+    int row0, row1, col0, col1;
+  };
+
+  int heads_[kNmsGridSize * kNmsGridSize];
+  std::vector<Entry> entries_;
+};
+
+// Matches the intersection-over-union of `TFLite_Detection_PostProcess`.
+float IntersectionOverUnion(const BBox<float>& a, const BBox<float>& b) {
+  const float area_a = (a.ymax - a.ymin) * (a.xmax - a.xmin);
+  const float area_b = (b.ymax - b.ymin) * (b.xmax - b.xmin);
+  if (area_a <= 0 || area_b <= 0) return 0.0f;
+  const float ymin = std::max(a.ymin, b.ymin);
+  const float xmin = std::max(a.xmin, b.xmin);
+  const float ymax = std::min(a.ymax, b.ymax);
+  const float xmax = std::min(a.xmax, b.xmax);
+  const float intersection =
+      std::max(ymax - ymin, 0.0f) * std::max(xmax - xmin, 0.0f);
+  return intersection / (area_a + area_b - intersection);
+}
+
+// Gets the value at `index` of a quantized or float tensor.
+float TensorValue(const TfLiteTensor& tensor, size_t index) {
+  switch (tensor.type) {
+    case kTfLiteUInt8:
+      return tensor.params.scale *
+             (tflite::GetTensorData<uint8_t>(&tensor)[index] -
+              tensor.params.zero_point);
+    case kTfLiteInt8:
+      return tensor.params.scale *
+             (tflite::GetTensorData<int8_t>(&tensor)[index] -
+              tensor.params.zero_point);
+    default:
+      return tflite::GetTensorData<float>(&tensor)[index];
+  }
+}
+
+size_t TensorElements(const TfLiteTensor& tensor) {
+  size_t count = 1;
+  for (int i = 0; i < tensor.dims->size; ++i) count *= tensor.dims->data[i];
+  return count;
+}
+
+// Collects up to `max_candidates` of the highest-scoring anchor and class
+// pairs with a score of at least `threshold`, in decreasing score order.
+template <typename T>
+std::vector<SsdCandidate> CollectSsdCandidates(
+    const T* scores, int num_anchors, int columns, int label_offset,
+    T threshold, bool class_aware, size_t max_candidates) {
+  using Scored = ScoredSsdCandidate<T>;
+  const SsdCandidateComparator<T> comparator;
+  std::vector<Scored> heap;
+  auto push = [&](T score, int anchor, int id) {
+    const Scored scored{score, {anchor, id}};
+    if (heap.size() < max_candidates) {
+      heap.push_back(scored);
+      std::push_heap(heap.begin(), heap.end(), comparator);
+    } else if (comparator(scored, heap.front())) {
+      std::pop_heap(heap.begin(), heap.end(), comparator);
+      heap.back() = scored;
+      std::push_heap(heap.begin(), heap.end(), comparator);
+    }
+  };
+
+  if (max_candidates > 0) {
+    const int num_classes = columns - label_offset;
+    for (int anchor = 0; anchor < num_anchors; ++anchor) {
+      const T* row = scores + anchor * columns + label_offset;
+      if (class_aware) {
+        for (int id = 0; id < num_classes; ++id) {
+          if (row[id] >= threshold) push(row[id], anchor, id);
+        }
+      } else {
+        const T* top = std::max_element(row, row + num_classes);
+        if (*top >= threshold) push(*top, anchor, top - row);
+      }
+    }
+  }
+
+  std::sort_heap(heap.begin(), heap.end(), comparator);
+  std::vector<SsdCandidate> candidates;
+  candidates.reserve(heap.size());
+  for (const auto& scored : heap) candidates.push_back(scored.candidate);
+  return candidates;
+}
+
+// Decodes the box of `anchor` like `TFLite_Detection_PostProcess`.
+BBox<float> DecodeSsdBox(const TfLiteTensor& box_encodings,
+                         const float* anchors, int anchor,
+                         const SsdDecoderOptions& options) {
+  const float y = TensorValue(box_encodings, 4 * anchor);
+  const float x = TensorValue(box_encodings, 4 * anchor + 1);
+  const float h = TensorValue(box_encodings, 4 * anchor + 2);
+  const float w = TensorValue(box_encodings, 4 * anchor + 3);
+  const float* a = anchors + 4 * anchor;
+  const float ycenter = y / options.y_scale * a[2] + a[0];
+  const float xcenter = x / options.x_scale * a[3] + a[1];
+  const float half_h = 0.5f * std::exp(h / options.h_scale) * a[2];
+  const float half_w = 0.5f * std::exp(w / options.w_scale) * a[3];
+  return {ycenter - half_h, xcenter - half_w, ycenter + half_h,
+          xcenter + half_w};
+}
 }  // namespace
 
 std::string FormatDetectionOutput(const std::vector<Object>& objects) {
@@ -97,4 +283,91 @@ std::vector<Object> GetDetectionResults(tflite::MicroInterpreter* interpreter,
                              threshold, top_k);
 }
 
+std::vector<Object> GetSsdDetectionResults(
+    const TfLiteTensor& box_encodings, const TfLiteTensor& class_predictions,
+    const float* anchors, const SsdDecoderOptions& options) {
+  const auto supported = [](const TfLiteTensor& tensor) {
+    return tensor.type == kTfLiteUInt8 || tensor.type == kTfLiteInt8 ||
+           tensor.type == kTfLiteFloat32;
+  };
+  if (!supported(box_encodings) || !supported(class_predictions)) {
+    printf("Unsupported SSD output type\r\n");
+    return {};
+  }
+  const int num_anchors = TensorElements(box_encodings) / 4;
+  const int columns =
+      num_anchors ? TensorElements(class_predictions) / num_anchors : 0;
+  if (num_anchors == 0 ||
+      static_cast<size_t>(num_anchors) * 4 != TensorElements(box_encodings) ||
+      static_cast<size_t>(num_anchors) * columns !=
+          TensorElements(class_predictions) ||
+      options.label_offset < 0 || columns <= options.label_offset) {
+    printf("SSD output size mismatch\r\n");
+    return {};
+  }
+
+  float threshold = options.score_threshold;
+  if (options.logits) {
+    // Compare logits, since the sigmoid is monotonic.
+    if (threshold <= 0.0f) {
+      threshold = -std::numeric_limits<float>::infinity();
+    } else if (threshold >= 1.0f) {
+      threshold = std::numeric_limits<float>::infinity();
+    } else {
+      threshold = std::log(threshold / (1.0f - threshold));
+    }
+  }
+  std::vector<SsdCandidate> candidates;
+  switch (class_predictions.type) {
+    case kTfLiteUInt8: {
+      const int quantized =
+          QuantizedThreshold<uint8_t>(class_predictions, threshold);
+      if (quantized <= std::numeric_limits<uint8_t>::max()) {
+        candidates = CollectSsdCandidates(
+            tflite::GetTensorData<uint8_t>(&class_predictions), num_anchors,
+            columns, options.label_offset, static_cast<uint8_t>(quantized),
+            options.class_aware, options.max_candidates);
+      }
+    } break;
+    case kTfLiteInt8: {
+      const int quantized =
+          QuantizedThreshold<int8_t>(class_predictions, threshold);
+      if (quantized <= std::numeric_limits<int8_t>::max()) {
+        candidates = CollectSsdCandidates(
+            tflite::GetTensorData<int8_t>(&class_predictions), num_anchors,
+            columns, options.label_offset, static_cast<int8_t>(quantized),
+            options.class_aware, options.max_candidates);
+      }
+    } break;
+    default:
+      candidates = CollectSsdCandidates(
+          tflite::GetTensorData<float>(&class_predictions), num_anchors,
+          columns, options.label_offset, threshold, options.class_aware,
+          options.max_candidates);
+      break;
+  }
+
+  std::vector<Object> objects;
+  NmsGrid grid;
+  for (const auto& candidate : candidates) {
+    if (objects.size() >= options.max_detections) break;
+    const BBox<float> bbox =
+        DecodeSsdBox(box_encodings, anchors, candidate.anchor, options);
+    const bool suppressed = grid.AnyOverlapping(bbox, [&](int index) {
+      const Object& kept = objects[index];
+      return (!options.class_aware || kept.id == candidate.id) &&
+             IntersectionOverUnion(kept.bbox, bbox) > options.iou_threshold;
+    });
+    if (suppressed) continue;
+
+    float score = TensorValue(
+        class_predictions,
+        candidate.anchor * columns + options.label_offset + candidate.id);
+    if (options.logits) score = 1.0f / (1.0f + std::exp(-score));
+    grid.Add(bbox, objects.size());
+    objects.push_back(Object{candidate.id, score, bbox});
+  }
+  return objects;
+}
+
 }  // namespace coralmicro::tensorflow
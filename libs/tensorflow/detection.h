@@ -86,6 +86,60 @@ std::vector<Object> GetDetectionResults(
     float threshold = -std::numeric_limits<float>::infinity(),
     size_t top_k = std::numeric_limits<size_t>::max());
 
+// Parameters for `GetSsdDetectionResults()`. The box coder scales match the
+// custom options of the `TFLite_Detection_PostProcess` op.
+struct SsdDecoderOptions {
+  // Scale of the box center offsets along y and x.
+  float y_scale = 10.0f;
+  float x_scale = 10.0f;
+  // Scale of the log box height and width.
+  float h_scale = 5.0f;
+  float w_scale = 5.0f;
+  // Number of leading columns of the class predictions that are not object
+  // classes, such as the background class of SSD models.
+  int label_offset = 1;
+  // Set true if the class predictions are logits, in which case the object
+  // scores are their sigmoid. Otherwise, the predictions are the scores.
+  bool logits = false;
+  // The minimum object score.
+  float score_threshold = 0.5f;
+  // A box is suppressed if its intersection-over-union with a higher-scoring
+  // box exceeds this value.
+  float iou_threshold = 0.6f;
+  // Set true to only suppress boxes of the same class (like the op's regular
+  // NMS). Set false to let each anchor propose only its top class, and to
+  // suppress boxes of any class (like the op's fast NMS).
+  bool class_aware = true;
+  // The maximum number of candidates kept for NMS. When more anchor and class
+  // pairs pass the score threshold, only the highest-scoring are kept.
+  size_t max_candidates = 300;
+  // The maximum number of objects to return.
+  size_t max_detections = 10;
+};
+
+// Decodes objects from the raw outputs of an SSD model, for models that don't
+// end with the `TFLite_Detection_PostProcess` op.
+//
+// The score threshold is applied to the quantized class predictions, so only
+// the anchors that pass it are dequantized and decoded. Candidates then go
+// through greedy non-maximum suppression, where each box is only compared
+// with the kept boxes that share a cell of a coarse spatial grid.
+//
+// @param box_encodings The box regression tensor, with 4 values per anchor in
+//   (y, x, h, w) order. Must be of type `kTfLiteUInt8`, `kTfLiteInt8`, or
+//   `kTfLiteFloat32`.
+// @param class_predictions The class prediction tensor, with the same number
+//   of columns for each anchor. Same types as `box_encodings`.
+// @param anchors The anchor boxes in (ycenter, xcenter, h, w) order, 4 values
+//   per anchor, in the normalized coordinates of the returned boxes.
+// @param options The decoder parameters.
+// @returns Up to `options.max_detections` objects (id, score, BBox), ordered by
+// score (first element has the highest score). The ids don't count the
+// `label_offset` columns. Boxes aren't clipped to the image.
+std::vector<Object> GetSsdDetectionResults(
+    const TfLiteTensor& box_encodings, const TfLiteTensor& class_predictions,
+    const float* anchors, const SsdDecoderOptions& options = {});
+
 }  // namespace coralmicro::tensorflow
 
 #endif  // LIBS_TENSORFLOW_DETECTION_H_
@@ -29,6 +29,7 @@ using posenet_decoder_op::kNumKeypoints;
 using posenet_decoder_op::Point;
 using posenet_decoder_op::PoseKeypoints;
 using posenet_decoder_op::PoseKeypointScores;
+using posenet_decoder_op::TensorView;
 
 enum KeypointType {
   kNose,
@@ -161,7 +162,7 @@ void BuildBilinearInterpolation(const float y, const float x, const int height,
 // sample its value at tensor(y, x, c), for c in the channels specified. This
 // is faster than calling the single channel interpolation function multiple
 // times because the computation of the positions needs to be done only once.
-void SampleTensorAtMultipleChannels(const float* tensor, const int height,
+void SampleTensorAtMultipleChannels(const TensorView& tensor, const int height,
                                     const int width, const int num_channels,
                                     const float y, const float x,
                                     const int* result_channels,
@@ -188,7 +189,7 @@ void SampleTensorAtMultipleChannels(const float* tensor, const int height,
 // Sample the input tensor values at position (x, y) and at a single channel.
 // The input tensor has shape [height, width, num_channels]. We bilinearly
 // sample its value at tensor(y, x, channel).
-float SampleTensorAtSingleChannel(const float* tensor, const int height,
+float SampleTensorAtSingleChannel(const TensorView& tensor, const int height,
                                   const int width, const int num_channels,
                                   const Point& point, const int c) {
   float result;
@@ -199,8 +200,8 @@ float SampleTensorAtSingleChannel(const float* tensor, const int height,
 
 // Follows the mid-range offsets, and then refines the position by the short-
 // range offsets for a fixed number of steps.
-Point FindDisplacedPosition(const float* short_offsets,
-                            const float* mid_offsets, const int height,
+Point FindDisplacedPosition(const TensorView& short_offsets,
+                            const TensorView& mid_offsets, const int height,
                             const int width, const int num_keypoints,
                             const int num_edges, const Point& source,
                             const int edge_id, const int target_id,
@@ -241,8 +242,9 @@ AdjacencyList BuildAdjacencyList() {
   return adjacency_list;
 }
 
-void BacktrackDecodePose(const float* scores, const float* short_offsets,
-                         const float* mid_offsets, const int height,
+void BacktrackDecodePose(const TensorView& scores,
+                         const TensorView& short_offsets,
+                         const TensorView& mid_offsets, const int height,
                          const int width, const int num_keypoints,
                          const int num_edges, const KeypointWithScore& root,
                          const AdjacencyList& adjacency_list,
@@ -305,19 +307,22 @@ void BacktrackDecodePose(const float* scores, const float* short_offsets,
   }
 }
 
-void BuildKeypointWithScoreQueue(const float* scores,
-                                 const float* short_offsets, const int height,
-                                 const int width, const int num_keypoints,
-                                 const float score_threshold,
-                                 const int local_maximum_radius,
-                                 DecreasingScoreKeypointPriorityQueue* queue) {
+namespace {
+// Queues the local maxima of the scores, where `score(index)` gets comparable
+// values (such as quantized ones) and `threshold` is in the same units.
+template <typename Score, typename T>
+void QueueLocalMaxima(Score score, const T threshold,
+                      const TensorView& scores, const TensorView& short_offsets,
+                      const int height, const int width,
+                      const int num_keypoints, const int local_maximum_radius,
+                      DecreasingScoreKeypointPriorityQueue* queue) {
   int score_index = 0;
   for (int y = 0; y < height; ++y) {
     for (int x = 0; x < width; ++x) {
       int offset_index = 2 * score_index;
       for (int j = 0; j < num_keypoints; ++j) {
-        const float score = scores[score_index];
-        if (score >= score_threshold) {
+        const T value = score(score_index);
+        if (value >= threshold) {
           // Only consider keypoints whose score is maximum in a local window.
           bool local_maximum = true;
           const int y_start = std::max(y - local_maximum_radius, 0);
@@ -326,8 +331,8 @@ void BuildKeypointWithScoreQueue(const float* scores,
             const int x_start = std::max(x - local_maximum_radius, 0);
             const int x_end = std::min(x + local_maximum_radius + 1, width);
             for (int x_current = x_start; x_current < x_end; ++x_current) {
-              if (scores[y_current * width * num_keypoints +
-                         x_current * num_keypoints + j] > score) {
+              if (score(y_current * width * num_keypoints +
+                        x_current * num_keypoints + j) > value) {
                 local_maximum = false;
                 break;
               }
@@ -339,7 +344,8 @@ void BuildKeypointWithScoreQueue(const float* scores,
             const float dx = short_offsets[offset_index + num_keypoints];
             const float y_refined = clamp(y + dy, 0.0f, height - 1.0f);
             const float x_refined = clamp(x + dx, 0.0f, width - 1.0f);
-            queue->emplace(Point{y_refined, x_refined}, j, score);
+            queue->emplace(Point{y_refined, x_refined}, j,
+                           scores[score_index]);
           }
         }
 
@@ -349,6 +355,35 @@ void BuildKeypointWithScoreQueue(const float* scores,
     }
   }
 }
+}  // namespace
+
+void BuildKeypointWithScoreQueue(const TensorView& scores,
+                                 const TensorView& short_offsets,
+                                 const int height, const int width,
+                                 const int num_keypoints,
+                                 const float score_threshold,
+                                 const int local_maximum_radius,
+                                 DecreasingScoreKeypointPriorityQueue* queue) {
+  if (scores.quantized_monotonic()) {
+    // Find the lowest quantized score that passes the threshold, so that the
+    // search never dequantizes.
+    int threshold = 0;
+    while (threshold <= UINT8_MAX &&
+           scores.Dequantize(threshold) < score_threshold) {
+      ++threshold;
+    }
+    if (threshold > UINT8_MAX) return;
+    const uint8_t* data = scores.quantized_data();
+    QueueLocalMaxima([data](int index) { return data[index]; },
+                     static_cast<uint8_t>(threshold), scores, short_offsets,
+                     height, width, num_keypoints, local_maximum_radius,
+                     queue);
+  } else {
+    QueueLocalMaxima([&scores](int index) { return scores[index]; },
+                     score_threshold, scores, short_offsets, height, width,
+                     num_keypoints, local_maximum_radius, queue);
+  }
+}
 
 bool PassKeypointNMS(const PoseKeypoints* poses, const size_t n_poses,
                      const KeypointWithScore& keypoint,
@@ -429,7 +464,7 @@ float ComputeSumSquaredDistance(const std::vector<Point>& embedding,
 // Follows the long-range offsets, and then refines the position by the
 // long-range offsets for a fixed number of steps.
 Point GetEmbedding(const int y_location, const int x_location,
-                   const float* long_offsets, const int keypoint_index,
+                   const TensorView& long_offsets, const int keypoint_index,
                    const int refinement_steps, const int height,
                    const int width, const int num_keypoints, const int stride) {
   float y = static_cast<float>(y_location);
@@ -450,7 +485,7 @@ Point GetEmbedding(const int y_location, const int x_location,
 // Matches the list of embeddings to a pose in a list of poses based off the
 // sum of the squared distance between the pose keypoints and the embeddings.
 int MatchEmbeddingToInstance(const int y_location, const int x_location,
-                             const float* long_offsets, const int height,
+                             const TensorView& long_offsets, const int height,
                              const int width, PoseKeypoints* poses,
                              const size_t num_poses, const int num_keypoints,
                              const int refinement_steps, const int stride) {
@@ -472,9 +507,10 @@ int MatchEmbeddingToInstance(const int y_location, const int x_location,
 
 namespace posenet_decoder_op {
 
-int DecodeAllPoses(const float* scores, const float* short_offsets,
-                   const float* mid_offsets, const int height, const int width,
-                   const int max_detections, const float score_threshold,
+int DecodeAllPoses(const TensorView& scores, const TensorView& short_offsets,
+                   const TensorView& mid_offsets, const int height,
+                   const int width, const int max_detections,
+                   const float score_threshold,
                    const int mid_short_offset_refinement_steps,
                    const float nms_radius, const int stride,
                    PoseKeypoints* pose_keypoints,
@@ -583,19 +619,93 @@ int DecodeAllPoses(const float* scores, const float* short_offsets,
   return pose_counter;
 }
 
-void DecodeInstanceMasks(const float* long_offsets, int height, int width,
+void DecodeInstanceMasks(const TensorView& long_offsets, int height, int width,
                          PoseKeypoints* poses, size_t num_poses,
                          int refinement_steps, int stride,
                          float* instance_masks) {
   std::fill(instance_masks, instance_masks + height * width * num_poses, 0.0f);
+  if (num_poses == 0) return;
   for (int y = 0; y < height; y++) {
     for (int x = 0; x < width; x++) {
       int instance_index = MatchEmbeddingToInstance(
           y, x, long_offsets, height, width, poses, num_poses, kNumKeypoints,
           refinement_steps, stride);
       if (instance_index >= 0) {
-        instance_masks[(instance_index * width + y) * height + x] = 1.0f;
+        instance_masks[(instance_index * height + y) * width + x] = 1.0f;
+      }
+    }
+  }
+}
+
+void DecodeInstanceMaskLabels(const TensorView& long_offsets, int height,
+                              int width, const PoseKeypoints* poses,
+                              size_t num_poses, int refinement_steps,
+                              int stride, float box_margin, uint8_t* labels) {
+  std::fill(labels, labels + height * width, 0);
+  num_poses = std::min<size_t>(num_poses, UINT8_MAX);
+  if (num_poses == 0) return;
+
+  // Expanded keypoint bounding boxes in block space, inclusive.
+  struct Box {
+    int y_min, x_min, y_max, x_max;
+    bool Contains(int y, int x) const {
+      return y >= y_min && y <= y_max && x >= x_min && x <= x_max;
+    }
+  };
+  std::vector<Box> boxes(num_poses);
+  Box bounds{height, width, -1, -1};
+  for (size_t k = 0; k < num_poses; k++) {
+    float y_min = poses[k].keypoint[0].y, y_max = y_min;
+    float x_min = poses[k].keypoint[0].x, x_max = x_min;
+    for (int i = 1; i < kNumKeypoints; i++) {
+      y_min = std::min(y_min, poses[k].keypoint[i].y);
+      y_max = std::max(y_max, poses[k].keypoint[i].y);
+      x_min = std::min(x_min, poses[k].keypoint[i].x);
+      x_max = std::max(x_max, poses[k].keypoint[i].x);
+    }
+    const float margin_y = box_margin * (y_max - y_min);
+    const float margin_x = box_margin * (x_max - x_min);
+    Box& box = boxes[k];
+    box.y_min = std::max(0, static_cast<int>(
+                                std::floor((y_min - margin_y) / stride)));
+    box.x_min = std::max(0, static_cast<int>(
+                                std::floor((x_min - margin_x) / stride)));
+    box.y_max = std::min(height - 1, static_cast<int>(std::ceil(
+                                         (y_max + margin_y) / stride)));
+    box.x_max = std::min(width - 1, static_cast<int>(std::ceil(
+                                        (x_max + margin_x) / stride)));
+    bounds.y_min = std::min(bounds.y_min, box.y_min);
+    bounds.x_min = std::min(bounds.x_min, box.x_min);
+    bounds.y_max = std::max(bounds.y_max, box.y_max);
+    bounds.x_max = std::max(bounds.x_max, box.x_max);
+  }
+
+  std::vector<size_t> candidates;
+  candidates.reserve(num_poses);
+  std::vector<float> dists;
+  dists.reserve(num_poses);
+  for (int y = bounds.y_min; y <= bounds.y_max; y++) {
+    for (int x = bounds.x_min; x <= bounds.x_max; x++) {
+      candidates.clear();
+      for (size_t k = 0; k < num_poses; k++) {
+        if (boxes[k].Contains(y, x)) candidates.push_back(k);
+      }
+      if (candidates.empty()) continue;
+
+      // Same sums, in the same order, as `MatchEmbeddingToInstance()`.
+      dists.assign(candidates.size(), 0.0f);
+      for (int i = 0; i < kNumKeypoints; i++) {
+        const Point embedding =
+            GetEmbedding(y, x, long_offsets, i, refinement_steps, height,
+                         width, kNumKeypoints, stride);
+        for (size_t c = 0; c < candidates.size(); c++) {
+          dists[c] += ComputeSquaredDistance(
+              embedding, poses[candidates[c]].keypoint[i]);
+        }
       }
+      const auto best = std::distance(
+          dists.begin(), std::min_element(dists.begin(), dists.end()));
+      labels[y * width + x] = static_cast<uint8_t>(candidates[best] + 1);
     }
   }
 }
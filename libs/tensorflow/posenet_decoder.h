@@ -17,6 +17,7 @@
 #ifndef LIBS_POSENET_POSENET_DECODER_H_
 #define LIBS_POSENET_POSENET_DECODER_H_
 
+#include <cstdint>
 #include <ostream>
 #include <queue>
 #include <vector>
@@ -62,6 +63,51 @@ struct PoseKeypointScores {
   float keypoint[posenet_decoder_op::kNumKeypoints];
 };
 
+// A read-only view of a decoder input tensor. Quantized values are
+// dequantized (and rescaled) one at a time as the decoder samples them, so
+// only the positions it visits are ever converted.
+class TensorView {
+ public:
+  // Views float data, scaled by `extra_scale`. Implicit, so that float arrays
+  // can be passed to the decoder functions directly.
+  TensorView(const float* data, float extra_scale = 1.0f)  // NOLINT
+      : float_data_(data), extra_scale_(extra_scale) {}
+
+  // Views uint8 data quantized with `scale` and `zero_point`, scaled by
+  // `extra_scale` once dequantized.
+  TensorView(const uint8_t* data, float scale, int zero_point,
+             float extra_scale = 1.0f)
+      : quantized_data_(data),
+        scale_(scale),
+        zero_point_(zero_point),
+        extra_scale_(extra_scale) {}
+
+  float operator[](int index) const {
+    if (quantized_data_) return Dequantize(quantized_data_[index]);
+    return float_data_[index] * extra_scale_;
+  }
+
+  // Gets the real value of the quantized value `q`.
+  float Dequantize(uint8_t q) const {
+    return (q - zero_point_) * scale_ * extra_scale_;
+  }
+
+  // Checks whether ordering the quantized values orders the real values.
+  bool quantized_monotonic() const {
+    return quantized_data_ && scale_ > 0 && extra_scale_ > 0;
+  }
+
+  // The quantized data, or nullptr for float data.
+  const uint8_t* quantized_data() const { return quantized_data_; }
+
+ private:
+  const float* float_data_ = nullptr;
+  const uint8_t* quantized_data_ = nullptr;
+  float scale_ = 1.0f;
+  int zero_point_ = 0;
+  float extra_scale_;
+};
+
 // Decodes poses from the score map, the short and mid offsets.
 // "Block space" refers to the output y and z size of the network.
 // For example if the network that takes a (353,481) (y,x) input image will have
@@ -81,9 +127,9 @@ struct PoseKeypointScores {
 // Jonathan Tompson, Kevin Murphy
 
 int DecodeAllPoses(
-    const float* scores,                    // As logits, not post sigmoid
-    const float* short_offsets,             // in block space (not pixels)
-    const float* mid_offsets,               // in block space (not pixels)
+    const TensorView& scores,               // As logits, not post sigmoid
+    const TensorView& short_offsets,        // in block space (not pixels)
+    const TensorView& mid_offsets,          // in block space (not pixels)
     int height,                             // in block space (not pixels)
     int width,                              // in block space (not pixels)
     int max_detections,                     // maximum number of poses to detect
@@ -105,10 +151,23 @@ int DecodeAllPoses(
 
 // Decodes person instance masks from decoded poses and long_offsets.
 //   long_offsets 33x33x2*kNumKeypoints (x and y per keypoint)
-void DecodeInstanceMasks(const float* long_offsets, int height, int width,
-                         PoseKeypoints* poses, size_t num_poses,
+void DecodeInstanceMasks(const TensorView& long_offsets, int height,
+                         int width, PoseKeypoints* poses, size_t num_poses,
                          int refinement_steps, int stride,
                          float* instance_masks);
+
+// Decodes person instance masks into a single height x width label map: 0
+// where no pose claims the cell, otherwise 1 + the index of the pose.
+//
+// Unlike `DecodeInstanceMasks()`, each pose only claims cells within the
+// bounding box of its keypoints, expanded on each side by `box_margin` times
+// the box size, and cells outside all boxes are never visited. The embedding
+// of a cell is computed once and matched against every pose whose box
+// contains it. Poses past the 255th are ignored.
+void DecodeInstanceMaskLabels(const TensorView& long_offsets, int height,
+                              int width, const PoseKeypoints* poses,
+                              size_t num_poses, int refinement_steps,
+                              int stride, float box_margin, uint8_t* labels);
 }  // namespace posenet_decoder_op
 
 // Defines a 2-D keypoint with (x, y) float coordinates and its type id.
@@ -161,20 +220,20 @@ void BuildBilinearInterpolation(const float y, const float x, const int height,
                                 int* bottom_right, float* y_lerp,
                                 float* x_lerp);
 
-void SampleTensorAtMultipleChannels(const float* tensor, const int height,
-                                    const int width, const int num_channels,
-                                    const float y, const float x,
-                                    const int* result_channels,
-                                    const size_t n_result_channels,
-                                    float* result);
+void SampleTensorAtMultipleChannels(
+    const posenet_decoder_op::TensorView& tensor, const int height,
+    const int width, const int num_channels, const float y, const float x,
+    const int* result_channels, const size_t n_result_channels, float* result);
 
-float SampleTensorAtSingleChannel(const float* tensor, const int height,
-                                  const int width, const int num_channels,
+float SampleTensorAtSingleChannel(const posenet_decoder_op::TensorView& tensor,
+                                  const int height, const int width,
+                                  const int num_channels,
                                   const posenet_decoder_op::Point& point,
                                   const int c);
 
 posenet_decoder_op::Point FindDisplacedPosition(
-    const float* short_offsets, const float* mid_offsets, const int height,
+    const posenet_decoder_op::TensorView& short_offsets,
+    const posenet_decoder_op::TensorView& mid_offsets, const int height,
     const int width, const int num_keypoints, const int num_edges,
     const posenet_decoder_op::Point& source, const int edge_id,
     const int target_id, const int mid_short_offset_refinement_steps);
@@ -182,20 +241,24 @@ posenet_decoder_op::Point FindDisplacedPosition(
 AdjacencyList BuildAdjacencyList();
 
 void BacktrackDecodePose(
-    const float* scores, const float* short_offsets, const float* mid_offsets,
-    const int height, const int width, const int num_keypoints,
-    const int num_edges, const KeypointWithScore& root,
-    const AdjacencyList& adjacency_list,
+    const posenet_decoder_op::TensorView& scores,
+    const posenet_decoder_op::TensorView& short_offsets,
+    const posenet_decoder_op::TensorView& mid_offsets, const int height,
+    const int width, const int num_keypoints, const int num_edges,
+    const KeypointWithScore& root, const AdjacencyList& adjacency_list,
     const int mid_short_offset_refinement_steps,
     posenet_decoder_op::PoseKeypoints* pose_keypoints,
     posenet_decoder_op::PoseKeypointScores* keypoint_scores);
 
-void BuildKeypointWithScoreQueue(const float* scores,
-                                 const float* short_offsets, const int height,
-                                 const int width, const int num_keypoints,
-                                 const float score_threshold,
-                                 const int local_maximum_radius,
-                                 DecreasingScoreKeypointPriorityQueue* queue);
+// Queues the keypoints whose score is at least `score_threshold` and maximal
+// within `local_maximum_radius`. Quantized scores are compared as stored, and
+// only the queued keypoints are dequantized.
+void BuildKeypointWithScoreQueue(
+    const posenet_decoder_op::TensorView& scores,
+    const posenet_decoder_op::TensorView& short_offsets, const int height,
+    const int width, const int num_keypoints, const float score_threshold,
+    const int local_maximum_radius,
+    DecreasingScoreKeypointPriorityQueue* queue);
 
 bool PassKeypointNMS(const posenet_decoder_op::PoseKeypoints* poses,
                      const size_t n_poses, const KeypointWithScore& keypoint,
@@ -218,16 +281,17 @@ float ComputeSumSquaredDistance(
     const posenet_decoder_op::PoseKeypoints& pose);
 
 posenet_decoder_op::Point GetEmbedding(
-    const int y_location, const int x_location, const float* long_offsets,
+    const int y_location, const int x_location,
+    const posenet_decoder_op::TensorView& long_offsets,
     const int keypoint_index, const int refinement_steps, const int height,
     const int width, const int num_keypoints, const int stride);
 
-int MatchEmbeddingToInstance(const int y_location, const int x_location,
-                             const float* long_offsets, const int height,
-                             const int width,
-                             posenet_decoder_op::PoseKeypoints* poses,
-                             const size_t num_poses, const int num_keypoints,
-                             const int refinement_steps, const int stride);
+int MatchEmbeddingToInstance(
+    const int y_location, const int x_location,
+    const posenet_decoder_op::TensorView& long_offsets, const int height,
+    const int width, posenet_decoder_op::PoseKeypoints* poses,
+    const size_t num_poses, const int num_keypoints,
+    const int refinement_steps, const int stride);
 
 }  // namespace coralmicro
 
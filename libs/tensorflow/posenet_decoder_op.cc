@@ -49,25 +49,28 @@ constexpr int kOutputTensorPoseScores = 2;
 constexpr int kOutputTensorPoseCount = 3;
 constexpr int kOutputTensorInstanceMasks = 4;
 
+// Expansion of the keypoint bounding boxes for `PosenetMaskFormat::kLabels`,
+// relative to their size.
+constexpr float kMaskBoxMargin = 0.25f;
+
 struct OpData {
   // Decoder parameters
   int max_detections;
   float score_threshold;
   int stride;
   float nms_radius;
+  PosenetMaskFormat mask_format;
 
-  // Temporary tensors (e.g for dequantized values)
-  void* heatmaps_float_ptr;
-  void* shorts_float_ptr;
-  void* mids_float_ptr;
-  void* longs_float_ptr;
-
+  // Quantization parameters of uint8 inputs, which are dequantized as they
+  // are sampled by the decoder.
   int zero_point[kNumInputs];
   float scale[kNumInputs];
 };
 
+template <PosenetMaskFormat kMaskFormat>
 void* Init(TfLiteContext* context, const char* buffer, size_t length) {
   auto* op_data = new OpData;
+  op_data->mask_format = kMaskFormat;
   const uint8_t* buffer_t = reinterpret_cast<const uint8_t*>(buffer);
   const flexbuffers::Map& m = flexbuffers::GetRoot(buffer_t, length).AsMap();
 
@@ -83,39 +86,15 @@ void Free(TfLiteContext* context, void* buffer) {
   delete reinterpret_cast<OpData*>(buffer);
 }
 
-TfLiteStatus PrepTempTensor(TfLiteContext* context, void** temp_tensor_ptr,
-                            const TfLiteIntArray* dims) {
-  int bytes = sizeof(float);
-  for (int i = 0; i < dims->size; ++i) {
-    bytes *= dims->data[i];
-  }
-  *temp_tensor_ptr = context->AllocatePersistentBuffer(context, bytes);
-  if (*temp_tensor_ptr) {
-    return kTfLiteOk;
-  } else {
-    return kTfLiteError;
-  }
-}
-
-void DequantizeTensor(const TfLiteEvalTensor* src, void* dst,
-                      const OpData* op_data, const int tensor_type,
-                      float extra_scale = 1.0) {
-  if (tensor_type >= kNumInputs || tensor_type < 0) {
-    assert(false);
-  }
-  if (src->type == kTfLiteUInt8) {
-    const int num_elements = tflite::micro::GetTensorShape(src).FlatSize();
-    const uint8_t* src_data = tflite::micro::GetTensorData<uint8_t>(src);
-    assert(src_data != nullptr);
-    float* dst_data = reinterpret_cast<float*>(dst);
-    assert(dst_data != nullptr);
-    for (int idx = 0; idx < num_elements; ++idx) {
-      dst_data[idx] = (src_data[idx] - op_data->zero_point[tensor_type]) *
-                      op_data->scale[tensor_type] * extra_scale;
-    }
-  } else {
-    assert(false);
+// Views an input tensor, dequantized (and rescaled) on demand.
+TensorView InputView(const TfLiteEvalTensor* tensor, const OpData* op_data,
+                     const int tensor_type, float extra_scale = 1.0) {
+  if (tensor->type == kTfLiteUInt8) {
+    return TensorView(tflite::micro::GetTensorData<uint8_t>(tensor),
+                      op_data->scale[tensor_type],
+                      op_data->zero_point[tensor_type], extra_scale);
   }
+  return TensorView(tflite::micro::GetTensorData<float>(tensor), extra_scale);
 }
 
 TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
@@ -154,17 +133,10 @@ TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
   TF_LITE_ENSURE_EQ(context, shorts->dims->data[3], 2 * kNumKeypoints);
   TF_LITE_ENSURE_EQ(context, mids->dims->data[3], 2 * 2 * kNumEdges);
 
-  TF_LITE_ENSURE_OK(
-      context,
-      PrepTempTensor(context, &op_data->heatmaps_float_ptr, heatmaps->dims));
   op_data->scale[kInputTensorHeatmaps] = heatmaps->params.scale;
   op_data->zero_point[kInputTensorHeatmaps] = heatmaps->params.zero_point;
-  TF_LITE_ENSURE_OK(context, PrepTempTensor(context, &op_data->shorts_float_ptr,
-                                            shorts->dims));
   op_data->scale[kInputTensorShortOffsets] = shorts->params.scale;
   op_data->zero_point[kInputTensorShortOffsets] = shorts->params.zero_point;
-  TF_LITE_ENSURE_OK(
-      context, PrepTempTensor(context, &op_data->mids_float_ptr, mids->dims));
   op_data->scale[kInputTensorMidOffsets] = mids->params.scale;
   op_data->zero_point[kInputTensorMidOffsets] = mids->params.zero_point;
 
@@ -178,11 +150,21 @@ TfLiteStatus Prepare(TfLiteContext* context, TfLiteNode* node) {
     TF_LITE_ENSURE_EQ(context, longs->dims->data[0], 1);
     TF_LITE_ENSURE_EQ(context, longs->dims->data[3], 2 * kNumKeypoints);
 
-    TF_LITE_ENSURE_OK(
-        context,
-        PrepTempTensor(context, &op_data->longs_float_ptr, longs->dims));
     op_data->scale[kInputTensorLongOffsets] = longs->params.scale;
     op_data->zero_point[kInputTensorLongOffsets] = longs->params.zero_point;
+
+    TfLiteTensor* instance_masks = micro_context->AllocateTempOutputTensor(
+        node, kOutputTensorInstanceMasks);
+    TF_LITE_ENSURE(context, instance_masks != nullptr);
+    if (op_data->mask_format == PosenetMaskFormat::kFloat) {
+      TF_LITE_ENSURE_EQ(context, instance_masks->type, kTfLiteFloat32);
+    } else {
+      TF_LITE_ENSURE(context,
+                     instance_masks->bytes >=
+                         static_cast<size_t>(longs->dims->data[1] *
+                                             longs->dims->data[2]));
+    }
+    micro_context->DeallocateTempTfLiteTensor(instance_masks);
     micro_context->DeallocateTempTfLiteTensor(longs);
   }
 
@@ -207,19 +189,13 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
       tflite::micro::GetEvalInput(context, node, kInputTensorMidOffsets);
   TF_LITE_ENSURE(context, mids != nullptr);
 
-  // Dequantize (and rescale) input tensors
-  DequantizeTensor(heatmaps, op_data->heatmaps_float_ptr, op_data,
-                   kInputTensorHeatmaps);
-  DequantizeTensor(shorts, op_data->shorts_float_ptr, op_data,
-                   kInputTensorShortOffsets, 1.0 / op_data->stride);
-  DequantizeTensor(mids, op_data->mids_float_ptr, op_data,
-                   kInputTensorMidOffsets, 1.0 / op_data->stride);
-
-  const float* heatmaps_data =
-      reinterpret_cast<float*>(op_data->heatmaps_float_ptr);
-  const float* shorts_data =
-      reinterpret_cast<float*>(op_data->shorts_float_ptr);
-  const float* mids_data = reinterpret_cast<float*>(op_data->mids_float_ptr);
+  // View (and rescale) input tensors
+  const TensorView heatmaps_data =
+      InputView(heatmaps, op_data, kInputTensorHeatmaps);
+  const TensorView shorts_data = InputView(
+      shorts, op_data, kInputTensorShortOffsets, 1.0 / op_data->stride);
+  const TensorView mids_data =
+      InputView(mids, op_data, kInputTensorMidOffsets, 1.0 / op_data->stride);
 
   TfLiteEvalTensor* pose_keypoints =
       tflite::micro::GetEvalOutput(context, node, kOutputTensorPoseKeypoints);
@@ -256,22 +232,28 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
     const TfLiteEvalTensor* longs =
         tflite::micro::GetEvalInput(context, node, kInputTensorLongOffsets);
     TF_LITE_ENSURE(context, longs != nullptr);
-    DequantizeTensor(longs, op_data->longs_float_ptr, op_data,
-                     kInputTensorLongOffsets, 1.0 / op_data->stride);
-    const float* longs_data =
-        reinterpret_cast<float*>(op_data->longs_float_ptr);
+    const TensorView longs_data = InputView(
+        longs, op_data, kInputTensorLongOffsets, 1.0 / op_data->stride);
     TfLiteEvalTensor* instance_masks =
         tflite::micro::GetEvalOutput(context, node, kOutputTensorInstanceMasks);
     TF_LITE_ENSURE(context, instance_masks != nullptr);
-    float* instance_masks_data =
-        tflite::micro::GetTensorData<float>(instance_masks);
-
-    DecodeInstanceMasks(longs_data, /*height = */ longs->dims->data[1],
-                        /*width = */ longs->dims->data[2],
-                        reinterpret_cast<PoseKeypoints*>(pose_keypoints_data),
-                        /*num_poses = */ pose_count_data[0],
-                        /*refinement_steps = */ 2, op_data->stride,
-                        instance_masks_data);
+
+    if (op_data->mask_format == PosenetMaskFormat::kLabels) {
+      DecodeInstanceMaskLabels(
+          longs_data, /*height = */ longs->dims->data[1],
+          /*width = */ longs->dims->data[2],
+          reinterpret_cast<PoseKeypoints*>(pose_keypoints_data),
+          /*num_poses = */ pose_count_data[0],
+          /*refinement_steps = */ 2, op_data->stride, kMaskBoxMargin,
+          tflite::micro::GetTensorData<uint8_t>(instance_masks));
+    } else {
+      DecodeInstanceMasks(longs_data, /*height = */ longs->dims->data[1],
+                          /*width = */ longs->dims->data[2],
+                          reinterpret_cast<PoseKeypoints*>(pose_keypoints_data),
+                          /*num_poses = */ pose_count_data[0],
+                          /*refinement_steps = */ 2, op_data->stride,
+                          tflite::micro::GetTensorData<float>(instance_masks));
+    }
   }
 
   return kTfLiteOk;
@@ -279,11 +261,17 @@ TfLiteStatus Eval(TfLiteContext* context, TfLiteNode* node) {
 
 }  // namespace posenet_decoder_op
 
-TfLiteRegistration* RegisterPosenetDecoderOp() {
-  static TfLiteRegistration r = {
-      posenet_decoder_op::Init, posenet_decoder_op::Free,
-      posenet_decoder_op::Prepare, posenet_decoder_op::Eval};
-  return &r;
+TfLiteRegistration* RegisterPosenetDecoderOp(PosenetMaskFormat mask_format) {
+  static TfLiteRegistration float_masks = {
+      posenet_decoder_op::Init<PosenetMaskFormat::kFloat>,
+      posenet_decoder_op::Free, posenet_decoder_op::Prepare,
+      posenet_decoder_op::Eval};
+  static TfLiteRegistration mask_labels = {
+      posenet_decoder_op::Init<PosenetMaskFormat::kLabels>,
+      posenet_decoder_op::Free, posenet_decoder_op::Prepare,
+      posenet_decoder_op::Eval};
+  return mask_format == PosenetMaskFormat::kLabels ? &mask_labels
+                                                   : &float_masks;
 }
 
 }  // namespace coralmicro
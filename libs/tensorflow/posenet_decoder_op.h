@@ -25,10 +25,28 @@ namespace coralmicro {
 // `tflite::MicroMutableOpResolver::AddCustom()`.
 inline constexpr char kPosenetDecoderOp[] = "PosenetDecoderOp";
 
+// Formats of the instance masks that the PoseNet decoder op writes for models
+// with a long-range offsets output, such as BodyPix.
+enum class PosenetMaskFormat {
+  // One float mask per detected pose, as declared by the model: every cell of
+  // the frame is 1.0 in the mask of the pose its embedding is nearest to.
+  kFloat,
+  // A single uint8 label map of height x width cells at the start of the mask
+  // output tensor: 0 for background, otherwise 1 + the index of the pose. A
+  // pose only claims cells near its keypoints (within their bounding box,
+  // expanded by a quarter of its size on each side), which is much faster to
+  // decode than `kFloat`. The tensor keeps its declared type, so read its
+  // data as `uint8_t`.
+  kLabels,
+};
+
 // Returns pointer to an instance of `tflite::TfLiteRegistration` to handle the
 // custom op for post-processing PoseNet output tensors on the MCU. Pass this to
 // `tflite::MicroMutableOpResolver::AddCustom()`.
-TfLiteRegistration* RegisterPosenetDecoderOp();
+//
+// @param mask_format The format of the instance masks, if the model has them.
+TfLiteRegistration* RegisterPosenetDecoderOp(
+    PosenetMaskFormat mask_format = PosenetMaskFormat::kFloat);
 
 }  // namespace coralmicro
 
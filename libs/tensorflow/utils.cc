@@ -16,81 +16,147 @@
 
 #include "libs/tensorflow/utils.h"
 
-#include "third_party/tflite-micro/tensorflow/lite/micro/kernels/kernel_runner.h"
-#include "third_party/tflite-micro/tensorflow/lite/micro/micro_interpreter.h"
-#include "third_party/tflite-micro/tensorflow/lite/micro/test_helpers.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
 
 namespace coralmicro::tensorflow {
+namespace {
+// Same source index as TFLM's RESIZE_NEAREST_NEIGHBOR with `align_corners`
+// and `half_pixel_centers` both false.
+inline int NearestIndex(int i, float scale, int in_size) {
+  return std::min(static_cast<int>(std::floor(i * scale)), in_size - 1);
+}
 
-bool ResizeImage(const ImageDims& in_dims, const uint8_t* uin,
-                 const ImageDims& out_dims, uint8_t* uout) {
-  if (in_dims == out_dims) {
-    memcpy(uout, uin, ImageSize(in_dims));
-    return true;
+// Source indices and 8.8 fixed-point weight of `i1` for bilinear sampling
+// with half-pixel centers.
+inline void BilinearIndex(int i, float scale, int in_size, int* i0, int* i1,
+                          uint32_t* w1) {
+  float center = std::max(0.0f, (i + 0.5f) * scale - 0.5f);
+  *i0 = static_cast<int>(center);
+  if (*i0 >= in_size - 1) {
+    *i0 = *i1 = in_size - 1;
+    *w1 = 0;
+    return;
   }
+  *i1 = *i0 + 1;
+  *w1 = static_cast<uint32_t>((center - *i0) * 256 + 0.5f);
+}
 
-  // TODO(dkovalev): Implement resizing in a more efficient way. TFLM doesn't
-  // support uint8, int8 is required for all operations.
-  const auto in_size = ImageSize(in_dims);
-  auto in_tmp = std::make_unique<int8_t[]>(in_size);
-  int8_t* in = in_tmp.get();
-
-  const auto out_size = ImageSize(out_dims);
-  auto out_tmp = std::make_unique<int8_t[]>(out_size);
-  int8_t* out = out_tmp.get();
-
-  for (int i = 0; i < in_size; ++i) in[i] = static_cast<int>(uin[i]) - 128;
-
-  // Array with 4 values: batch, rows, columns, depth
-  int input_dims_ints[] = {4, 1, in_dims.height, in_dims.width, in_dims.depth};
-  TfLiteIntArray* input_dims =
-      tflite::testing::IntArrayFromInts(input_dims_ints);
-  // Array with 1 value: the number of dimensions.
-  int size_dims_ints[] = {1, 2};
-  TfLiteIntArray* size_dims = tflite::testing::IntArrayFromInts(size_dims_ints);
-  // Array with 4 values: batch, rows, columns, depth
-  int output_dims_ints[] = {4, 1, out_dims.height, out_dims.width,
-                            out_dims.depth};
-  TfLiteIntArray* output_dims =
-      tflite::testing::IntArrayFromInts(output_dims_ints);
-
-  constexpr int tensors_size = 3;
-  int32_t expected_size[] = {out_dims.height, out_dims.width};
-  TfLiteTensor tensors[tensors_size] = {
-      tflite::testing::CreateQuantizedTensor(in, input_dims, 0, 255),
-      tflite::testing::CreateTensor(expected_size, size_dims),
-      tflite::testing::CreateQuantizedTensor(out, output_dims, 0, 255)};
-  tensors[1].allocation_type = kTfLiteMmapRo;
-
-  // Array with 2 values, representing the indices of the input tensors in the
-  // tensors array.
-  int inputs_ints[] = {2, 0, 1};
-  TfLiteIntArray* inputs = tflite::testing::IntArrayFromInts(inputs_ints);
-  // Array with 1 value, representing the indices of the output tensors in the
-  // tensors array.
-  int outputs_ints[] = {1, 2};
-  TfLiteIntArray* outputs = tflite::testing::IntArrayFromInts(outputs_ints);
+// Output value mappings for the resize functions.
+struct Identity {
+  uint8_t operator()(uint8_t value) const { return value; }
+};
+
+struct Lookup {
+  const uint8_t* lut;
+  uint8_t operator()(uint8_t value) const { return lut[value]; }
+};
+
+template <typename Map>
+void ResizeNearestNeighbor(const ImageDims& in_dims, const uint8_t* in,
+                           const ImageDims& out_dims, uint8_t* out, Map map) {
+  const int depth = in_dims.depth;
+  const int in_stride = in_dims.width * depth;
+  const float scale_y = static_cast<float>(in_dims.height) / out_dims.height;
+  const float scale_x = static_cast<float>(in_dims.width) / out_dims.width;
+  for (int y = 0; y < out_dims.height; ++y) {
+    const uint8_t* in_row =
+        in + NearestIndex(y, scale_y, in_dims.height) * in_stride;
+    for (int x = 0; x < out_dims.width; ++x) {
+      const uint8_t* src =
+          in_row + NearestIndex(x, scale_x, in_dims.width) * depth;
+      for (int c = 0; c < depth; ++c) *out++ = map(src[c]);
+    }
+  }
+}
 
-  TfLiteResizeNearestNeighborParams params = {false, /* align_corners */
-                                              false /* half_pixel_centers */};
+template <typename Map>
+void ResizeBilinear(const ImageDims& in_dims, const uint8_t* in,
+                    const ImageDims& out_dims, uint8_t* out, Map map) {
+  const int depth = in_dims.depth;
+  const int in_stride = in_dims.width * depth;
+  const float scale_y = static_cast<float>(in_dims.height) / out_dims.height;
+  const float scale_x = static_cast<float>(in_dims.width) / out_dims.width;
+  for (int y = 0; y < out_dims.height; ++y) {
+    int y0, y1;
+    uint32_t wy;
+    BilinearIndex(y, scale_y, in_dims.height, &y0, &y1, &wy);
+    const uint8_t* top = in + y0 * in_stride;
+    const uint8_t* bottom = in + y1 * in_stride;
+    for (int x = 0; x < out_dims.width; ++x) {
+      int x0, x1;
+      uint32_t wx;
+      BilinearIndex(x, scale_x, in_dims.width, &x0, &x1, &wx);
+      x0 *= depth;
+      x1 *= depth;
+      for (int c = 0; c < depth; ++c) {
+        // Both weights are 8.8, so the sum is 16.16.
+        uint32_t t = top[x0 + c] * (256 - wx) + top[x1 + c] * wx;
+        uint32_t b = bottom[x0 + c] * (256 - wx) + bottom[x1 + c] * wx;
+        *out++ = map((t * (256 - wy) + b * wy + (1 << 15)) >> 16);
+      }
+    }
+  }
+}
 
-  tflite::micro::KernelRunner runner(
-      tflite::ops::micro::Register_RESIZE_NEAREST_NEIGHBOR(), tensors,
-      tensors_size, inputs, outputs, &params);
+template <typename Map>
+bool ResizeImageWith(const ImageDims& in_dims, const uint8_t* uin,
+                     const ImageDims& out_dims, uint8_t* uout,
+                     ResizeMethod method, Map map) {
+  switch (method) {
+    case ResizeMethod::kNearestNeighbor:
+      ResizeNearestNeighbor(in_dims, uin, out_dims, uout, map);
+      return true;
+    case ResizeMethod::kBilinear:
+      ResizeBilinear(in_dims, uin, out_dims, uout, map);
+      return true;
+  }
+  return false;
+}
+}  // namespace
 
-  if (runner.InitAndPrepare() != kTfLiteOk) {
-    printf("failed to init and prepare\r\n");
+bool ResizeImage(const ImageDims& in_dims, const uint8_t* uin,
+                 const ImageDims& out_dims, uint8_t* uout,
+                 ResizeMethod method, const uint8_t* lut) {
+  if (in_dims.depth != out_dims.depth || ImageSize(in_dims) <= 0 ||
+      ImageSize(out_dims) <= 0) {
+    printf("invalid resize dimensions\r\n");
     return false;
   }
 
-  if (runner.Invoke() != kTfLiteOk) {
-    printf("failed to invoke\r\n");
-    return false;
+  if (in_dims == out_dims) {
+    if (lut) {
+      for (int i = 0; i < ImageSize(in_dims); ++i) uout[i] = lut[uin[i]];
+    } else {
+      memcpy(uout, uin, ImageSize(in_dims));
+    }
+    return true;
   }
 
-  for (int i = 0; i < out_size; ++i) uout[i] = static_cast<int>(out[i]) + 128;
+  if (lut) {
+    return ResizeImageWith(in_dims, uin, out_dims, uout, method, Lookup{lut});
+  }
+  return ResizeImageWith(in_dims, uin, out_dims, uout, method, Identity());
+}
 
-  return true;
+int QuantizedThreshold(float threshold, float scale, float zero_point, int min,
+                       int max) {
+  auto value = [scale, zero_point](int q) { return scale * (q - zero_point); };
+  const float estimate = zero_point + threshold / scale;
+  int q;
+  if (!(estimate > min)) {
+    q = min;
+  } else if (estimate > max) {
+    q = max + 1;
+  } else {
+    q = static_cast<int>(std::ceil(estimate));
+  }
+  // Fix rounding errors of the estimate.
+  while (q > min && value(q - 1) >= threshold) --q;
+  while (q <= max && value(q) < threshold) ++q;
+  return q;
 }
 
 }  // namespace coralmicro::tensorflow
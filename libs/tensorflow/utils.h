@@ -17,6 +17,9 @@
 #ifndef LIBS_TENSORFLOW_UTILS_H_
 #define LIBS_TENSORFLOW_UTILS_H_
 
+#include <limits>
+#include <vector>
+
 #include "libs/tpu/edgetpu_manager.h"
 #include "libs/tpu/edgetpu_op.h"
 #include "third_party/tflite-micro/tensorflow/lite/micro/micro_error_reporter.h"
@@ -64,13 +67,57 @@ inline int ImageSize(const ImageDims& dims) {
   return dims.height * dims.width * dims.depth;
 }
 
+// Image resampling method for `ResizeImage()`.
+enum class ResizeMethod {
+  // Matches TensorFlow's nearest-neighbor resize (without aligned corners or
+  // half-pixel centers).
+  kNearestNeighbor,
+  // Bilinear interpolation with half-pixel centers, in fixed point.
+  kBilinear,
+};
+
 // Resizes a bitmap image.
+//
+// The image is resized directly into `uout`, without any allocation. Both
+// images must have the same depth (number of channels), which can be any
+// value.
+//
 // @param in_dims The current dimensions for image `uin`.
 // @param uin The input image location.
 // @param out_dims The desired dimensions for image `uout`.
 // @param uout The output image location.
+// @param method The resampling method.
+// @param lut An optional 256-entry table applied to every output value as it
+//   is written, such as `ClassificationPreprocessor::lut()`.
+// @return True on success, false if the dimensions are invalid.
 bool ResizeImage(const ImageDims& in_dims, const uint8_t* uin,
-                 const ImageDims& out_dims, uint8_t* uout);
+                 const ImageDims& out_dims, uint8_t* uout,
+                 ResizeMethod method = ResizeMethod::kNearestNeighbor,
+                 const uint8_t* lut = nullptr);
+
+// Gets the smallest quantized value in [`min`, `max`] whose dequantized value
+// is at least `threshold`, so that comparing quantized values against it agrees
+// exactly with comparing the values `Dequantize()` gives against `threshold`.
+//
+// @param threshold The dequantized threshold.
+// @param scale The scale of the quantized values.
+// @param zero_point The zero point of the quantized values.
+// @param min The lowest quantized value.
+// @param max The highest quantized value.
+// @return The quantized threshold, or `max + 1` if no value reaches
+//   `threshold`.
+int QuantizedThreshold(float threshold, float scale, float zero_point, int min,
+                       int max);
+
+// Gets the quantized threshold for the values of a tensor of type `T`.
+// See the function above.
+template <typename T>
+int QuantizedThreshold(const TfLiteTensor& tensor, float threshold) {
+  return QuantizedThreshold(threshold, tensor.params.scale,
+                            tensor.params.zero_point,
+                            std::numeric_limits<T>::min(),
+                            std::numeric_limits<T>::max());
+}
 
 // Gets the size of a tensor.
 // @param tensor The tensor to get the size.
@@ -405,26 +405,34 @@ void RunClassificationModel(struct jsonrpc_request* request) {
   auto* input_tensor = interpreter.input_tensor(0);
   bool needs_preprocessing =
       tensorflow::ClassificationInputNeedsPreprocessing(*input_tensor);
+  tensorflow::ImageDims image_dims = {image_height, image_width, image_depth};
   uint64_t preprocess_latency = 0;
   if (needs_preprocessing) {
+    // Resize into input tensor and normalize in the same pass.
     auto preprocess_start = coralmicro::TimerMicros();
-    if (!tensorflow::ClassificationPreprocess(input_tensor)) {
+    tensorflow::ClassificationPreprocessor preprocessor(*input_tensor);
+    if (!preprocessor.valid()) {
       jsonrpc_return_error(request, -1, "input preprocessing failed", nullptr);
       return;
     }
+    if (!preprocessor.CopyToTensor(image_dims, image_resource->data(),
+                                   input_tensor)) {
+      jsonrpc_return_error(request, -1, "failed to resize input", nullptr);
+      return;
+    }
     auto preprocess_end = coralmicro::TimerMicros();
     preprocess_latency = preprocess_end - preprocess_start;
-  }
-
-  // Resize into input tensor
-  tensorflow::ImageDims input_tensor_dims = {input_tensor->dims->data[1],
-                                             input_tensor->dims->data[2],
-                                             input_tensor->dims->data[3]};
-  if (!tensorflow::ResizeImage({image_height, image_width, image_depth},
-                               image_resource->data(), input_tensor_dims,
-                               tflite::GetTensorData<uint8_t>(input_tensor))) {
-    jsonrpc_return_error(request, -1, "failed to resize input", nullptr);
-    return;
+  } else {
+    // Resize into input tensor
+    tensorflow::ImageDims input_tensor_dims = {input_tensor->dims->data[1],
+                                               input_tensor->dims->data[2],
+                                               input_tensor->dims->data[3]};
+    auto* input_tensor_data = tflite::GetTensorData<uint8_t>(input_tensor);
+    if (!tensorflow::ResizeImage(image_dims, image_resource->data(),
+                                 input_tensor_dims, input_tensor_data)) {
+      jsonrpc_return_error(request, -1, "failed to resize input", nullptr);
+      return;
+    }
   }
 
   // The first Invoke is slow due to model transfer. Run an Invoke
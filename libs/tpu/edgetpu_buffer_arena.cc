@@ -0,0 +1,83 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_buffer_arena.h"
+
+#include "libs/base/check.h"
+
+namespace coralmicro {
+namespace {
+size_t AlignUp(size_t value) {
+  return (value + EdgeTpuBufferArena::kAlignment - 1) &
+         ~(EdgeTpuBufferArena::kAlignment - 1);
+}
+}  // namespace
+
+EdgeTpuBufferArena::EdgeTpuBufferArena(uint8_t* buffer, size_t size) {
+  auto address = reinterpret_cast<uintptr_t>(buffer);
+  size_t padding = AlignUp(address) - address;
+  base_ = buffer + padding;
+  size_ = size > padding ? (size - padding) & ~(kAlignment - 1) : 0;
+  if (size_) blocks_.push_back({0, size_, false});
+}
+
+uint8_t* EdgeTpuBufferArena::Allocate(size_t size) {
+  size = AlignUp(size ? size : 1);
+  for (size_t i = 0; i < blocks_.size(); ++i) {
+    auto& block = blocks_[i];
+    if (block.used || block.size < size) continue;
+
+    if (block.size > size) {
+      blocks_.insert(blocks_.begin() + i + 1,
+                     {block.offset + size, block.size - size, false});
+    }
+    // The insertion may have moved the blocks.
+    auto& allocated = blocks_[i];
+    allocated.size = size;
+    allocated.used = true;
+    return base_ + allocated.offset;
+  }
+  return nullptr;
+}
+
+void EdgeTpuBufferArena::Free(uint8_t* buffer) {
+  CHECK(Contains(buffer));
+  const size_t offset = buffer - base_;
+  size_t i = 0;
+  while (i < blocks_.size() && blocks_[i].offset != offset) ++i;
+  CHECK(i < blocks_.size() && blocks_[i].used);
+  blocks_[i].used = false;
+
+  // Merge with the free neighbors.
+  if (i + 1 < blocks_.size() && !blocks_[i + 1].used) {
+    blocks_[i].size += blocks_[i + 1].size;
+    blocks_.erase(blocks_.begin() + i + 1);
+  }
+  if (i > 0 && !blocks_[i - 1].used) {
+    blocks_[i - 1].size += blocks_[i].size;
+    blocks_.erase(blocks_.begin() + i);
+  }
+}
+
+size_t EdgeTpuBufferArena::FreeBytes() const {
+  size_t free_bytes = 0;
+  for (const auto& block : blocks_) {
+    if (!block.used) free_bytes += block.size;
+  }
+  return free_bytes;
+}
+
+}  // namespace coralmicro
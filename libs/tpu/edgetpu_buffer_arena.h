@@ -0,0 +1,77 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_BUFFER_ARENA_H_
+#define LIBS_TPU_EDGETPU_BUFFER_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace coralmicro {
+
+// A caller-supplied memory region for the buffers that Edge TPU packages
+// receive output activations into, so you control whether they live in
+// OCRAM or SDRAM. Pass it to `EdgeTpuManager::SetBufferArena()`.
+//
+// Buffers are aligned to, and sized in multiples of, the 32-byte cache line,
+// which lets the USB controller write outputs into them directly. Freed
+// buffers are returned to the arena, so models can be swapped at runtime.
+//
+// The arena keeps its bookkeeping outside of `buffer`, and is not
+// thread-safe; `EdgeTpuManager` serializes access to it.
+class EdgeTpuBufferArena {
+ public:
+  static constexpr size_t kAlignment = 32;
+
+  // @param buffer The memory to allocate from. It must outlive the arena.
+  // @param size The size of `buffer` in bytes.
+  EdgeTpuBufferArena(uint8_t* buffer, size_t size);
+  EdgeTpuBufferArena(const EdgeTpuBufferArena&) = delete;
+  EdgeTpuBufferArena& operator=(const EdgeTpuBufferArena&) = delete;
+
+  // Allocates `size` bytes, or returns nullptr if no free block is large
+  // enough.
+  uint8_t* Allocate(size_t size);
+
+  // Returns a buffer obtained from `Allocate()` to the arena.
+  void Free(uint8_t* buffer);
+
+  // Returns true if `buffer` points into the arena.
+  bool Contains(const uint8_t* buffer) const {
+    return buffer >= base_ && buffer < base_ + size_;
+  }
+
+  // Gets the number of bytes not allocated.
+  size_t FreeBytes() const;
+
+ private:
+  // A range of the arena, either allocated or free. Together the blocks
+  // cover the whole arena, in address order.
+  struct Block {
+    size_t offset;
+    size_t size;
+    bool used;
+  };
+
+  uint8_t* base_;
+  size_t size_;
+  std::vector<Block> blocks_;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_BUFFER_ARENA_H_
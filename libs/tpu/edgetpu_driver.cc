@@ -16,9 +16,12 @@
 
 #include "libs/tpu/edgetpu_driver.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 
 #include "libs/base/check.h"
+#include "libs/base/timer.h"
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/config/beagle_csr_helper.h"
 #include "libs/tpu/darwinn/driver/config/common_csr_helper.h"
@@ -29,79 +32,238 @@
 
 namespace coralmicro {
 namespace {
-constexpr uint8_t kSingleBulkOutEndpoint = 1;
-constexpr uint8_t kEventInEndpoint = 2;
-constexpr uint8_t kInterruptInEndpoint = 3;
 constexpr uint32_t kMaxBulkBufferSize = 32 * 1024;
+constexpr size_t kPacketHeaderRawDataSizeInBytes = 8;
+// Line size of the M7 data cache.
+constexpr uintptr_t kCacheLineSize = 32;
+// Bounce buffer for caller buffers the USB controller can't use in place.
+// Bulk in transfers use all of it, while queued bulk out transfers each use a
+// slice; the two never overlap because bulk out is flushed before reading.
+__attribute__((aligned(kCacheLineSize)))
 uint8_t BulkTransferBuffer[kMaxBulkBufferSize];
+constexpr size_t kEventSizeBytes = 16;
+constexpr size_t kInterruptSizeBytes = 4;
+// Receive buffers of the event and interrupt listeners, a cache line each.
+__attribute__((aligned(kCacheLineSize))) uint8_t EventBuffer[kCacheLineSize];
+__attribute__((aligned(kCacheLineSize)))
+uint8_t InterruptBuffer[kCacheLineSize];
+// Task notification index used to wake `ReadEvent()`; index 0 belongs to
+// stream and message buffers.
+constexpr UBaseType_t kEventNotification = 1;
+constexpr TickType_t kEventTimeout = pdMS_TO_TICKS(200);
+// Data stages of the control transfers in flight, one register each.
+constexpr int kMaxCsrTransfers = 8;
+__attribute__((aligned(kCacheLineSize)))
+uint64_t CsrTransferBuffer[kMaxCsrTransfers];
+constexpr TickType_t kCsrTimeout = pdMS_TO_TICKS(200);
+// How long a polled register may take to reach its value.
+constexpr uint64_t kCsrPollTimeoutUs = 1000000;
+
+struct MemoryRegion {
+  uintptr_t start;
+  uintptr_t end;
+  bool cacheable;
+};
 
-struct UsbTransferMetadata {
-  SemaphoreHandle_t sema;
-  usb_status_t status;
-  size_t bytes_transferred;
+// Memory the USB controller can reach: DTCM (through the M7 AHB slave port),
+// OCRAM and SDRAM.
+constexpr MemoryRegion kDmaRegions[] = {
+    {0x20000000, 0x20040000, false},
+    {0x20240000, 0x20380000, true},
+    {0x80000000, 0x90000000, true},
 };
+
+// Returns true if the USB controller can transfer `length` bytes at `data` in
+// place. For transfers into cacheable memory (`device_to_host`), the buffer
+// must also start and end on cache line boundaries: the USB stack invalidates
+// whole lines, which would discard neighboring data.
+bool IsDmaCapable(const uint8_t* data, uint32_t length, bool device_to_host) {
+  auto start = reinterpret_cast<uintptr_t>(data);
+  for (const auto& region : kDmaRegions) {
+    if (start < region.start || start + length > region.end) continue;
+    if (!region.cacheable || !device_to_host) return true;
+    return start % kCacheLineSize == 0 && length % kCacheLineSize == 0;
+  }
+  return false;
+}
 }  // namespace
 
 namespace registers = platforms::darwinn::driver::config::registers;
+using platforms::darwinn::driver::RunControl;
+
+namespace {
+// Gets scu_ctrl_3 with only the current power state field set to `state`.
+uint32_t ScuCtrl3PowerState(uint64_t state) {
+  registers::ScuCtrl3 scu_ctrl_3(0);
+  scu_ctrl_3.set_cur_pwr_state(state);
+  return scu_ctrl_3.raw();
+}
+}  // namespace
+
+void TpuCsrBatch::Read32(uint64_t reg, uint32_t *val) {
+  ops_.push_back({OpType::kRead, false, reg, 0, 0, val});
+}
+
+void TpuCsrBatch::Read64(uint64_t reg, uint64_t *val) {
+  ops_.push_back({OpType::kRead, true, reg, 0, 0, val});
+}
+
+void TpuCsrBatch::Write32(uint64_t reg, uint32_t val) {
+  ops_.push_back({OpType::kWrite, false, reg, val, 0, nullptr});
+}
+
+void TpuCsrBatch::Write64(uint64_t reg, uint64_t val) {
+  ops_.push_back({OpType::kWrite, true, reg, val, 0, nullptr});
+}
 
-bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
-                           PerformanceMode mode) {
-  if (usb_instance == nullptr) {
+void TpuCsrBatch::Poll32(uint64_t reg, uint32_t mask, uint32_t expected) {
+  ops_.push_back({OpType::kPoll, false, reg, expected, mask, nullptr});
+}
+
+void TpuCsrBatch::Poll64(uint64_t reg, uint64_t mask, uint64_t expected) {
+  ops_.push_back({OpType::kPoll, true, reg, expected, mask, nullptr});
+}
+
+uint32_t SignedXorMask(int data_type_size) {
+  switch (data_type_size) {
+    case 1:
+      return 0x80808080;
+    case 2:
+      return 0x80008000;
+    case 4:
+      return 0x80000000;
+    default:
+      return 0;
+  }
+}
+
+void CopyWithXor(uint8_t *dst, const uint8_t *src, size_t size,
+                 uint32_t xor_mask) {
+  if (!xor_mask) {
+    memcpy(dst, src, size);
+    return;
+  }
+  // Word accesses through memcpy, as the buffers may be unaligned.
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint32_t lo, hi;
+    memcpy(&lo, src + i, sizeof(lo));
+    memcpy(&hi, src + i + 4, sizeof(hi));
+    lo ^= xor_mask;
+    hi ^= xor_mask;
+    memcpy(dst + i, &lo, sizeof(lo));
+    memcpy(dst + i + 4, &hi, sizeof(hi));
+  }
+  for (; i < size; ++i) dst[i] = src[i] ^ (xor_mask >> (8 * (i % 4)));
+}
+
+TpuDriver::TpuDriver() {
+  static_assert(kBulkOutQueueDepth * kBulkOutSlotSize <= kMaxBulkBufferSize);
+  static_assert(kCsrQueueDepth <= kMaxCsrTransfers);
+  static_assert(kCsrQueueDepth * kQtdsPerCsrTransfer + kListenerQtds <=
+                    USB_HOST_CONFIG_EHCI_MAX_QTD,
+                "Queued CSR transfers need more qTDs than the EHCI has");
+  bulk_out_done_ = xSemaphoreCreateCounting(kBulkOutQueueDepth, 0);
+  bulk_in_transfer_.sema = xSemaphoreCreateBinary();
+  csr_queue_.done = xSemaphoreCreateCounting(kCsrQueueDepth, 0);
+  CHECK(bulk_out_done_ && bulk_in_transfer_.sema && csr_queue_.done);
+  event_listener_ = {kEventInEndpoint, EventBuffer, kEventSizeBytes};
+  interrupt_listener_ = {kInterruptInEndpoint, InterruptBuffer,
+                         kInterruptSizeBytes};
+  for (int i = 0; i < kBulkOutQueueDepth; ++i) {
+    BulkOutSlot &slot = bulk_out_queue_[i];
+    slot.done = bulk_out_done_;
+    slot.bounce = BulkTransferBuffer + i * kBulkOutSlotSize;
+    slot.transfer.callbackFn = [](void *param, uint8_t *data,
+                                  uint32_t data_length, usb_status_t status) {
+      BulkOutSlot *slot = static_cast<BulkOutSlot *>(param);
+      slot->bytes_transferred = data_length;
+      slot->status = status;
+      xSemaphoreGive(slot->done);
+    };
+    slot.transfer.callbackParam = &slot;
+  }
+}
+
+TpuDriver::~TpuDriver() {
+  vSemaphoreDelete(bulk_out_done_);
+  vSemaphoreDelete(bulk_in_transfer_.sema);
+  vSemaphoreDelete(csr_queue_.done);
+}
+
+bool TpuDriver::Initialize(TpuTransport *transport, PerformanceMode mode) {
+  if (transport == nullptr) {
     return false;
   }
-  usb_instance_ = usb_instance;
+  transport_ = transport;
+  initialize_stats_ = {};
+  // Transfers posted on a previous instance are gone.
+  event_listener_.posted = false;
+  interrupt_listener_.posted = false;
+  events_consumed_ = event_listener_.received;
+
+  const auto &apex_csrs = chip_config_.GetApexCsrOffsets();
+  const auto &scu_csrs = chip_config_.GetScuCsrOffsets();
+  // Most registers are read back after a write, only to make sure the write
+  // is done. Accesses are batched up to the next read whose value is needed.
+  TpuCsrBatch batch;
 
   // Check chip id and test write
   uint32_t omc0_00_reg;
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_00, &omc0_00_reg));
+  batch.Read32(apex_csrs.omc0_00, &omc0_00_reg);
+  CHECK(RunInitializeBatch(batch));
 
   registers::Omc000 omc0_00(omc0_00_reg);
   CHECK(0x89A == omc0_00.chip_id());
 
   omc0_00.set_test_reg0(0xAA);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_00, omc0_00.raw()));
-
-  omc0_00_reg = 0;
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_00, &omc0_00_reg));
+  uint32_t scu_ctrl_0_reg;
+  batch.Clear();
+  batch.Write32(apex_csrs.omc0_00, omc0_00.raw());
+  batch.Read32(apex_csrs.omc0_00, &omc0_00_reg);
+  batch.Read32(scu_csrs.scu_ctrl_0, &scu_ctrl_0_reg);
+  CHECK(RunInitializeBatch(batch));
   omc0_00.set_raw(omc0_00_reg);
   CHECK(0xAA == omc0_00.test_reg0());
 
   // Disable inactive mode
-  uint32_t scu_ctrl_0_reg;
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, &scu_ctrl_0_reg));
   registers::ScuCtrl0 scu_ctrl_0(scu_ctrl_0_reg);
   scu_ctrl_0.set_rg_pcie_inact_phy_mode(0);
   scu_ctrl_0.set_rg_usb_inact_phy_mode(0);
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, scu_ctrl_0.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_0, &scu_ctrl_0_reg));
+  uint32_t scu_ctrl_2_reg;
+  batch.Clear();
+  batch.Write32(scu_csrs.scu_ctrl_0, scu_ctrl_0.raw());
+  batch.Read32(scu_csrs.scu_ctrl_0, &scu_ctrl_0_reg);
+  batch.Read32(scu_csrs.scu_ctrl_2, &scu_ctrl_2_reg);
+  CHECK(RunInitializeBatch(batch));
 
   // Disable clock gating
-  uint32_t scu_ctrl_2_reg;
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
   registers::ScuCtrl2 scu_ctrl_2(scu_ctrl_2_reg);
   scu_ctrl_2.set_rg_gated_gcb(0x2);
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
+  uint32_t scu_ctrl_3_reg;
+  batch.Clear();
+  batch.Write32(scu_csrs.scu_ctrl_2, scu_ctrl_2.raw());
+  batch.Read32(scu_csrs.scu_ctrl_2, &scu_ctrl_2_reg);
+  batch.Read32(scu_csrs.scu_ctrl_3, &scu_ctrl_3_reg);
+  CHECK(RunInitializeBatch(batch));
 
   // Go into reset, if we're not there
-  uint32_t scu_ctrl_3_reg;
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
+  const uint32_t power_state_mask =
+      ScuCtrl3PowerState(registers::ScuCtrl3(~0ULL).cur_pwr_state());
   registers::ScuCtrl3 scu_ctrl_3(scu_ctrl_3_reg);
+  batch.Clear();
   if (scu_ctrl_3.rg_force_sleep() != 0x3) {
     scu_ctrl_3.set_rg_force_sleep(0x3);
-    CHECK(
-        Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
-    do {
-      CHECK(
-          Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-      scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-    } while (scu_ctrl_3.cur_pwr_state() != 0x2);
-    CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0xF));
-    CHECK(Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0x0));
+    batch.Write32(scu_csrs.scu_ctrl_3, scu_ctrl_3.raw());
+    batch.Poll32(scu_csrs.scu_ctrl_3, power_state_mask,
+                 ScuCtrl3PowerState(0x2));
+    batch.Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0xF);
+    batch.Write32(chip_config_.GetCbBridgeCsrOffsets().gcbb_credit0, 0x0);
   }
 
   // Set performance mode and exit reset.
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
+  batch.Read32(scu_csrs.scu_ctrl_3, &scu_ctrl_3_reg);
+  CHECK(RunInitializeBatch(batch));
   scu_ctrl_3.set_raw(scu_ctrl_3_reg);
   scu_ctrl_3.set_rg_force_sleep(0x2);
   switch (mode) {
@@ -130,143 +292,247 @@ bool TpuDriver::Initialize(usb_host_edgetpu_instance_t *usb_instance,
           registers::ScuCtrl3::Usb8051Clock::k250MHZ);
       break;
   }
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, scu_ctrl_3.raw()));
-
-  do {
-    CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_3, &scu_ctrl_3_reg));
-    scu_ctrl_3.set_raw(scu_ctrl_3_reg);
-  } while (scu_ctrl_3.cur_pwr_state() != 0x0);
+  batch.Clear();
+  batch.Write32(scu_csrs.scu_ctrl_3, scu_ctrl_3.raw());
+  batch.Poll32(scu_csrs.scu_ctrl_3, power_state_mask, ScuCtrl3PowerState(0x0));
 
   // Check a known register to verify reset exit.
-  uint64_t scalar_core_run_control;
-  do {
-    CHECK(Read64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
-                 &scalar_core_run_control));
-  } while (scalar_core_run_control != 0);
+  batch.Poll64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
+               ~0ULL, 0);
 
   registers::IdleRegister idle_reg;
   idle_reg.set_enable();
   idle_reg.set_counter(1);
-  CHECK(Write64(chip_config_.GetMiscCsrOffsets().idleRegister, idle_reg.raw()));
+  batch.Write64(chip_config_.GetMiscCsrOffsets().idleRegister, idle_reg.raw());
 
   registers::TileConfig<7> tile_config;
   tile_config.set_broadcast();
-  CHECK(Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                tile_config.raw()));
-
-  uint64_t tile_config_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tile_config_reg));
-  } while (tile_config.raw() != tile_config_reg);
+  batch.Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+                tile_config.raw());
+  batch.Poll64(chip_config_.GetTileConfigCsrOffsets().tileconfig0, ~0ULL,
+               tile_config.raw());
 
   registers::DeepSleep deep_sleep_reg;
   deep_sleep_reg.set_to_sleep_delay(2);
   deep_sleep_reg.set_to_wake_delay(30);
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().deepSleep,
-                deep_sleep_reg.raw()));
+  batch.Write64(chip_config_.GetTileCsrOffsets().deepSleep,
+                deep_sleep_reg.raw());
 
   // Enable clock gating
-  CHECK(Read32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, &scu_ctrl_2_reg));
+  batch.Read32(scu_csrs.scu_ctrl_2, &scu_ctrl_2_reg);
+  CHECK(RunInitializeBatch(batch));
   scu_ctrl_2.set_raw(scu_ctrl_2_reg);
   scu_ctrl_2.set_rg_gated_gcb(1);
-  CHECK(Write32(chip_config_.GetScuCsrOffsets().scu_ctrl_2, scu_ctrl_2.raw()));
+  batch.Clear();
+  batch.Write32(scu_csrs.scu_ctrl_2, scu_ctrl_2.raw());
 
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().descr_ep, 0xF0));
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().multi_bo_ep, 0));
-  CHECK(Write64(chip_config_.GetUsbCsrOffsets().outfeed_chunk_length, 0x20));
+  batch.Write64(chip_config_.GetUsbCsrOffsets().descr_ep, 0xF0);
+  batch.Write64(chip_config_.GetUsbCsrOffsets().multi_bo_ep, 0);
+  batch.Write64(chip_config_.GetUsbCsrOffsets().outfeed_chunk_length, 0x20);
 
   uint32_t omc0_d0_reg, omc0_d8_reg, omc0_dc_reg;
 
   // Enables tempsense clock.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_d0, &omc0_d0_reg));
+  batch.Read32(apex_csrs.omc0_d0, &omc0_d0_reg);
+  CHECK(RunInitializeBatch(batch));
   registers::Omc0D0 omc0_d0(omc0_d0_reg);
   omc0_d0.set_clk_en(0x1);
   omc0_d0.set_adr(0xC);
   omc0_d0.set_tref(0);
   omc0_d0.set_tslope(0);
   omc0_d0.set_t_setting(0);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_d0, omc0_d0.raw()));
+  batch.Clear();
+  batch.Write32(apex_csrs.omc0_d0, omc0_d0.raw());
 
   // Enables tempsense input ports.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_d8, &omc0_d8_reg));
+  batch.Read32(apex_csrs.omc0_d8, &omc0_d8_reg);
+  CHECK(RunInitializeBatch(batch));
   registers::Omc0D8 omc0_d8(omc0_d8_reg);
   omc0_d8.set_enbg(0x1);
   omc0_d8.set_envr(0x1);
   omc0_d8.set_enad(0x1);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_d8, omc0_d8.raw()));
+  batch.Clear();
+  batch.Write32(apex_csrs.omc0_d8, omc0_d8.raw());
+  CHECK(RunInitializeBatch(batch));
 
   // Wait 100 us before enabling tempsense flow.
   SDK_DelayAtLeastUs(100, CLOCK_GetFreq(kCLOCK_CpuClk));
 
   // Enables tempsense flow.
-  CHECK(Read32(chip_config_.GetApexCsrOffsets().omc0_dc, &omc0_dc_reg));
+  batch.Clear();
+  batch.Read32(apex_csrs.omc0_dc, &omc0_dc_reg);
+  CHECK(RunInitializeBatch(batch));
   registers::Omc0DC omc0_dc(omc0_dc_reg);
   omc0_dc.set_enthmc(0x1);
-  CHECK(Write32(chip_config_.GetApexCsrOffsets().omc0_dc, omc0_dc.raw()));
+  batch.Clear();
+  batch.Write32(apex_csrs.omc0_dc, omc0_dc.raw());
 
-  CHECK(DoRunControl(platforms::darwinn::driver::RunControl::kMoveToRun));
+  AddRunControl(RunControl::kMoveToRun, &batch);
+  CHECK(RunInitializeBatch(batch));
 
+  PostListener(&event_listener_);
+  // The interrupt pipe may not be open, see USB_HostEdgeTpuOpenInterface().
+  PostListener(&interrupt_listener_);
   return true;
 }
 
-bool TpuDriver::CSRTransfer(uint64_t reg, void *data, bool read,
-                            RegisterSize reg_size) {
-  bool ret = false;
-  usb_status_t control_status;
+bool TpuDriver::RunCsrBatch(const TpuCsrBatch &batch,
+                            TpuCsrBatchStats *stats) {
+  if (!FlushBulkOut()) return false;
+  ResetCsrQueue();
+  TpuCsrBatchStats batch_stats{};
+  const uint64_t start_us = TimerMicros();
+  bool ret = true;
+  for (const auto &op : batch.ops_) {
+    if (op.type == TpuCsrBatch::OpType::kPoll) {
+      // Later accesses may rely on the polled state.
+      ret = CompleteAllCsr() && PollCsr(op, &batch_stats);
+    } else {
+      ret = (csr_pending_ < kCsrQueueDepth || CompleteCsr(nullptr)) &&
+            SubmitCsr(op);
+      ++batch_stats.transfers;
+    }
+    if (!ret) break;
+  }
+  ret = ret && CompleteAllCsr();
+  batch_stats.duration_us = static_cast<uint32_t>(TimerMicros() - start_us);
+  if (stats) *stats = batch_stats;
+  return ret;
+}
+
+bool TpuDriver::RunInitializeBatch(const TpuCsrBatch &batch) {
+  TpuCsrBatchStats stats;
+  bool ret = RunCsrBatch(batch, &stats);
+  initialize_stats_.transfers += stats.transfers;
+  initialize_stats_.poll_retries += stats.poll_retries;
+  initialize_stats_.duration_us += stats.duration_us;
+  return ret;
+}
+
+bool TpuDriver::CSRTransfer(const TpuCsrBatch::Op &op) {
+  if (!FlushBulkOut()) return false;
+  ResetCsrQueue();
+  return SubmitCsr(op) && CompleteCsr(nullptr);
+}
+
+void TpuDriver::ResetCsrQueue() {
+  // Drop completions left over from transfers that timed out.
+  xQueueReset(csr_queue_.done);
+  csr_queue_.failed = false;
+  csr_head_ = 0;
+  csr_pending_ = 0;
+}
+
+bool TpuDriver::SubmitCsr(const TpuCsrBatch::Op &op) {
+  assert(csr_pending_ < kCsrQueueDepth);
+  const int slot = (csr_head_ + csr_pending_) % kCsrQueueDepth;
+  uint64_t *buffer = &CsrTransferBuffer[slot];
+  const bool read = op.type != TpuCsrBatch::OpType::kWrite;
+  // 32-bit registers use the low half, as the Edge TPU is little endian.
+  *buffer = read ? 0 : op.value;
+
   usb_setup_struct_t setup_packet;
   setup_packet.bmRequestType =
       USB_REQUEST_TYPE_TYPE_VENDOR | USB_REQUEST_TYPE_RECIPIENT_DEVICE;
   setup_packet.bmRequestType |=
       read ? USB_REQUEST_TYPE_DIR_IN : USB_REQUEST_TYPE_DIR_OUT;
-  switch (reg_size) {
-    case RegisterSize::kRegSize32:
-      setup_packet.bRequest = 1;
-      setup_packet.wLength = 4;
-      break;
-    case RegisterSize::kRegSize64:
-      setup_packet.bRequest = 0;
-      setup_packet.wLength = 8;
-      break;
+  if (op.wide) {
+    setup_packet.bRequest = 0;
+    setup_packet.wLength = 8;
+  } else {
+    setup_packet.bRequest = 1;
+    setup_packet.wLength = 4;
+  }
+
+  setup_packet.wValue = 0xFFFF & op.reg;
+  setup_packet.wIndex = 0xFFFF & (op.reg >> 16);
+
+  while (true) {
+    usb_status_t control_status = transport_->Control(
+        &setup_packet, reinterpret_cast<uint8_t *>(buffer),
+        [](void *param, uint8_t *data, uint32_t data_length,
+           usb_status_t status) {
+          CsrQueue *queue = static_cast<CsrQueue *>(param);
+          if (status != kStatus_USB_Success) queue->failed = true;
+          xSemaphoreGive(queue->done);
+        },
+        &csr_queue_);
+    if (control_status == kStatus_USB_Success) break;
+    // Other transfers may hold the qTDs this one needs; retry once the
+    // oldest queued transfer has freed its own. The slot doesn't move.
+    if (csr_pending_ == 0) {
+      printf("Control transfer failed\r\n");
+      return false;
+    }
+    if (!CompleteCsr(nullptr)) return false;
   }
+  csr_ops_[slot] = &op;
+  ++csr_pending_;
+  return true;
+}
 
-  setup_packet.wValue = 0xFFFF & reg;
-  setup_packet.wIndex = 0xFFFF & (reg >> 16);
-
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
+bool TpuDriver::CompleteCsr(uint64_t *value) {
+  if (xSemaphoreTake(csr_queue_.done, kCsrTimeout) == pdFALSE) {
+    printf("%s didn't get semaphore\r\n", __func__);
+    // A late completion would be taken for the next transfer, before its
+    // data stage is done, so cancel the transfers still queued.
+    if (transport_->CancelControl() != kStatus_USB_Success) {
+      printf("Failed to cancel control transfers\r\n");
+    }
+    ResetCsrQueue();
+    return false;
+  }
+  const int slot = csr_head_;
+  csr_head_ = (csr_head_ + 1) % kCsrQueueDepth;
+  --csr_pending_;
+  if (csr_queue_.failed) {
+    printf("CSR transfer failed\r\n");
+    return false;
+  }
 
-  control_status = USB_HostEdgeTpuControl(
-      usb_instance_, &setup_packet, (uint8_t *)data,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
-      },
-      sema);
-  if (control_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuControl failed\r\n");
-    goto exit;
+  const TpuCsrBatch::Op &op = *csr_ops_[slot];
+  const uint64_t data = CsrTransferBuffer[slot];
+  if (op.type == TpuCsrBatch::OpType::kRead) {
+    if (op.wide)
+      *static_cast<uint64_t *>(op.out) = data;
+    else
+      *static_cast<uint32_t *>(op.out) = static_cast<uint32_t>(data);
   }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    ret = false;
-    printf("%s didn't get semaphore\r\n", __func__);
-    goto exit;
+  if (value) *value = data;
+  return true;
+}
+
+bool TpuDriver::CompleteAllCsr() {
+  while (csr_pending_) {
+    if (!CompleteCsr(nullptr)) return false;
   }
+  return true;
+}
 
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
-  return ret;
+bool TpuDriver::PollCsr(const TpuCsrBatch::Op &op, TpuCsrBatchStats *stats) {
+  const uint64_t start_us = TimerMicros();
+  while (true) {
+    uint64_t value;
+    ++stats->transfers;
+    if (!SubmitCsr(op) || !CompleteCsr(&value)) return false;
+    if ((value & op.mask) == op.value) return true;
+    if (TimerMicros() - start_us > kCsrPollTimeoutUs) {
+      printf("CSR 0x%lx didn't reach its value\r\n",
+             static_cast<unsigned long>(op.reg));
+      return false;
+    }
+    ++stats->poll_retries;
+  }
 }
 
 bool TpuDriver::SendData(DescriptorTag tag, const uint8_t *data,
-                         uint32_t length) const {
+                         uint32_t length, uint32_t xor_mask) const {
   if (!WriteHeader(tag, length)) {
     printf("WriteHeader failed\r\n");
     return false;
   }
 
-  if (!BulkOutTransfer(data, length)) {
+  if (!BulkOutTransfer(data, length, xor_mask)) {
     printf("BulkOutTransfer failed\r\n");
     return false;
   }
@@ -274,91 +540,140 @@ bool TpuDriver::SendData(DescriptorTag tag, const uint8_t *data,
 }
 
 bool TpuDriver::SendParameters(const uint8_t *data, uint32_t length) const {
-  return SendData(DescriptorTag::kParameters, data, length);
+  const uint64_t start_us = TimerMicros();
+  bool ret = SendData(DescriptorTag::kParameters, data, length);
+  Profile(EdgeTpuProfilePhase::kParameterUpload, start_us, length);
+  return ret;
 }
 
-bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length) const {
-  return SendData(DescriptorTag::kInputActivations, data, length);
+bool TpuDriver::SendInputs(const uint8_t *data, uint32_t length,
+                           uint32_t xor_mask) const {
+  const uint64_t start_us = TimerMicros();
+  bool ret =
+      SendData(DescriptorTag::kInputActivations, data, length, xor_mask);
+  Profile(EdgeTpuProfilePhase::kInputUpload, start_us, length);
+  return ret;
 }
 
 bool TpuDriver::SendInstructions(const uint8_t *data, uint32_t length) const {
-  return SendData(DescriptorTag::kInstructions, data, length);
+  const uint64_t start_us = TimerMicros();
+  bool ret = SendData(DescriptorTag::kInstructions, data, length);
+  Profile(EdgeTpuProfilePhase::kInstructionUpload, start_us, length);
+  return ret;
 }
 
 bool TpuDriver::GetOutputs(uint8_t *data, uint32_t length) const {
-  return BulkInTransfer(data, length);
+  const uint64_t start_us = TimerMicros();
+  bool ret = BulkInTransfer(data, length);
+  Profile(EdgeTpuProfilePhase::kOutputDownload, start_us, length);
+  return ret;
+}
+
+void TpuDriver::Profile(EdgeTpuProfilePhase phase, uint64_t start_us,
+                        uint32_t bytes) const {
+  if (profiler_) profiler_->Record(phase, start_us, bytes);
 }
 
 bool TpuDriver::Read32(uint64_t reg, uint32_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize32);
+  return CSRTransfer({TpuCsrBatch::OpType::kRead, false, reg, 0, 0, val});
 }
 
 bool TpuDriver::Read64(uint64_t reg, uint64_t *val) {
-  return CSRTransfer(reg, val, true, RegisterSize::kRegSize64);
+  return CSRTransfer({TpuCsrBatch::OpType::kRead, true, reg, 0, 0, val});
 }
 
 bool TpuDriver::Write32(uint64_t reg, uint32_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize32);
+  return CSRTransfer(
+      {TpuCsrBatch::OpType::kWrite, false, reg, val, 0, nullptr});
 }
 
 bool TpuDriver::Write64(uint64_t reg, uint64_t val) {
-  return CSRTransfer(reg, &val, false, RegisterSize::kRegSize64);
+  return CSRTransfer(
+      {TpuCsrBatch::OpType::kWrite, true, reg, val, 0, nullptr});
 }
 
-ssize_t TpuDriver::BulkOutTransferInternal(uint8_t endpoint,
-                                           const uint8_t *data,
-                                           uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
-  meta.status = kStatus_USB_Error;
-
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkOutSend(
-      usb_instance_, endpoint, (uint8_t *)data, data_length,
-      [](void *param, uint8_t *data, uint32_t data_length,
-         usb_status_t status) {
-        UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
-        meta->bytes_transferred = data_length;
-        meta->status = status;
-        xSemaphoreGive(meta->sema);
-      },
-      &meta);
+TpuDriver::BulkOutSlot *TpuDriver::AcquireBulkOutSlot() const {
+  if (bulk_out_pending_ == kBulkOutQueueDepth && !CompleteBulkOut())
+    return nullptr;
+  if (bulk_out_pending_ == 0) {
+    // Drop completions left over from transfers that timed out.
+    xQueueReset(bulk_out_done_);
+  }
+  return &bulk_out_queue_[(bulk_out_head_ + bulk_out_pending_) %
+                          kBulkOutQueueDepth];
+}
 
+bool TpuDriver::SubmitBulkOut(BulkOutSlot *slot, const uint8_t *data,
+                              uint32_t length) const {
+  slot->length = length;
+  slot->status = kStatus_USB_Error;
+  slot->bytes_transferred = 0;
+  usb_status_t bulk_status = transport_->BulkOutQueue(
+      kSingleBulkOutEndpoint, const_cast<uint8_t *>(data), length,
+      &slot->transfer);
   if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkOutSend failed\r\n");
-    goto exit;
+    printf("Bulk out transfer failed\r\n");
+    FlushBulkOut();
+    return false;
   }
+  ++bulk_out_pending_;
+  return true;
+}
 
-  if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
+bool TpuDriver::CompleteBulkOut() const {
+  if (xSemaphoreTake(bulk_out_done_, pdMS_TO_TICKS(200)) == pdFALSE) {
     printf("%s didn't get semaphore\r\n", __func__);
-  };
-
-exit:
-  vSemaphoreDelete(meta.sema);
-
-  if (meta.status == kStatus_USB_Success) {
-    return meta.bytes_transferred;
-  } else {
-    return -meta.status;
+    // The controller may still be reading the buffers of the queued
+    // transfers, so cancel them before their slots are reused.
+    if (transport_->CancelEndpoint(kSingleBulkOutEndpoint, USB_OUT) !=
+        kStatus_USB_Success) {
+      printf("Failed to cancel bulk out transfers\r\n");
+    }
+    xQueueReset(bulk_out_done_);
+    bulk_out_head_ = 0;
+    bulk_out_pending_ = 0;
+    return false;
   }
+  const BulkOutSlot &slot = bulk_out_queue_[bulk_out_head_];
+  bulk_out_head_ = (bulk_out_head_ + 1) % kBulkOutQueueDepth;
+  --bulk_out_pending_;
+  if (slot.status != kStatus_USB_Success ||
+      slot.bytes_transferred != slot.length) {
+    printf("Bad bulk out transfer: %d\r\n", static_cast<int>(slot.status));
+    return false;
+  }
+  return true;
 }
 
-bool TpuDriver::BulkOutTransfer(const uint8_t *data,
-                                uint32_t data_length) const {
-  uint8_t *current_chunk = const_cast<uint8_t *>(data);
+bool TpuDriver::FlushBulkOut() const {
+  bool ret = true;
+  while (bulk_out_pending_ > 0) ret &= CompleteBulkOut();
+  return ret;
+}
+
+bool TpuDriver::BulkOutTransfer(const uint8_t *data, uint32_t data_length,
+                                uint32_t xor_mask) const {
+  const uint8_t *current_chunk = data;
   uint32_t bytes_left = data_length;
 
   while (bytes_left > 0) {
+    BulkOutSlot *slot = AcquireBulkOutSlot();
+    if (!slot) return false;
     uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
-    memcpy(BulkTransferBuffer, current_chunk, chunk_size);
-    ssize_t bytes_sent = BulkOutTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
-    if (bytes_sent > 0) {
-      current_chunk += bytes_sent;
-      bytes_left -= bytes_sent;
-    } else {
-      printf("Bad BulkOutTransferInternal\r\n");
-      return false;
+    // Data to transform has to be staged anyway.
+    bool direct = !xor_mask && IsDmaCapable(current_chunk, chunk_size, false);
+    if (!direct) {
+      // Slot sizes are a multiple of 4, so the mask stays in phase.
+      chunk_size = std::min(kBulkOutSlotSize, chunk_size);
+      CopyWithXor(slot->bounce, current_chunk, chunk_size, xor_mask);
     }
+    if (!SubmitBulkOut(slot, direct ? current_chunk : slot->bounce,
+                       chunk_size))
+      return false;
+    (direct ? transfer_stats_.bytes_direct : transfer_stats_.bytes_copied) +=
+        chunk_size;
+    current_chunk += chunk_size;
+    bytes_left -= chunk_size;
   }
 
   return true;
@@ -366,12 +681,14 @@ bool TpuDriver::BulkOutTransfer(const uint8_t *data,
 
 ssize_t TpuDriver::BulkInTransferInternal(uint8_t endpoint, uint8_t *data,
                                           uint32_t data_length) const {
-  UsbTransferMetadata meta;
-  meta.sema = xSemaphoreCreateBinary();
+  UsbTransferMetadata &meta = bulk_in_transfer_;
   meta.status = kStatus_USB_Error;
+  // Drop a completion that raced with the cancellation of a transfer that
+  // timed out.
+  xSemaphoreTake(meta.sema, 0);
 
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, endpoint, data, data_length,
+  usb_status_t bulk_status = transport_->BulkInRecv(
+      endpoint, data, data_length,
       [](void *param, uint8_t *data, uint32_t data_length,
          usb_status_t status) {
         UsbTransferMetadata *meta = static_cast<UsbTransferMetadata *>(param);
@@ -382,16 +699,20 @@ ssize_t TpuDriver::BulkInTransferInternal(uint8_t endpoint, uint8_t *data,
       &meta);
 
   if (bulk_status != kStatus_USB_Success) {
-    printf("USB_HostEdgeTpuBulkInRecv failed\r\n");
-    goto exit;
+    printf("Bulk in transfer failed\r\n");
+    return -kStatus_USB_Error;
   }
 
   if (xSemaphoreTake(meta.sema, pdMS_TO_TICKS(200)) == pdFALSE) {
     printf("%s didn't get semaphore\r\n", __func__);
-  };
-
-exit:
-  vSemaphoreDelete(meta.sema);
+    // The transfer may still complete into `data`, which the caller is
+    // about to reuse, and would be taken for the next one.
+    if (transport_->CancelEndpoint(endpoint, USB_IN) != kStatus_USB_Success) {
+      printf("Failed to cancel bulk in transfer\r\n");
+    }
+    xSemaphoreTake(meta.sema, 0);
+    return -kStatus_USB_Error;
+  }
 
   if (meta.status == kStatus_USB_Success) {
     return meta.bytes_transferred;
@@ -401,14 +722,22 @@ exit:
 }
 
 bool TpuDriver::BulkInTransfer(uint8_t *data, uint32_t data_length) const {
+  if (!FlushBulkOut()) return false;
   uint8_t *current_chunk = data;
   uint32_t bytes_left = data_length;
   while (bytes_left > 0) {
     uint32_t chunk_size = std::min(kMaxBulkBufferSize, bytes_left);
+    bool direct = IsDmaCapable(current_chunk, chunk_size, true);
     ssize_t bytes_received = BulkInTransferInternal(
-        kSingleBulkOutEndpoint, BulkTransferBuffer, chunk_size);
+        kSingleBulkOutEndpoint, direct ? current_chunk : BulkTransferBuffer,
+        chunk_size);
     if (bytes_received > 0) {
-      memcpy(current_chunk, BulkTransferBuffer, chunk_size);
+      if (direct) {
+        transfer_stats_.bytes_direct += bytes_received;
+      } else {
+        memcpy(current_chunk, BulkTransferBuffer, bytes_received);
+        transfer_stats_.bytes_copied += bytes_received;
+      }
       current_chunk += bytes_received;
       bytes_left -= bytes_received;
     } else {
@@ -419,244 +748,181 @@ bool TpuDriver::BulkInTransfer(uint8_t *data, uint32_t data_length) const {
   return true;
 }
 
-std::vector<uint8_t> TpuDriver::PrepareHeader(DescriptorTag tag,
-                                              uint32_t length) const {
-  constexpr size_t kPacketHeaderRawDataSizeInBytes = 8;
+void TpuDriver::PrepareHeader(DescriptorTag tag, uint32_t length,
+                              uint8_t *header) const {
   constexpr size_t kLengthSizeInBytes = sizeof(length);
-  std::vector<uint8_t> header_packet(kPacketHeaderRawDataSizeInBytes);
-  std::fill(header_packet.begin(), header_packet.end(), 0);
-  memcpy(header_packet.data(), &length, kLengthSizeInBytes);
-
-  *(header_packet.data() + sizeof(kLengthSizeInBytes)) =
-      (static_cast<uint8_t>(tag) & 0xF);
+  std::fill(header, header + kPacketHeaderRawDataSizeInBytes, 0);
+  memcpy(header, &length, kLengthSizeInBytes);
 
-  return header_packet;
+  *(header + kLengthSizeInBytes) = (static_cast<uint8_t>(tag) & 0xF);
 }
 
 bool TpuDriver::WriteHeader(DescriptorTag tag, uint32_t length) const {
-  std::vector<uint8_t> header_packet = PrepareHeader(tag, length);
-  return BulkOutTransfer(header_packet.data(), header_packet.size());
+  // The header is staged in the slot, so it outlives this call.
+  BulkOutSlot *slot = AcquireBulkOutSlot();
+  if (!slot) return false;
+  PrepareHeader(tag, length, slot->bounce);
+  if (!SubmitBulkOut(slot, slot->bounce, kPacketHeaderRawDataSizeInBytes))
+    return false;
+  transfer_stats_.bytes_copied += kPacketHeaderRawDataSizeInBytes;
+  return true;
 }
 
 bool TpuDriver::ReadEvent() const {
-  bool ret = false;
-  constexpr size_t kEventSizeBytes = 16;
-  uint8_t *buf = (uint8_t *)OSA_MemoryAllocate(kEventSizeBytes);
-  SemaphoreHandle_t sema = xSemaphoreCreateBinary();
-  usb_status_t bulk_status = USB_HostEdgeTpuBulkInRecv(
-      usb_instance_, kEventInEndpoint, buf, kEventSizeBytes,
+  const uint64_t start_us = TimerMicros();
+  if (!FlushBulkOut()) return false;
+  bool ret = WaitForEvent();
+  Profile(EdgeTpuProfilePhase::kWaitEvent, start_us, 0);
+  return ret;
+}
+
+bool TpuDriver::WaitForEvent() const {
+  Listener &listener = event_listener_;
+  listener.waiter = xTaskGetCurrentTaskHandle();
+  const TickType_t start = xTaskGetTickCount();
+  bool ret = true;
+  // The event is normally already on its way into the transfer posted after
+  // the previous one.
+  while (listener.received == events_consumed_) {
+    if (!listener.posted && !PostListener(&listener)) {
+      ret = false;
+      break;
+    }
+    const TickType_t elapsed = xTaskGetTickCount() - start;
+    // A notification can be stale, so the loop checks the counter again.
+    if (elapsed >= kEventTimeout ||
+        ulTaskNotifyTakeIndexed(kEventNotification, pdTRUE,
+                                kEventTimeout - elapsed) == 0) {
+      ++event_timeouts_;
+      ret = false;
+      break;
+    }
+  }
+  listener.waiter = nullptr;
+  if (!ret && listener.posted) {
+    // After a timeout, a late event must not complete the next invocation,
+    // so drop the transfer it would land in. The callback clears `posted`.
+    if (transport_->CancelEndpoint(kEventInEndpoint, USB_IN) !=
+        kStatus_USB_Success) {
+      printf("Failed to cancel event transfer\r\n");
+    }
+  }
+  events_consumed_ = listener.received;
+
+  if (ret) {
+    uint32_t len;
+    uint64_t address;
+    memcpy(&address, EventBuffer, sizeof(address));
+    memcpy(&len, EventBuffer + sizeof(address), sizeof(len));
+    uint8_t tag = *(EventBuffer + sizeof(address) + sizeof(len)) & 0xF;
+    // For now, we don't do anything with these events we've read back.
+    (void)tag;
+  }
+
+  PostListener(&listener);
+  PostListener(&interrupt_listener_);
+  return ret;
+}
+
+bool TpuDriver::PostListener(Listener *listener) const {
+  if (listener->posted) return true;
+  listener->posted = true;
+  usb_status_t status = transport_->BulkInRecv(
+      listener->endpoint, listener->buffer, listener->length,
       [](void *param, uint8_t *data, uint32_t data_length,
          usb_status_t status) {
-        uint32_t len;
-        uint64_t address;
-        uint8_t tag;
-        memcpy(&address, data, sizeof(address));
-        memcpy(&len, data + sizeof(address), sizeof(len));
-        tag = *(data + sizeof(address) + sizeof(len)) & 0xF;
-        // For now, we don't do anything with these events we've read back.
-        (void)tag;
-        SemaphoreHandle_t sema = (SemaphoreHandle_t)param;
-        xSemaphoreGive(sema);
+        auto *listener = static_cast<Listener *>(param);
+        if (status == kStatus_USB_Success)
+          ++listener->received;
+        else if (status != kStatus_USB_TransferCancel)
+          ++listener->errors;
+        listener->posted = false;
+        TaskHandle_t waiter = listener->waiter;
+        if (waiter) xTaskNotifyGiveIndexed(waiter, kEventNotification);
       },
-      sema);
-  if (bulk_status != kStatus_USB_Success) {
-    printf("ReadEvent failed\r\n");
-    goto exit;
-  }
-  if (xSemaphoreTake(sema, pdMS_TO_TICKS(200)) == pdFALSE) {
-    goto exit;
-  };
-  ret = true;
-exit:
-  vSemaphoreDelete(sema);
-  OSA_MemoryFree(buf);
-  return ret;
+      listener);
+  if (status != kStatus_USB_Success) {
+    listener->posted = false;
+    return false;
+  }
+  return true;
 }
 
-bool TpuDriver::DoRunControl(platforms::darwinn::driver::RunControl run_state) {
+TpuEventStats TpuDriver::GetEventStats() const {
+  return {event_listener_.received - event_stats_base_.events,
+          interrupt_listener_.received - event_stats_base_.interrupts,
+          event_timeouts_ - event_stats_base_.timeouts,
+          event_listener_.errors + interrupt_listener_.errors -
+              event_stats_base_.errors};
+}
+
+void TpuDriver::ResetEventStats() {
+  event_stats_base_ = {event_listener_.received, interrupt_listener_.received,
+                       event_timeouts_,
+                       event_listener_.errors + interrupt_listener_.errors};
+}
+
+void TpuDriver::AddRunControl(RunControl run_state, TpuCsrBatch *batch) const {
   const uint64_t run_state_value = static_cast<uint64_t>(run_state);
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().scalarCoreRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().avDataPopRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().parameterPopRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().infeedRunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetScalarCoreCsrOffsets().outfeedRunControl,
-                run_state_value));
+  const auto &scalar_core_csrs = chip_config_.GetScalarCoreCsrOffsets();
+  for (uint64_t reg : {scalar_core_csrs.scalarCoreRunControl,
+                       scalar_core_csrs.avDataPopRunControl,
+                       scalar_core_csrs.parameterPopRunControl,
+                       scalar_core_csrs.infeedRunControl,
+                       scalar_core_csrs.outfeedRunControl}) {
+    batch->Write64(reg, run_state_value);
+  }
 
   registers::TileConfig<7> helper;
   helper.set_broadcast();
-  CHECK(Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                helper.raw()));
+  batch->Write64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
+                 helper.raw());
 
   // Wait until tileconfig0 is set correctly. Subsequent writes are going to
   // tiles, but hardware does not guarantee correct ordering with previous
   // write.
-  uint64_t tileconfig0_reg;
-  do {
-    CHECK(Read64(chip_config_.GetTileConfigCsrOffsets().tileconfig0,
-                 &tileconfig0_reg));
-  } while (tileconfig0_reg != helper.raw());
-
-  if (chip_config_.GetTileCsrOffsets().opRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().opRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().opRunControl_7,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().narrowToWideRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToWideRunControl_7,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_0 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_0,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_1 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_1,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_2 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_2,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_3 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_3,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_4 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_4,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_5 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_5,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_6 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_6,
-                  run_state_value));
-  }
-  if (chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_7 !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().wideToNarrowRunControl_7,
-                  run_state_value));
-  }
-
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus0RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus1RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus2RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().meshBus3RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusConsumer0RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusConsumer1RunControl,
-                run_state_value));
-  CHECK(Write64(chip_config_.GetTileCsrOffsets().ringBusProducerRunControl,
-                run_state_value));
-  if (chip_config_.GetTileCsrOffsets().narrowToNarrowRunControl !=
-      static_cast<uint64_t>(-1)) {
-    CHECK(Write64(chip_config_.GetTileCsrOffsets().narrowToNarrowRunControl,
-                  run_state_value));
+  batch->Poll64(chip_config_.GetTileConfigCsrOffsets().tileconfig0, ~0ULL,
+                helper.raw());
+
+  // Registers the chip doesn't have are set to -1.
+  const auto &tile_csrs = chip_config_.GetTileCsrOffsets();
+  for (uint64_t reg : {tile_csrs.opRunControl,
+                       tile_csrs.opRunControl_0,
+                       tile_csrs.opRunControl_1,
+                       tile_csrs.opRunControl_2,
+                       tile_csrs.opRunControl_3,
+                       tile_csrs.opRunControl_4,
+                       tile_csrs.opRunControl_5,
+                       tile_csrs.opRunControl_6,
+                       tile_csrs.opRunControl_7,
+                       tile_csrs.narrowToWideRunControl,
+                       tile_csrs.narrowToWideRunControl_0,
+                       tile_csrs.narrowToWideRunControl_1,
+                       tile_csrs.narrowToWideRunControl_2,
+                       tile_csrs.narrowToWideRunControl_3,
+                       tile_csrs.narrowToWideRunControl_4,
+                       tile_csrs.narrowToWideRunControl_5,
+                       tile_csrs.narrowToWideRunControl_6,
+                       tile_csrs.narrowToWideRunControl_7,
+                       tile_csrs.wideToNarrowRunControl,
+                       tile_csrs.wideToNarrowRunControl_0,
+                       tile_csrs.wideToNarrowRunControl_1,
+                       tile_csrs.wideToNarrowRunControl_2,
+                       tile_csrs.wideToNarrowRunControl_3,
+                       tile_csrs.wideToNarrowRunControl_4,
+                       tile_csrs.wideToNarrowRunControl_5,
+                       tile_csrs.wideToNarrowRunControl_6,
+                       tile_csrs.wideToNarrowRunControl_7,
+                       tile_csrs.meshBus0RunControl,
+                       tile_csrs.meshBus1RunControl,
+                       tile_csrs.meshBus2RunControl,
+                       tile_csrs.meshBus3RunControl,
+                       tile_csrs.ringBusConsumer0RunControl,
+                       tile_csrs.ringBusConsumer1RunControl,
+                       tile_csrs.ringBusProducerRunControl,
+                       tile_csrs.narrowToNarrowRunControl}) {
+    if (reg != static_cast<uint64_t>(-1)) batch->Write64(reg, run_state_value);
   }
-
-  return true;
 }
 
 float TpuDriver::GetTemperature() {
@@ -22,7 +22,11 @@
 
 #include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
 #include "libs/tpu/darwinn/driver/hardware_structures.h"
-#include "libs/tpu/usb_host_edgetpu.h"
+#include "libs/tpu/edgetpu_profiler.h"
+#include "libs/tpu/edgetpu_transport.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
 
 namespace coralmicro {
 
@@ -45,46 +49,251 @@ enum class DescriptorTag {
   kInterrupt3 = 7,
 };
 
+// Returns the XOR mask that converts between signed values of
+// `data_type_size` bytes and the Edge TPU's unsigned representation by
+// flipping the most significant bit of each (little endian) value. The mask
+// repeats every 4 bytes.
+uint32_t SignedXorMask(int data_type_size);
+
+// Copies `size` bytes from `src` to `dst`, XORing them with `xor_mask`
+// (repeated every 4 bytes, starting at `src`). Works on whole words, so it is
+// as cheap as a plain copy.
+void CopyWithXor(uint8_t* dst, const uint8_t* src, size_t size,
+                 uint32_t xor_mask);
+
+// Counters of the bytes moved by `TpuDriver` bulk transfers.
+struct TpuTransferStats {
+  // Bytes staged through the driver's bounce buffer, because the caller's
+  // buffer was not reachable by the USB controller or not cache-line aligned.
+  uint64_t bytes_copied;
+  // Bytes transferred directly from or into the caller's buffer.
+  uint64_t bytes_direct;
+};
+
+// Counters of the packets received from the Edge TPU outside of data
+// transfers.
+struct TpuEventStats {
+  // Completion events received on the event endpoint.
+  uint32_t events;
+  // Packets received on the interrupt endpoint.
+  uint32_t interrupts;
+  // `ReadEvent()` calls that gave up waiting for an event.
+  uint32_t timeouts;
+  // Event or interrupt transfers that failed.
+  uint32_t errors;
+};
+
+// Timing of a `TpuCsrBatch` run by `TpuDriver::RunCsrBatch()`.
+struct TpuCsrBatchStats {
+  // Control transfers issued, including every read made by polls.
+  uint32_t transfers;
+  // Times a poll had to read its register again.
+  uint32_t poll_retries;
+  // Time from the first transfer until the last one completed.
+  uint32_t duration_us;
+};
+
+// A sequence of Edge TPU register (CSR) accesses.
+//
+// Each access is a USB control transfer, and most of their latency is the
+// round trip through the USB host stack. `TpuDriver::RunCsrBatch()` instead
+// issues the transfers of a batch back-to-back and only waits where a poll
+// needs the register value, so a batch takes about as long as the bus
+// needs to carry it. Accesses are still performed in order.
+//
+// Values read by `Read32()` and `Read64()` are only stored once the batch
+// completes, so they can't be used by later accesses of the same batch.
+class TpuCsrBatch {
+ public:
+  void Read32(uint64_t reg, uint32_t* val);
+  void Read64(uint64_t reg, uint64_t* val);
+  void Write32(uint64_t reg, uint32_t val);
+  void Write64(uint64_t reg, uint64_t val);
+  // Reads `reg` until `(value & mask) == expected`. Later accesses are only
+  // issued once the register reached that value.
+  void Poll32(uint64_t reg, uint32_t mask, uint32_t expected);
+  void Poll64(uint64_t reg, uint64_t mask, uint64_t expected);
+
+  size_t size() const { return ops_.size(); }
+  void Clear() { ops_.clear(); }
+
+ private:
+  friend class TpuDriver;
+
+  enum class OpType : uint8_t {
+    kRead,
+    kWrite,
+    kPoll,
+  };
+
+  struct Op {
+    OpType type;
+    bool wide;
+    uint64_t reg;
+    // Value written, or expected by a poll.
+    uint64_t value;
+    uint64_t mask;
+    // Destination of a read, either a uint32_t or a uint64_t.
+    void* out;
+  };
+
+  std::vector<Op> ops_;
+};
+
 class TpuDriver {
  public:
-  TpuDriver() = default;
+  TpuDriver();
+  ~TpuDriver();
   TpuDriver(const TpuDriver&) = delete;
   TpuDriver& operator=(const TpuDriver&) = delete;
-  bool Initialize(usb_host_edgetpu_instance_t* usb_instance,
-                  PerformanceMode mode);
+  // Brings up the Edge TPU reached through `transport`, which must outlive
+  // its use by this driver.
+  bool Initialize(TpuTransport* transport, PerformanceMode mode);
   bool SendParameters(const uint8_t* data, uint32_t length) const;
-  bool SendInputs(const uint8_t* data, uint32_t length) const;
+  // Sends input activations. A nonzero `xor_mask` (see `SignedXorMask()`) is
+  // applied while staging the data, leaving `data` untouched.
+  bool SendInputs(const uint8_t* data, uint32_t length,
+                  uint32_t xor_mask = 0) const;
   bool SendInstructions(const uint8_t* data, uint32_t length) const;
   bool GetOutputs(uint8_t* data, uint32_t length) const;
+  // Waits for the Edge TPU to report the completion of an executable.
   bool ReadEvent() const;
   float GetTemperature();
+  TpuTransferStats GetTransferStats() const { return transfer_stats_; }
+  void ResetTransferStats() { transfer_stats_ = {}; }
+  TpuEventStats GetEventStats() const;
+  void ResetEventStats();
+  // Records the duration of each transfer in `profiler`, if not nullptr.
+  void SetProfiler(EdgeTpuProfiler* profiler) { profiler_ = profiler; }
+  // Performs the register accesses of `batch`, see `TpuCsrBatch`.
+  //
+  // @param batch The accesses to perform.
+  // @param stats Receives the number of transfers and the time they took,
+  //   if not nullptr.
+  // @return True if every access succeeded and every poll reached its
+  //   value.
+  bool RunCsrBatch(const TpuCsrBatch& batch,
+                   TpuCsrBatchStats* stats = nullptr);
+  // Gets the totals of the batches run by the last `Initialize()`.
+  TpuCsrBatchStats GetInitializeStats() const { return initialize_stats_; }
 
  private:
-  enum class RegisterSize {
-    kRegSize32,
-    kRegSize64,
+  // Completion state of a bulk transfer, reused by every transfer on the
+  // same endpoint.
+  struct UsbTransferMetadata {
+    SemaphoreHandle_t sema;
+    usb_status_t status;
+    size_t bytes_transferred;
+  };
+
+  // A bulk out transfer in flight. Completions are signaled through
+  // `bulk_out_done_` in submission order.
+  struct BulkOutSlot {
+    usb_host_edgetpu_queued_transfer_t transfer;
+    SemaphoreHandle_t done;
+    // Staging area for data that can't be sent in place, such as headers.
+    uint8_t* bounce;
+    uint32_t length;
+    usb_status_t status;
+    uint32_t bytes_transferred;
   };
 
-  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length) const;
-  ssize_t BulkOutTransferInternal(uint8_t endpoint, const uint8_t* data,
-                                  uint32_t data_length) const;
+  // Completions of the control transfers queued by `SubmitCsr()`, signaled
+  // in submission order.
+  struct CsrQueue {
+    SemaphoreHandle_t done;
+    volatile bool failed;
+  };
+
+  // A transfer kept posted on an endpoint whose packets arrive unsolicited,
+  // so they are caught as soon as the Edge TPU sends them. The completion
+  // callback runs in the USB host task and notifies `waiter`.
+  struct Listener {
+    uint8_t endpoint;
+    uint8_t* buffer;
+    uint32_t length;
+    volatile bool posted;
+    // Packets received and transfers failed since initialization.
+    volatile uint32_t received;
+    volatile uint32_t errors;
+    volatile TaskHandle_t waiter;
+  };
+
+  // Bulk out transfers kept in flight before waiting for the oldest one.
+  static constexpr int kBulkOutQueueDepth = 4;
+  static constexpr uint32_t kBulkOutSlotSize = 8 * 1024;
+  // Control transfers kept in flight by `RunCsrBatch()`. Each one holds
+  // three EHCI qTDs (setup, data and status stages) and the event and
+  // interrupt listeners hold one each, so 4 * 3 + 2 of the
+  // `USB_HOST_CONFIG_EHCI_MAX_QTD` (16) qTDs are in use at once.
+  static constexpr int kCsrQueueDepth = 4;
+  static constexpr int kQtdsPerCsrTransfer = 3;
+  static constexpr int kListenerQtds = 2;
+
+  bool BulkOutTransfer(const uint8_t* data, uint32_t data_length,
+                       uint32_t xor_mask = 0) const;
+  // Returns a free slot, waiting for the oldest transfer if all are in use.
+  BulkOutSlot* AcquireBulkOutSlot() const;
+  bool SubmitBulkOut(BulkOutSlot* slot, const uint8_t* data,
+                     uint32_t length) const;
+  bool CompleteBulkOut() const;
+  // Waits for all queued bulk out transfers to complete.
+  bool FlushBulkOut() const;
   bool BulkInTransfer(uint8_t* data, uint32_t data_length) const;
+  // Posts a transfer for `listener` unless one is already posted.
+  bool PostListener(Listener* listener) const;
+  bool WaitForEvent() const;
   ssize_t BulkInTransferInternal(uint8_t endpoint, uint8_t* data,
                                  uint32_t data_length) const;
 
-  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length) const;
+  bool SendData(DescriptorTag tag, const uint8_t* data, uint32_t length,
+                uint32_t xor_mask = 0) const;
   bool WriteHeader(DescriptorTag tag, uint32_t length) const;
-  std::vector<uint8_t> PrepareHeader(DescriptorTag tag, uint32_t length) const;
+  void PrepareHeader(DescriptorTag tag, uint32_t length,
+                     uint8_t* header) const;
+
+  void Profile(EdgeTpuProfilePhase phase, uint64_t start_us,
+               uint32_t bytes) const;
 
-  bool CSRTransfer(uint64_t reg, void* data, bool read, RegisterSize reg_size);
+  bool CSRTransfer(const TpuCsrBatch::Op& op);
+  // Drops the state of transfers left over from a failed batch.
+  void ResetCsrQueue();
+  // Queues the transfer of `op`. A slot must be free.
+  bool SubmitCsr(const TpuCsrBatch::Op& op);
+  // Waits for the oldest queued transfer and stores what it read in `value`,
+  // if not nullptr.
+  bool CompleteCsr(uint64_t* value);
+  bool CompleteAllCsr();
+  bool PollCsr(const TpuCsrBatch::Op& op, TpuCsrBatchStats* stats);
+  bool RunInitializeBatch(const TpuCsrBatch& batch);
   bool Read32(uint64_t reg, uint32_t* val);
   bool Read64(uint64_t reg, uint64_t* val);
   bool Write32(uint64_t reg, uint32_t val);
   bool Write64(uint64_t reg, uint64_t val);
-  bool DoRunControl(platforms::darwinn::driver::RunControl run_state);
+  void AddRunControl(platforms::darwinn::driver::RunControl run_state,
+                     TpuCsrBatch* batch) const;
 
   platforms::darwinn::driver::config::BeagleChipConfig chip_config_;
-  usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  TpuTransport* transport_ = nullptr;
+  mutable BulkOutSlot bulk_out_queue_[kBulkOutQueueDepth];
+  mutable int bulk_out_head_ = 0;
+  mutable int bulk_out_pending_ = 0;
+  SemaphoreHandle_t bulk_out_done_;
+  mutable UsbTransferMetadata bulk_in_transfer_;
+  CsrQueue csr_queue_;
+  const TpuCsrBatch::Op* csr_ops_[kCsrQueueDepth];
+  int csr_head_ = 0;
+  int csr_pending_ = 0;
+  TpuCsrBatchStats initialize_stats_{};
+  mutable Listener event_listener_;
+  mutable Listener interrupt_listener_;
+  // Value of `event_listener_.received` when the last event was consumed.
+  mutable uint32_t events_consumed_ = 0;
+  mutable uint32_t event_timeouts_ = 0;
+  // Counter values at the last `ResetEventStats()`.
+  TpuEventStats event_stats_base_{};
+  mutable TpuTransferStats transfer_stats_{};
+  EdgeTpuProfiler* profiler_ = nullptr;
 };
 
 }  // namespace coralmicro
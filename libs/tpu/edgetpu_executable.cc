@@ -16,6 +16,8 @@
 
 #include "libs/tpu/edgetpu_executable.h"
 
+#include <utility>
+
 #include "tensorflow/lite/micro/kernels/kernel_util.h"
 
 namespace {
@@ -44,16 +46,51 @@ int TensorDataTypeSize(platforms::darwinn::DataType data_type) {
 
 namespace coralmicro {
 
-EdgeTpuExecutable::EdgeTpuExecutable(const platforms::darwinn::Executable* exe)
+OutputLayer::OutputLayer(const platforms::darwinn::Layer* layer,
+                         EdgeTpuBufferArena* arena)
+    : output_layer_(layer),
+      arena_(arena),
+      output_buffer_(arena ? arena->Allocate(layer->size_bytes()) : nullptr) {
+  if (!output_buffer_) {
+    if (arena_) printf("Edge TPU buffer arena is full, using the heap.\r\n");
+    arena_ = nullptr;
+    output_buffer_ = new uint8_t[layer->size_bytes()];
+  }
+  BuildRelayoutPlan();
+}
+
+OutputLayer::~OutputLayer() {
+  if (arena_)
+    arena_->Free(output_buffer_);
+  else
+    delete[] output_buffer_;
+}
+
+EdgeTpuExecutable::EdgeTpuExecutable(const platforms::darwinn::Executable* exe,
+                                     EdgeTpuBufferArena* arena)
     : executable_(exe) {
   if (executable_->output_layers()) {
     for (const auto* output_layer : *(executable_->output_layers())) {
       output_layers_[output_layer->name()->c_str()] =
-          new OutputLayer(output_layer);
+          new OutputLayer(output_layer, arena);
     }
   }
 }
 
+void EdgeTpuExecutable::Rebind(const platforms::darwinn::Executable* exe) {
+  // The map keys point into the old model data, which is still valid here.
+  std::map<const char*, OutputLayer*, Less> output_layers;
+  if (exe->output_layers()) {
+    for (const auto* layer : *(exe->output_layers())) {
+      auto* output_layer = output_layers_.at(layer->name()->c_str());
+      output_layer->Rebind(layer);
+      output_layers[layer->name()->c_str()] = output_layer;
+    }
+  }
+  output_layers_ = std::move(output_layers);
+  executable_ = exe;
+}
+
 EdgeTpuExecutable::~EdgeTpuExecutable() {
   for (auto entry : output_layers_) {
     delete entry.second;
@@ -69,18 +106,11 @@ EdgeTpuExecutable::~EdgeTpuExecutable() {
   } while (0);
 
 TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
-                                       TfLiteContext* context,
-                                       TfLiteNode* node) {
-  const TfLiteEvalTensor* input_tensor =
-      tflite::micro::GetEvalInput(context, node, 0);
-  const int input_size = tflite::micro::GetTensorShape(input_tensor).FlatSize();
-  if (!input_tensor) {
-    return kTfLiteError;
-  }
-
+                                       const uint8_t* input) {
   const platforms::darwinn::DmaDescriptorHint* dma_hint;
   const char* name;
   uint8_t* output;
+  uint32_t xor_mask;
   int32_t ins_idx;
   const flatbuffers::Vector<uint8_t>* bitstream;
 
@@ -96,22 +126,19 @@ TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_INPUT_ACTIVATION:
             name = dma_hint->meta()->name()->c_str();
+            xor_mask = 0;
             if (executable_->input_layers()) {
               for (const auto* input_layer : *(executable_->input_layers())) {
-                if (!strcmp(input_layer->name()->c_str(), name)) {
-                  if (OutputLayer::SignedDataType(input_layer->data_type())) {
-                    OutputLayer::TransformSignedDataType(
-                        input_tensor->data.uint8, input_size,
-                        TensorDataTypeSize(input_layer->data_type()),
-                        input_layer->x_dim(), input_layer->y_dim(),
-                        input_layer->z_dim());
-                  }
+                if (!strcmp(input_layer->name()->c_str(), name) &&
+                    OutputLayer::SignedDataType(input_layer->data_type())) {
+                  xor_mask = SignedXorMask(
+                      TensorDataTypeSize(input_layer->data_type()));
                 }
               }
             }
             RETURN_IF_ERROR(tpu_driver.SendInputs(
-                input_tensor->data.uint8 + dma_hint->offset_in_bytes(),
-                dma_hint->size_in_bytes()));
+                input + dma_hint->offset_in_bytes(), dma_hint->size_in_bytes(),
+                xor_mask));
             break;
           case platforms::darwinn::Description_BASE_ADDRESS_OUTPUT_ACTIVATION:
             name = dma_hint->meta()->name()->c_str();
@@ -141,32 +168,38 @@ TfLiteStatus EdgeTpuExecutable::Invoke(const TpuDriver& tpu_driver,
   }
 
   tpu_driver.ReadEvent();
+  return kTfLiteOk;
+}
 
+TfLiteStatus EdgeTpuExecutable::ReadOutputs(TfLiteContext* context,
+                                            TfLiteNode* node) const {
   if (!output_layers_.empty()) {
     for (int i = 0; i < node->outputs->size; ++i) {
       const TfLiteEvalTensor* output_tensor =
           tflite::micro::GetEvalOutput(context, node, i);
-      const int output_size =
-          tflite::micro::GetTensorShape(output_tensor).FlatSize();
       if (!output_tensor) {
         return kTfLiteError;
       }
-      name = executable_->output_layers()->Get(i)->name()->c_str();
-      if (output_layers_.find(name) == output_layers_.end()) {
-        printf("Executable does not have buffer for %s\r\n", name);
+      if (ReadOutput(i, output_tensor->data.uint8) != kTfLiteOk) {
         return kTfLiteError;
       }
-      OutputLayer* output_layer = output_layers_[name];
-
-      output_layer->Relayout(output_tensor->data.uint8);
-      output_layer->TransformSignedDataType(output_tensor->data.uint8,
-                                            output_size);
     }
   }
 
   return kTfLiteOk;
 }
 
+TfLiteStatus EdgeTpuExecutable::ReadOutput(int index, uint8_t* dest) const {
+  if (output_layers_.empty()) return kTfLiteOk;
+  const char* name = executable_->output_layers()->Get(index)->name()->c_str();
+  if (output_layers_.find(name) == output_layers_.end()) {
+    printf("Executable does not have buffer for %s\r\n", name);
+    return kTfLiteError;
+  }
+  output_layers_.at(name)->Relayout(dest);
+  return kTfLiteOk;
+}
+
 int OutputLayer::DataTypeSize() const {
   return TensorDataTypeSize(output_layer_->data_type());
 }
@@ -197,145 +230,116 @@ bool OutputLayer::SignedDataType(platforms::darwinn::DataType type) {
   return false;
 }
 
-void OutputLayer::Relayout(uint8_t* dest) const {
-  uint8_t* src = output_buffer_.get();
+void OutputLayer::BuildRelayoutPlan() {
   const auto data_type_size = DataTypeSize();
-  const int z_bytes = z_dim() * data_type_size;
+  z_bytes_ = z_dim() * data_type_size;
+  xor_mask_ = SignedDataType() ? SignedXorMask(data_type_size) : 0;
 
   if (y_dim() == 1 && x_dim() == 1) {
     // One dimensional output (only z-dimension).
-    if (src != dest) {
-      const int padded_size_bytes = PaddedSizeBytes();
-      const int actual_size_bytes = ActualSizeBytes();
-      const int executions = execution_count_per_inference();
-      if (executions == 1 || padded_size_bytes == actual_size_bytes) {
-        memcpy(dest, src, z_bytes * executions);
-      } else {
-        // Remove padding values at the end of each execution.
-        const int padded_size_per_execution =
-            (padded_size_bytes - actual_size_bytes) / executions;
-        for (int i = 0; i < executions; ++i) {
-          memcpy(dest, src, z_bytes);
-          dest += z_bytes;
-          src += z_bytes + padded_size_per_execution;
-        }
-      }
-    }
+    const int padded_size_bytes = PaddedSizeBytes();
+    const int actual_size_bytes = ActualSizeBytes();
+    const int executions = execution_count_per_inference();
+    // Skip padding values at the end of each execution.
+    z_bytes_padded_ =
+        z_bytes_ + (padded_size_bytes - actual_size_bytes) / executions;
+    relayout_spans_.push_back({0, 0, static_cast<uint32_t>(executions)});
+    return;
+  }
+
+  if (x_dim() > 1) {
+    // If x-dim is > 1, padded-z-size can be deduced by looking at
+    // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
+    z_bytes_padded_ = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
   } else {
-    int z_bytes_padded;
-    if (x_dim() > 1) {
-      // If x-dim is > 1, padded-z-size can be deduced by looking at
-      // difference between offset of element y=0,x=0,z=0 and y=0,x=1,z=0.
-      z_bytes_padded = GetBufferIndex(0, 1, 0) - GetBufferIndex(0, 0, 0);
-    } else {
-      // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
-      // padded-z-size can be deduced by looking at difference between
-      // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
-      z_bytes_padded = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+    // Otherwise when x-dim is 1 (y-dim must be > 1 in that case),
+    // padded-z-size can be deduced by looking at difference between
+    // offset of element y=0,x=0,z=0 and y=1,x=0,z=0.
+    z_bytes_padded_ = GetBufferIndex(1, 0, 0) - GetBufferIndex(0, 0, 0);
+  }
+  z_bytes_padded_ *= data_type_size;
+  // Grayscale and RGB outputs are always padded to 4 bytes.
+  if (z_bytes_ == 1 || z_bytes_ == 3) z_bytes_padded_ = 4;
+
+  // Within an x tile, elements are z_bytes_padded_ apart, so each (y, x tile)
+  // pair is one span.
+  const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
+  std::vector<int> tile_x_starts{0};
+  int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
+  for (int x = 1; x < x_dim(); ++x) {
+    int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
+    if (cur_x_tile != last_x_tile) {
+      tile_x_starts.push_back(x);
+      last_x_tile = cur_x_tile;
     }
-    z_bytes_padded *= data_type_size;
-
-    const auto* layout = output_layer_->any_layer_as_OutputLayer()->layout();
-    int last_x = 0;
-    size_t active_tile_x_count = 0;
-
-    int last_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(0);
-
-    for (int x = 1; x < x_dim(); ++x) {
-      int cur_x_tile = layout->x_coordinate_to_linear_tile_id_map()->Get(x);
-      if (cur_x_tile != last_x_tile) {
-        active_tile_x_sizes_[active_tile_x_count] = x - last_x;
-        active_tile_x_count++;
-        last_x_tile = cur_x_tile;
-        last_x = x;
+  }
+  tile_x_starts.push_back(x_dim());
+
+  uint32_t dst = 0;
+  for (int y = 0; y < y_dim(); ++y) {
+    const auto y_buffer_index = GetYBufferIndex(y);
+    for (size_t i = 0; i + 1 < tile_x_starts.size(); ++i) {
+      const uint32_t src =
+          GetBufferIndex(y_buffer_index, tile_x_starts[i], 0) * data_type_size;
+      const uint32_t count = tile_x_starts[i + 1] - tile_x_starts[i];
+      // Unpadded runs that continue the previous one are merged.
+      if (z_bytes_padded_ == z_bytes_ && !relayout_spans_.empty()) {
+        auto& last = relayout_spans_.back();
+        if (last.src + last.count * z_bytes_ == src) {
+          last.count += count;
+          dst += count * z_bytes_;
+          continue;
+        }
       }
+      relayout_spans_.push_back({src, dst, count});
+      dst += count * z_bytes_;
     }
-    active_tile_x_sizes_[active_tile_x_count] = x_dim() - last_x;
-    active_tile_x_count++;
-
-    // When the num_z_bytes parameter is a compile-time constant, the
-    // conditions in the innermost loop will be replaced with a single
-    // optimized path, specialized for that value. Specialization is
-    // provided for num_z_bytes value of 1 and 3. We can also make this a
-    // helper function and still realize the benefits provided we have a
-    // guaranteed way of ensuring this function would be inlined so that the
-    // compiler optimizations based on compile-time-constants can kick in.
-#define RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(num_z_bytes, num_z_bytes_padded) \
-  do {                                                                        \
-    for (int y = 0; y < y_dim(); ++y) {                                       \
-      const auto y_buffer_index = GetYBufferIndex(y);                         \
-      int tile_starting_x = 0;                                                \
-      for (size_t x_tile = 0; x_tile < active_tile_x_count; ++x_tile) {       \
-        const unsigned char* source =                                         \
-            src + GetBufferIndex(y_buffer_index, tile_starting_x, 0) *        \
-                      data_type_size;                                         \
-        const int tile_x_size = active_tile_x_sizes_[x_tile];                 \
-        for (int local_offset_x = 0; local_offset_x < tile_x_size;            \
-             ++local_offset_x) {                                              \
-          if ((num_z_bytes) == 1) {                                           \
-            *dest = *source;                                                  \
-          } else if ((num_z_bytes) == 3) {                                    \
-            *(dest + 0) = *(source + 0);                                      \
-            *(dest + 1) = *(source + 1);                                      \
-            *(dest + 2) = *(source + 2);                                      \
-          } else {                                                            \
-            memcpy(dest, source, (num_z_bytes));                              \
-          }                                                                   \
-          dest += (num_z_bytes);                                              \
-          source += (num_z_bytes_padded);                                     \
-        }                                                                     \
-        tile_starting_x += tile_x_size;                                       \
-      }                                                                       \
-    }                                                                         \
-  } while (0)
-
-    if (z_bytes == 1) {
-      // Specialization for z_bytes = 1 (grayscale image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(1, 4);
-    } else if (z_bytes == 3) {
-      // Specialization for z_bytes = 3 (RGB image).
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(3, 4);
-    } else {
-      // Default.
-      RELAYOUT_WITH_Z_BYTES_SPECIALIZATION(z_bytes, z_bytes_padded);
-    }
-
-#undef RELAYOUT_WITH_Z_BYTES_SPECIALIZATION
   }
 }
 
-void OutputLayer::TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                          int data_type_size, int x_dim,
-                                          int y_dim, int z_dim) {
-  int buffer_index = 0;
-
-  for (int y = 0; y < y_dim; ++y) {
-    for (int x = 0; x < x_dim; ++x) {
-      for (int z = 0; z < z_dim; ++z) {
-        // XORing with 128 on the last byte of each entry will flip the
-        // MSB of each entry. Please note that bytes are stored little
-        // endian.
-        int msb_index = buffer_index + data_type_size - 1;
-        buffer[msb_index] = buffer[msb_index] ^ 128;
-        buffer_index += data_type_size;
+template <int kZBytes, int kZBytesPadded>
+void OutputLayer::CopySpans(uint8_t* dest) const {
+  // Compile-time sizes let the compiler unroll the per-element copy; zero
+  // falls back to the run-time sizes.
+  const int z_bytes = kZBytes ? kZBytes : z_bytes_;
+  const int z_bytes_padded = kZBytesPadded ? kZBytesPadded : z_bytes_padded_;
+  // Single byte elements only need the low byte of the mask.
+  const uint8_t byte_mask = xor_mask_;
+  const uint8_t* src = output_buffer_;
+  for (const auto& span : relayout_spans_) {
+    const uint8_t* source = src + span.src;
+    uint8_t* target = dest + span.dst;
+    for (uint32_t i = 0; i < span.count; ++i) {
+      if (kZBytes == 1) {
+        *target = *source ^ byte_mask;
+      } else if (kZBytes == 3) {
+        *(target + 0) = *(source + 0) ^ byte_mask;
+        *(target + 1) = *(source + 1) ^ byte_mask;
+        *(target + 2) = *(source + 2) ^ byte_mask;
+      } else {
+        CopyWithXor(target, source, z_bytes, xor_mask_);
       }
+      target += z_bytes;
+      source += z_bytes_padded;
     }
   }
 }
 
-void OutputLayer::TransformSignedDataType(uint8_t* buffer,
-                                          int buffer_size) const {
-  if (!SignedDataType()) {
-    return;
-  }
-
-  if (buffer_size < ActualSizeBytes()) {
-    printf("Provided buffer size is less than actual size_bytes.");
-    return;
+void OutputLayer::Relayout(uint8_t* dest) const {
+  if (z_bytes_padded_ == z_bytes_) {
+    const uint8_t* src = output_buffer_;
+    for (const auto& span : relayout_spans_)
+      CopyWithXor(dest + span.dst, src + span.src, span.count * z_bytes_,
+                  xor_mask_);
+  } else if (z_bytes_ == 1 && z_bytes_padded_ == 4) {
+    // Specialization for z_bytes = 1 (grayscale image).
+    CopySpans<1, 4>(dest);
+  } else if (z_bytes_ == 3 && z_bytes_padded_ == 4) {
+    // Specialization for z_bytes = 3 (RGB image).
+    CopySpans<3, 4>(dest);
+  } else {
+    CopySpans<0, 0>(dest);
   }
-
-  TransformSignedDataType(buffer, buffer_size, DataTypeSize(), x_dim(), y_dim(),
-                          z_dim());
 }
 
 // Used in GetBufferIndex(int y, int x, int z)
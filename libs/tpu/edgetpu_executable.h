@@ -20,7 +20,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <map>
+#include <vector>
 
+#include "libs/tpu/edgetpu_buffer_arena.h"
 #include "libs/tpu/edgetpu_driver.h"
 #include "libs/tpu/executable_generated.h"
 #include "third_party/tflite-micro/tensorflow/lite/c/common.h"
@@ -29,22 +31,32 @@ namespace coralmicro {
 
 class OutputLayer {
  public:
-  explicit OutputLayer(const platforms::darwinn::Layer* layer)
-      : output_layer_(layer),
-        output_buffer_(std::make_unique<uint8_t[]>(layer->size_bytes())),
-        active_tile_x_sizes_(std::make_unique<int[]>(x_dim())) {}
+  // Allocates the output buffer from `arena`, or from the heap if `arena` is
+  // nullptr or full.
+  OutputLayer(const platforms::darwinn::Layer* layer,
+              EdgeTpuBufferArena* arena);
+  ~OutputLayer();
   OutputLayer(const OutputLayer&) = delete;
   OutputLayer& operator=(const OutputLayer&) = delete;
-  uint8_t* output_buffer() { return output_buffer_.get(); }
+  uint8_t* output_buffer() { return output_buffer_; }
+  // Switches to the same layer in another copy of the model data.
+  void Rebind(const platforms::darwinn::Layer* layer) { output_layer_ = layer; }
 
   static bool SignedDataType(platforms::darwinn::DataType type);
-  static void TransformSignedDataType(uint8_t* buffer, int buffer_size,
-                                      int data_type_size, int x_dim, int y_dim,
-                                      int z_dim);
+  // Copies the output buffer into `dest` in tensor layout, converting signed
+  // data types on the way.
   void Relayout(uint8_t* dest) const;
-  void TransformSignedDataType(uint8_t* buffer, int buffer_size) const;
 
  private:
+  // A run of `count` output elements of `z_bytes_` bytes, read from `src` in
+  // the output buffer every `z_bytes_padded_` bytes and written contiguously
+  // to `dst` in the tensor.
+  struct RelayoutSpan {
+    uint32_t src;
+    uint32_t dst;
+    uint32_t count;
+  };
+
   struct YBufferIndex {
     // Holds the linearized tile ID for a given y value.
     int y_linearized_tile_id;
@@ -54,6 +66,10 @@ class OutputLayer {
   YBufferIndex GetYBufferIndex(int y) const;
   int GetBufferIndex(int y, int x, int z) const;
   int GetBufferIndex(const YBufferIndex& y_buffer_index, int x, int z) const;
+  // Precomputes `relayout_spans_`, so `Relayout()` needs no layout lookups.
+  void BuildRelayoutPlan();
+  template <int kZBytes, int kZBytesPadded>
+  void CopySpans(uint8_t* dest) const;
 
   int execution_count_per_inference() const {
     return output_layer_->execution_count_per_inference();
@@ -74,24 +90,45 @@ class OutputLayer {
   int z_dim() const { return output_layer_->z_dim(); }
 
   const platforms::darwinn::Layer* output_layer_;
-  std::unique_ptr<uint8_t[]> output_buffer_;
-  std::unique_ptr<int[]> active_tile_x_sizes_;
+  EdgeTpuBufferArena* arena_;
+  uint8_t* output_buffer_;
+  std::vector<RelayoutSpan> relayout_spans_;
+  int z_bytes_;
+  int z_bytes_padded_;
+  // Applied to every copied byte, see `SignedXorMask()`.
+  uint32_t xor_mask_;
 };
 
 class EdgeTpuExecutable {
  public:
-  explicit EdgeTpuExecutable(const platforms::darwinn::Executable* exe);
+  // Output buffers are allocated from `arena`, if not nullptr.
+  EdgeTpuExecutable(const platforms::darwinn::Executable* exe,
+                    EdgeTpuBufferArena* arena);
   ~EdgeTpuExecutable();
   EdgeTpuExecutable(const EdgeTpuExecutable&) = delete;
   EdgeTpuExecutable& operator=(const EdgeTpuExecutable&) = delete;
 
-  TfLiteStatus Invoke(const TpuDriver& tpu_driver, TfLiteContext* context,
-                      TfLiteNode* node);
+  // Runs the executable on `input`, leaving its results in the output layer
+  // buffers. Signed inputs are converted while they are sent, so `input` is
+  // left untouched.
+  TfLiteStatus Invoke(const TpuDriver& tpu_driver, const uint8_t* input);
+  // Copies the results of the last `Invoke()` into the node's output tensors.
+  TfLiteStatus ReadOutputs(TfLiteContext* context, TfLiteNode* node) const;
+  // Copies the result of the last `Invoke()` for output `index` to `dest`,
+  // which must be as large as that output tensor.
+  TfLiteStatus ReadOutput(int index, uint8_t* dest) const;
+  // Switches to `exe`, the same executable in another copy of the model data,
+  // keeping the output buffers and their contents.
+  void Rebind(const platforms::darwinn::Executable* exe);
 
   uint64_t ParameterCachingToken() const {
     return executable_->parameter_caching_token();
   }
 
+  size_t ParameterSize() const {
+    return executable_->parameters() ? executable_->parameters()->size() : 0;
+  }
+
  private:
   const platforms::darwinn::Executable* executable_;
 
@@ -0,0 +1,388 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_fake_transport.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+#include "libs/base/tasks.h"
+#include "libs/base/timer.h"
+#include "libs/tpu/darwinn/driver/config/beagle_csr_helper.h"
+
+namespace coralmicro {
+namespace {
+namespace registers = platforms::darwinn::driver::config::registers;
+
+// A descriptor header: the payload length (4 bytes) and the tag.
+constexpr uint32_t kHeaderSize = 8;
+constexpr size_t kEventSize = 16;
+}  // namespace
+
+FakeTpuTransport::FakeTpuTransport(const FakeTpuTiming& timing)
+    : mutex_(xSemaphoreCreateMutex()),
+      stopped_(xSemaphoreCreateBinary()),
+      timing_(timing),
+      task_timing_(timing) {
+  CHECK(mutex_ && stopped_);
+  // The reset value holds the chip id checked by the driver.
+  registers_[chip_config_.GetApexCsrOffsets().omc0_00] =
+      registers::Omc000().raw();
+  registers_[chip_config_.GetScuCsrOffsets().scu_ctrl_3] =
+      registers::ScuCtrl3().raw();
+  CHECK(xTaskCreate(StaticRun, "fake_edgetpu", configMINIMAL_STACK_SIZE * 10,
+                    this, kEdgeTpuFakeTransportTaskPriority,
+                    &task_) == pdPASS);
+}
+
+FakeTpuTransport::~FakeTpuTransport() {
+  stopping_ = true;
+  xTaskNotifyGive(task_);
+  xSemaphoreTake(stopped_, portMAX_DELAY);
+  vTaskDelete(task_);
+  vSemaphoreDelete(stopped_);
+  vSemaphoreDelete(mutex_);
+}
+
+usb_status_t FakeTpuTransport::Control(usb_setup_struct_t* setup_packet,
+                                       uint8_t* buffer,
+                                       transfer_callback_t callback,
+                                       void* param) {
+  Request request{};
+  request.type = Request::Type::kControl;
+  request.buffer = buffer;
+  request.length = setup_packet->wLength;
+  request.setup_packet = *setup_packet;
+  request.callback = callback;
+  request.param = param;
+  request.submit_us = TimerMicros();
+  return Submit(request);
+}
+
+usb_status_t FakeTpuTransport::BulkOutQueue(
+    uint8_t endpoint, uint8_t* buffer, uint16_t length,
+    usb_host_edgetpu_queued_transfer_t* transfer) {
+  if (endpoint != kSingleBulkOutEndpoint) return kStatus_USB_InvalidParameter;
+  Request request{};
+  request.type = Request::Type::kBulkOut;
+  request.endpoint = endpoint;
+  request.buffer = buffer;
+  request.length = length;
+  request.callback = transfer->callbackFn;
+  request.param = transfer->callbackParam;
+  request.submit_us = TimerMicros();
+  return Submit(request);
+}
+
+usb_status_t FakeTpuTransport::BulkInRecv(uint8_t endpoint, uint8_t* buffer,
+                                          uint32_t length,
+                                          transfer_callback_t callback,
+                                          void* param) {
+  Request request{};
+  request.type = Request::Type::kBulkIn;
+  request.endpoint = endpoint;
+  request.buffer = buffer;
+  request.length = length;
+  request.callback = callback;
+  request.param = param;
+  request.submit_us = TimerMicros();
+  switch (endpoint) {
+    case kSingleBulkOutEndpoint:
+      return Submit(request);
+    case kEventInEndpoint: {
+      MutexLock lock(mutex_);
+      if (event_request_) return kStatus_USB_Busy;
+      event_request_ = request;
+      break;
+    }
+    case kInterruptInEndpoint:
+      // The fake never raises interrupts, so the transfer never completes.
+      return kStatus_USB_Success;
+    default:
+      return kStatus_USB_InvalidParameter;
+  }
+  xTaskNotifyGive(task_);
+  return kStatus_USB_Success;
+}
+
+usb_status_t FakeTpuTransport::CancelEndpoint(uint8_t endpoint,
+                                              uint8_t direction) {
+  Cancel([endpoint, direction](const Request& request) {
+    if (request.type == Request::Type::kControl ||
+        request.endpoint != endpoint)
+      return false;
+    return (request.type == Request::Type::kBulkIn) == (direction == USB_IN);
+  });
+  return kStatus_USB_Success;
+}
+
+usb_status_t FakeTpuTransport::CancelControl() {
+  Cancel([](const Request& request) {
+    return request.type == Request::Type::kControl;
+  });
+  return kStatus_USB_Success;
+}
+
+template <typename Predicate>
+void FakeTpuTransport::Cancel(Predicate cancelled) {
+  std::vector<Request> requests;
+  {
+    MutexLock lock(mutex_);
+    std::copy_if(requests_.begin(), requests_.end(),
+                 std::back_inserter(requests), cancelled);
+    requests_.erase(
+        std::remove_if(requests_.begin(), requests_.end(), cancelled),
+        requests_.end());
+    if (event_request_ && cancelled(*event_request_)) {
+      requests.push_back(*event_request_);
+      event_request_.reset();
+    }
+    stats_.cancelled += static_cast<uint32_t>(requests.size());
+  }
+  // Like the USB host stack, the callbacks run before this returns. A
+  // transfer the task is already processing still completes normally.
+  for (const auto& request : requests) {
+    request.callback(request.param, request.buffer, 0,
+                     kStatus_USB_TransferCancel);
+  }
+}
+
+void FakeTpuTransport::SetTiming(const FakeTpuTiming& timing) {
+  MutexLock lock(mutex_);
+  timing_ = timing;
+}
+
+void FakeTpuTransport::SetOutputs(const uint8_t* data, size_t size) {
+  MutexLock lock(mutex_);
+  outputs_.assign(data, data + size);
+}
+
+FakeTpuStats FakeTpuTransport::GetStats() {
+  MutexLock lock(mutex_);
+  return stats_;
+}
+
+void FakeTpuTransport::ResetStats() {
+  MutexLock lock(mutex_);
+  stats_ = {};
+}
+
+void FakeTpuTransport::StaticRun(void* param) {
+  auto* transport = static_cast<FakeTpuTransport*>(param);
+  transport->Run();
+  xSemaphoreGive(transport->stopped_);
+  vTaskSuspend(nullptr);
+}
+
+void FakeTpuTransport::Run() {
+  while (!stopping_) {
+    Request request;
+    if (PopRequest(&request)) {
+      Process(request);
+      continue;
+    }
+    // The task only runs once the host is blocked, so it has sent all the
+    // data of the executable and is waiting for it.
+    if (executable_ == ExecutableState::kReceived) Execute();
+    if (executable_ == ExecutableState::kDone && SendEvent()) continue;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  }
+}
+
+usb_status_t FakeTpuTransport::Submit(const Request& request) {
+  {
+    MutexLock lock(mutex_);
+    requests_.push_back(request);
+  }
+  xTaskNotifyGive(task_);
+  return kStatus_USB_Success;
+}
+
+bool FakeTpuTransport::PopRequest(Request* request) {
+  MutexLock lock(mutex_);
+  if (requests_.empty()) return false;
+  *request = requests_.front();
+  requests_.pop_front();
+  task_timing_ = timing_;
+  return true;
+}
+
+void FakeTpuTransport::Process(const Request& request) {
+  usb_status_t status = kStatus_USB_Success;
+  switch (request.type) {
+    case Request::Type::kControl:
+      Transfer(request.submit_us, task_timing_.control_us);
+      status = AccessCsr(request.setup_packet, request.buffer);
+      break;
+    case Request::Type::kBulkOut:
+      Transfer(request.submit_us, BulkDuration(request.length));
+      ReceiveData(request.buffer, request.length);
+      break;
+    case Request::Type::kBulkIn:
+      // Output activations only exist once the executable ran.
+      if (executable_ == ExecutableState::kReceived) Execute();
+      Transfer(request.submit_us, BulkDuration(request.length));
+      FillOutputs(request.buffer, request.length);
+      break;
+  }
+  request.callback(request.param, request.buffer, request.length, status);
+}
+
+void FakeTpuTransport::Transfer(uint64_t submit_us, uint32_t duration_us) {
+  const uint64_t end_us = std::max(submit_us, bus_free_us_) + duration_us;
+  while (true) {
+    const uint64_t now_us = TimerMicros();
+    if (now_us >= end_us) break;
+    // Sleep through whole ticks, and yield for the rest.
+    const TickType_t ticks = static_cast<TickType_t>(
+        (end_us - now_us) / (1000 * portTICK_PERIOD_MS));
+    if (ticks > 1)
+      vTaskDelay(ticks - 1);
+    else
+      taskYIELD();
+  }
+  bus_free_us_ = end_us;
+}
+
+void FakeTpuTransport::Execute() {
+  // The executable started once its data arrived.
+  Transfer(bus_free_us_, task_timing_.execute_us);
+  executable_ = ExecutableState::kDone;
+  output_offset_ = 0;
+}
+
+bool FakeTpuTransport::SendEvent() {
+  std::optional<Request> request;
+  {
+    MutexLock lock(mutex_);
+    request.swap(event_request_);
+    if (!request) return false;
+    ++stats_.executables;
+  }
+  // The driver doesn't decode events, so they are all zeros.
+  const uint32_t length =
+      std::min(request->length, static_cast<uint32_t>(kEventSize));
+  std::memset(request->buffer, 0, length);
+  executable_ = ExecutableState::kIdle;
+  request->callback(request->param, request->buffer, length,
+                    kStatus_USB_Success);
+  return true;
+}
+
+usb_status_t FakeTpuTransport::AccessCsr(
+    const usb_setup_struct_t& setup_packet, uint8_t* buffer) {
+  const uint64_t reg = setup_packet.wValue |
+                       (static_cast<uint64_t>(setup_packet.wIndex) << 16);
+  const size_t size = setup_packet.wLength;
+  if (size != sizeof(uint32_t) && size != sizeof(uint64_t))
+    return kStatus_USB_InvalidRequest;
+
+  // Registers are little endian, like the M7.
+  uint64_t value = 0;
+  if (setup_packet.bmRequestType & USB_REQUEST_TYPE_DIR_IN) {
+    auto it = registers_.find(reg);
+    if (it != registers_.end()) value = it->second;
+    std::memcpy(buffer, &value, size);
+    MutexLock lock(mutex_);
+    ++stats_.csr_reads;
+  } else {
+    std::memcpy(&value, buffer, size);
+    WriteCsr(reg, value);
+    MutexLock lock(mutex_);
+    ++stats_.csr_writes;
+  }
+  return kStatus_USB_Success;
+}
+
+void FakeTpuTransport::WriteCsr(uint64_t reg, uint64_t value) {
+  if (reg == chip_config_.GetScuCsrOffsets().scu_ctrl_3) {
+    // The power state follows the requested sleep mode at once: forced sleep
+    // (3) holds the chip in reset (state 2), anything else runs it (state 0).
+    registers::ScuCtrl3 scu_ctrl_3(value);
+    const bool reset = scu_ctrl_3.rg_force_sleep() == 0x3;
+    scu_ctrl_3.set_cur_pwr_state(reset ? 0x2 : 0x0);
+    value = scu_ctrl_3.raw();
+    if (reset) {
+      registers_[chip_config_.GetScalarCoreCsrOffsets()
+                     .scalarCoreRunControl] = 0;
+      executable_ = ExecutableState::kIdle;
+      descriptor_left_ = 0;
+    }
+  }
+  registers_[reg] = value;
+}
+
+void FakeTpuTransport::ReceiveData(const uint8_t* data, uint32_t length) {
+  if (descriptor_left_ == 0) {
+    // The driver sends each header in a transfer of its own.
+    if (length != kHeaderSize) {
+      printf("Fake Edge TPU: expected a descriptor header\r\n");
+      return;
+    }
+    std::memcpy(&descriptor_left_, data, sizeof(descriptor_left_));
+    descriptor_tag_ = static_cast<DescriptorTag>(data[4] & 0xF);
+    return;
+  }
+
+  const uint32_t bytes = std::min(length, descriptor_left_);
+  descriptor_left_ -= bytes;
+  MutexLock lock(mutex_);
+  switch (descriptor_tag_) {
+    case DescriptorTag::kInstructions:
+      stats_.instruction_bytes += bytes;
+      executable_ = ExecutableState::kReceived;
+      break;
+    case DescriptorTag::kParameters:
+      stats_.parameter_bytes += bytes;
+      break;
+    case DescriptorTag::kInputActivations:
+      stats_.input_bytes += bytes;
+      break;
+    default:
+      break;
+  }
+}
+
+void FakeTpuTransport::FillOutputs(uint8_t* data, uint32_t length) {
+  MutexLock lock(mutex_);
+  stats_.output_bytes += length;
+  if (outputs_.empty()) {
+    std::memset(data, 0, length);
+    return;
+  }
+  for (uint32_t i = 0; i < length;) {
+    const size_t chunk = std::min<size_t>(length - i,
+                                          outputs_.size() - output_offset_);
+    std::memcpy(data + i, outputs_.data() + output_offset_, chunk);
+    i += chunk;
+    output_offset_ = (output_offset_ + chunk) % outputs_.size();
+  }
+}
+
+uint32_t FakeTpuTransport::BulkDuration(uint32_t length) const {
+  uint32_t duration_us = task_timing_.bulk_overhead_us;
+  if (task_timing_.bulk_mbps) {
+    duration_us +=
+        static_cast<uint32_t>(length * 8ull / task_timing_.bulk_mbps);
+  }
+  return duration_us;
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,181 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_FAKE_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_FAKE_TRANSPORT_H_
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <optional>
+#include <vector>
+
+#include "libs/tpu/darwinn/driver/config/beagle/beagle_chip_config.h"
+#include "libs/tpu/edgetpu_driver.h"
+#include "libs/tpu/edgetpu_transport.h"
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
+
+namespace coralmicro {
+
+// Time the simulated Edge TPU takes for each kind of work.
+struct FakeTpuTiming {
+  // Time of a control transfer (one register access).
+  uint32_t control_us;
+  // Fixed cost of a bulk transfer, on top of the time of its bytes.
+  uint32_t bulk_overhead_us;
+  // Throughput of bulk transfers in megabits per second, or 0 for no limit.
+  uint32_t bulk_mbps;
+  // Time an executable runs once the Edge TPU has its data.
+  uint32_t execute_us;
+};
+
+// Counters of the traffic handled by a `FakeTpuTransport`.
+struct FakeTpuStats {
+  uint32_t csr_reads;
+  uint32_t csr_writes;
+  // Descriptor payloads received, by kind.
+  uint64_t instruction_bytes;
+  uint64_t parameter_bytes;
+  uint64_t input_bytes;
+  // Output activations sent back.
+  uint64_t output_bytes;
+  // Executables run, each reported with an event.
+  uint32_t executables;
+  // Transfers completed with `kStatus_USB_TransferCancel`.
+  uint32_t cancelled;
+};
+
+// A `TpuTransport` that simulates an Edge TPU instead of reaching one, so the
+// driver and the invocation path can run (and be benchmarked) without the
+// chip. Pass it to `EdgeTpuManager::SetTransport()` before `OpenDevice()`.
+//
+// The fake keeps a register file that answers the accesses made by
+// `TpuDriver::Initialize()`, and follows the descriptors sent on the bulk
+// endpoint. Once it received instructions, it runs the executable when the
+// host reads output activations or stops sending data, and then completes the
+// transfer posted on the event endpoint. Output activations are the
+// `SetOutputs()` data, repeated as needed.
+//
+// Transfers complete in submission order, in a task of lower priority than
+// the Edge TPU tasks, after the time set by `FakeTpuTiming`. That time counts
+// from submission, as if the transfers ran alongside the CPU, but the fake
+// only makes progress while the tasks using the Edge TPU are blocked.
+class FakeTpuTransport : public TpuTransport {
+ public:
+  explicit FakeTpuTransport(const FakeTpuTiming& timing);
+  ~FakeTpuTransport() override;
+  FakeTpuTransport(const FakeTpuTransport&) = delete;
+  FakeTpuTransport& operator=(const FakeTpuTransport&) = delete;
+
+  usb_status_t Control(usb_setup_struct_t* setup_packet, uint8_t* buffer,
+                       transfer_callback_t callback, void* param) override;
+  usb_status_t BulkOutQueue(
+      uint8_t endpoint, uint8_t* buffer, uint16_t length,
+      usb_host_edgetpu_queued_transfer_t* transfer) override;
+  usb_status_t BulkInRecv(uint8_t endpoint, uint8_t* buffer, uint32_t length,
+                          transfer_callback_t callback, void* param) override;
+  usb_status_t CancelEndpoint(uint8_t endpoint, uint8_t direction) override;
+  usb_status_t CancelControl() override;
+
+  // Sets the timing of transfers submitted from now on.
+  void SetTiming(const FakeTpuTiming& timing);
+  // Sets the output activations returned by every executable, starting over
+  // for each one. Outputs are zeros by default.
+  void SetOutputs(const uint8_t* data, size_t size);
+
+  FakeTpuStats GetStats();
+  void ResetStats();
+
+ private:
+  struct Request {
+    enum class Type : uint8_t {
+      kControl,
+      kBulkOut,
+      kBulkIn,
+    };
+
+    Type type;
+    uint8_t endpoint;
+    uint8_t* buffer;
+    uint32_t length;
+    usb_setup_struct_t setup_packet;
+    transfer_callback_t callback;
+    void* param;
+    uint64_t submit_us;
+  };
+
+  enum class ExecutableState {
+    kIdle,
+    // Instructions received, not run yet.
+    kReceived,
+    // Run, the event isn't sent yet.
+    kDone,
+  };
+
+  static void StaticRun(void* param);
+  void Run();
+  // Adds `request` to the transfers in flight and wakes the task.
+  usb_status_t Submit(const Request& request);
+  // Takes the oldest request, along with the current timing.
+  bool PopRequest(Request* request);
+  // Removes the requests for which `cancelled` returns true, and completes
+  // them with `kStatus_USB_TransferCancel`.
+  template <typename Predicate>
+  void Cancel(Predicate cancelled);
+  void Process(const Request& request);
+  // Waits until the bus is free and `duration_us` later.
+  void Transfer(uint64_t submit_us, uint32_t duration_us);
+  void Execute();
+  // Completes the posted event transfer, if any.
+  bool SendEvent();
+  usb_status_t AccessCsr(const usb_setup_struct_t& setup_packet,
+                         uint8_t* buffer);
+  void WriteCsr(uint64_t reg, uint64_t value);
+  void ReceiveData(const uint8_t* data, uint32_t length);
+  void FillOutputs(uint8_t* data, uint32_t length);
+  uint32_t BulkDuration(uint32_t length) const;
+
+  platforms::darwinn::driver::config::BeagleChipConfig chip_config_;
+  // Protects the members shared with the callers: `requests_`,
+  // `event_request_`, `timing_`, `outputs_` and `stats_`.
+  SemaphoreHandle_t mutex_;
+  SemaphoreHandle_t stopped_;
+  TaskHandle_t task_;
+  volatile bool stopping_ = false;
+  std::deque<Request> requests_;
+  std::optional<Request> event_request_;
+  FakeTpuTiming timing_;
+  std::vector<uint8_t> outputs_;
+  FakeTpuStats stats_{};
+
+  // Only used by the task: `timing_` as of the request being processed, and
+  // the state of the simulated device.
+  FakeTpuTiming task_timing_;
+  std::map<uint64_t, uint64_t> registers_;
+  // Time the last transfer or executable finished.
+  uint64_t bus_free_us_ = 0;
+  ExecutableState executable_ = ExecutableState::kIdle;
+  // Payload left in the current descriptor, and its kind.
+  uint32_t descriptor_left_ = 0;
+  DescriptorTag descriptor_tag_ = DescriptorTag::kUnknown;
+  size_t output_offset_ = 0;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_FAKE_TRANSPORT_H_
@@ -16,14 +16,20 @@
 
 #include "libs/tpu/edgetpu_manager.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 
 #include "libs/base/check.h"
 #include "libs/base/mutex.h"
+#include "libs/base/tasks.h"
+#include "libs/base/timer.h"
 #include "libs/tpu/edgetpu_task.h"
 #include "third_party/flatbuffers/include/flatbuffers/flatbuffers.h"
 #include "third_party/flatbuffers/include/flatbuffers/flexbuffers.h"
 #include "third_party/nxp/rt1176-sdk/components/osa/fsl_os_abstraction.h"
+#include "tensorflow/lite/micro/kernels/kernel_util.h"
+#include "tensorflow/lite/micro/memory_helpers.h"
 
 namespace coralmicro {
 namespace {
@@ -31,6 +37,86 @@ constexpr char kKeyVersion[] = "1";
 constexpr char kKeyChipName[] = "2";
 constexpr char kKeyParamCache_DEPRECATED[] = "3";
 constexpr char kKeyExecutable[] = "4";
+// Edge TPU on-chip memory available for cached parameters.
+constexpr size_t kParameterCacheBytes = 8 * 1024 * 1024;
+// Invocations that can be queued for the invoke task at once.
+constexpr int kInvokeQueueLength = 4;
+
+// Finds the executables within the Edge TPU custom op data.
+bool ParsePackage(
+    const char* package_content, size_t length,
+    const platforms::darwinn::Executable** inference_exe,
+    const platforms::darwinn::Executable** parameter_caching_exe) {
+  auto flexbuffer_map =
+      flexbuffers::GetRoot((const uint8_t*)package_content, length).AsMap();
+  auto package_binary = flexbuffer_map[kKeyExecutable].AsString();
+  flatbuffers::Verifier package_verifier((const uint8_t*)package_binary.c_str(),
+                                         package_binary.length());
+  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
+    printf("Package verification failed.\r\n");
+    return false;
+  }
+
+  auto* package =
+      flatbuffers::GetRoot<platforms::darwinn::Package>(package_binary.c_str());
+  if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
+    printf("No executables to register.\r\n");
+    return false;
+  }
+
+  auto* multi_executable =
+      flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
+          package->serialized_multi_executable()->data());
+  flatbuffers::Verifier multi_executable_verifier(
+      package->serialized_multi_executable()->data(),
+      flatbuffers::VectorLength(package->serialized_multi_executable()));
+  if (!multi_executable_verifier
+           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
+    printf("MultiExecutable verification failed.\r\n");
+    return false;
+  }
+
+  *inference_exe = nullptr;
+  *parameter_caching_exe = nullptr;
+  for (const auto* executable_serialized :
+       *(multi_executable->serialized_executables())) {
+    flatbuffers::Verifier verifier(
+        (const uint8_t*)executable_serialized->c_str(),
+        executable_serialized->size());
+    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
+      printf("Executable verification failed.\r\n");
+      return false;
+    }
+
+    const auto* executable =
+        flatbuffers::GetRoot<platforms::darwinn::Executable>(
+            (const uint8_t*)executable_serialized->c_str());
+    if (executable->type() ==
+            platforms::darwinn::ExecutableType_EXECUTION_ONLY ||
+        executable->type() == platforms::darwinn::ExecutableType_STAND_ALONE) {
+      *inference_exe = executable;
+    } else if (executable->type() ==
+               platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
+      *parameter_caching_exe = executable;
+    }
+  }
+
+  if (*inference_exe == nullptr) {
+    printf("Package does not have inference executable.\r\n");
+    return false;
+  }
+  return true;
+}
+
+// FNV-1a, seeded with the length.
+uint64_t ContentHash(const char* content, size_t length) {
+  uint64_t hash = 14695981039346656037ull ^ length;
+  for (size_t i = 0; i < length; ++i) {
+    hash ^= static_cast<uint8_t>(content[i]);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
 }  // namespace
 
 EdgeTpuContext::EdgeTpuContext() {
@@ -43,8 +129,14 @@ EdgeTpuContext::~EdgeTpuContext() {
   vTaskDelay(pdMS_TO_TICKS(30));
 }
 
-EdgeTpuManager::EdgeTpuManager() : mutex_(xSemaphoreCreateMutex()) {
+EdgeTpuManager::EdgeTpuManager()
+    : parameter_cache_(kParameterCacheBytes),
+      mutex_(xSemaphoreCreateMutex()),
+      invoke_queue_(
+          xQueueCreate(kInvokeQueueLength, sizeof(EdgeTpuAsyncInvoke*))) {
   CHECK(mutex_);
+  CHECK(invoke_queue_);
+  tpu_driver_.SetProfiler(&profiler_);
 }
 
 void EdgeTpuManager::NotifyConnected(
@@ -53,12 +145,17 @@ void EdgeTpuManager::NotifyConnected(
 
   // The EdgeTPU has left the USB bus -- clean up state.
   if (!usb_instance_) {
-    current_parameter_caching_token_ = 0;
+    parameter_cache_.Clear();
   }
 }
 
 void EdgeTpuManager::NotifyError() { usb_error_ = true; }
 
+void EdgeTpuManager::SetTransport(TpuTransport* transport) {
+  MutexLock lock(mutex_);
+  transport_ = transport;
+}
+
 std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
     PerformanceMode mode) {
   MutexLock lock(mutex_);
@@ -66,9 +163,11 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
   auto context = context_.lock();
   if (context) return context;
 
+  const uint64_t start_us = TimerMicros();
   context = std::make_shared<EdgeTpuContext>();
 
-  while (!usb_instance_) {
+  TpuTransport* transport = transport_;
+  while (!transport && !usb_instance_) {
     if (usb_error_) {
       printf("%s: Error encountered while bringing up the tpu\r\n", __func__);
       usb_error_ = false;  // Reset error.
@@ -78,10 +177,20 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
     vTaskDelay(pdMS_TO_TICKS(100));
   }
 
-  // Got tpu usb instance, init the tpu driver.
-  if (!tpu_driver_.Initialize(usb_instance_, mode)) {
+  if (!transport) {
+    // Got tpu usb instance, init the tpu driver.
+    usb_transport_.SetInstance(usb_instance_);
+    transport = &usb_transport_;
+  }
+  const uint64_t initialize_start_us = TimerMicros();
+  if (!tpu_driver_.Initialize(transport, mode)) {
     return nullptr;
   }
+  const uint64_t end_us = TimerMicros();
+  startup_stats_ = {static_cast<uint32_t>(initialize_start_us - start_us),
+                    static_cast<uint32_t>(end_us - initialize_start_us),
+                    tpu_driver_.GetInitializeStats().transfers,
+                    static_cast<uint32_t>(end_us - start_us)};
 
   context_ = context;
   return context;
@@ -90,104 +199,341 @@ std::shared_ptr<EdgeTpuContext> EdgeTpuManager::OpenDevice(
 EdgeTpuPackage* EdgeTpuManager::RegisterPackage(const char* package_content,
                                                 size_t length) {
   MutexLock lock(mutex_);
-  auto package_ptr = (uintptr_t)package_content;
-
-  if (packages_.find(package_ptr) != packages_.end()) {
-    return packages_[package_ptr];
+  const uint64_t hash = ContentHash(package_content, length);
+  auto range = packages_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    auto& entry = it->second;
+    // Only share the package if the content really matches, not just the
+    // hash.
+    if (entry.length != length ||
+        std::memcmp(package_content, entry.contents.front(), length) != 0)
+      continue;
+    entry.contents.push_back(package_content);
+    return entry.package.get();
   }
 
-  auto flexbuffer_map =
-      flexbuffers::GetRoot((const uint8_t*)package_ptr, length).AsMap();
-  auto package_binary = flexbuffer_map[kKeyExecutable].AsString();
-  flatbuffers::Verifier package_verifier((const uint8_t*)package_binary.c_str(),
-                                         package_binary.length());
-  if (!package_verifier.VerifyBuffer<platforms::darwinn::Package>()) {
-    printf("Package verification failed.\r\n");
+  const platforms::darwinn::Executable* inference_exe;
+  const platforms::darwinn::Executable* parameter_caching_exe;
+  if (!ParsePackage(package_content, length, &inference_exe,
+                    &parameter_caching_exe)) {
     return nullptr;
   }
 
-  auto* package =
-      flatbuffers::GetRoot<platforms::darwinn::Package>(package_binary.c_str());
-  if (flatbuffers::VectorLength(package->serialized_multi_executable()) == 0) {
-    printf("No executables to register.\r\n");
-    return nullptr;
+  auto& entry = packages_.emplace(hash, PackageEntry{})->second;
+  entry.package = std::make_unique<EdgeTpuPackage>(
+      inference_exe, parameter_caching_exe, buffer_arena_);
+  entry.contents.push_back(package_content);
+  entry.length = length;
+  return entry.package.get();
+}
+
+void EdgeTpuManager::ReleasePackage(EdgeTpuPackage* package,
+                                    const char* package_content) {
+  MutexLock lock(mutex_);
+  auto it = FindPackage(package);
+  CHECK(it != packages_.end());
+  ReleasePackageLocked(it, package_content);
+}
+
+void EdgeTpuManager::ReleasePackageLocked(
+    std::multimap<uint64_t, PackageEntry>::iterator it,
+    const char* package_content) {
+  auto& entry = it->second;
+  auto content =
+      std::find(entry.contents.begin(), entry.contents.end(), package_content);
+  CHECK(content != entry.contents.end());
+  const bool backing = content == entry.contents.begin();
+  entry.contents.erase(content);
+
+  if (entry.contents.empty()) {
+    parameter_cache_.Remove(entry.package.get());
+    packages_.erase(it);
+  } else if (backing && entry.contents.front() != package_content) {
+    // The model data the package points into may go away with its owner,
+    // so switch to another copy.
+    const platforms::darwinn::Executable* inference_exe;
+    const platforms::darwinn::Executable* parameter_caching_exe;
+    CHECK(ParsePackage(entry.contents.front(), entry.length, &inference_exe,
+                       &parameter_caching_exe));
+    entry.package->Rebind(inference_exe, parameter_caching_exe);
   }
+}
 
-  auto* multi_executable =
-      flatbuffers::GetRoot<platforms::darwinn::MultiExecutable>(
-          package->serialized_multi_executable()->data());
-  flatbuffers::Verifier multi_executable_verifier(
-      package->serialized_multi_executable()->data(),
-      flatbuffers::VectorLength(package->serialized_multi_executable()));
-  if (!multi_executable_verifier
-           .VerifyBuffer<platforms::darwinn::MultiExecutable>()) {
-    printf("MultiExecutable verification failed.\r\n");
-    return nullptr;
+std::multimap<uint64_t, EdgeTpuManager::PackageEntry>::iterator
+EdgeTpuManager::FindPackage(const EdgeTpuPackage* package) {
+  for (auto it = packages_.begin(); it != packages_.end(); ++it) {
+    if (it->second.package.get() == package) return it;
   }
+  return packages_.end();
+}
 
-  const platforms::darwinn::Executable* inference_exe = nullptr;
-  const platforms::darwinn::Executable* parameter_caching_exe = nullptr;
+bool EdgeTpuManager::PackageInRange(const PackageEntry& entry,
+                                    const void* begin, size_t size) {
+  auto* first = static_cast<const char*>(begin);
+  for (const char* content : entry.contents) {
+    if (content >= first && content < first + size) return true;
+  }
+  return false;
+}
 
-  for (const auto* executable_serialized :
-       *(multi_executable->serialized_executables())) {
-    flatbuffers::Verifier verifier(
-        (const uint8_t*)executable_serialized->c_str(),
-        executable_serialized->size());
-    if (!verifier.VerifyBuffer<platforms::darwinn::Executable>()) {
-      printf("Executable verification failed.\r\n");
-      return nullptr;
+void EdgeTpuManager::SetBufferArena(EdgeTpuBufferArena* arena) {
+  MutexLock lock(mutex_);
+  buffer_arena_ = arena;
+}
+
+TfLiteStatus EdgeTpuManager::Invoke(EdgeTpuPackage* package,
+                                    TfLiteContext* context, TfLiteNode* node) {
+  const TfLiteEvalTensor* input_tensor =
+      tflite::micro::GetEvalInput(context, node, 0);
+  if (!input_tensor) {
+    return kTfLiteError;
+  }
+
+  MutexLock lock(mutex_);
+  TfLiteStatus status = InvokeLocked(package, input_tensor->data.uint8);
+  if (status != kTfLiteOk) return status;
+  return ReadOutputs(package, context, node);
+}
+
+TfLiteStatus EdgeTpuManager::InvokeAsync(EdgeTpuPackage* package,
+                                         EdgeTpuAsyncInvoke* async,
+                                         TfLiteContext* context,
+                                         TfLiteNode* node,
+                                         EdgeTpuInvokeCallback callback,
+                                         void* param) {
+  if (async->pending) {
+    printf("Edge TPU invocation already in flight\r\n");
+    return kTfLiteError;
+  }
+
+  const TfLiteEvalTensor* input_tensor =
+      tflite::micro::GetEvalInput(context, node, 0);
+  size_t input_bytes;
+  if (!input_tensor ||
+      tflite::TfLiteEvalTensorByteLength(input_tensor, &input_bytes) !=
+          kTfLiteOk) {
+    return kTfLiteError;
+  }
+  if (async->input_capacity < input_bytes) {
+    async->input = std::make_unique<uint8_t[]>(input_bytes);
+    async->input_capacity = input_bytes;
+  }
+  async->outputs.resize(node->outputs->size);
+  for (int i = 0; i < node->outputs->size; ++i) {
+    const TfLiteEvalTensor* output_tensor =
+        tflite::micro::GetEvalOutput(context, node, i);
+    size_t output_bytes;
+    if (!output_tensor ||
+        tflite::TfLiteEvalTensorByteLength(output_tensor, &output_bytes) !=
+            kTfLiteOk) {
+      return kTfLiteError;
     }
+    async->outputs[i].resize(output_bytes);
+  }
+  if (!async->done) {
+    async->done = xSemaphoreCreateBinary();
+    CHECK(async->done);
+  }
+  std::memcpy(async->input.get(), input_tensor->data.uint8, input_bytes);
+  async->package = package;
+  async->callback = callback;
+  async->callback_param = param;
+  async->pending = true;
 
-    const auto* executable =
-        flatbuffers::GetRoot<platforms::darwinn::Executable>(
-            (const uint8_t*)executable_serialized->c_str());
-    if (executable->type() ==
-            platforms::darwinn::ExecutableType_EXECUTION_ONLY ||
-        executable->type() == platforms::darwinn::ExecutableType_STAND_ALONE) {
-      inference_exe = executable;
-    } else if (executable->type() ==
-               platforms::darwinn::ExecutableType_PARAMETER_CACHING) {
-      parameter_caching_exe = executable;
+  {
+    MutexLock lock(mutex_);
+    if (!invoke_task_) {
+      CHECK(xTaskCreate(StaticInvokeTask, "edgetpu_invoke",
+                        configMINIMAL_STACK_SIZE * 10, this,
+                        kEdgeTpuInvokeTaskPriority, &invoke_task_) == pdPASS);
     }
   }
+  CHECK(xQueueSend(invoke_queue_, &async, portMAX_DELAY) == pdTRUE);
+  return kTfLiteOk;
+}
 
-  if (inference_exe == nullptr) {
-    printf("Package does not have inference executable.\r\n");
-    return nullptr;
+TfLiteStatus EdgeTpuManager::WaitForInvoke(EdgeTpuAsyncInvoke* async,
+                                           TfLiteContext* context,
+                                           TfLiteNode* node,
+                                           TickType_t timeout) {
+  if (!async->pending) {
+    printf("No Edge TPU invocation in flight\r\n");
+    return kTfLiteError;
+  }
+  if (xSemaphoreTake(async->done, timeout) == pdFALSE) {
+    return kTfLiteError;
+  }
+  async->pending = false;
+  if (async->status != kTfLiteOk) return async->status;
+  async->has_result = true;
+  return ReadLastOutputs(async, context, node);
+}
+
+TfLiteStatus EdgeTpuManager::ReadLastOutputs(const EdgeTpuAsyncInvoke* async,
+                                             TfLiteContext* context,
+                                             TfLiteNode* node) {
+  if (!async->has_result ||
+      async->outputs.size() != static_cast<size_t>(node->outputs->size)) {
+    return kTfLiteError;
+  }
+  for (int i = 0; i < node->outputs->size; ++i) {
+    const TfLiteEvalTensor* output_tensor =
+        tflite::micro::GetEvalOutput(context, node, i);
+    size_t output_bytes;
+    if (!output_tensor ||
+        tflite::TfLiteEvalTensorByteLength(output_tensor, &output_bytes) !=
+            kTfLiteOk ||
+        output_bytes != async->outputs[i].size()) {
+      return kTfLiteError;
+    }
+    std::memcpy(output_tensor->data.uint8, async->outputs[i].data(),
+                output_bytes);
   }
+  return kTfLiteOk;
+}
 
-  auto* edgetpu_package =
-      new EdgeTpuPackage(inference_exe, parameter_caching_exe);
-  packages_[package_ptr] = edgetpu_package;
+void EdgeTpuManager::FinishInvoke(EdgeTpuAsyncInvoke* async) {
+  if (!async->pending) return;
+  CHECK(xSemaphoreTake(async->done, portMAX_DELAY) == pdTRUE);
+  async->pending = false;
+}
 
-  return edgetpu_package;
+TfLiteStatus EdgeTpuManager::ReadOutputs(EdgeTpuPackage* package,
+                                         TfLiteContext* context,
+                                         TfLiteNode* node) {
+  const uint64_t start_us = TimerMicros();
+  TfLiteStatus status = package->inference_exe()->ReadOutputs(context, node);
+  if (profiler_.enabled()) {
+    size_t bytes = 0;
+    for (int i = 0; i < node->outputs->size; ++i) {
+      size_t output_bytes;
+      const TfLiteEvalTensor* output_tensor =
+          tflite::micro::GetEvalOutput(context, node, i);
+      if (output_tensor && tflite::TfLiteEvalTensorByteLength(
+                               output_tensor, &output_bytes) == kTfLiteOk)
+        bytes += output_bytes;
+    }
+    profiler_.Record(EdgeTpuProfilePhase::kRelayout, start_us, bytes);
+  }
+  return status;
 }
 
-TfLiteStatus EdgeTpuManager::Invoke(EdgeTpuPackage* package,
-                                    TfLiteContext* context, TfLiteNode* node) {
-  MutexLock lock(mutex_);
-  if (package->parameter_caching_exe()) {
-    auto token = package->parameter_caching_exe()->ParameterCachingToken();
-    if (token != current_parameter_caching_token_) {
-      cached_packages_.fill(nullptr);
-      package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-      current_parameter_caching_token_ = token;
-      cached_packages_[0] = package;
-    } else {
-      for (auto& cached_package : cached_packages_) {
-        if (cached_package == package) {
-          break;
-        } else if (cached_package == nullptr) {
-          package->parameter_caching_exe()->Invoke(tpu_driver_, context, node);
-          cached_package = package;
-        }
-      }
+TfLiteStatus EdgeTpuManager::CopyOutputsLocked(EdgeTpuAsyncInvoke* async) {
+  const uint64_t start_us = TimerMicros();
+  size_t bytes = 0;
+  for (size_t i = 0; i < async->outputs.size(); ++i) {
+    auto& output = async->outputs[i];
+    if (async->package->inference_exe()->ReadOutput(i, output.data()) !=
+        kTfLiteOk) {
+      return kTfLiteError;
     }
-  } else {
-    current_parameter_caching_token_ = 0;
+    bytes += output.size();
   }
+  profiler_.Record(EdgeTpuProfilePhase::kRelayout, start_us, bytes);
+  return kTfLiteOk;
+}
+
+void EdgeTpuManager::StaticInvokeTask(void* param) {
+  static_cast<EdgeTpuManager*>(param)->InvokeTask();
+}
+
+void EdgeTpuManager::InvokeTask() {
+  while (true) {
+    EdgeTpuAsyncInvoke* async;
+    CHECK(xQueueReceive(invoke_queue_, &async, portMAX_DELAY) == pdTRUE);
+    {
+      MutexLock lock(mutex_);
+      async->status = InvokeLocked(async->package, async->input.get());
+      // Another interpreter of the same model may run the package as soon as
+      // the mutex is released, so take the results now.
+      if (async->status == kTfLiteOk) async->status = CopyOutputsLocked(async);
+    }
+    if (async->callback) async->callback(async->status, async->callback_param);
+    xSemaphoreGive(async->done);
+  }
+}
+
+TfLiteStatus EdgeTpuManager::InvokeLocked(EdgeTpuPackage* package,
+                                          const uint8_t* input) {
+  const TpuTransferStats start_stats = tpu_driver_.GetTransferStats();
+  const uint64_t start_us = TimerMicros();
+  profiler_.BeginInvoke();
+  TfLiteStatus status = CacheParametersLocked(package, input);
+  if (status == kTfLiteOk) {
+    status = package->inference_exe()->Invoke(tpu_driver_, input);
+  }
+  profiler_.EndInvoke();
 
-  return package->inference_exe()->Invoke(tpu_driver_, context, node);
+  const TpuTransferStats stats = tpu_driver_.GetTransferStats();
+  last_invoke_stats_.bytes_transferred =
+      (stats.bytes_copied - start_stats.bytes_copied) +
+      (stats.bytes_direct - start_stats.bytes_direct);
+  last_invoke_stats_.duration_us = TimerMicros() - start_us;
+  last_invoke_stats_.throughput_mbps =
+      last_invoke_stats_.duration_us
+          ? static_cast<float>(last_invoke_stats_.bytes_transferred) /
+                last_invoke_stats_.duration_us
+          : 0.0f;
+  return status;
+}
+
+TfLiteStatus EdgeTpuManager::CacheParametersLocked(EdgeTpuPackage* package,
+                                                   const uint8_t* input) {
+  auto* caching_exe = package->parameter_caching_exe();
+  if (!caching_exe) {
+    parameter_cache_.Use(package, 0, 0);
+    return kTfLiteOk;
+  }
+  if (!parameter_cache_.Use(package, caching_exe->ParameterCachingToken(),
+                            caching_exe->ParameterSize())) {
+    return kTfLiteOk;
+  }
+  TfLiteStatus status = caching_exe->Invoke(tpu_driver_, input);
+  if (status != kTfLiteOk) parameter_cache_.Invalidate(package);
+  return status;
+}
+
+bool EdgeTpuManager::PinModel(const void* model_data, size_t model_size,
+                              bool pinned) {
+  MutexLock lock(mutex_);
+  bool found = false;
+  for (auto& item : packages_) {
+    auto& entry = item.second;
+    auto* caching_exe = entry.package->parameter_caching_exe();
+    if (!caching_exe || !PackageInRange(entry, model_data, model_size))
+      continue;
+    parameter_cache_.SetPinned(entry.package.get(),
+                               caching_exe->ParameterCachingToken(),
+                               caching_exe->ParameterSize(), pinned);
+    found = true;
+  }
+  return found;
+}
+
+bool EdgeTpuManager::PrefetchModel(const void* model_data, size_t model_size) {
+  MutexLock lock(mutex_);
+  if (!context_.lock()) return false;
+  bool found = false;
+  for (auto& item : packages_) {
+    auto& entry = item.second;
+    if (!entry.package->parameter_caching_exe() ||
+        !PackageInRange(entry, model_data, model_size))
+      continue;
+    if (CacheParametersLocked(entry.package.get(), nullptr) != kTfLiteOk)
+      return false;
+    found = true;
+  }
+  return found;
+}
+
+EdgeTpuParameterCacheStats EdgeTpuManager::GetParameterCacheStats() {
+  MutexLock lock(mutex_);
+  return parameter_cache_.GetStats();
+}
+
+void EdgeTpuManager::ResetParameterCacheStats() {
+  MutexLock lock(mutex_);
+  parameter_cache_.ResetStats();
 }
 
 std::optional<float> EdgeTpuManager::GetTemperature() {
@@ -198,4 +544,34 @@ std::optional<float> EdgeTpuManager::GetTemperature() {
   return std::nullopt;
 }
 
+TpuTransferStats EdgeTpuManager::GetTransferStats() {
+  MutexLock lock(mutex_);
+  return tpu_driver_.GetTransferStats();
+}
+
+void EdgeTpuManager::ResetTransferStats() {
+  MutexLock lock(mutex_);
+  tpu_driver_.ResetTransferStats();
+}
+
+TpuEventStats EdgeTpuManager::GetEventStats() {
+  MutexLock lock(mutex_);
+  return tpu_driver_.GetEventStats();
+}
+
+void EdgeTpuManager::ResetEventStats() {
+  MutexLock lock(mutex_);
+  tpu_driver_.ResetEventStats();
+}
+
+EdgeTpuInvokeStats EdgeTpuManager::GetLastInvokeStats() {
+  MutexLock lock(mutex_);
+  return last_invoke_stats_;
+}
+
+EdgeTpuStartupStats EdgeTpuManager::GetStartupStats() {
+  MutexLock lock(mutex_);
+  return startup_stats_;
+}
+
 }  // namespace coralmicro
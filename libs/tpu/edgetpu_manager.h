@@ -21,13 +21,20 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
 
+#include "libs/tpu/edgetpu_buffer_arena.h"
 #include "libs/tpu/edgetpu_driver.h"
 #include "libs/tpu/edgetpu_executable.h"
+#include "libs/tpu/edgetpu_parameter_cache.h"
+#include "libs/tpu/edgetpu_profiler.h"
+#include "libs/tpu/edgetpu_transport.h"
 #include "libs/tpu/executable_generated.h"
 #include "libs/tpu/usb_host_edgetpu.h"
 #include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/queue.h"
 #include "third_party/freertos_kernel/include/semphr.h"
+#include "third_party/freertos_kernel/include/task.h"
 #include "third_party/tflite-micro/tensorflow/lite/c/common.h"
 
 namespace coralmicro {
@@ -53,27 +60,92 @@ class EdgeTpuContext {
 };
 
 // @cond Do not generate docs
+// Called from the Edge TPU invoke task when an invocation started with
+// `EdgeTpuManager::InvokeAsync()` completes.
+using EdgeTpuInvokeCallback = void (*)(TfLiteStatus status, void* param);
+
 class EdgeTpuPackage {
  public:
   EdgeTpuPackage(const platforms::darwinn::Executable* inference_exe,
-                 const platforms::darwinn::Executable* parameter_caching_exe) {
-    inference_ = std::make_unique<EdgeTpuExecutable>(inference_exe);
+                 const platforms::darwinn::Executable* parameter_caching_exe,
+                 EdgeTpuBufferArena* arena) {
+    inference_ = std::make_unique<EdgeTpuExecutable>(inference_exe, arena);
     if (parameter_caching_exe) {
       parameter_caching_ =
-          std::make_unique<EdgeTpuExecutable>(parameter_caching_exe);
+          std::make_unique<EdgeTpuExecutable>(parameter_caching_exe, arena);
     }
   }
   EdgeTpuExecutable* parameter_caching_exe() {
     return parameter_caching_.get();
   }
   EdgeTpuExecutable* inference_exe() { return inference_.get(); }
+  // Switches to the same executables in another copy of the model data.
+  void Rebind(const platforms::darwinn::Executable* inference_exe,
+              const platforms::darwinn::Executable* parameter_caching_exe) {
+    inference_->Rebind(inference_exe);
+    if (parameter_caching_) parameter_caching_->Rebind(parameter_caching_exe);
+  }
 
  private:
   std::unique_ptr<EdgeTpuExecutable> inference_;
   std::unique_ptr<EdgeTpuExecutable> parameter_caching_;
 };
+
+// State of an invocation started with `EdgeTpuManager::InvokeAsync()`. Each
+// caller (such as each pipelined op node) needs its own: interpreters that
+// load the same model share one package, output buffers included.
+struct EdgeTpuAsyncInvoke {
+  EdgeTpuAsyncInvoke() = default;
+  ~EdgeTpuAsyncInvoke() {
+    if (done) vSemaphoreDelete(done);
+  }
+  EdgeTpuAsyncInvoke(const EdgeTpuAsyncInvoke&) = delete;
+  EdgeTpuAsyncInvoke& operator=(const EdgeTpuAsyncInvoke&) = delete;
+
+  EdgeTpuPackage* package = nullptr;
+  // Copy of the input tensor, owned by the invocation.
+  std::unique_ptr<uint8_t[]> input;
+  size_t input_capacity = 0;
+  // Results of the last invocation, one buffer per output tensor, copied
+  // out of the package by the invoke task before another invocation can
+  // overwrite them.
+  std::vector<std::vector<uint8_t>> outputs;
+  EdgeTpuInvokeCallback callback = nullptr;
+  void* callback_param = nullptr;
+  // Given by the invoke task when `status` is set.
+  SemaphoreHandle_t done = nullptr;
+  TfLiteStatus status = kTfLiteOk;
+  // Set between `InvokeAsync()` and the matching wait.
+  bool pending = false;
+  // Set once `outputs` hold a result.
+  bool has_result = false;
+};
 // @endcond
 
+// USB traffic of the most recent model invocation on the Edge TPU, as
+// reported by `EdgeTpuManager::GetLastInvokeStats()`.
+struct EdgeTpuInvokeStats {
+  // Bytes of parameters, inputs, instructions and outputs transferred.
+  uint64_t bytes_transferred;
+  // Time spent in the invocation, in microseconds.
+  uint64_t duration_us;
+  // Effective USB throughput in MB/s, `bytes_transferred / duration_us`.
+  float throughput_mbps;
+};
+
+// Time spent by the most recent `EdgeTpuManager::OpenDevice()` call that
+// powered on the Edge TPU, as reported by `EdgeTpuManager::GetStartupStats()`.
+struct EdgeTpuStartupStats {
+  // Time from powering on the Edge TPU until it enumerated on USB.
+  uint32_t enumeration_us;
+  // Time spent configuring the Edge TPU registers.
+  uint32_t initialize_us;
+  // Register accesses made while configuring, each a USB control transfer.
+  uint32_t csr_transfers;
+  // Time of the whole `OpenDevice()` call.
+  uint32_t total_us;
+};
+
 // Singleton Edge TPU manager for allocating new instances of `EdgeTpuContext`.
 class EdgeTpuManager {
  public:
@@ -90,9 +162,46 @@ class EdgeTpuManager {
   }
 
   // @cond Do not generate docs
+  // Gets the package for the Edge TPU custom op data `package_content`,
+  // registering it on first use. The same model loaded more than once (at
+  // any address) shares one package, looked up by a hash of its content.
+  // Each call must be paired with `ReleasePackage()`.
   EdgeTpuPackage* RegisterPackage(const char* package_content, size_t length);
+  // Drops a reference obtained from `RegisterPackage()`, and frees the
+  // package once the last one is gone. `package_content` must still be valid.
+  void ReleasePackage(EdgeTpuPackage* package, const char* package_content);
   TfLiteStatus Invoke(EdgeTpuPackage* package, TfLiteContext* context,
                       TfLiteNode* node);
+
+  // Starts running `package` on the node's input in the Edge TPU invoke task
+  // and returns right away, so the caller can do other work (such as
+  // post-processing the previous result) while the Edge TPU computes.
+  //
+  // The input tensor is copied, so it can be overwritten immediately. The
+  // invocation's state lives in `async`, which can have one invocation in
+  // flight; collect it with `WaitForInvoke()`. The optional `callback` runs
+  // in the invoke task once the Edge TPU is done, before `WaitForInvoke()`
+  // returns.
+  TfLiteStatus InvokeAsync(EdgeTpuPackage* package, EdgeTpuAsyncInvoke* async,
+                           TfLiteContext* context, TfLiteNode* node,
+                           EdgeTpuInvokeCallback callback = nullptr,
+                           void* param = nullptr);
+
+  // Waits for the invocation started with `InvokeAsync()` and copies its
+  // results into the node's output tensors. If the timeout expires, the
+  // invocation stays in flight and `kTfLiteError` is returned.
+  TfLiteStatus WaitForInvoke(EdgeTpuAsyncInvoke* async, TfLiteContext* context,
+                             TfLiteNode* node,
+                             TickType_t timeout = portMAX_DELAY);
+
+  // Copies the results of the last invocation of `async` into the node's
+  // output tensors again.
+  TfLiteStatus ReadLastOutputs(const EdgeTpuAsyncInvoke* async,
+                               TfLiteContext* context, TfLiteNode* node);
+
+  // Waits for the invocation of `async`, if any, and drops its results. Call
+  // this before destroying `async`.
+  void FinishInvoke(EdgeTpuAsyncInvoke* async);
   // @endcond
 
   // Gets the default Edge TPU device (and starts it if necessary).
@@ -120,6 +229,15 @@ class EdgeTpuManager {
   // @cond Do not generate docs
   void NotifyError();
   void NotifyConnected(usb_host_edgetpu_instance_t* usb_instance);
+
+  // Makes `OpenDevice()` bring up the Edge TPU reached through `transport`
+  // instead of the one on the USB bus, for example a `FakeTpuTransport` to
+  // run models without the chip. Takes effect once every `EdgeTpuContext` is
+  // released.
+  //
+  // @param transport The transport, or nullptr to use USB again. It must
+  //   outlive the contexts opened with it.
+  void SetTransport(TpuTransport* transport);
   // @endcond
 
   // Gets the current Edge TPU junction temperature.
@@ -127,15 +245,153 @@ class EdgeTpuManager {
   // `EdgeTpuContext` is empty.
   std::optional<float> GetTemperature();
 
+  // Gets the number of bytes moved by USB bulk transfers to and from the
+  // Edge TPU, split by whether they were copied through an intermediate
+  // buffer or transferred directly from the tensor memory.
+  //
+  // Tensors and parameters are transferred directly when they are located in
+  // OCRAM, SDRAM or DTCM; data received from the Edge TPU also needs 32-byte
+  // alignment (and a multiple of 32 bytes) outside of DTCM.
+  // @returns The counters accumulated since the last call to
+  // `ResetTransferStats()`.
+  TpuTransferStats GetTransferStats();
+
+  // Resets the counters returned by `GetTransferStats()`.
+  void ResetTransferStats();
+
+  // Gets the number of completion events and interrupts received from the
+  // Edge TPU, along with waits that timed out and failed transfers. Every
+  // invocation normally produces one event.
+  // @returns The counters accumulated since the last call to
+  // `ResetEventStats()`.
+  TpuEventStats GetEventStats();
+
+  // Resets the counters returned by `GetEventStats()`.
+  void ResetEventStats();
+
+  // Gets the USB traffic of the most recent invocation of an Edge TPU model
+  // (including any parameter caching it triggered). Parameter-heavy models
+  // that don't fit in the Edge TPU cache are usually bound by this
+  // throughput.
+  // @returns The stats of the last invocation, or all zeros if no model has
+  // been invoked yet.
+  EdgeTpuInvokeStats GetLastInvokeStats();
+
+  // Gets the time it took to bring up the Edge TPU. This is the latency paid
+  // by every `OpenDevice()` call after all contexts were released and the
+  // Edge TPU powered off.
+  // @returns The stats of the last power on, or all zeros if the Edge TPU
+  // hasn't been opened yet.
+  EdgeTpuStartupStats GetStartupStats();
+
+  // Protects the Edge TPU models within a .tflite model from being evicted
+  // from the Edge TPU parameter cache by other models compiled with them.
+  //
+  // Models compiled together share the on-chip memory; running a model that
+  // was compiled separately (or that has no cached parameters) still
+  // replaces all cached parameters, pinned or not.
+  //
+  // The model must already be loaded by a `tflite::MicroInterpreter` (after
+  // `AllocateTensors()`), so its Edge TPU custom ops are registered.
+  //
+  // @param model_data The .tflite model data.
+  // @param model_size The size of `model_data` in bytes.
+  // @param pinned True to pin, false to unpin.
+  // @returns True if the model contains an Edge TPU model with cached
+  // parameters; false otherwise.
+  bool PinModel(const void* model_data, size_t model_size, bool pinned = true);
+
+  // Uploads the cached parameters of the Edge TPU models within a .tflite
+  // model now, so its next invocation doesn't have to. For example, prefetch
+  // the next stage of a cascade while the CPU post-processes the current one.
+  //
+  // The Edge TPU must be open and the model must already be loaded by a
+  // `tflite::MicroInterpreter` (after `AllocateTensors()`).
+  //
+  // @param model_data The .tflite model data.
+  // @param model_size The size of `model_data` in bytes.
+  // @returns True if the parameters are cached; false otherwise.
+  bool PrefetchModel(const void* model_data, size_t model_size);
+
+  // Gets the Edge TPU parameter cache counters.
+  // @returns The counters accumulated since the last call to
+  // `ResetParameterCacheStats()`.
+  EdgeTpuParameterCacheStats GetParameterCacheStats();
+
+  // Resets the counters returned by `GetParameterCacheStats()`.
+  void ResetParameterCacheStats();
+
+  // Allocates the output buffers of Edge TPU models registered from now on
+  // (by `tflite::MicroInterpreter::AllocateTensors()`) from `arena`, instead
+  // of the heap. Use it to place them in OCRAM or SDRAM.
+  //
+  // @param arena The arena, or nullptr to use the heap again. It must
+  //   outlive the interpreters of the models registered while it is set.
+  void SetBufferArena(EdgeTpuBufferArena* arena);
+
+  // Gets the profiler recording the phases of every Edge TPU invocation.
+  // Call `SetEnabled(true)` on it to start profiling, or use
+  // `RegisterEdgeTpuProfilerRpc()` to read the profile over JSON-RPC.
+  EdgeTpuProfiler* GetProfiler() { return &profiler_; }
+
  private:
+  static void StaticInvokeTask(void* param);
+  void InvokeTask();
+  // Runs parameter caching if needed, then the inference executable. Must be
+  // called with `mutex_` held.
+  TfLiteStatus InvokeLocked(EdgeTpuPackage* package, const uint8_t* input);
+  // Uploads the cached parameters of `package` unless they are still
+  // cached. Must be called with `mutex_` held.
+  TfLiteStatus CacheParametersLocked(EdgeTpuPackage* package,
+                                     const uint8_t* input);
+  // Copies the last results of `package` into the node's output tensors.
+  TfLiteStatus ReadOutputs(EdgeTpuPackage* package, TfLiteContext* context,
+                           TfLiteNode* node);
+  // Copies the last results of `async->package` into `async->outputs`. Must
+  // be called with `mutex_` held.
+  TfLiteStatus CopyOutputsLocked(EdgeTpuAsyncInvoke* async);
+
+  // A registered package and the copies of the model data referencing it,
+  // one per `RegisterPackage()` call. The package points into
+  // `contents.front()`.
+  struct PackageEntry {
+    std::unique_ptr<EdgeTpuPackage> package;
+    std::vector<const char*> contents;
+    size_t length;
+  };
+
+  // Drops the reference of `package_content` to the package of `it`. Must be
+  // called with `mutex_` held.
+  void ReleasePackageLocked(
+      std::multimap<uint64_t, PackageEntry>::iterator it,
+      const char* package_content);
+  // Returns the entry of `package`, or `packages_.end()`.
+  std::multimap<uint64_t, PackageEntry>::iterator FindPackage(
+      const EdgeTpuPackage* package);
+  // Returns true if `entry` references model data within
+  // [`begin`, `begin + size`).
+  static bool PackageInRange(const PackageEntry& entry, const void* begin,
+                             size_t size);
+
   TpuDriver tpu_driver_;
-  std::map<uintptr_t, EdgeTpuPackage*> packages_;
-  std::array<EdgeTpuPackage*, 2> cached_packages_;
-  uint64_t current_parameter_caching_token_ = 0;
+  // Keyed by content hash. Packages whose content differs despite equal
+  // hashes get separate entries.
+  std::multimap<uint64_t, PackageEntry> packages_;
+  EdgeTpuBufferArena* buffer_arena_ = nullptr;
+  EdgeTpuParameterCache parameter_cache_;
+  EdgeTpuProfiler profiler_;
   usb_host_edgetpu_instance_t* usb_instance_ = nullptr;
+  UsbTpuTransport usb_transport_;
+  // Used instead of `usb_transport_` if not nullptr.
+  TpuTransport* transport_ = nullptr;
   std::weak_ptr<EdgeTpuContext> context_;
   SemaphoreHandle_t mutex_;
   bool usb_error_{false};
+  EdgeTpuInvokeStats last_invoke_stats_{};
+  EdgeTpuStartupStats startup_stats_{};
+  // Invocations waiting for the invoke task, which is created on first use.
+  QueueHandle_t invoke_queue_;
+  TaskHandle_t invoke_task_ = nullptr;
 };
 
 }  // namespace coralmicro
@@ -21,11 +21,36 @@
 
 namespace coralmicro {
 namespace {
+struct OpData {
+  EdgeTpuPackage* package;
+  // The custom op data the package was registered from.
+  const char* package_content;
+  // Invocation state of the pipelined op, private to this node.
+  EdgeTpuAsyncInvoke async_invoke;
+};
+
+EdgeTpuPackage* GetPackage(TfLiteNode* node) {
+  return static_cast<OpData*>(node->user_data)->package;
+}
+
 void* CustomOpInit(TfLiteContext* context, const char* buffer, size_t length) {
-  return EdgeTpuManager::GetSingleton()->RegisterPackage(buffer, length);
+  auto* package =
+      EdgeTpuManager::GetSingleton()->RegisterPackage(buffer, length);
+  if (!package) return nullptr;
+  auto* op_data = new OpData;
+  op_data->package = package;
+  op_data->package_content = buffer;
+  return op_data;
 }
 
-void CustomOpFree(TfLiteContext* context, void* buffer) {}
+void CustomOpFree(TfLiteContext* context, void* buffer) {
+  auto* op_data = static_cast<OpData*>(buffer);
+  if (!op_data) return;
+  auto* manager = EdgeTpuManager::GetSingleton();
+  manager->FinishInvoke(&op_data->async_invoke);
+  manager->ReleasePackage(op_data->package, op_data->package_content);
+  delete op_data;
+}
 
 TfLiteStatus CustomOpPrepare(TfLiteContext* context, TfLiteNode* node) {
   if (node->user_data == nullptr) return kTfLiteError;
@@ -33,9 +58,30 @@ TfLiteStatus CustomOpPrepare(TfLiteContext* context, TfLiteNode* node) {
 }
 
 TfLiteStatus CustomOpInvoke(TfLiteContext* context, TfLiteNode* node) {
-  EdgeTpuPackage* package = static_cast<EdgeTpuPackage*>(node->user_data);
+  EdgeTpuPackage* package = GetPackage(node);
   return EdgeTpuManager::GetSingleton()->Invoke(package, context, node);
 }
+TfLiteStatus PipelinedCustomOpInvoke(TfLiteContext* context,
+                                     TfLiteNode* node) {
+  auto* op_data = static_cast<OpData*>(node->user_data);
+  auto* manager = EdgeTpuManager::GetSingleton();
+  auto* async = &op_data->async_invoke;
+  TfLiteStatus status;
+  if (async->pending) {
+    status = manager->WaitForInvoke(async, context, node);
+  } else if (async->has_result) {
+    // The graph may have reused the output tensors since the last result was
+    // copied there.
+    status = manager->ReadLastOutputs(async, context, node);
+  } else {
+    // The first invocation has nothing to overlap with.
+    status = manager->InvokeAsync(op_data->package, async, context, node);
+    if (status != kTfLiteOk) return status;
+    return manager->WaitForInvoke(async, context, node);
+  }
+  if (status != kTfLiteOk) return status;
+  return manager->InvokeAsync(op_data->package, async, context, node);
+}
 }  // namespace
 
 TfLiteRegistration* RegisterCustomOp() {
@@ -47,4 +93,15 @@ TfLiteRegistration* RegisterCustomOp() {
   };
   return &registration;
 }
+
+TfLiteRegistration* RegisterPipelinedCustomOp() {
+  static TfLiteRegistration registration = {
+      CustomOpInit,
+      CustomOpFree,
+      CustomOpPrepare,
+      PipelinedCustomOpInvoke,
+  };
+  return &registration;
+}
+
 }  // namespace coralmicro
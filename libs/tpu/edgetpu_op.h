@@ -30,6 +30,19 @@ inline constexpr char kCustomOp[] = "edgetpu-custom-op";
 // `tflite::MicroMutableOpResolver::AddCustom()`.
 TfLiteRegistration* RegisterCustomOp();
 
+// Returns pointer to an instance of `tflite::TfLiteRegistration` that
+// handles Edge TPU custom ops in pipelined mode. Pass this to
+// `tflite::MicroMutableOpResolver::AddCustom()` instead of
+// `RegisterCustomOp()`.
+//
+// In pipelined mode, the op hands the input to the Edge TPU and returns the
+// results of the *previous* invocation instead of waiting, so the CPU ops
+// that follow it in the graph (and your own post-processing) run while the
+// Edge TPU computes the next frame. The first invocation has nothing to
+// overlap with, so it waits for its own results; from the second invocation
+// on, the outputs lag the inputs by one frame.
+TfLiteRegistration* RegisterPipelinedCustomOp();
+
 }  // namespace coralmicro
 
 #endif  // LIBS_TPU_EDGETPU_OP_H_
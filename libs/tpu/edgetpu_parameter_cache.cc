@@ -0,0 +1,121 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_parameter_cache.h"
+
+#include <algorithm>
+
+namespace coralmicro {
+
+EdgeTpuParameterCache::EdgeTpuParameterCache(size_t capacity_bytes)
+    : capacity_bytes_(capacity_bytes) {}
+
+bool EdgeTpuParameterCache::Use(const EdgeTpuPackage* package, uint64_t token,
+                                size_t size_bytes) {
+  if (token != token_) {
+    for (auto& entry : entries_) {
+      if (entry.cached) Evict(entry);
+    }
+    token_ = token;
+  }
+  if (token == 0) return false;
+
+  Entry& entry = FindOrAdd(package, token, size_bytes);
+  entry.last_use = ++use_clock_;
+  if (entry.cached) {
+    ++stats_.hits;
+    return false;
+  }
+
+  ++stats_.misses;
+  while (cached_bytes_ + entry.size_bytes > capacity_bytes_) {
+    Entry* lru = nullptr;
+    for (auto& other : entries_) {
+      if (!other.cached || other.pinned) continue;
+      if (!lru || other.last_use < lru->last_use) lru = &other;
+    }
+    // Only pinned models are left; trust the compiler that they all fit.
+    if (!lru) break;
+    Evict(*lru);
+  }
+
+  entry.cached = true;
+  cached_bytes_ += entry.size_bytes;
+  stats_.bytes_uploaded += entry.size_bytes;
+  if (entry.uploaded) stats_.bytes_reuploaded += entry.size_bytes;
+  entry.uploaded = true;
+  return true;
+}
+
+void EdgeTpuParameterCache::Invalidate(const EdgeTpuPackage* package) {
+  Entry* entry = Find(package);
+  if (entry && entry->cached) {
+    entry->cached = false;
+    cached_bytes_ -= entry->size_bytes;
+  }
+}
+
+void EdgeTpuParameterCache::Remove(const EdgeTpuPackage* package) {
+  Invalidate(package);
+  entries_.erase(std::remove_if(entries_.begin(), entries_.end(),
+                                [package](const Entry& entry) {
+                                  return entry.package == package;
+                                }),
+                 entries_.end());
+}
+
+void EdgeTpuParameterCache::Clear() {
+  for (auto& entry : entries_) entry.cached = false;
+  cached_bytes_ = 0;
+  token_ = 0;
+}
+
+void EdgeTpuParameterCache::SetPinned(const EdgeTpuPackage* package,
+                                      uint64_t token, size_t size_bytes,
+                                      bool pinned) {
+  FindOrAdd(package, token, size_bytes).pinned = pinned;
+}
+
+bool EdgeTpuParameterCache::IsCached(const EdgeTpuPackage* package) const {
+  for (const auto& entry : entries_) {
+    if (entry.package == package) return entry.cached;
+  }
+  return false;
+}
+
+EdgeTpuParameterCache::Entry* EdgeTpuParameterCache::Find(
+    const EdgeTpuPackage* package) {
+  for (auto& entry : entries_) {
+    if (entry.package == package) return &entry;
+  }
+  return nullptr;
+}
+
+EdgeTpuParameterCache::Entry& EdgeTpuParameterCache::FindOrAdd(
+    const EdgeTpuPackage* package, uint64_t token, size_t size_bytes) {
+  Entry* entry = Find(package);
+  if (entry) return *entry;
+  entries_.push_back({package, token, size_bytes, 0, false, false, false});
+  return entries_.back();
+}
+
+void EdgeTpuParameterCache::Evict(Entry& entry) {
+  entry.cached = false;
+  cached_bytes_ -= entry.size_bytes;
+  ++stats_.evictions;
+}
+
+}  // namespace coralmicro
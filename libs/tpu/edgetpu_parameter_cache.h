@@ -0,0 +1,115 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
+#define LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace coralmicro {
+
+class EdgeTpuPackage;
+
+// Counters reported by `EdgeTpuManager::GetParameterCacheStats()`.
+struct EdgeTpuParameterCacheStats {
+  // Invocations whose parameters were already cached on the Edge TPU.
+  uint32_t hits;
+  // Invocations that had to upload their parameters first.
+  uint32_t misses;
+  // Models whose cached parameters were dropped, either to make room or
+  // because a model with a different caching token ran.
+  uint32_t evictions;
+  // Parameter bytes uploaded into the Edge TPU cache.
+  uint64_t bytes_uploaded;
+  // Part of `bytes_uploaded` spent on models that had been cached before.
+  uint64_t bytes_reuploaded;
+};
+
+// Bookkeeping of the model parameters cached in the Edge TPU on-chip memory.
+//
+// Models compiled together share a parameter caching token and can be cached
+// side by side; caching parameters with a different token (or running a
+// model without cached parameters) overwrites the whole cache. Within one
+// token, the least recently used unpinned models are evicted when the cached
+// parameters would exceed the capacity.
+//
+// This class only decides when parameters must be uploaded; the caller runs
+// the parameter caching executable and serializes access.
+class EdgeTpuParameterCache {
+ public:
+  // @param capacity_bytes On-chip memory available for cached parameters.
+  explicit EdgeTpuParameterCache(size_t capacity_bytes);
+  EdgeTpuParameterCache(const EdgeTpuParameterCache&) = delete;
+  EdgeTpuParameterCache& operator=(const EdgeTpuParameterCache&) = delete;
+
+  // Records that `package` is about to run.
+  //
+  // @param package The package to run.
+  // @param token Its parameter caching token, or 0 if it has no cached
+  //   parameters.
+  // @param size_bytes The size of its cached parameters.
+  // @return True if the parameters must be uploaded first. They are then
+  //   accounted as cached; call `Invalidate()` if the upload fails.
+  bool Use(const EdgeTpuPackage* package, uint64_t token, size_t size_bytes);
+
+  // Marks the parameters of `package` as no longer cached.
+  void Invalidate(const EdgeTpuPackage* package);
+
+  // Forgets `package`, which is about to be deleted.
+  void Remove(const EdgeTpuPackage* package);
+
+  // Marks all parameters as no longer cached, e.g. after the Edge TPU reset.
+  void Clear();
+
+  // Protects `package` from eviction by other models with the same token.
+  void SetPinned(const EdgeTpuPackage* package, uint64_t token,
+                 size_t size_bytes, bool pinned);
+
+  // Returns true if the parameters of `package` are currently cached.
+  bool IsCached(const EdgeTpuPackage* package) const;
+
+  EdgeTpuParameterCacheStats GetStats() const { return stats_; }
+  void ResetStats() { stats_ = {}; }
+
+ private:
+  struct Entry {
+    const EdgeTpuPackage* package;
+    uint64_t token;
+    size_t size_bytes;
+    uint32_t last_use;
+    bool cached;
+    bool uploaded;
+    bool pinned;
+  };
+
+  Entry* Find(const EdgeTpuPackage* package);
+  Entry& FindOrAdd(const EdgeTpuPackage* package, uint64_t token,
+                   size_t size_bytes);
+  void Evict(Entry& entry);
+
+  size_t capacity_bytes_;
+  size_t cached_bytes_ = 0;
+  uint64_t token_ = 0;
+  uint32_t use_clock_ = 0;
+  std::vector<Entry> entries_;
+  EdgeTpuParameterCacheStats stats_{};
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PARAMETER_CACHE_H_
@@ -0,0 +1,116 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_profiler.h"
+
+#include <algorithm>
+
+#include "libs/base/check.h"
+#include "libs/base/mutex.h"
+#include "libs/base/timer.h"
+
+namespace coralmicro {
+
+const char* EdgeTpuProfilePhaseName(EdgeTpuProfilePhase phase) {
+  switch (phase) {
+    case EdgeTpuProfilePhase::kInvoke:
+      return "invoke";
+    case EdgeTpuProfilePhase::kParameterUpload:
+      return "parameter_upload";
+    case EdgeTpuProfilePhase::kInputUpload:
+      return "input_upload";
+    case EdgeTpuProfilePhase::kInstructionUpload:
+      return "instruction_upload";
+    case EdgeTpuProfilePhase::kWaitEvent:
+      return "wait_event";
+    case EdgeTpuProfilePhase::kOutputDownload:
+      return "output_download";
+    case EdgeTpuProfilePhase::kRelayout:
+      return "relayout";
+    default:
+      return "unknown";
+  }
+}
+
+EdgeTpuProfiler::EdgeTpuProfiler() : mutex_(xSemaphoreCreateMutex()) {
+  CHECK(mutex_);
+}
+
+EdgeTpuProfiler::~EdgeTpuProfiler() { vSemaphoreDelete(mutex_); }
+
+void EdgeTpuProfiler::BeginInvoke() {
+  if (!enabled_) return;
+  MutexLock lock(mutex_);
+  ++invoke_;
+  invoke_start_us_ = TimerMicros();
+}
+
+void EdgeTpuProfiler::EndInvoke() {
+  if (!enabled_) return;
+  MutexLock lock(mutex_);
+  // Enabled in the middle of an invocation.
+  if (!invoke_start_us_) return;
+  RecordLocked(EdgeTpuProfilePhase::kInvoke, invoke_start_us_, TimerMicros(),
+               0);
+  invoke_start_us_ = 0;
+}
+
+void EdgeTpuProfiler::Record(EdgeTpuProfilePhase phase, uint64_t start_us,
+                             uint32_t bytes) {
+  if (!enabled_) return;
+  const uint64_t end_us = TimerMicros();
+  MutexLock lock(mutex_);
+  RecordLocked(phase, start_us, end_us, bytes);
+}
+
+void EdgeTpuProfiler::RecordLocked(EdgeTpuProfilePhase phase,
+                                   uint64_t start_us, uint64_t end_us,
+                                   uint32_t bytes) {
+  const auto duration_us = static_cast<uint32_t>(end_us - start_us);
+  events_[next_event_] = {invoke_, phase, start_us, duration_us, bytes};
+  next_event_ = (next_event_ + 1) % kEventCount;
+  event_count_ = std::min(event_count_ + 1, kEventCount);
+
+  auto& stats = stats_.phases[static_cast<size_t>(phase)];
+  ++stats.count;
+  stats.total_us += duration_us;
+  stats.max_us = std::max(stats.max_us, duration_us);
+  stats.bytes += bytes;
+}
+
+EdgeTpuProfileStats EdgeTpuProfiler::GetStats() const {
+  MutexLock lock(mutex_);
+  return stats_;
+}
+
+std::vector<EdgeTpuProfileEvent> EdgeTpuProfiler::GetEvents() const {
+  MutexLock lock(mutex_);
+  std::vector<EdgeTpuProfileEvent> events;
+  events.reserve(event_count_);
+  const size_t first = (next_event_ + kEventCount - event_count_) % kEventCount;
+  for (size_t i = 0; i < event_count_; ++i)
+    events.push_back(events_[(first + i) % kEventCount]);
+  return events;
+}
+
+void EdgeTpuProfiler::Reset() {
+  MutexLock lock(mutex_);
+  next_event_ = 0;
+  event_count_ = 0;
+  stats_ = {};
+}
+
+}  // namespace coralmicro
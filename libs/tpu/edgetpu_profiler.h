@@ -0,0 +1,133 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PROFILER_H_
+#define LIBS_TPU_EDGETPU_PROFILER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "third_party/freertos_kernel/include/FreeRTOS.h"
+#include "third_party/freertos_kernel/include/semphr.h"
+
+namespace coralmicro {
+
+// The phases of an Edge TPU invocation timed by `EdgeTpuProfiler`.
+enum class EdgeTpuProfilePhase : uint8_t {
+  // The whole invocation, from parameter caching to the completion event.
+  kInvoke,
+  // Parameters sent to the Edge TPU, cached or streamed.
+  kParameterUpload,
+  kInputUpload,
+  kInstructionUpload,
+  // Waiting for the Edge TPU to report completion, including any bulk out
+  // transfers still in flight.
+  kWaitEvent,
+  kOutputDownload,
+  // Copying the outputs into the output tensors, including the conversion
+  // of signed data types.
+  kRelayout,
+  kCount,
+};
+
+// Gets a short name for `phase`, such as "input_upload".
+const char* EdgeTpuProfilePhaseName(EdgeTpuProfilePhase phase);
+
+// One timed occurrence of a phase.
+struct EdgeTpuProfileEvent {
+  // Sequence number of the invocation the event belongs to.
+  uint32_t invoke;
+  EdgeTpuProfilePhase phase;
+  // Start time, from `TimerMicros()`.
+  uint64_t start_us;
+  uint32_t duration_us;
+  // Bytes transferred or copied during the event.
+  uint32_t bytes;
+};
+
+// Totals of one phase, as reported by `EdgeTpuProfiler::GetStats()`.
+struct EdgeTpuPhaseStats {
+  uint32_t count;
+  uint64_t total_us;
+  uint32_t max_us;
+  uint64_t bytes;
+};
+
+// Per-phase totals since the last `EdgeTpuProfiler::Reset()`. The
+// `kInvoke` entry counts the invocations.
+struct EdgeTpuProfileStats {
+  EdgeTpuPhaseStats
+      phases[static_cast<size_t>(EdgeTpuProfilePhase::kCount)];
+};
+
+// Records the time and bytes spent in each phase of Edge TPU invocations.
+//
+// The most recent `kEventCount` events are kept in a ring buffer, so a
+// profile can be read at any time without allocating while invoking;
+// aggregates cover every event since the last reset. The profiler is
+// disabled by default.
+//
+// Bulk out transfers are queued, so the upload phases measure the time to
+// hand the data to the USB controller; transfers still in flight complete
+// during the following phase (usually `kWaitEvent`).
+class EdgeTpuProfiler {
+ public:
+  static constexpr size_t kEventCount = 256;
+
+  EdgeTpuProfiler();
+  ~EdgeTpuProfiler();
+  EdgeTpuProfiler(const EdgeTpuProfiler&) = delete;
+  EdgeTpuProfiler& operator=(const EdgeTpuProfiler&) = delete;
+
+  void SetEnabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  // Starts a new invocation. Events recorded until the next call belong to
+  // it.
+  void BeginInvoke();
+  // Records the `kInvoke` event of the current invocation.
+  void EndInvoke();
+
+  // Records a `phase` event that started at `start_us` and ends now.
+  void Record(EdgeTpuProfilePhase phase, uint64_t start_us, uint32_t bytes);
+
+  // Gets the per-phase totals.
+  EdgeTpuProfileStats GetStats() const;
+
+  // Gets the events kept in the ring buffer, oldest first.
+  std::vector<EdgeTpuProfileEvent> GetEvents() const;
+
+  // Drops all events and totals.
+  void Reset();
+
+ private:
+  void RecordLocked(EdgeTpuProfilePhase phase, uint64_t start_us,
+                    uint64_t end_us, uint32_t bytes);
+
+  volatile bool enabled_ = false;
+  SemaphoreHandle_t mutex_;
+  EdgeTpuProfileEvent events_[kEventCount];
+  size_t next_event_ = 0;
+  size_t event_count_ = 0;
+  uint32_t invoke_ = 0;
+  uint64_t invoke_start_us_ = 0;
+  EdgeTpuProfileStats stats_{};
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PROFILER_H_
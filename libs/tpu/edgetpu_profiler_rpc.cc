@@ -0,0 +1,89 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libs/tpu/edgetpu_profiler_rpc.h"
+
+#include <cstdarg>
+#include <vector>
+
+#include "libs/tpu/edgetpu_manager.h"
+#include "libs/tpu/edgetpu_profiler.h"
+#include "third_party/mjson/src/mjson.h"
+
+namespace coralmicro {
+namespace {
+struct Profile {
+  std::vector<EdgeTpuProfileEvent> events;
+  EdgeTpuProfileStats stats;
+};
+
+// Digits printed for the 64-bit phase totals, which don't fit the 32-bit
+// `unsigned long`. Doubles hold them exactly up to 10^15.
+constexpr int kTotalDigits = 15;
+
+// Prints a `Profile*` for the mjson "%M" format.
+int PrintProfile(mjson_print_fn_t fn, void* fndata, va_list* ap) {
+  const auto* profile = va_arg(*ap, const Profile*);
+  const uint64_t origin_us =
+      profile->events.empty() ? 0 : profile->events.front().start_us;
+
+  int n = mjson_printf(fn, fndata, "{%Q:[", "traceEvents");
+  for (size_t i = 0; i < profile->events.size(); ++i) {
+    const auto& event = profile->events[i];
+    n += mjson_printf(
+        fn, fndata,
+        "%s{%Q:%Q,%Q:%Q,%Q:%lu,%Q:%lu,%Q:%d,%Q:%d,%Q:{%Q:%lu,%Q:%lu}}",
+        i ? "," : "", "name", EdgeTpuProfilePhaseName(event.phase), "ph", "X",
+        "ts", static_cast<unsigned long>(event.start_us - origin_us), "dur",
+        static_cast<unsigned long>(event.duration_us), "pid", 0, "tid", 0,
+        "args", "invoke", static_cast<unsigned long>(event.invoke), "bytes",
+        static_cast<unsigned long>(event.bytes));
+  }
+
+  n += mjson_printf(fn, fndata, "],%Q:{", "phases");
+  for (size_t i = 0; i < static_cast<size_t>(EdgeTpuProfilePhase::kCount);
+       ++i) {
+    const auto& phase = profile->stats.phases[i];
+    n += mjson_printf(
+        fn, fndata, "%s%Q:{%Q:%lu,%Q:%.*g,%Q:%lu,%Q:%.*g}", i ? "," : "",
+        EdgeTpuProfilePhaseName(static_cast<EdgeTpuProfilePhase>(i)), "count",
+        static_cast<unsigned long>(phase.count), "total_us", kTotalDigits,
+        static_cast<double>(phase.total_us), "max_us",
+        static_cast<unsigned long>(phase.max_us), "bytes", kTotalDigits,
+        static_cast<double>(phase.bytes));
+  }
+  n += mjson_printf(fn, fndata, "}}");
+  return n;
+}
+
+void EdgeTpuProfileRpc(struct jsonrpc_request* request) {
+  auto* profiler = EdgeTpuManager::GetSingleton()->GetProfiler();
+  Profile profile{profiler->GetEvents(), profiler->GetStats()};
+
+  int reset = 0;
+  mjson_get_bool(request->params, request->params_len, "$[0].reset", &reset);
+  if (reset) profiler->Reset();
+
+  jsonrpc_return_success(request, "%M", PrintProfile, &profile);
+}
+}  // namespace
+
+void RegisterEdgeTpuProfilerRpc() {
+  EdgeTpuManager::GetSingleton()->GetProfiler()->SetEnabled(true);
+  jsonrpc_export("edgetpu_profile", EdgeTpuProfileRpc);
+}
+
+}  // namespace coralmicro
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_PROFILER_RPC_H_
+#define LIBS_TPU_EDGETPU_PROFILER_RPC_H_
+
+namespace coralmicro {
+
+// Enables the Edge TPU profiler and exports the `edgetpu_profile` JSON-RPC
+// method, to be served by `JsonRpcHttpServer`. Call it after
+// `jsonrpc_init()`.
+//
+// The result is a Chrome trace (load it in chrome://tracing or Perfetto)
+// with one complete event per recorded phase, plus the per-phase totals:
+//
+// ```
+// {
+//   "traceEvents": [{"name": "input_upload", "ph": "X", "ts": 0,
+//                    "dur": 120, "pid": 0, "tid": 0,
+//                    "args": {"invoke": 7, "bytes": 150528}}, ...],
+//   "phases": {"input_upload": {"count": 7, "total_us": 840,
+//                               "max_us": 130, "bytes": 1053696}, ...}
+// }
+// ```
+//
+// Timestamps are relative to the oldest event in the profiler's ring
+// buffer. Pass `{"reset": true}` to clear the profile once it is read.
+void RegisterEdgeTpuProfilerRpc();
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_PROFILER_RPC_H_
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2022 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef LIBS_TPU_EDGETPU_TRANSPORT_H_
+#define LIBS_TPU_EDGETPU_TRANSPORT_H_
+
+#include <cstdint>
+
+#include "libs/tpu/usb_host_edgetpu.h"
+
+namespace coralmicro {
+
+// Endpoints of the Edge TPU. Descriptors go out and output activations come
+// back on the bulk endpoint, while events and interrupts arrive unsolicited
+// on endpoints of their own.
+inline constexpr uint8_t kSingleBulkOutEndpoint = 1;
+inline constexpr uint8_t kEventInEndpoint = 2;
+inline constexpr uint8_t kInterruptInEndpoint = 3;
+
+// The link between `TpuDriver` and the Edge TPU. Transfers complete
+// asynchronously: their callbacks may run in another task, and transfers on
+// the same endpoint complete in submission order.
+class TpuTransport {
+ public:
+  virtual ~TpuTransport() = default;
+
+  // Sends a control transfer, which accesses a register. See
+  // `USB_HostEdgeTpuControl()`.
+  virtual usb_status_t Control(usb_setup_struct_t* setup_packet,
+                               uint8_t* buffer, transfer_callback_t callback,
+                               void* param) = 0;
+  // Queues a bulk out transfer. See `USB_HostEdgeTpuBulkOutQueue()`.
+  virtual usb_status_t BulkOutQueue(
+      uint8_t endpoint, uint8_t* buffer, uint16_t length,
+      usb_host_edgetpu_queued_transfer_t* transfer) = 0;
+  // Receives from a bulk or interrupt in endpoint. See
+  // `USB_HostEdgeTpuBulkInRecv()`.
+  virtual usb_status_t BulkInRecv(uint8_t endpoint, uint8_t* buffer,
+                                  uint32_t length, transfer_callback_t callback,
+                                  void* param) = 0;
+  // Cancels every transfer in flight on an endpoint. See
+  // `USB_HostEdgeTpuCancelEndpoint()`.
+  virtual usb_status_t CancelEndpoint(uint8_t endpoint, uint8_t direction) = 0;
+  // Cancels every control transfer in flight. See
+  // `USB_HostEdgeTpuCancelControl()`.
+  virtual usb_status_t CancelControl() = 0;
+};
+
+// Reaches the Edge TPU through the USB host stack.
+class UsbTpuTransport : public TpuTransport {
+ public:
+  void SetInstance(usb_host_edgetpu_instance_t* instance) {
+    instance_ = instance;
+  }
+
+  usb_status_t Control(usb_setup_struct_t* setup_packet, uint8_t* buffer,
+                       transfer_callback_t callback, void* param) override {
+    return USB_HostEdgeTpuControl(instance_, setup_packet, buffer, callback,
+                                  param);
+  }
+  usb_status_t BulkOutQueue(
+      uint8_t endpoint, uint8_t* buffer, uint16_t length,
+      usb_host_edgetpu_queued_transfer_t* transfer) override {
+    return USB_HostEdgeTpuBulkOutQueue(instance_, endpoint, buffer, length,
+                                       transfer);
+  }
+  usb_status_t BulkInRecv(uint8_t endpoint, uint8_t* buffer, uint32_t length,
+                          transfer_callback_t callback, void* param) override {
+    return USB_HostEdgeTpuBulkInRecv(instance_, endpoint, buffer, length,
+                                     callback, param);
+  }
+  usb_status_t CancelEndpoint(uint8_t endpoint, uint8_t direction) override {
+    return USB_HostEdgeTpuCancelEndpoint(instance_, endpoint, direction);
+  }
+  usb_status_t CancelControl() override {
+    return USB_HostEdgeTpuCancelControl(instance_);
+  }
+
+ private:
+  usb_host_edgetpu_instance_t* instance_ = nullptr;
+};
+
+}  // namespace coralmicro
+
+#endif  // LIBS_TPU_EDGETPU_TRANSPORT_H_
@@ -412,6 +412,76 @@ usb_status_t USB_HostEdgeTpuBulkOutSend(usb_host_edgetpu_instance_t *tpuInstance
 }
 
 
+static void USB_HostEdgeTpuQueuedCallback(void *param,
+                                          usb_host_transfer_t *transfer,
+                                          usb_status_t status)
+{
+    usb_host_edgetpu_queued_transfer_t *queuedTransfer = (usb_host_edgetpu_queued_transfer_t *)param;
+    usb_host_handle hostHandle = queuedTransfer->tpuInstance->hostHandle;
+    if (queuedTransfer->callbackFn != NULL) {
+        queuedTransfer->callbackFn(queuedTransfer->callbackParam, transfer->transferBuffer, transfer->transferSofar, status);
+    }
+    USB_HostFreeTransfer(hostHandle, transfer);
+}
+
+
+usb_status_t USB_HostEdgeTpuBulkOutQueue(usb_host_edgetpu_instance_t *tpuInstance,
+                                         uint8_t endPoint,
+                                         uint8_t *buffer,
+                                         uint16_t length,
+                                         usb_host_edgetpu_queued_transfer_t *queuedTransfer)
+{
+    usb_host_transfer_t *transfer;
+
+    // Determine index of pipe to endpoint
+    int8_t index = USB_HostEdgeTpuGetPipeIndexFromEndpoint(tpuInstance, endPoint, USB_OUT);
+    if (index < 0)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    usb_host_edgetpu_pipe_t *pipe = &tpuInstance->pipes[index];
+
+    // Check endpoint is BULK
+    if (pipe->pipeType != USB_ENDPOINT_BULK)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+
+    if (USB_HostMallocTransfer(tpuInstance->hostHandle, &transfer) != kStatus_USB_Success)
+    {
+        return kStatus_USB_Error;
+    }
+
+    // The pipe's activeTransfer and callback are left alone, so queued
+    // transfers don't disturb each other.
+    queuedTransfer->tpuInstance = tpuInstance;
+    transfer->transferBuffer = buffer;
+    transfer->transferLength = length;
+    transfer->callbackFn = USB_HostEdgeTpuQueuedCallback;
+    transfer->callbackParam = queuedTransfer;
+    transfer->direction = USB_OUT;
+
+    if (USB_HostSend(tpuInstance->hostHandle, pipe->pipeHandle, transfer) != kStatus_USB_Success)
+    {
+        USB_HostFreeTransfer(tpuInstance->hostHandle, transfer);
+        return kStatus_USB_Error;
+    }
+    return kStatus_USB_Success;
+}
+
+usb_status_t USB_HostEdgeTpuCancelEndpoint(usb_host_edgetpu_instance_t *tpuInstance,
+                                           uint8_t endPoint,
+                                           uint8_t direction)
+{
+    int8_t index = USB_HostEdgeTpuGetPipeIndexFromEndpoint(tpuInstance, endPoint, direction);
+    if (index < 0)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    return USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->pipes[index].pipeHandle, NULL);
+}
+
+
 usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
                                  uint8_t endPoint,
                                  uint8_t *buffer,
@@ -429,8 +499,13 @@ usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
     }
     usb_host_edgetpu_pipe_t *pipe = &tpuInstance->pipes[index];
 
-    // Check endpoint is BULK
-    if (pipe->pipeType != USB_ENDPOINT_BULK)
+    // Check endpoint is BULK, or INTERRUPT (which is received the same way)
+    if (pipe->pipeType != USB_ENDPOINT_BULK && pipe->pipeType != USB_ENDPOINT_INTERRUPT)
+    {
+        return kStatus_USB_InvalidParameter;
+    }
+    // The interrupt pipe may have failed to open
+    if (!pipe->connected)
     {
         return kStatus_USB_InvalidParameter;
     }
@@ -511,4 +586,9 @@ usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
     return kStatus_USB_Success;
 }
 
+usb_status_t USB_HostEdgeTpuCancelControl(usb_host_edgetpu_instance_t *tpuInstance)
+{
+    return USB_HostCancelTransfer(tpuInstance->hostHandle, tpuInstance->controlPipe, NULL);
+}
+
 
@@ -54,6 +54,14 @@ typedef struct _usb_host_edgetpu_pipe {
   bool connected;
 } usb_host_edgetpu_pipe_t;
 
+/* A bulk transfer submitted with USB_HostEdgeTpuBulkOutQueue. Owned by the
+ * caller and must stay valid until callbackFn runs. */
+typedef struct _usb_host_edgetpu_queued_transfer {
+  struct _usb_host_edgetpu_instance *tpuInstance;
+  transfer_callback_t callbackFn;
+  void *callbackParam;
+} usb_host_edgetpu_queued_transfer_t;
+
 typedef struct _usb_host_edgetpu_instance {
   usb_host_handle hostHandle;     /*!< This instance's related host handle*/
   usb_device_handle deviceHandle; /*!< This instance's related device handle*/
@@ -94,18 +102,39 @@ usb_status_t USB_HostEdgeTpuBulkOutSend(
     usb_host_edgetpu_instance_t *tpuInstance, uint8_t endPoint, uint8_t *buffer,
     uint16_t length, transfer_callback_t callbackFn, void *callbackParam);
 
+/* Like USB_HostEdgeTpuBulkOutSend, but any number of queued transfers can be
+ * in flight on the same endpoint; they complete in submission order. */
+usb_status_t USB_HostEdgeTpuBulkOutQueue(
+    usb_host_edgetpu_instance_t *tpuInstance, uint8_t endPoint, uint8_t *buffer,
+    uint16_t length, usb_host_edgetpu_queued_transfer_t *queuedTransfer);
+
+/* Cancels every transfer in flight on an endpoint (USB_IN or USB_OUT). Their
+ * callbacks run with kStatus_USB_TransferCancel. */
+usb_status_t USB_HostEdgeTpuCancelEndpoint(
+    usb_host_edgetpu_instance_t *tpuInstance, uint8_t endPoint,
+    uint8_t direction);
+
+/* Receives from a bulk or interrupt IN endpoint. */
 usb_status_t USB_HostEdgeTpuBulkInRecv(usb_host_edgetpu_instance_t *tpuInstance,
                                        uint8_t endPoint, uint8_t *buffer,
                                        uint32_t bufferLength,
                                        transfer_callback_t callbackFn,
                                        void *callbackParam);
 
+/* Sends a control transfer on the device's control pipe. Several transfers
+ * can be in flight if they share callbackFn and callbackParam; they complete
+ * in submission order. */
 usb_status_t USB_HostEdgeTpuControl(usb_host_edgetpu_instance_t *tpuInstance,
                                     usb_setup_struct_t *setupPacket,
                                     uint8_t *buffer,
                                     transfer_callback_t callbackFn,
                                     void *callbackParam);
 
+/* Cancels every control transfer in flight. Their callbacks run with
+ * kStatus_USB_TransferCancel. */
+usb_status_t USB_HostEdgeTpuCancelControl(
+    usb_host_edgetpu_instance_t *tpuInstance);
+
 #ifdef __cplusplus
 }
 #endif
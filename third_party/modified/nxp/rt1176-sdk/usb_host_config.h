@@ -133,8 +133,10 @@
 
 /*!
  * @brief ehci QTD max count.
+ * The Edge TPU driver keeps TpuDriver::kCsrQueueDepth control transfers (3
+ * qTDs each) and its 2 event/interrupt transfers posted at once.
  */
-#define USB_HOST_CONFIG_EHCI_MAX_QTD (8U)
+#define USB_HOST_CONFIG_EHCI_MAX_QTD (16U)
 
 /*!
  * @brief ehci ITD max count.